@@ -2,10 +2,12 @@
 export OBJDIR=$(PWD)/.obj
 export BUILDDIR=$(PWD)/build
 
-DEFINES=LEVELDB
+DEFINES=LEVELDB LMDB ZLIB
+LIBS=leveldb lmdb z
 INCLUDES=$(shell echo ~)/Dropbox/coding/platform
 
 CFLAGS=-std=c++0x $(addprefix -I,$(INCLUDES)) $(addprefix -D,$(DEFINES)) 
+LDFLAGS=$(addprefix -l,$(LIBS))
 
 # These are the executables we'll build
 export SHINYFS_EXE=$(BUILD)/shinyfs
@@ -0,0 +1,188 @@
+//
+//  AllocBench.cpp
+//  shinyfs
+//
+//  Counts how many times the heap gets hit per read and write once a file has settled into a workload.  Every
+//  operator new in the process gets counted (DB workers and all), so this is the whole cost of an op, not just ours.
+//  Pass in the spec of the engine to run on top of (leveldb:/tmp/shinybench.leveldb if you don't), e.g.
+//
+//      ./AllocBench memory:
+//
+//  Reads that hit the chunk cache shouldn't allocate anything at all, and neither should small appends that the
+//  writeback just soaks up (the logger / small-block dd case), and we exit with 1 if either of them do, so this can
+//  keep it that way.  Everything else is just reported: writes that reach the DB pay for a batch, and whatever the
+//  engine does with it, but that's once per chunk, not per op.
+//
+//  Whatever is sitting at that path gets blown away first, so don't point this at a real filecache!
+//
+
+#include "../shinyfs/filesystem/ShinyFilesystem.h"
+#include "../shinyfs/filesystem/ShinyMetaRootDir.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include "../shinyfs/filesystem/ShinyMetaFileHandle.h"
+#include <base/Logger.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <new>
+
+// How big a file we're going to play with, and how many ops of each workload to count
+#define FILESIZE        (16*1024*1024)
+#define SEQ_IOSIZE      (128*1024)
+#define RAND_IOSIZE     (4*1024)
+#define OPS             20000
+
+// Random-ish reads that are never back to back, so the prefetcher never thinks it's being streamed
+#define STRIDE          7919
+
+static uint64_t allocs = 0;
+
+void * operator new( size_t size ) {
+    __sync_fetch_and_add( &allocs, 1 );
+    void * ptr = malloc( size ? size : 1 );
+    if( !ptr )
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void * operator new[]( size_t size ) {
+    return operator new( size );
+}
+
+void operator delete( void * ptr ) throw() {
+    free( ptr );
+}
+
+void operator delete[]( void * ptr ) throw() {
+    free( ptr );
+}
+
+static int wipeEntry( const char * path, const struct stat * sb, int typeflag, struct FTW * ftwbuf ) {
+    remove( path );
+    return 0;
+}
+
+// Gets rid of whatever a previous run left lying around at the path in spec
+static void wipe( const char * spec ) {
+    const char * colon = strchr( spec, ':' );
+    const char * path = colon ? colon + 1 : spec;
+    if( path[0] )
+        nftw( path, wipeEntry, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+// Makes a fresh file, then gets a handle on it the same way ShinyFuse does
+static ShinyMetaFileHandle * newHandle( ShinyFilesystem * fs, const char * name, const char * path ) {
+    ShinyMetaFile * file = new ShinyMetaFile( name, (ShinyMetaDir *)fs->findNode( "/" ) );
+    char * serialized = new char[file->serializedLen()];
+    file->serialize( serialized );
+    const char * input = serialized;
+    ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &input, fs, path );
+    delete [] serialized;
+    return fh;
+}
+
+static void cachedRead( ShinyMetaFileHandle * fh, uint64_t i, char * buff ) {
+    fh->read( (i*STRIDE % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+}
+
+static void seqRead( ShinyMetaFileHandle * fh, uint64_t i, char * buff ) {
+    fh->read( (i % (FILESIZE/SEQ_IOSIZE))*SEQ_IOSIZE, buff, SEQ_IOSIZE );
+}
+
+static void smallSeqWrite( ShinyMetaFileHandle * fh, uint64_t i, char * buff ) {
+    fh->write( (i % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+}
+
+static void smallRandWrite( ShinyMetaFileHandle * fh, uint64_t i, char * buff ) {
+    fh->write( (i*STRIDE % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+}
+
+static void chunkWrite( ShinyMetaFileHandle * fh, uint64_t i, char * buff ) {
+    uint64_t chunkSize = fh->getChunkSize();
+    fh->write( (i % (FILESIZE/chunkSize))*chunkSize, buff, chunkSize );
+}
+
+// Runs a workload once to warm up (so the cache is full, the scratch buffers have grown, and so on), then again
+// counting allocations.  Returns allocations per op
+static double bench( const char * label, void (*op)( ShinyMetaFileHandle *, uint64_t, char * ), ShinyMetaFileHandle * fh, char * buff ) {
+    for( uint64_t i=0; i<OPS; ++i )
+        op( fh, i, buff );
+    fh->flush();
+
+    uint64_t start = __sync_fetch_and_add( &allocs, 0 );
+    for( uint64_t i=0; i<OPS; ++i )
+        op( fh, i, buff );
+    double perOp = (double)(__sync_fetch_and_add( &allocs, 0 ) - start)/OPS;
+    fh->flush();
+
+    printf( "%-16s %10.3f allocs/op\n", label, perOp );
+    return perOp;
+}
+
+// Small appends past the end of the file, warmed up and then counted just like bench() does.  Only the ones that
+// stay in the writeback count, since the ones that finish off a chunk go out to the DB like any other write.
+// Returns allocations per counted op
+static double bufferedBench( const char * label, ShinyMetaFileHandle * fh, char * buff ) {
+    double perOp = 0;
+    for( int pass=0; pass<2; ++pass ) {
+        uint64_t counted = 0, ops = 0;
+        for( uint64_t i=0; i<OPS/4; ++i ) {
+            uint64_t offset = fh->getLen();
+            bool buffered = (offset + RAND_IOSIZE) % fh->getChunkSize() != 0;
+            uint64_t start = __sync_fetch_and_add( &allocs, 0 );
+            fh->write( offset, buff, RAND_IOSIZE );
+            if( buffered ) {
+                counted += __sync_fetch_and_add( &allocs, 0 ) - start;
+                ops++;
+            }
+        }
+        fh->flush();
+        perOp = ops ? (double)counted/ops : 0;
+    }
+
+    printf( "%-16s %10.3f allocs/op\n", label, perOp );
+    return perOp;
+}
+
+int main( int argc, const char * argv[] ) {
+    // We don't care to hear about every little thing the filesystem gets up to
+    Logger::getGlobalLogger()->setPrintId(0);
+    Logger::getGlobalLogger()->setPrintThread(0);
+
+    const char * spec = argc > 1 ? argv[1] : "leveldb:/tmp/shinybench.leveldb";
+    wipe( spec );
+    ShinyFilesystem * fs = new ShinyFilesystem( spec );
+    ShinyMetaFileHandle * fh = newHandle( fs, "bench", "/bench" );
+
+    // Fill up the file with junk that won't compress to nothing, so every chunk is really there
+    char * buff = new char[ShinyMetaFileSnapshot::MAX_CHUNKSIZE];
+    srand( 1337 );
+    for( uint64_t i=0; i<ShinyMetaFileSnapshot::MAX_CHUNKSIZE; ++i )
+        buff[i] = (char) rand();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE )
+        fh->write( offset, buff, SEQ_IOSIZE );
+    fh->flush();
+
+    double cached = bench( "cached read", &cachedRead, fh, buff );
+    bench( "seq read", &seqRead, fh, buff );
+    bench( "small seq write", &smallSeqWrite, fh, buff );
+    bench( "small rand write", &smallRandWrite, fh, buff );
+    bench( "chunk write", &chunkWrite, fh, buff );
+    double appended = bufferedBench( "small append", fh, buff );
+
+    delete [] buff;
+    delete( fh );
+    delete( fs );
+
+    int retVal = 0;
+    if( cached > 0 ) {
+        printf( "Reads out of the cache are allocating again!\n" );
+        retVal = 1;
+    }
+    if( appended > 0 ) {
+        printf( "Buffered writes are allocating again!\n" );
+        retVal = 1;
+    }
+    return retVal;
+}
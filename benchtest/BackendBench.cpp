@@ -0,0 +1,153 @@
+//
+//  BackendBench.cpp
+//  shinyfs
+//
+//  Pits the storage engines against each other by pushing the same file workloads through a ShinyMetaFileHandle
+//  (just like ShinyFuse does) on top of each one.  Pass in whatever specs you want to compare, e.g.
+//
+//      ./BackendBench memory: leveldb:/tmp/bench.leveldb lmdb:/tmp/bench.lmdb
+//
+//  Pass -d first to lay out chunks in dedup mode (see ShinyChunkStore.h) instead of storing them directly.
+//
+//  Whatever is sitting at those paths gets blown away first, so don't point this at a real filecache!
+//
+
+#include "../shinyfs/filesystem/ShinyFilesystem.h"
+#include "../shinyfs/filesystem/ShinyMetaRootDir.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include "../shinyfs/filesystem/ShinyMetaFileHandle.h"
+#include <base/Logger.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+
+// How big a file we're going to play with, and how many random ops to do on it
+#define FILESIZE        (64*1024*1024)
+#define SEQ_IOSIZE      (128*1024)
+#define BIG_IOSIZE      (1024*1024)
+#define RAND_IOSIZE     (4*1024)
+#define RAND_OPS        20000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int wipeEntry( const char * path, const struct stat * sb, int typeflag, struct FTW * ftwbuf ) {
+    remove( path );
+    return 0;
+}
+
+// Gets rid of whatever a previous run left lying around at the path in spec
+static void wipe( const char * spec ) {
+    const char * colon = strchr( spec, ':' );
+    const char * path = colon ? colon + 1 : spec;
+    if( path[0] )
+        nftw( path, wipeEntry, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+// Stamps offset into the start of every chunk in buff, so no two chunks of the file are the same (otherwise dedup
+// mode would get away with storing hardly anything at all)
+static void stamp( char * buff, uint64_t offset, uint64_t len ) {
+    for( uint64_t i=0; i<len; i += ShinyMetaFile::CHUNKSIZE ) {
+        uint64_t chunkOffset = offset + i;
+        memcpy( buff + i, &chunkOffset, sizeof(uint64_t) );
+    }
+}
+
+static void report( const char * spec, const char * workload, uint64_t ops, uint64_t bytes, double secs ) {
+    printf( "%-32s %-12s %10.0f ops/s %10.1f MB/s\n", spec, workload, ops/secs, bytes/secs/(1024*1024) );
+}
+
+// Makes a fresh file, then gets a handle on it the same way ShinyFuse does
+static ShinyMetaFileHandle * newHandle( ShinyFilesystem * fs, const char * name, const char * path ) {
+    ShinyMetaFile * file = new ShinyMetaFile( name, (ShinyMetaDir *)fs->findNode( "/" ) );
+    char * serialized = new char[file->serializedLen()];
+    file->serialize( serialized );
+    const char * input = serialized;
+    ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &input, fs, path );
+    delete [] serialized;
+    return fh;
+}
+
+static void bench( const char * spec, ShinyChunkStore::Mode chunkMode ) {
+    wipe( spec );
+    ShinyFilesystem * fs = new ShinyFilesystem( spec, chunkMode );
+    ShinyMetaFileHandle * fh = newHandle( fs, "bench", "/bench" );
+
+    // Fill up our buffer with junk that won't compress to nothing
+    char * buff = new char[BIG_IOSIZE];
+    srand( 1337 );
+    for( uint64_t i=0; i<BIG_IOSIZE; ++i )
+        buff[i] = (char) rand();
+
+    double start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE ) {
+        stamp( buff, offset, SEQ_IOSIZE );
+        fh->write( offset, buff, SEQ_IOSIZE );
+    }
+    report( spec, "seq write", FILESIZE/SEQ_IOSIZE, FILESIZE, now() - start );
+
+    // Exactly the same data all over again, into another file.  In dedup mode this shouldn't cost much of anything
+    ShinyMetaFileHandle * copy = newHandle( fs, "copy", "/copy" );
+    start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE ) {
+        stamp( buff, offset, SEQ_IOSIZE );
+        copy->write( offset, buff, SEQ_IOSIZE );
+    }
+    report( spec, "dup write", FILESIZE/SEQ_IOSIZE, FILESIZE, now() - start );
+
+    start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE )
+        fh->read( offset, buff, SEQ_IOSIZE );
+    report( spec, "seq read", FILESIZE/SEQ_IOSIZE, FILESIZE, now() - start );
+
+    // Big reads like this are what FUSE sends our way with large max_read, and they stream through an iterator
+    start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += BIG_IOSIZE )
+        fh->read( offset, buff, BIG_IOSIZE );
+    report( spec, "seq read 1M", FILESIZE/BIG_IOSIZE, FILESIZE, now() - start );
+
+    start = now();
+    for( uint64_t i=0; i<RAND_OPS; ++i )
+        fh->write( (rand() % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+    report( spec, "rand write", RAND_OPS, RAND_OPS*RAND_IOSIZE, now() - start );
+
+    start = now();
+    for( uint64_t i=0; i<RAND_OPS; ++i )
+        fh->read( (rand() % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+    report( spec, "rand read", RAND_OPS, RAND_OPS*RAND_IOSIZE, now() - start );
+
+    start = now();
+    fh->setLen( 0 );
+    report( spec, "truncate", 1, FILESIZE, now() - start );
+
+    delete [] buff;
+    delete( copy );
+    delete( fh );
+    delete( fs );
+}
+
+int main( int argc, const char * argv[] ) {
+    // We don't care to hear about every little thing the filesystem gets up to
+    Logger::getGlobalLogger()->setPrintId(0);
+    Logger::getGlobalLogger()->setPrintThread(0);
+
+    const char * defaultSpecs[] = { "memory:", "leveldb:/tmp/shinybench.leveldb", "lmdb:/tmp/shinybench.lmdb" };
+    ShinyChunkStore::Mode chunkMode = ShinyChunkStore::MODE_DIRECT;
+    if( argc > 1 && strcmp( argv[1], "-d" ) == 0 ) {
+        chunkMode = ShinyChunkStore::MODE_DEDUP;
+        argv++;
+        argc--;
+    }
+
+    const char ** specs = argc > 1 ? argv + 1 : defaultSpecs;
+    int numSpecs = argc > 1 ? argc - 1 : sizeof(defaultSpecs)/sizeof(defaultSpecs[0]);
+
+    for( int i=0; i<numSpecs; ++i )
+        bench( specs[i], chunkMode );
+    return 0;
+}
@@ -0,0 +1,147 @@
+//
+//  ChecksumBench.cpp
+//  shinyfs
+//
+//  Measures what chunk checksums cost.  Writes the same data into a fresh chunk store with and without checksums
+//  (for every codec we were built with, and none), then reads it all back a few times with no chunk cache in the way,
+//  so every read goes to the DB and every checksum gets checked.  Reports how much slower the checksummed store is,
+//  along with how fast CRC-32C runs on its own and whether it's got a CRC32 instruction to run on.  Pass in the spec
+//  of the engine to run on top of (memory: if you don't, since the engine would only drown out the difference), e.g.
+//
+//      ./ChecksumBench leveldb:/tmp/shinybench.leveldb
+//
+//  Whatever is sitting at that path gets blown away first, so don't point this at a real filecache!
+//
+
+#include "../shinyfs/filesystem/ShinyChunkStore.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include "../shinyfs/util/ShinyCRC32C.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <vector>
+
+// How much data goes in, in chunks how big, and how many times it gets read back
+#define DATASIZE        (64*1024*1024)
+#define CHUNKSIZE       ShinyMetaFile::CHUNKSIZE
+#define READS           5
+
+// How much CRC-32C gets run over on its own
+#define CRC_REPS        64
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int wipeEntry( const char * path, const struct stat * sb, int typeflag, struct FTW * ftwbuf ) {
+    remove( path );
+    return 0;
+}
+
+// Gets rid of whatever a previous run left lying around at the path in spec
+static void wipe( const char * spec ) {
+    const char * colon = strchr( spec, ':' );
+    const char * path = colon ? colon + 1 : spec;
+    if( path[0] )
+        nftw( path, wipeEntry, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+// Half random bytes, half runs of text, so a codec has something to chew on but can't make it disappear
+static void makeData( char * data, uint64_t len ) {
+    const char * words = "the quick brown fox jumps over the lazy dog ";
+    for( uint64_t i=0; i<len; ++i )
+        data[i] = (i/4096) % 2 ? (char) rand() : words[i % 44];
+}
+
+struct Result {
+    double writeSecs;
+    double readSecs;
+};
+
+// Writes data into a brand new store, then reads it back READS times, keeping the best time of the lot
+static bool bench( const char * spec, ShinyChunkCodec * codec, bool checksums, const char * data, Result * result ) {
+    wipe( spec );
+    ShinyDBWrapper * db = new ShinyDBWrapper( spec );
+    ShinyChunkStore * store = new ShinyChunkStore( db, ShinyChunkStore::MODE_DIRECT, codec, 0, checksums );
+    const uint64_t numChunks = DATASIZE/CHUNKSIZE;
+    bool success = true;
+
+    // A batch per 16 chunks, roughly what a big sequential write looks like
+    double start = now();
+    ShinyChunkBatch * batch = store->newBatch();
+    for( uint64_t chunk=0; chunk<numChunks && success; ++chunk ) {
+        batch->put( 1, chunk, data + chunk*CHUNKSIZE, CHUNKSIZE );
+        if( chunk % 16 == 15 || chunk == numChunks - 1 ) {
+            success = store->write( batch );
+            batch->clear();
+        }
+    }
+    delete( batch );
+    result->writeSecs = now() - start;
+
+    char * output = new char[CHUNKSIZE];
+    result->readSecs = 0;
+    for( int pass=0; pass<READS && success; ++pass ) {
+        start = now();
+        ShinyChunkReader reader( store, 1, 0, numChunks - 1 );
+        for( uint64_t chunk=0; chunk<numChunks && success; ++chunk ) {
+            uint64_t chunkLen;
+            success = reader.copy( chunk, 0, output, CHUNKSIZE, &chunkLen ) && chunkLen == CHUNKSIZE;
+        }
+        double secs = now() - start;
+        if( pass == 0 || secs < result->readSecs )
+            result->readSecs = secs;
+
+        // Make sure what came back is what went in, once
+        if( pass == 0 && success )
+            success = memcmp( output, data + (numChunks - 1)*CHUNKSIZE, CHUNKSIZE ) == 0;
+    }
+    if( !success )
+        printf( "Couldn't write and read back %s chunks: %s\n", codec ? codec->getName() : "raw", store->getError() );
+
+    delete [] output;
+    delete( store );
+    delete( db );
+    return success;
+}
+
+int main( int argc, const char * argv[] ) {
+    const char * spec = argc > 1 ? argv[1] : "memory:";
+    char * data = new char[DATASIZE];
+    srand( 1337 );
+    makeData( data, DATASIZE );
+
+    // CRC-32C on its own, first
+    double start = now();
+    uint32_t crc = 0;
+    for( int i=0; i<CRC_REPS; ++i )
+        crc = ShinyCRC32C::extend( crc, data, DATASIZE );
+    double crcSecs = now() - start;
+    printf( "CRC-32C: %.2f GB/s (%s) [%08x]\n", (double)CRC_REPS*DATASIZE/crcSecs/(1024.0*1024*1024), ShinyCRC32C::isHardware() ? "hardware" : "software", crc );
+
+    std::vector<ShinyChunkCodec *> codecs;
+    codecs.push_back( NULL );
+    const char * codecNames[] = { "lz", "zlib" };
+    for( uint64_t i=0; i<sizeof(codecNames)/sizeof(codecNames[0]); ++i ) {
+        if( ShinyChunkCodec * codec = ShinyChunkCodec::get( codecNames[i] ) )
+            codecs.push_back( codec );
+    }
+
+    double mb = DATASIZE/(1024.0*1024.0);
+    for( uint64_t i=0; i<codecs.size(); ++i ) {
+        Result plain, checked;
+        if( !bench( spec, codecs[i], false, data, &plain ) || !bench( spec, codecs[i], true, data, &checked ) )
+            return 1;
+        printf( "%-6s write %8.1f -> %8.1f MB/s (%+5.1f%%)   read %8.1f -> %8.1f MB/s (%+5.1f%%)\n", codecs[i] ? codecs[i]->getName() : "none",
+                mb/plain.writeSecs, mb/checked.writeSecs, 100.0*(checked.writeSecs/plain.writeSecs - 1),
+                mb/plain.readSecs, mb/checked.readSecs, 100.0*(checked.readSecs/plain.readSecs - 1) );
+    }
+
+    wipe( spec );
+    delete [] data;
+    return 0;
+}
@@ -0,0 +1,152 @@
+//
+//  ChunkSizeBench.cpp
+//  shinyfs
+//
+//  Runs the same file workloads as BackendBench once for each chunk size a file can have, and once letting
+//  ShinyMetaFile pick for itself, then reports how many keys and bytes the file ended up taking in the DB.  Pass in
+//  the spec of the engine to run on top of (leveldb:/tmp/shinybench.leveldb if you don't), e.g.
+//
+//      ./ChunkSizeBench lmdb:/tmp/shinybench.lmdb
+//
+//  The DB gets reopened after the filesystem is shut down to size it up, so memory: will only give you throughput.
+//
+//  Whatever is sitting at that path gets blown away first, so don't point this at a real filecache!
+//
+
+#include "../shinyfs/filesystem/ShinyFilesystem.h"
+#include "../shinyfs/filesystem/ShinyMetaRootDir.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include "../shinyfs/filesystem/ShinyMetaFileHandle.h"
+#include <base/Logger.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+
+// How big a file we're going to play with, and how many random ops to do on it
+#define FILESIZE        (64*1024*1024)
+#define SEQ_IOSIZE      (128*1024)
+#define RAND_IOSIZE     (4*1024)
+#define RAND_OPS        20000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int wipeEntry( const char * path, const struct stat * sb, int typeflag, struct FTW * ftwbuf ) {
+    remove( path );
+    return 0;
+}
+
+// Gets rid of whatever a previous run left lying around at the path in spec
+static void wipe( const char * spec ) {
+    const char * colon = strchr( spec, ':' );
+    const char * path = colon ? colon + 1 : spec;
+    if( path[0] )
+        nftw( path, wipeEntry, 16, FTW_DEPTH | FTW_PHYS );
+}
+
+// Stamps offset into the start of every 16KB of buff, so no two chunks of the file are the same, whatever size
+// they are
+static void stamp( char * buff, uint64_t offset, uint64_t len ) {
+    for( uint64_t i=0; i<len; i += ShinyMetaFileSnapshot::MIN_CHUNKSIZE ) {
+        uint64_t chunkOffset = offset + i;
+        memcpy( buff + i, &chunkOffset, sizeof(uint64_t) );
+    }
+}
+
+static void report( const char * label, const char * workload, uint64_t ops, uint64_t bytes, double secs ) {
+    printf( "%-10s %-12s %10.0f ops/s %10.1f MB/s\n", label, workload, ops/secs, bytes/secs/(1024*1024) );
+}
+
+// Adds up every key in the DB at spec, and how much they hold.  Each run gets a fresh DB, so that's pretty much all
+// our file (plus the tree and a few bookkeeping keys)
+static void reportSize( const char * label, const char * spec ) {
+    if( !strncmp( spec, "memory:", 7 ) )
+        return;
+    ShinyDBWrapper db( spec );
+    uint64_t keys = 0, bytes = 0;
+    ShinyDBIterator * it = db.newIterator();
+    for( it->seek( "", 0 ); it->valid(); it->next() ) {
+        keys++;
+        bytes += it->keySize() + it->valueSize();
+    }
+    delete( it );
+    printf( "%-10s %-12s %10llu keys %10.1f MB\n", label, "db size", keys, bytes/(1024.0*1024) );
+}
+
+// Makes a fresh file, then gets a handle on it the same way ShinyFuse does
+static ShinyMetaFileHandle * newHandle( ShinyFilesystem * fs, const char * name, const char * path ) {
+    ShinyMetaFile * file = new ShinyMetaFile( name, (ShinyMetaDir *)fs->findNode( "/" ) );
+    char * serialized = new char[file->serializedLen()];
+    file->serialize( serialized );
+    const char * input = serialized;
+    ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &input, fs, path );
+    delete [] serialized;
+    return fh;
+}
+
+// chunkSize of 0 means leave it up to ShinyMetaFile
+static void bench( const char * spec, uint64_t chunkSize ) {
+    char label[32];
+    if( chunkSize )
+        sprintf( label, "%lluK", chunkSize/1024 );
+    else
+        strcpy( label, "auto" );
+
+    wipe( spec );
+    ShinyFilesystem * fs = new ShinyFilesystem( spec );
+    ShinyMetaFileHandle * fh = newHandle( fs, "bench", "/bench" );
+    if( chunkSize )
+        fh->rechunk( fs, chunkSize );
+
+    // Fill up our buffer with junk that won't compress to nothing
+    char * buff = new char[SEQ_IOSIZE];
+    srand( 1337 );
+    for( uint64_t i=0; i<SEQ_IOSIZE; ++i )
+        buff[i] = (char) rand();
+
+    double start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE ) {
+        stamp( buff, offset, SEQ_IOSIZE );
+        fh->write( offset, buff, SEQ_IOSIZE );
+    }
+    report( label, "seq write", FILESIZE/SEQ_IOSIZE, FILESIZE, now() - start );
+
+    start = now();
+    for( uint64_t offset = 0; offset < FILESIZE; offset += SEQ_IOSIZE )
+        fh->read( offset, buff, SEQ_IOSIZE );
+    report( label, "seq read", FILESIZE/SEQ_IOSIZE, FILESIZE, now() - start );
+
+    start = now();
+    for( uint64_t i=0; i<RAND_OPS; ++i )
+        fh->write( (rand() % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+    report( label, "rand write", RAND_OPS, RAND_OPS*RAND_IOSIZE, now() - start );
+
+    start = now();
+    for( uint64_t i=0; i<RAND_OPS; ++i )
+        fh->read( (rand() % (FILESIZE/RAND_IOSIZE))*RAND_IOSIZE, buff, RAND_IOSIZE );
+    report( label, "rand read", RAND_OPS, RAND_OPS*RAND_IOSIZE, now() - start );
+    printf( "%-10s %-12s %10llu bytes\n", label, "chunk size", fh->getChunkSize() );
+
+    delete [] buff;
+    delete( fh );
+    delete( fs );
+    reportSize( label, spec );
+    printf( "\n" );
+}
+
+int main( int argc, const char * argv[] ) {
+    // We don't care to hear about every little thing the filesystem gets up to
+    Logger::getGlobalLogger()->setPrintId(0);
+    Logger::getGlobalLogger()->setPrintThread(0);
+
+    const char * spec = argc > 1 ? argv[1] : "leveldb:/tmp/shinybench.leveldb";
+    for( uint64_t chunkSize = ShinyMetaFileSnapshot::MIN_CHUNKSIZE; chunkSize <= ShinyMetaFileSnapshot::MAX_CHUNKSIZE; chunkSize *= 4 )
+        bench( spec, chunkSize );
+    bench( spec, 0 );
+    return 0;
+}
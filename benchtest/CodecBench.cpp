@@ -0,0 +1,172 @@
+//
+//  CodecBench.cpp
+//  shinyfs
+//
+//  Runs every chunk codec we were built with over a few kinds of data, chunk by chunk exactly the way
+//  ShinyChunkStore does it (incompressible chunks get stored raw and all), and reports the ratio along with how
+//  fast each codec compresses and decompresses.  Pass in some files to throw those at the codecs too, e.g.
+//
+//      ./CodecBench /var/log/syslog some.tar
+//
+
+#include "../shinyfs/filesystem/ShinyChunkCodec.h"
+#include "../shinyfs/filesystem/ShinyChunkStore.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// How much of each kind of data we make up
+#define DATASIZE        (32*1024*1024)
+#define CHUNKSIZE       ShinyMetaFile::CHUNKSIZE
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Log lines, which is what we see the most of and what compresses the best
+static void makeText( std::string & data ) {
+    const char * levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+    const char * words[] = { "request", "served", "cache", "miss", "hit", "user", "session", "opened", "closed",
+                             "timeout", "retrying", "connection", "from", "to", "bytes", "in", "ms", "ok" };
+    char line[256];
+    for( uint64_t i=0; data.size() < DATASIZE; ++i ) {
+        int len = sprintf( line, "2012-06-%02llu %02llu:%02llu:%02llu.%03llu [%s] worker-%llu:", i/86400000 % 28 + 1,
+                           i/3600000 % 24, i/60000 % 60, i/1000 % 60, i % 1000, levels[rand() % 4], (unsigned long long)(rand() % 16) );
+        for( int w = rand() % 10 + 3; w > 0; --w )
+            len += sprintf( line + len, " %s", words[rand() % (sizeof(words)/sizeof(words[0]))] );
+        len += sprintf( line + len, " %d\n", rand() % 100000 );
+        data.append( line, len );
+    }
+    data.resize( DATASIZE );
+}
+
+// Fixed-width binary records with slowly-changing fields, like a database or a VM image full of structs
+static void makeRecords( std::string & data ) {
+    struct { uint64_t id; uint32_t flags; uint32_t count; double value; char name[8]; } record;
+    memset( &record, 0, sizeof(record) );
+    strcpy( record.name, "shiny" );
+    while( data.size() < DATASIZE ) {
+        record.id++;
+        record.count += rand() % 4;
+        record.flags = rand() % 8 == 0 ? rand() : record.flags;
+        record.value = record.count * 0.5;
+        data.append( (const char *)&record, sizeof(record) );
+    }
+    data.resize( DATASIZE );
+}
+
+// Stuff that's already compressed (or encrypted), where the only thing that matters is how fast we give up
+static void makeRandom( std::string & data ) {
+    data.resize( DATASIZE );
+    for( uint64_t i=0; i<DATASIZE; ++i )
+        data[i] = (char)rand();
+}
+
+// Half text and half junk, chunk by chunk, like a tarball of logs and binaries
+static void makeMixed( std::string & data ) {
+    std::string text, junk;
+    makeText( text );
+    makeRandom( junk );
+    data.resize( DATASIZE );
+    for( uint64_t i=0; i<DATASIZE; i += CHUNKSIZE )
+        memcpy( &data[i], ((i/CHUNKSIZE) % 2 ? junk : text).data() + i, CHUNKSIZE );
+}
+
+static bool loadFile( const char * path, std::string & data ) {
+    FILE * f = fopen( path, "rb" );
+    if( !f )
+        return false;
+    char buff[64*1024];
+    size_t len;
+    while( (len = fread( buff, 1, sizeof(buff), f )) > 0 )
+        data.append( buff, len );
+    fclose( f );
+    return true;
+}
+
+static void bench( const char * name, const std::string & data, ShinyChunkCodec * codec ) {
+    uint64_t numChunks = (data.size() + CHUNKSIZE - 1)/CHUNKSIZE;
+    char * compressed = new char[numChunks*CHUNKSIZE];
+    uint64_t * compressedLen = new uint64_t[numChunks];
+    char * output = new char[CHUNKSIZE];
+
+    // Compress every chunk, holding on to the results so we can decompress them afterwards
+    uint64_t storedBytes = 0, rawChunks = 0;
+    double start = now();
+    for( uint64_t i=0; i<numChunks; ++i ) {
+        uint64_t len = i == numChunks - 1 ? data.size() - i*CHUNKSIZE : CHUNKSIZE;
+        compressedLen[i] = codec->compress( data.data() + i*CHUNKSIZE, len, compressed + i*CHUNKSIZE, len - len/ShinyChunkStore::MIN_SAVINGS );
+        if( !compressedLen[i] )
+            rawChunks++;
+        storedBytes += ShinyChunkStore::HEADER_LEN + (compressedLen[i] ? compressedLen[i] : len);
+    }
+    double compressSecs = now() - start;
+
+    // Then back again, checking we got out what we put in.  Raw chunks don't cost anything to read back
+    start = now();
+    for( uint64_t i=0; i<numChunks; ++i ) {
+        uint64_t len = i == numChunks - 1 ? data.size() - i*CHUNKSIZE : CHUNKSIZE;
+        if( compressedLen[i] && !codec->decompress( compressed + i*CHUNKSIZE, compressedLen[i], output, len ) ) {
+            printf( "%s: %s couldn't decompress chunk %llu!\n", name, codec->getName(), (unsigned long long)i );
+            break;
+        }
+    }
+    double decompressSecs = now() - start;
+
+    for( uint64_t i=0; i<numChunks; ++i ) {
+        uint64_t len = i == numChunks - 1 ? data.size() - i*CHUNKSIZE : CHUNKSIZE;
+        if( compressedLen[i] && (!codec->decompress( compressed + i*CHUNKSIZE, compressedLen[i], output, len ) || memcmp( output, data.data() + i*CHUNKSIZE, len ) != 0) ) {
+            printf( "%s: %s mangled chunk %llu!\n", name, codec->getName(), (unsigned long long)i );
+            break;
+        }
+    }
+
+    double mb = data.size()/(1024.0*1024.0);
+    printf( "%-24s %-6s %6.2fx ratio %5.1f%% raw %8.1f MB/s compress %8.1f MB/s decompress\n", name, codec->getName(),
+            (double)data.size()/storedBytes, 100.0*rawChunks/numChunks, mb/compressSecs, mb/decompressSecs );
+
+    delete [] output;
+    delete [] compressedLen;
+    delete [] compressed;
+}
+
+int main( int argc, const char * argv[] ) {
+    const char * codecNames[] = { "lz", "zlib" };
+    std::vector<ShinyChunkCodec *> codecs;
+    for( uint64_t i=0; i<sizeof(codecNames)/sizeof(codecNames[0]); ++i ) {
+        if( ShinyChunkCodec * codec = ShinyChunkCodec::get( codecNames[i] ) )
+            codecs.push_back( codec );
+    }
+
+    std::vector<std::string> names;
+    std::vector<std::string> datasets;
+    void (*makers[])( std::string & ) = { makeText, makeRecords, makeRandom, makeMixed };
+    const char * makerNames[] = { "text", "records", "random", "mixed" };
+    srand( 1337 );
+    for( uint64_t i=0; i<sizeof(makers)/sizeof(makers[0]); ++i ) {
+        names.push_back( makerNames[i] );
+        datasets.push_back( std::string() );
+        makers[i]( datasets.back() );
+    }
+    for( int i=1; i<argc; ++i ) {
+        std::string data;
+        if( !loadFile( argv[i], data ) || data.empty() ) {
+            printf( "Couldn't read anything from %s, skipping it\n", argv[i] );
+            continue;
+        }
+        names.push_back( argv[i] );
+        datasets.push_back( data );
+    }
+
+    for( uint64_t d=0; d<datasets.size(); ++d ) {
+        for( uint64_t c=0; c<codecs.size(); ++c )
+            bench( names[d].c_str(), datasets[d], codecs[c] );
+    }
+    return 0;
+}
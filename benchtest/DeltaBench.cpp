@@ -0,0 +1,145 @@
+//
+//  DeltaBench.cpp
+//  shinyfs
+//
+//  Pits ShinyDelta against the brute force matcher difftest used to have (every offset of the old data tried for
+//  every position in the new), on a few kinds of edits: a handful of bytes inserted, everything shifted along, and
+//  bytes changed all over the place.  Reports how long each takes to work out what changed, and how much of the new
+//  data they couldn't find in the old (which is roughly what a delta has to carry).  ShinyDelta's deltas also get
+//  decoded and checked.  The brute force one is quadratic, so it only gets the smaller sizes; pass in a size (in KB)
+//  to only run that one, e.g.
+//
+//      ./DeltaBench 1024
+//
+
+#include "../shinyfs/util/ShinyDelta.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+#define min( x, y )     ((x) < (y) ? (x) : (y))
+
+// The sizes we run at, and the biggest one the brute force matcher has to sit through
+static const uint64_t SIZES[] = { 16*1024, 256*1024, 1024*1024, 16*1024*1024 };
+#define OLD_MAXSIZE     (1024*1024)
+
+// The old matcher only counted matches longer than this
+#define OLD_MINMATCH    16
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void makeRandom( std::string & data, uint64_t len ) {
+    data.resize( len );
+    for( uint64_t i=0; i<len; ++i )
+        data[i] = (char) rand();
+}
+
+// A few runs of bytes inserted here and there, the first right where difftest put its three
+static void makeInserted( const std::string & source, std::string & target ) {
+    target = source;
+    target.insert( min( (uint64_t)157, target.size() ), "\1\1\1", 3 );
+    for( int i=0; i<8; ++i ) {
+        std::string bytes;
+        makeRandom( bytes, 1 + rand() % 64 );
+        target.insert( rand() % target.size(), bytes );
+    }
+}
+
+// Everything moved along by a few bytes, with new ones at the front and the end falling off
+static void makeShifted( const std::string & source, std::string & target ) {
+    makeRandom( target, 7 );
+    target.append( source, 0, source.size() - 7 );
+}
+
+// One byte in every thousand or so changed
+static void makeEdited( const std::string & source, std::string & target ) {
+    target = source;
+    for( uint64_t i=0; i<source.size()/1000; ++i )
+        target[rand() % target.size()] ^= (char)(1 + rand() % 255);
+}
+
+// The old difftest matcher, give or take not reading off the end of b
+struct SearchResult {
+    uint64_t idx;
+    uint64_t len;
+};
+
+static SearchResult findLongestSubstring( const uint8_t * a, uint64_t aLen, const uint8_t * b, uint64_t bLen, uint64_t start ) {
+    const uint8_t * aPtr = a + start;
+    SearchResult max = { 0, 0 };
+    for( uint64_t i = 0; i < bLen; ++i ) {
+        const uint8_t * bPtr = b + i;
+        const uint64_t limit = min( aLen - start, bLen - i );
+        uint64_t j = 0;
+        while( j < limit && aPtr[j] == bPtr[j] )
+            j++;
+        if( j > max.len ) {
+            max.len = j;
+            max.idx = i;
+        }
+    }
+    return max;
+}
+
+// Finds the target in as much of the source as it can, returning how many bytes of target it couldn't
+static uint64_t oldDiff( const std::string & source, const std::string & target ) {
+    const uint8_t * a = (const uint8_t *)target.data();
+    const uint8_t * b = (const uint8_t *)source.data();
+    uint64_t start = 0, missed = 0;
+    while( start < target.size() ) {
+        SearchResult result = findLongestSubstring( a, target.size(), b, source.size(), start );
+        if( result.len > OLD_MINMATCH )
+            start += result.len;
+        else {
+            start++;
+            missed++;
+        }
+    }
+    return missed;
+}
+
+static void bench( const char * name, const std::string & source, const std::string & target ) {
+    std::string delta, result;
+    double start = now();
+    ShinyDelta::encode( source.data(), source.size(), target.data(), target.size(), delta );
+    double encodeSecs = now() - start;
+    start = now();
+    bool success = ShinyDelta::decode( source.data(), source.size(), delta.data(), delta.size(), result ) && result == target;
+    double decodeSecs = now() - start;
+
+    printf( "%-9s %6llu KB   delta %10.2f ms %8llu bytes   decode %8.2f ms%s", name, (unsigned long long)source.size()/1024,
+            encodeSecs*1000, (unsigned long long)delta.size(), decodeSecs*1000, success ? "" : " (MISMATCH!)" );
+    if( source.size() <= OLD_MAXSIZE ) {
+        start = now();
+        uint64_t missed = oldDiff( source, target );
+        double oldSecs = now() - start;
+        printf( "   old %10.2f ms %8llu missed (%.0fx)\n", oldSecs*1000, (unsigned long long)missed, oldSecs/encodeSecs );
+    } else
+        printf( "   old (too slow)\n" );
+}
+
+int main( int argc, const char * argv[] ) {
+    uint64_t onlySize = argc > 1 ? strtoull( argv[1], NULL, 10 )*1024 : 0;
+    for( uint64_t i=0; i<sizeof(SIZES)/sizeof(SIZES[0]); ++i ) {
+        uint64_t size = onlySize ? onlySize : SIZES[i];
+        srand( 1 );
+        std::string source, target;
+        makeRandom( source, size );
+
+        makeInserted( source, target );
+        bench( "inserted", source, target );
+        makeShifted( source, target );
+        bench( "shifted", source, target );
+        makeEdited( source, target );
+        bench( "edited", source, target );
+        if( onlySize )
+            break;
+    }
+    return 0;
+}
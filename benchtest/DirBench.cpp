@@ -0,0 +1,144 @@
+//
+//  DirBench.cpp
+//  shinyfs
+//
+//  Times looking up, adding and deleting children of a ShinyMetaDirSnapshot, at sizes from 10 children up to 10
+//  million, so we can see lookups stay flat as directories grow (and where the switch from binary search to hash
+//  table lands, see ShinyMetaDirSnapshot::HASH_MIN).  For comparison, it also times the linear scan lookups used to
+//  be (every child's name strlen()'d and compared, one after another), up to the sizes where that's still bearable.
+//  Pass in the biggest size to go up to, if 10 million children (a GB or so of nodes) is too many, e.g.
+//
+//      ./DirBench 1000000
+//
+
+#include "../shinyfs/filesystem/ShinyMetaDirSnapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// How many lookups get timed at each size, and the biggest size the linear scan gets timed at
+#define LOOKUPS         1000000
+#define LINEAR_MAX      100000
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// A child with nothing but a name, which is all a dir cares about
+class BenchNode : public ShinyMetaNodeSnapshot {
+public:
+    BenchNode( const char * newName, ShinyMetaDirSnapshot * newParent ) {
+        this->name = new char[strlen( newName ) + 1];
+        strcpy( this->name, newName );
+        this->parent = newParent;
+    }
+
+    // Takes care of the name ourselves, and keeps the base class from going looking for our parent
+    ~BenchNode() {
+        delete [] this->name;
+        this->name = NULL;
+        this->parent = NULL;
+    }
+};
+
+// Opens up the dir's add/delete, which are normally only for nodes and the filesystem
+class BenchDir : public ShinyMetaDirSnapshot {
+public:
+    BenchDir() {
+        this->name = NULL;
+        this->parent = NULL;
+    }
+
+    void add( ShinyMetaNodeSnapshot * node ) {
+        this->addNode( node );
+    }
+
+    void del( ShinyMetaNodeSnapshot * node ) {
+        this->delNode( node );
+    }
+};
+
+// The old ShinyFilesystem::findMatchingChild()
+static ShinyMetaNodeSnapshot * linearFind( ShinyMetaDirSnapshot * dir, const char * name, uint64_t nameLen ) {
+    const std::vector<ShinyMetaNodeSnapshot *> & list = *dir->getNodes();
+    for( uint64_t i = 0; i < list.size(); ++i ) {
+        if( strlen( list[i]->getName() ) == nameLen && memcmp( list[i]->getName(), name, nameLen ) == 0 )
+            return list[i];
+    }
+    return NULL;
+}
+
+// Names that look about like real ones, and don't go in in order
+static void makeName( uint64_t i, char * name ) {
+    sprintf( name, "IMG_%04llu_%llu.jpg", (unsigned long long)((i*2654435761u) % 10000), (unsigned long long)i );
+}
+
+static void bench( uint64_t size ) {
+    BenchDir * dir = new BenchDir();
+    std::vector<BenchNode *> nodes( size );
+    char name[64];
+
+    double start = now();
+    for( uint64_t i=0; i<size; ++i ) {
+        makeName( i, name );
+        nodes[i] = new BenchNode( name, dir );
+        dir->add( nodes[i] );
+    }
+    double addSecs = now() - start;
+    if( dir->getNumNodes() != size )
+        printf( "Only %llu of %llu names made it in!\n", (unsigned long long)dir->getNumNodes(), (unsigned long long)size );
+
+    // Half hits, half misses, with the names made up ahead of time so we only time the lookups
+    std::vector<std::string> names( LOOKUPS/100 );
+    for( uint64_t i=0; i<names.size(); ++i ) {
+        makeName( i % 2 ? (uint64_t)rand() % size : size + (uint64_t)rand(), name );
+        names[i] = name;
+    }
+    uint64_t found = 0;
+    start = now();
+    for( uint64_t i=0; i<LOOKUPS; ++i ) {
+        const std::string & lookup = names[i % names.size()];
+        found += dir->findNode( lookup.data(), lookup.size() ) != NULL;
+    }
+    double findSecs = now() - start;
+
+    // The linear scan only gets as many lookups as it can do in about as much time as a big dir's worth of adds
+    double linearNs = 0;
+    if( size <= LINEAR_MAX ) {
+        uint64_t lookups = LOOKUPS/(size/10 + 1) + 1;
+        start = now();
+        for( uint64_t i=0; i<lookups; ++i ) {
+            const std::string & lookup = names[i % names.size()];
+            found += linearFind( dir, lookup.data(), lookup.size() ) != NULL;
+        }
+        linearNs = (now() - start)/lookups*1e9;
+    }
+
+    start = now();
+    for( uint64_t i=0; i<size; ++i ) {
+        dir->del( nodes[i] );
+        delete( nodes[i] );
+    }
+    double delSecs = now() - start;
+
+    printf( "%9llu children   add %8.1f ns   find %8.1f ns", (unsigned long long)size, addSecs/size*1e9, findSecs/LOOKUPS*1e9 );
+    if( linearNs )
+        printf( "   (linear %11.1f ns)", linearNs );
+    else
+        printf( "   (linear   too slow)    " );
+    printf( "   delete %8.1f ns   [%llu]\n", delSecs/size*1e9, (unsigned long long)found );
+    delete( dir );
+}
+
+int main( int argc, const char * argv[] ) {
+    uint64_t maxSize = argc > 1 ? strtoull( argv[1], NULL, 10 ) : 10000000;
+    srand( 1 );
+    for( uint64_t size = 10; size <= maxSize; size *= 10 )
+        bench( size );
+    return 0;
+}
@@ -0,0 +1,85 @@
+//
+//  PathBench.cpp
+//  shinyfs
+//
+//  Times ShinyFilesystem::findNode() on paths of a few depths, the first time each path is looked up (walking down
+//  from the root a name at a time, then remembering it) and every time after that (straight out of the path cache),
+//  and reports the hit/miss counts findNode() kept along the way.  Every path is a file at the bottom of a chain of
+//  dirs, with a few siblings at every level so there's something to search through.  Runs on top of memory:, so
+//  there's nothing to set up, e.g.
+//
+//      ./PathBench
+//
+
+#include "../shinyfs/filesystem/ShinyFilesystem.h"
+#include "../shinyfs/filesystem/ShinyMetaRootDir.h"
+#include "../shinyfs/filesystem/ShinyMetaFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// How deep the paths go, how many files sit at the bottom, how many extra dirs sit at every level, and how many
+// times every file gets looked up once it's been cached
+static const uint64_t DEPTHS[] = { 1, 4, 16, 64 };
+#define FILES           1000
+#define SIBLINGS        16
+#define REPEATS         100
+
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void bench( ShinyFilesystem * fs, uint64_t depth ) {
+    // Build the chain of dirs down, each with a few siblings next to it
+    char name[64];
+    std::string path;
+    ShinyMetaDir * dir = (ShinyMetaDir *)fs->findNode( "/" );
+    for( uint64_t i=0; i<depth; ++i ) {
+        for( uint64_t j=0; j<SIBLINGS; ++j ) {
+            sprintf( name, "sibling%02llu_%llu", (unsigned long long)j, (unsigned long long)depth );
+            new ShinyMetaDir( name, dir );
+        }
+        sprintf( name, "dir%02llu_%llu", (unsigned long long)i, (unsigned long long)depth );
+        dir = new ShinyMetaDir( name, dir );
+        path += "/";
+        path += name;
+    }
+
+    std::vector<std::string> paths( FILES );
+    for( uint64_t i=0; i<FILES; ++i ) {
+        sprintf( name, "file%04llu", (unsigned long long)i );
+        new ShinyMetaFile( name, dir );
+        paths[i] = path + "/" + name;
+    }
+
+    uint64_t hits = fs->getPathCacheHits(), misses = fs->getPathCacheMisses(), found = 0;
+    double start = now();
+    for( uint64_t i=0; i<FILES; ++i )
+        found += fs->findNode( paths[i].c_str() ) != NULL;
+    double coldSecs = now() - start;
+
+    start = now();
+    for( uint64_t r=0; r<REPEATS; ++r ) {
+        for( uint64_t i=0; i<FILES; ++i )
+            found += fs->findNode( paths[i].c_str() ) != NULL;
+    }
+    double warmSecs = now() - start;
+
+    printf( "depth %3llu (%5llu byte paths)   first lookup %9.1f ns   cached %7.1f ns   [%llu hits, %llu misses, %llu found]\n",
+            (unsigned long long)depth, (unsigned long long)paths[0].size(), coldSecs/FILES*1e9, warmSecs/(FILES*REPEATS)*1e9,
+            (unsigned long long)(fs->getPathCacheHits() - hits), (unsigned long long)(fs->getPathCacheMisses() - misses),
+            (unsigned long long)found );
+}
+
+int main( int argc, const char * argv[] ) {
+    ShinyFilesystem * fs = new ShinyFilesystem( "memory:" );
+    for( uint64_t i=0; i<sizeof(DEPTHS)/sizeof(DEPTHS[0]); ++i )
+        bench( fs, DEPTHS[i] );
+    delete( fs );
+    return 0;
+}
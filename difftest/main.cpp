@@ -2,50 +2,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <string>
+#include "../shinyfs/util/ShinyDelta.h"
 
 #define DATALEN1     1024*1000
 #define DATALEN2     (DATALEN1 + 3)
 
-#define min( x, y )  ((x) < (y) ? (x) : (y))
-
-typedef struct {
-    uint64_t idx;
-    uint64_t len;
-} SearchResult;
-
-SearchResult findLongestSubstring( void * a, uint64_t aLen, void * b, uint64_t bLen, uint64_t start ) {
-    uint8_t * aPtr = ((uint8_t *)a) + start;
-    uint8_t * bPtr;
-    const uint64_t limit = min(aLen - start, bLen);
-    
-    SearchResult max = { 0, 0 };
-    uint64_t j;
-    for( uint64_t i = 0; i < bLen; ++i ) {
-        bPtr = (uint8_t *)b + i;
-        j = 0;
-        while( aPtr[j] == bPtr[j] && j < limit ) {
-            j++;
-        }
-        if( j > max.len ) {
-            max.len = j;
-            max.idx = i;
-        }
-    }
-    return max;
+static double now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec*1e-9;
 }
 
-// Calculates a out of as much b as possible
-void doDiff( void * a, uint64_t aLen, void * b, uint64_t bLen ) {
-    // Start marks the position in a that we're trying to match in b
-    int64_t start = 0;
-    while( start < aLen - 1 ) {
-        SearchResult result = findLongestSubstring( a, aLen, b, bLen, start );
-        if( result.len > 16 ) {
-            printf("Mapped old %lld-%lld -> new %lld-%lld\n", result.idx, result.idx + result.len, start, start + result.len );
-            start += result.len;
-        } else
-            start++;
+// Works out b out of as much a as possible, then makes sure we get b back.  This used to be a brute force search of
+// every offset of a for every position in b, which took forever on anything this big; ShinyDelta does the real
+// work now (see benchtest/DeltaBench.cpp for how the two stack up)
+bool doDiff( void * a, uint64_t aLen, void * b, uint64_t bLen ) {
+    std::string delta;
+    double start = now();
+    ShinyDelta::encode( (const char *)a, aLen, (const char *)b, bLen, delta );
+    double encodeSecs = now() - start;
+    
+    std::string result;
+    start = now();
+    bool success = ShinyDelta::decode( (const char *)a, aLen, delta.data(), delta.size(), result );
+    double decodeSecs = now() - start;
+    
+    printf("Old %llu bytes -> new %llu bytes in a %llu byte delta (encode %.2fms, decode %.2fms)\n", (unsigned long long)aLen,
+           (unsigned long long)bLen, (unsigned long long)delta.size(), encodeSecs*1000, decodeSecs*1000 );
+    if( !success || result.size() != bLen || memcmp( result.data(), b, bLen ) != 0 ) {
+        printf("Delta didn't give us the new data back!\n");
+        return false;
     }
+    return true;
 }
 
 
@@ -66,10 +56,9 @@ int main(int argc, const char * argv[])
     
     
     
-    doDiff( data1, DATALEN1, data2, DATALEN2 );
+    bool success = doDiff( data1, DATALEN1, data2, DATALEN2 );
     
-    delete( data1 );
-    delete( data2 );
-    return 0;
+    delete[] data1;
+    delete[] data2;
+    return success ? 0 : 1;
 }
-
@@ -0,0 +1,229 @@
+//
+//  ShinyChunkCache.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkCache.h"
+#include <string.h>
+
+size_t ShinyChunkCache::KeyHash::operator()( const std::pair<uint64_t, uint64_t> & key ) const {
+    return (size_t)ShinyChunkCache::hash( key.first, key.second );
+}
+
+ShinyChunkCache::ShinyChunkCache( uint64_t maxSize ) : maxSize(maxSize), maxShardSize(maxSize/SHARDS) {
+    for( uint64_t i=0; i<SHARDS; ++i ) {
+        Shard * shard = &this->shards[i];
+        pthread_mutex_init( &shard->lock, NULL );
+        shard->hand = 0;
+        shard->size = 0;
+        shard->epoch = 0;
+        memset( shard->sketch, 0, sizeof(shard->sketch) );
+        shard->sketchCount = 0;
+        memset( &shard->stats, 0, sizeof(Stats) );
+    }
+}
+
+ShinyChunkCache::~ShinyChunkCache() {
+    for( uint64_t i=0; i<SHARDS; ++i ) {
+        Shard * shard = &this->shards[i];
+        for( uint64_t j=0; j<shard->clock.size(); ++j ) {
+            delete [] shard->clock[j]->data;
+            delete( shard->clock[j] );
+        }
+        pthread_mutex_destroy( &shard->lock );
+    }
+}
+
+uint64_t ShinyChunkCache::getMaxSize() {
+    return this->maxSize;
+}
+
+uint64_t ShinyChunkCache::hash( uint64_t fileID, uint64_t chunk ) {
+    // Consecutive chunks of a file should land all over the place, not in neighboring slots
+    uint64_t h = fileID*0x9e3779b97f4a7c15ULL ^ chunk;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t ShinyChunkCache::getShard( uint64_t fileID, uint64_t chunk ) {
+    // The sketch uses the low bits, so the shard comes from the top ones
+    return (hash( fileID, chunk ) >> 56) % SHARDS;
+}
+
+uint64_t ShinyChunkCache::getEpoch( uint64_t fileID, uint64_t chunk ) {
+    Shard * shard = &this->shards[getShard( fileID, chunk )];
+    pthread_mutex_lock( &shard->lock );
+    uint64_t epoch = shard->epoch;
+    pthread_mutex_unlock( &shard->lock );
+    return epoch;
+}
+
+void ShinyChunkCache::getEpochs( uint64_t * epochs ) {
+    for( uint64_t i=0; i<SHARDS; ++i ) {
+        pthread_mutex_lock( &this->shards[i].lock );
+        epochs[i] = this->shards[i].epoch;
+        pthread_mutex_unlock( &this->shards[i].lock );
+    }
+}
+
+bool ShinyChunkCache::get( uint64_t fileID, uint64_t chunk, uint64_t offset, char * output, uint64_t len, uint64_t * chunkLen, uint64_t * epoch ) {
+    uint64_t h = hash( fileID, chunk );
+    Shard * shard = &this->shards[(h >> 56) % SHARDS];
+
+    pthread_mutex_lock( &shard->lock );
+    this->touch( shard, h );
+    EntryMap::iterator itty = shard->entries.find( std::make_pair( fileID, chunk ) );
+    if( itty == shard->entries.end() ) {
+        shard->stats.misses++;
+        *epoch = shard->epoch;
+        pthread_mutex_unlock( &shard->lock );
+        return false;
+    }
+
+    // Copying out under the lock keeps the entry from getting freed out from under us.  It's never more than a chunk
+    Entry * entry = itty->second;
+    entry->referenced = true;
+    shard->stats.hits++;
+    *chunkLen = entry->len;
+    uint64_t copyLen = offset < entry->len ? entry->len - offset : 0;
+    memcpy( output, entry->data + offset, copyLen < len ? copyLen : len );
+    pthread_mutex_unlock( &shard->lock );
+    return true;
+}
+
+void ShinyChunkCache::put( uint64_t fileID, uint64_t chunk, const char * data, uint64_t len, uint64_t epoch ) {
+    uint64_t h = hash( fileID, chunk );
+    Shard * shard = &this->shards[(h >> 56) % SHARDS];
+    uint64_t charge = len + ENTRY_OVERHEAD;
+    if( charge > this->maxShardSize )
+        return;
+
+    pthread_mutex_lock( &shard->lock );
+
+    // Somebody wrote to it after we read it, so what we've got could be old news
+    if( epoch != shard->epoch ) {
+        shard->stats.rejects++;
+        pthread_mutex_unlock( &shard->lock );
+        return;
+    }
+
+    // Somebody else beat us to it, which is fine, they read the same thing we did
+    std::pair<uint64_t, uint64_t> key( fileID, chunk );
+    if( shard->entries.find( key ) != shard->entries.end() ) {
+        pthread_mutex_unlock( &shard->lock );
+        return;
+    }
+
+    // Make room, but only by pushing out chunks that are asked for less often than this one is
+    uint8_t freq = this->frequency( shard, h );
+    while( shard->size + charge > this->maxShardSize ) {
+        Entry * victim = this->findVictim( shard );
+        if( freq <= this->frequency( shard, hash( victim->fileID, victim->chunk ) ) ) {
+            shard->stats.rejects++;
+            pthread_mutex_unlock( &shard->lock );
+            return;
+        }
+        this->remove( shard, victim );
+        shard->stats.evictions++;
+    }
+
+    // New entries start out unreferenced, so a chunk that's never read again is the first to go
+    Entry * entry = new Entry;
+    entry->fileID = fileID;
+    entry->chunk = chunk;
+    entry->data = len ? new char[len] : NULL;
+    if( len )
+        memcpy( entry->data, data, len );
+    entry->len = len;
+    entry->referenced = false;
+    entry->slot = shard->clock.size();
+    shard->clock.push_back( entry );
+    shard->entries[key] = entry;
+    shard->size += charge;
+    shard->stats.inserts++;
+    pthread_mutex_unlock( &shard->lock );
+}
+
+void ShinyChunkCache::invalidate( uint64_t fileID, uint64_t chunk ) {
+    Shard * shard = &this->shards[getShard( fileID, chunk )];
+    pthread_mutex_lock( &shard->lock );
+    shard->epoch++;
+    EntryMap::iterator itty = shard->entries.find( std::make_pair( fileID, chunk ) );
+    if( itty != shard->entries.end() )
+        this->remove( shard, itty->second );
+    pthread_mutex_unlock( &shard->lock );
+}
+
+void ShinyChunkCache::getStats( Stats * stats ) {
+    memset( stats, 0, sizeof(Stats) );
+    for( uint64_t i=0; i<SHARDS; ++i ) {
+        Shard * shard = &this->shards[i];
+        pthread_mutex_lock( &shard->lock );
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->inserts += shard->stats.inserts;
+        stats->rejects += shard->stats.rejects;
+        stats->evictions += shard->stats.evictions;
+        stats->entries += shard->entries.size();
+        stats->bytes += shard->size;
+        pthread_mutex_unlock( &shard->lock );
+    }
+}
+
+void ShinyChunkCache::touch( Shard * shard, uint64_t h ) {
+    for( uint64_t row=0; row<SKETCH_DEPTH; ++row ) {
+        uint8_t & counter = shard->sketch[row][(h >> (row*12)) % SKETCH_WIDTH];
+        if( counter < SKETCH_MAX )
+            counter++;
+    }
+
+    // Age everything, so the sketch keeps up with what's popular now
+    if( ++shard->sketchCount >= SKETCH_RESET ) {
+        for( uint64_t row=0; row<SKETCH_DEPTH; ++row ) {
+            for( uint64_t i=0; i<SKETCH_WIDTH; ++i )
+                shard->sketch[row][i] >>= 1;
+        }
+        shard->sketchCount = 0;
+    }
+}
+
+uint8_t ShinyChunkCache::frequency( Shard * shard, uint64_t h ) {
+    // Collisions only ever push counters up, so the smallest one is the closest to the truth
+    uint8_t freq = SKETCH_MAX;
+    for( uint64_t row=0; row<SKETCH_DEPTH; ++row ) {
+        uint8_t counter = shard->sketch[row][(h >> (row*12)) % SKETCH_WIDTH];
+        if( counter < freq )
+            freq = counter;
+    }
+    return freq;
+}
+
+void ShinyChunkCache::remove( Shard * shard, Entry * entry ) {
+    // Fill the hole in the clock with whatever's at the end of it
+    Entry * last = shard->clock.back();
+    shard->clock[entry->slot] = last;
+    last->slot = entry->slot;
+    shard->clock.pop_back();
+    if( shard->hand >= shard->clock.size() )
+        shard->hand = 0;
+
+    shard->entries.erase( std::make_pair( entry->fileID, entry->chunk ) );
+    shard->size -= entry->len + ENTRY_OVERHEAD;
+    delete [] entry->data;
+    delete( entry );
+}
+
+ShinyChunkCache::Entry * ShinyChunkCache::findVictim( Shard * shard ) {
+    // Everything gets its bit cleared on the way past, so we're done within one trip around
+    while( true ) {
+        Entry * entry = shard->clock[shard->hand];
+        if( !entry->referenced )
+            return entry;
+        entry->referenced = false;
+        shard->hand = (shard->hand + 1) % shard->clock.size();
+    }
+}
@@ -0,0 +1,144 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkCache_h
+#define shinyfs_ShinyChunkCache_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ Keeps recently read chunks around in memory, already decompressed and with their deltas merged in, so reading the
+ same chunk again doesn't have to go anywhere near the DB.  Sits inside ShinyChunkStore, keyed by (file ID, chunk
+ index), and is shared by every thread reading through the store.
+
+ It's split up into SHARDS shards, each with its own lock, so FUSE threads reading different chunks hardly ever wait
+ on each other.  Each shard gets an equal slice of the memory budget and evicts with CLOCK: every entry has a
+ referenced bit that gets set whenever it's hit, and the hand sweeps around clearing bits until it finds an entry that
+ hasn't been hit since the last time around.
+
+ Eviction alone would let one big sequential read flush out everything that's actually being used, so new chunks
+ also have to earn their way in (TinyLFU): every shard keeps a small count-min sketch of how often each chunk has
+ been asked for lately, hits and misses alike, and once the shard is full a chunk only gets in if it's been asked for
+ more often than whatever it would push out.  A chunk read once during a scan never is.  The counts are halved every
+ so often, so chunks that were popular a long time ago don't stay that way forever.
+
+ Whoever writes a chunk has to invalidate() it once it's in the DB (ShinyChunkStore does this for every chunk a batch
+ touches).  Since a reader can look something up in the DB, get beaten to it by a writer, and only then try to put()
+ what it found, each shard also counts invalidations in its epoch.  Readers grab the epoch before they go to the DB,
+ and put() turns them away if it's changed since, so nothing stale ever gets in.
+ */
+
+class ShinyChunkCache {
+/////// CREATION ///////
+public:
+    // How many shards chunks are spread across, and how much memory the cache gets if nobody says otherwise
+    static const uint64_t SHARDS = 16;
+    static const uint64_t DEFAULT_SIZE = 64*1024*1024;
+
+    // Every entry is charged this much on top of its data, so that caching lots of holes (which have no data at all)
+    // still counts against the budget
+    static const uint64_t ENTRY_OVERHEAD = 64;
+
+    // maxSize is the memory budget in bytes, split evenly across the shards
+    ShinyChunkCache( uint64_t maxSize );
+    ~ShinyChunkCache();
+
+    uint64_t getMaxSize();
+
+/////// CACHING ///////
+public:
+    // Which shard chunk of fileID lives in, for picking its epoch out of getEpochs()
+    static uint64_t getShard( uint64_t fileID, uint64_t chunk );
+
+    // The current epoch of the shard chunk of fileID lives in, or of every shard (epochs must have room for SHARDS)
+    uint64_t getEpoch( uint64_t fileID, uint64_t chunk );
+    void getEpochs( uint64_t * epochs );
+
+    // If chunk of fileID is cached, copies up to len bytes of it starting at offset into output, sets chunkLen to the
+    // full length of the chunk (0 for a hole) and returns true.  Otherwise returns false, and sets epoch to hand to
+    // put() once the chunk has been read from the DB
+    bool get( uint64_t fileID, uint64_t chunk, uint64_t offset, char * output, uint64_t len, uint64_t * chunkLen, uint64_t * epoch );
+
+    // Caches len bytes of data (NULL and 0 for a hole) as the whole of chunk of fileID, if the chunk's shard is still
+    // at epoch and the chunk is worth keeping.  data is copied
+    void put( uint64_t fileID, uint64_t chunk, const char * data, uint64_t len, uint64_t epoch );
+
+    // Forgets chunk of fileID, and turns away any put() of it that got its epoch before now
+    void invalidate( uint64_t fileID, uint64_t chunk );
+
+/////// STATS ///////
+public:
+    // Lookups that found their chunk, and ones that didn't; chunks that got in, ones that weren't popular enough to
+    // (or came in with an old epoch), and ones pushed out to make room.  Plus what's in there right now
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t rejects;
+        uint64_t evictions;
+        uint64_t entries;
+        uint64_t bytes;
+    };
+
+    // Adds up the stats of every shard
+    void getStats( Stats * stats );
+private:
+    // The count-min sketch is SKETCH_DEPTH rows of SKETCH_WIDTH counters, none of which go over SKETCH_MAX.  Once a
+    // shard has counted SKETCH_RESET lookups, every counter gets halved
+    static const uint64_t SKETCH_DEPTH = 4;
+    static const uint64_t SKETCH_WIDTH = 4096;
+    static const uint8_t SKETCH_MAX = 15;
+    static const uint64_t SKETCH_RESET = 10*SKETCH_WIDTH;
+
+    struct Entry {
+        uint64_t fileID;
+        uint64_t chunk;
+        char * data;
+        uint64_t len;
+        bool referenced;
+
+        // Where we sit in our shard's clock
+        uint64_t slot;
+    };
+
+    struct KeyHash {
+        size_t operator()( const std::pair<uint64_t, uint64_t> & key ) const;
+    };
+    typedef std::unordered_map<std::pair<uint64_t, uint64_t>, Entry *, KeyHash> EntryMap;
+
+    // Everything in a shard is protected by its lock
+    struct Shard {
+        pthread_mutex_t lock;
+        EntryMap entries;
+        std::vector<Entry *> clock;
+        uint64_t hand;
+        uint64_t size;
+        uint64_t epoch;
+
+        uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+        uint64_t sketchCount;
+
+        Stats stats;
+    };
+
+    // Scrambles fileID and chunk together; the shard and sketch slots all come out of different bits of this
+    static uint64_t hash( uint64_t fileID, uint64_t chunk );
+
+    // Counts a lookup of the chunk that hashed to h in shard's sketch, and estimates how often it's been looked up
+    void touch( Shard * shard, uint64_t h );
+    uint8_t frequency( Shard * shard, uint64_t h );
+
+    // Takes entry out of shard and frees it
+    void remove( Shard * shard, Entry * entry );
+
+    // Sweeps the hand around until it finds an entry that hasn't been hit lately.  shard can't be empty
+    Entry * findVictim( Shard * shard );
+
+    Shard shards[SHARDS];
+    uint64_t maxSize;
+    uint64_t maxShardSize;
+};
+
+#endif // shinyfs_ShinyChunkCache_h
@@ -0,0 +1,40 @@
+//
+//  ShinyChunkCodec.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkCodec.h"
+#include "ShinyChunkCodecLZ.h"
+#include "ShinyChunkCodecZlib.h"
+#include <string.h>
+
+// Codecs don't hang on to any state between calls, so one of each does everybody
+static ShinyChunkCodecLZ lzCodec;
+#ifdef ZLIB
+static ShinyChunkCodecZlib zlibCodec;
+#endif
+
+ShinyChunkCodec * ShinyChunkCodec::get( const char * name ) {
+    if( strcmp( name, lzCodec.getName() ) == 0 )
+        return &lzCodec;
+#ifdef ZLIB
+    if( strcmp( name, zlibCodec.getName() ) == 0 )
+        return &zlibCodec;
+#endif
+    return NULL;
+}
+
+ShinyChunkCodec * ShinyChunkCodec::get( uint8_t id ) {
+    switch( id ) {
+        case ShinyChunkCodecLZ::ID:
+            return &lzCodec;
+#ifdef ZLIB
+        case ShinyChunkCodecZlib::ID:
+            return &zlibCodec;
+#endif
+    }
+    return NULL;
+}
+
+ShinyChunkCodec::~ShinyChunkCodec() {
+}
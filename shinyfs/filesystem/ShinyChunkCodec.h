@@ -0,0 +1,40 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkCodec_h
+#define shinyfs_ShinyChunkCodec_h
+
+#include <stdint.h>
+
+/*
+ Compresses chunks of file data on their way into the DB.  Every codec gets a name (for picking one out when a
+ filecache is created) and a one-byte ID, which is stamped into the header of every chunk it compresses, so that
+ reads can always find the right codec no matter what we happen to be writing with these days.  Codecs have to
+ be safe to use from a bunch of threads at once, since there's only ever one of each.
+
+ Codecs are picked by name: "lz" is our own LZ77 (always there, and the default), "zlib" is there if we were
+ built with ZLIB.  "none" means no codec at all.
+ */
+
+class ShinyChunkCodec {
+public:
+    virtual ~ShinyChunkCodec();
+
+    // Returns the codec with the given name/ID, or NULL if there isn't one (or it wasn't compiled in)
+    static ShinyChunkCodec * get( const char * name );
+    static ShinyChunkCodec * get( uint8_t id );
+
+    // ID 0 is taken by chunks that are stored just as they are, because compressing them didn't get us anywhere
+    static const uint8_t ID_RAW = 0;
+
+    virtual uint8_t getID() = 0;
+    virtual const char * getName() = 0;
+
+    // Compresses len bytes of input into output, returning how long the compressed data is.  Returns 0 if it won't
+    // fit into maxOutput bytes, which is how we get out of storing compressed data that isn't worth it
+    virtual uint64_t compress( const char * input, uint64_t len, char * output, uint64_t maxOutput ) = 0;
+
+    // Decompresses len bytes of input into output, which must come out to exactly rawLen bytes.  Returns false if
+    // the input is corrupt; this must never write past output + rawLen, no matter what garbage input holds
+    virtual bool decompress( const char * input, uint64_t len, char * output, uint64_t rawLen ) = 0;
+};
+
+#endif // shinyfs_ShinyChunkCodec_h
@@ -0,0 +1,196 @@
+//
+//  ShinyChunkCodecLZ.cpp
+//  shinyfs
+//
+//  Compressed data is a list of sequences, each one being a token byte, some literal bytes, then a match:
+//
+//      [token] [literal length...] [literals] [offset, 2 bytes LE] [match length...]
+//
+//  The high 4 bits of token are the literal length, the low 4 bits are the match length minus MIN_MATCH.  A nibble
+//  of 15 means more length follows, as bytes that get added on until one of them isn't 255.  The last sequence is
+//  only literals, and stops right after them.
+//
+
+#include "ShinyChunkCodecLZ.h"
+#include <string.h>
+
+static inline uint32_t read32( const uint8_t * p ) {
+    uint32_t val;
+    memcpy( &val, p, sizeof(uint32_t) );
+    return val;
+}
+
+static inline uint32_t hash32( uint32_t val, int bits ) {
+    return (val * 2654435761U) >> (32 - bits);
+}
+
+// Writes out the extra bytes for a length that didn't fit in its nibble.  Returns NULL if we'd pass outEnd
+static inline uint8_t * writeLength( uint8_t * op, uint8_t * outEnd, uint64_t len ) {
+    for( ; len >= 255; len -= 255 ) {
+        if( op >= outEnd )
+            return NULL;
+        *op++ = 255;
+    }
+    if( op >= outEnd )
+        return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Reads the extra bytes for a length, returns false if we ran off the end of the input
+static inline bool readLength( const uint8_t ** ip, const uint8_t * inEnd, uint64_t * len ) {
+    uint8_t b;
+    do {
+        if( *ip >= inEnd )
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while( b == 255 );
+    return true;
+}
+
+// Writes out one sequence; a matchLen of 0 means it's the last one, just literals
+static uint8_t * writeSequence( uint8_t * op, uint8_t * outEnd, const uint8_t * literals, uint64_t litLen, uint64_t offset, uint64_t matchLen ) {
+    if( op >= outEnd )
+        return NULL;
+    uint8_t * token = op++;
+    if( litLen >= 15 ) {
+        *token = 15 << 4;
+        if( !(op = writeLength( op, outEnd, litLen - 15 )) )
+            return NULL;
+    } else
+        *token = (uint8_t)(litLen << 4);
+
+    if( (uint64_t)(outEnd - op) < litLen )
+        return NULL;
+    memcpy( op, literals, litLen );
+    op += litLen;
+
+    if( !matchLen )
+        return op;
+
+    if( outEnd - op < 2 )
+        return NULL;
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+
+    uint64_t ml = matchLen - 4;
+    if( ml >= 15 ) {
+        *token |= 15;
+        if( !(op = writeLength( op, outEnd, ml - 15 )) )
+            return NULL;
+    } else
+        *token |= (uint8_t)ml;
+    return op;
+}
+
+uint8_t ShinyChunkCodecLZ::getID() {
+    return ID;
+}
+
+const char * ShinyChunkCodecLZ::getName() {
+    return "lz";
+}
+
+uint64_t ShinyChunkCodecLZ::compress( const char * input, uint64_t len, char * output, uint64_t maxOutput ) {
+    const uint8_t * in = (const uint8_t *)input;
+    uint8_t * op = (uint8_t *)output;
+    uint8_t * outEnd = op + maxOutput;
+
+    // Positions we've last seen each hash of 4 bytes at.  Garbage positions are fine, every match gets checked
+    uint32_t table[1 << HASH_BITS];
+    memset( table, 0, sizeof(table) );
+
+    uint64_t anchor = 0;
+    if( len > MATCH_LIMIT ) {
+        uint64_t ip = 1;
+        uint64_t matchEnd = len - LAST_LITERALS;
+        uint64_t limit = len - MATCH_LIMIT;
+        table[hash32( read32( in ), HASH_BITS )] = 0;
+
+        while( ip < limit ) {
+            uint32_t seq = read32( in + ip );
+            uint32_t h = hash32( seq, HASH_BITS );
+            uint64_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if( ref >= ip || ip - ref > MAX_OFFSET || read32( in + ref ) != seq ) {
+                // No luck; the longer we go without a match, the faster we skip ahead, so junk goes by quickly
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Got one!  See how far back and how far forward it goes
+            while( ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1] ) {
+                --ip;
+                --ref;
+            }
+            uint64_t matchLen = MIN_MATCH;
+            while( ip + matchLen < matchEnd && in[ref + matchLen] == in[ip + matchLen] )
+                ++matchLen;
+
+            if( !(op = writeSequence( op, outEnd, in + anchor, ip - anchor, ip - ref, matchLen )) )
+                return 0;
+            ip += matchLen;
+            anchor = ip;
+
+            // Toss the position just behind us in, so runs keep matching
+            if( ip < limit )
+                table[hash32( read32( in + ip - 2 ), HASH_BITS )] = (uint32_t)(ip - 2);
+        }
+    }
+
+    // Whatever's left goes out as literals
+    if( !(op = writeSequence( op, outEnd, in + anchor, len - anchor, 0, 0 )) )
+        return 0;
+    return op - (uint8_t *)output;
+}
+
+bool ShinyChunkCodecLZ::decompress( const char * input, uint64_t len, char * output, uint64_t rawLen ) {
+    const uint8_t * ip = (const uint8_t *)input;
+    const uint8_t * inEnd = ip + len;
+    uint8_t * op = (uint8_t *)output;
+    uint8_t * outEnd = op + rawLen;
+
+    while( ip < inEnd ) {
+        uint8_t token = *ip++;
+
+        uint64_t litLen = token >> 4;
+        if( litLen == 15 && !readLength( &ip, inEnd, &litLen ) )
+            return false;
+        if( (uint64_t)(inEnd - ip) < litLen || (uint64_t)(outEnd - op) < litLen )
+            return false;
+        memcpy( op, ip, litLen );
+        ip += litLen;
+        op += litLen;
+
+        // Only the last sequence stops after its literals
+        if( ip == inEnd )
+            break;
+
+        if( inEnd - ip < 2 )
+            return false;
+        uint64_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if( offset == 0 || offset > (uint64_t)(op - (uint8_t *)output) )
+            return false;
+
+        uint64_t matchLen = token & 15;
+        if( matchLen == 15 && !readLength( &ip, inEnd, &matchLen ) )
+            return false;
+        matchLen += MIN_MATCH;
+        if( (uint64_t)(outEnd - op) < matchLen )
+            return false;
+
+        // Matches can overlap what they're writing (that's how runs work), in which case it's byte by byte
+        const uint8_t * match = op - offset;
+        if( offset >= matchLen )
+            memcpy( op, match, matchLen );
+        else {
+            for( uint64_t i=0; i<matchLen; ++i )
+                op[i] = match[i];
+        }
+        op += matchLen;
+    }
+    return op == outEnd;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkCodecLZ_h
+#define shinyfs_ShinyChunkCodecLZ_h
+
+#include "ShinyChunkCodec.h"
+
+// A little LZ77 in the style of LZ4: a single hash table probe per position, no entropy coding, and a format that
+// decompresses with little more than memcpy()'s.  It doesn't squeeze as hard as zlib, but it's fast enough that
+// compressing everything costs us less than writing the bytes we save would have
+class ShinyChunkCodecLZ : public ShinyChunkCodec {
+public:
+    static const uint8_t ID = 1;
+
+    virtual uint8_t getID();
+    virtual const char * getName();
+
+    virtual uint64_t compress( const char * input, uint64_t len, char * output, uint64_t maxOutput );
+    virtual bool decompress( const char * input, uint64_t len, char * output, uint64_t rawLen );
+private:
+    // Size of the match-finding hash table, which lives on the stack for the length of a compress()
+    static const int HASH_BITS = 13;
+
+    // Matches are at least this long, and can be no farther back than MAX_OFFSET
+    static const uint64_t MIN_MATCH = 4;
+    static const uint64_t MAX_OFFSET = 65535;
+
+    // Same rules as LZ4: the last LAST_LITERALS bytes are always literals, and no match starts within
+    // MATCH_LIMIT bytes of the end, so the compressor can always read 4 bytes ahead without checking
+    static const uint64_t LAST_LITERALS = 5;
+    static const uint64_t MATCH_LIMIT = 12;
+};
+
+#endif // shinyfs_ShinyChunkCodecLZ_h
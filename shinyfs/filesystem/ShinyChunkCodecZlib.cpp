@@ -0,0 +1,34 @@
+//
+//  ShinyChunkCodecZlib.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkCodecZlib.h"
+#ifdef ZLIB
+#include <zlib.h>
+
+uint8_t ShinyChunkCodecZlib::getID() {
+    return ID;
+}
+
+const char * ShinyChunkCodecZlib::getName() {
+    return "zlib";
+}
+
+uint64_t ShinyChunkCodecZlib::compress( const char * input, uint64_t len, char * output, uint64_t maxOutput ) {
+    // compress2() takes care of setting up and tearing down a stream for us, and gives up with Z_BUF_ERROR if
+    // the result won't fit
+    uLongf outLen = maxOutput;
+    if( compress2( (Bytef *)output, &outLen, (const Bytef *)input, len, LEVEL ) != Z_OK )
+        return 0;
+    return outLen;
+}
+
+bool ShinyChunkCodecZlib::decompress( const char * input, uint64_t len, char * output, uint64_t rawLen ) {
+    uLongf outLen = rawLen;
+    if( uncompress( (Bytef *)output, &outLen, (const Bytef *)input, len ) != Z_OK )
+        return false;
+    return outLen == rawLen;
+}
+
+#endif // ZLIB
@@ -0,0 +1,26 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkCodecZlib_h
+#define shinyfs_ShinyChunkCodecZlib_h
+
+#include "ShinyChunkCodec.h"
+
+#ifdef ZLIB
+
+// Plain old deflate.  A good deal slower than "lz" both ways, but squeezes text down noticeably smaller, so it's
+// there for filecaches that are a lot shorter on disk than they are on CPU
+class ShinyChunkCodecZlib : public ShinyChunkCodec {
+public:
+    static const uint8_t ID = 2;
+
+    virtual uint8_t getID();
+    virtual const char * getName();
+
+    virtual uint64_t compress( const char * input, uint64_t len, char * output, uint64_t maxOutput );
+    virtual bool decompress( const char * input, uint64_t len, char * output, uint64_t rawLen );
+private:
+    // Trades off speed and size, 1 (fastest) through 9 (smallest)
+    static const int LEVEL = 6;
+};
+
+#endif // ZLIB
+#endif // shinyfs_ShinyChunkCodecZlib_h
@@ -0,0 +1,69 @@
+//
+//  ShinyChunkCompactor.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkCompactor.h"
+#include <base/Logger.h>
+#include <errno.h>
+#include <time.h>
+
+ShinyChunkCompactor::ShinyChunkCompactor( ShinyChunkStore * store ) : store(store), stopping(false), threadStarted(false) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->cond, NULL );
+
+    // Without us, chunks just stay as deltas until they're written over, reads are a little slower is all
+    if( pthread_create( &this->thread, NULL, &ShinyChunkCompactor::compactLoop, this ) == 0 )
+        this->threadStarted = true;
+    else
+        ERROR( "Could not start chunk compactor thread, small writes will slow down reads!" );
+}
+
+ShinyChunkCompactor::~ShinyChunkCompactor() {
+    pthread_mutex_lock( &this->mutex );
+    this->stopping = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+
+    if( this->threadStarted )
+        pthread_join( this->thread, NULL );
+
+    pthread_cond_destroy( &this->cond );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+void * ShinyChunkCompactor::compactLoop( void * data ) {
+    ShinyChunkCompactor * compactor = (ShinyChunkCompactor *) data;
+
+    // Anything with a delta from before mark hasn't been touched in at least one INTERVAL
+    uint64_t mark = compactor->store->getDeltaSeq();
+    while( compactor->nap( INTERVAL ) ) {
+        uint64_t newMark = compactor->store->getDeltaSeq();
+        while( compactor->store->compact( BATCH, mark ) == BATCH ) {
+            if( !compactor->nap( (double)BATCH/RATE ) )
+                return NULL;
+        }
+        mark = newMark;
+    }
+    return NULL;
+}
+
+bool ShinyChunkCompactor::nap( double secs ) {
+    struct timespec deadline;
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (time_t)secs)*1e9);
+    if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock( &this->mutex );
+    while( !this->stopping ) {
+        if( pthread_cond_timedwait( &this->cond, &this->mutex, &deadline ) == ETIMEDOUT )
+            break;
+    }
+    bool keepGoing = !this->stopping;
+    pthread_mutex_unlock( &this->mutex );
+    return keepGoing;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkCompactor_h
+#define shinyfs_ShinyChunkCompactor_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include "ShinyChunkStore.h"
+
+/*
+ Folds the deltas that small writes leave behind back into their chunks, in the background, so reads don't have to
+ keep merging them.  Every INTERVAL seconds we compact whichever chunks haven't been written to since last time; ones
+ that are still being hammered on are left alone, since they'd only pile up new deltas right after we were done (and
+ once they hit ShinyChunkStore::MAX_DELTAS, the next write rewrites them anyway).
+ */
+
+class ShinyChunkCompactor {
+/////// CREATION ///////
+public:
+    // Starts up the compactor thread
+    ShinyChunkCompactor( ShinyChunkStore * store );
+
+    // Stops the thread.  Anything it hadn't gotten to stays in the DB as deltas, which is perfectly fine
+    ~ShinyChunkCompactor();
+
+/////// COMPACTING ///////
+public:
+    // How often we go looking for chunks to compact, and how many we compact at a time, no more than RATE a second
+    static const uint64_t INTERVAL = 1;
+    static const uint64_t BATCH = 64;
+    static const uint64_t RATE = 1024;
+private:
+    // What our thread spends its life doing
+    static void * compactLoop( void * data );
+
+    // Sleeps for secs, or until we're told to stop.  Returns false if it's time to stop
+    bool nap( double secs );
+
+    ShinyChunkStore * store;
+
+    // Protected by mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stopping;
+
+    pthread_t thread;
+    bool threadStarted;
+};
+
+#endif // shinyfs_ShinyChunkCompactor_h
@@ -0,0 +1,128 @@
+//
+//  ShinyChunkMap.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkMap.h"
+
+ShinyChunkMap::ShinyChunkMap() {
+}
+
+std::vector<ShinyChunkMap::Run>::iterator ShinyChunkMap::after( uint64_t chunk ) {
+    std::vector<Run>::iterator lo = this->runs.begin(), hi = this->runs.end();
+    while( lo < hi ) {
+        std::vector<Run>::iterator mid = lo + (hi - lo)/2;
+        if( mid->end <= chunk )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool ShinyChunkMap::has( uint64_t chunk ) {
+    std::vector<Run>::iterator run = this->after( chunk );
+    return run != this->runs.end() && run->start <= chunk;
+}
+
+uint64_t ShinyChunkMap::nextData( uint64_t chunk, uint64_t endChunk ) {
+    if( chunk >= endChunk )
+        return endChunk;
+    std::vector<Run>::iterator run = this->after( chunk );
+    if( run == this->runs.end() || run->start >= endChunk )
+        return endChunk;
+    return run->start > chunk ? run->start : chunk;
+}
+
+uint64_t ShinyChunkMap::nextHole( uint64_t chunk, uint64_t endChunk ) {
+    if( chunk >= endChunk )
+        return endChunk;
+
+    // Runs never touch, so wherever the one chunk is in ends is a hole
+    std::vector<Run>::iterator run = this->after( chunk );
+    if( run == this->runs.end() || run->start > chunk )
+        return chunk;
+    return run->end < endChunk ? run->end : endChunk;
+}
+
+void ShinyChunkMap::add( uint64_t firstChunk, uint64_t endChunk ) {
+    if( firstChunk >= endChunk )
+        return;
+
+    // Appending to the last run is by far the most common case, so it gets to skip the search
+    if( !this->runs.empty() && this->runs.back().start <= firstChunk ) {
+        Run & last = this->runs.back();
+        if( firstChunk <= last.end ) {
+            if( endChunk > last.end )
+                last.end = endChunk;
+            return;
+        }
+        Run run = { firstChunk, endChunk };
+        this->runs.push_back( run );
+        return;
+    }
+
+    // Otherwise, swallow up every run we overlap or touch (starting with the one that ends right where we start, if
+    // there is one), and put one big one in their place
+    std::vector<Run>::iterator first = this->after( firstChunk ? firstChunk - 1 : 0 );
+    std::vector<Run>::iterator last = first;
+    Run merged = { firstChunk, endChunk };
+    while( last != this->runs.end() && last->start <= endChunk ) {
+        if( last->start < merged.start )
+            merged.start = last->start;
+        if( last->end > merged.end )
+            merged.end = last->end;
+        ++last;
+    }
+    if( first == last )
+        this->runs.insert( first, merged );
+    else {
+        *first = merged;
+        this->runs.erase( first + 1, last );
+    }
+}
+
+void ShinyChunkMap::trim( uint64_t endChunk ) {
+    std::vector<Run>::iterator run = this->after( endChunk );
+    if( run != this->runs.end() && run->start < endChunk ) {
+        run->end = endChunk;
+        ++run;
+    }
+    this->runs.erase( run, this->runs.end() );
+}
+
+void ShinyChunkMap::clear() {
+    this->runs.clear();
+}
+
+uint64_t ShinyChunkMap::getRuns() {
+    return this->runs.size();
+}
+
+uint64_t ShinyChunkMap::serializedLen() {
+    return sizeof(uint64_t) + this->runs.size()*2*sizeof(uint64_t);
+}
+
+char * ShinyChunkMap::serialize( char * output ) {
+    *((uint64_t *)output) = this->runs.size();
+    output += sizeof(uint64_t);
+    for( uint64_t i=0; i<this->runs.size(); ++i ) {
+        *((uint64_t *)output) = this->runs[i].start;
+        output += sizeof(uint64_t);
+        *((uint64_t *)output) = this->runs[i].end;
+        output += sizeof(uint64_t);
+    }
+    return output;
+}
+
+void ShinyChunkMap::unserialize( const char ** input ) {
+    uint64_t numRuns = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->runs.resize( numRuns );
+    for( uint64_t i=0; i<numRuns; ++i ) {
+        this->runs[i].start = *((uint64_t *)*input);
+        *input += sizeof(uint64_t);
+        this->runs[i].end = *((uint64_t *)*input);
+        *input += sizeof(uint64_t);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkMap_h
+#define shinyfs_ShinyChunkMap_h
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ Which chunks of a file might have data in them, kept right in its node (see ShinyMetaFileSnapshot) so reads can
+ tell a hole from a chunk without going anywhere near the DB.  It's a superset: every chunk that has data stored is
+ in here, but so can be some that don't (a chunk written full of zeros, say, which never gets stored).  So a chunk
+ that isn't in here is a hole for sure, and one that is still has to be looked for.
+
+ Files mostly get written in long runs, with holes (if any) in between, so we keep runs of chunks rather than a bit
+ per chunk: a file written front to back is a single run however big it gets, and a sparse one costs 16 bytes a
+ run.  Runs are kept sorted, never touch and never overlap, so finding the one a chunk is in is a binary search.
+ */
+
+class ShinyChunkMap {
+public:
+    ShinyChunkMap();
+
+    // Whether chunk might have data
+    bool has( uint64_t chunk );
+
+    // The first chunk from chunk up to (but not including) endChunk that might have data, or that's a hole for sure,
+    // respectively.  Returns endChunk if there isn't one
+    uint64_t nextData( uint64_t chunk, uint64_t endChunk );
+    uint64_t nextHole( uint64_t chunk, uint64_t endChunk );
+
+    // Marks chunks firstChunk up to (but not including) endChunk as maybe having data, for when they're written
+    void add( uint64_t firstChunk, uint64_t endChunk );
+
+    // Forgets about every chunk from endChunk on, for when the file is cut short
+    void trim( uint64_t endChunk );
+
+    // Every chunk is a hole, for when the file starts over from nothing
+    void clear();
+
+    // How many runs of chunks we're keeping track of
+    uint64_t getRuns();
+
+    // The run count followed by each run's first and end chunk, all as uint64_t's, same as the rest of the node
+    uint64_t serializedLen();
+    char * serialize( char * output );
+    void unserialize( const char ** input );
+private:
+    struct Run {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // The first run that ends after chunk (so it's either got chunk in it, or it's the next one after it)
+    std::vector<Run>::iterator after( uint64_t chunk );
+
+    std::vector<Run> runs;
+};
+
+#endif // shinyfs_ShinyChunkMap_h
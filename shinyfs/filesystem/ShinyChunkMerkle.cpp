@@ -0,0 +1,176 @@
+//
+//  ShinyChunkMerkle.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkMerkle.h"
+#include "../util/ShinyCRC32C.h"
+
+ShinyChunkMerkle::ShinyChunkMerkle( uint64_t chunkSize ) : chunkSize(chunkSize), fileLen(0), generation(0), readFrom(0) {
+}
+
+uint64_t ShinyChunkMerkle::getChunkSize() {
+    return this->chunkSize;
+}
+
+void ShinyChunkMerkle::resize( uint64_t fileLen ) {
+    if( fileLen == this->fileLen )
+        return;
+    uint64_t oldCount = this->leaves.size();
+    uint64_t newCount = (fileLen + this->chunkSize - 1)/this->chunkSize;
+    if( oldCount && oldCount - 1 < newCount && oldCount - 1 < this->readFrom )
+        this->unread.insert( oldCount - 1 );
+
+    this->leaves.resize( newCount );
+    if( newCount > oldCount ) {
+        for( uint64_t i=oldCount; i<newCount; ++i ) {
+            this->leaves[i].crc = 0;
+            this->leaves[i].len = 0;
+        }
+        if( this->readFrom > oldCount )
+            this->readFrom = oldCount;
+    } else {
+        this->unread.erase( this->unread.lower_bound( newCount ), this->unread.end() );
+        this->stale.erase( this->stale.lower_bound( newCount ), this->stale.end() );
+        if( this->readFrom > newCount )
+            this->readFrom = newCount;
+    }
+    if( newCount && newCount - 1 < this->readFrom )
+        this->unread.insert( newCount - 1 );
+
+    this->fileLen = fileLen;
+    this->generation++;
+}
+
+void ShinyChunkMerkle::set( uint64_t chunk, uint32_t crc, uint64_t len ) {
+    if( chunk >= this->leaves.size() )
+        return;
+    this->leaves[chunk].crc = crc;
+    this->leaves[chunk].len = (uint32_t)len;
+    this->unread.erase( chunk );
+
+    // Everything past readFrom is still unread, just not one by one, which it has to be now that one of them isn't
+    if( chunk >= this->readFrom ) {
+        for( uint64_t i=this->readFrom; i<this->leaves.size(); ++i ) {
+            if( i != chunk )
+                this->unread.insert( i );
+        }
+        this->readFrom = this->leaves.size();
+    }
+    this->stale.insert( chunk );
+    this->generation++;
+}
+
+void ShinyChunkMerkle::invalidate( uint64_t chunk ) {
+    if( chunk >= this->leaves.size() )
+        return;
+    if( chunk < this->readFrom )
+        this->unread.insert( chunk );
+    this->generation++;
+}
+
+uint64_t ShinyChunkMerkle::getGeneration() {
+    return this->generation;
+}
+
+void ShinyChunkMerkle::getUnread( std::vector<uint64_t> & chunks ) {
+    chunks.assign( this->unread.begin(), this->unread.end() );
+    for( uint64_t i=this->readFrom; i<this->leaves.size(); ++i )
+        chunks.push_back( i );
+}
+
+bool ShinyChunkMerkle::root( char * output ) {
+    if( !this->unread.empty() || this->readFrom < this->leaves.size() )
+        return false;
+
+    // A chunk stored past the end of the file only counts up to the end, and all we've got is the CRC of the whole
+    // thing, so it's got to be read again
+    bool missing = false;
+    for( std::set<uint64_t>::iterator itty = this->stale.begin(); itty != this->stale.end(); ++itty ) {
+        if( this->leaves[*itty].len > this->getExtent( *itty ) ) {
+            this->unread.insert( *itty );
+            missing = true;
+        }
+    }
+    if( missing )
+        return false;
+
+    uint64_t count = this->leaves.size();
+    if( !count ) {
+        this->levels.clear();
+        char treeRoot[ROOT_LEN];
+        ShinySHA256::hash( "", 0, treeRoot );
+        finish( this->fileLen, this->chunkSize, treeRoot, output );
+        return true;
+    }
+
+    // However many levels it takes to get down to one hash.  Anything the file grew (or shrank) into is stale already
+    std::vector<uint64_t> sizes;
+    for( uint64_t size = count; sizes.empty() || size > 1; ) {
+        size = (size + FANOUT - 1)/FANOUT;
+        sizes.push_back( size );
+    }
+    this->levels.resize( sizes.size() );
+    for( uint64_t k=0; k<sizes.size(); ++k )
+        this->levels[k].resize( sizes[k]*ROOT_LEN );
+
+    // Each level only redoes the hashes above whatever changed in the level below
+    std::set<uint64_t> parents;
+    for( std::set<uint64_t>::iterator itty = this->stale.begin(); itty != this->stale.end(); ++itty )
+        parents.insert( *itty/FANOUT );
+    ShinySHA256 sha;
+    for( uint64_t k=0; k<sizes.size(); ++k ) {
+        uint64_t below = k ? sizes[k-1] : count;
+        std::set<uint64_t> next;
+        for( std::set<uint64_t>::iterator itty = parents.begin(); itty != parents.end(); ++itty ) {
+            uint64_t first = *itty*FANOUT;
+            uint64_t last = first + FANOUT < below ? first + FANOUT : below;
+            sha.reset();
+            if( k == 0 ) {
+                char crcs[FANOUT*ShinyCRC32C::LEN];
+                for( uint64_t i=first; i<last; ++i )
+                    ShinyCRC32C::encode( this->getLeafCRC( i ), crcs + (i - first)*ShinyCRC32C::LEN );
+                sha.update( crcs, (last - first)*ShinyCRC32C::LEN );
+            } else
+                sha.update( &this->levels[k-1][first*ROOT_LEN], (last - first)*ROOT_LEN );
+            sha.finish( &this->levels[k][*itty*ROOT_LEN] );
+            next.insert( *itty/FANOUT );
+        }
+        parents.swap( next );
+    }
+    this->stale.clear();
+    finish( this->fileLen, this->chunkSize, this->levels.back().data(), output );
+    return true;
+}
+
+void ShinyChunkMerkle::inlineRoot( const char * data, uint64_t len, uint64_t chunkSize, char * output ) {
+    char treeRoot[ROOT_LEN];
+    if( len ) {
+        char crc[ShinyCRC32C::LEN];
+        ShinyCRC32C::encode( ShinyCRC32C::hash( data, len ), crc );
+        ShinySHA256::hash( crc, sizeof(crc), treeRoot );
+    } else
+        ShinySHA256::hash( "", 0, treeRoot );
+    finish( len, chunkSize, treeRoot, output );
+}
+
+uint64_t ShinyChunkMerkle::getExtent( uint64_t chunk ) {
+    uint64_t start = chunk*this->chunkSize;
+    return this->fileLen - start < this->chunkSize ? this->fileLen - start : this->chunkSize;
+}
+
+uint32_t ShinyChunkMerkle::getLeafCRC( uint64_t chunk ) {
+    return ShinyCRC32C::extendZeros( this->leaves[chunk].crc, this->getExtent( chunk ) - this->leaves[chunk].len );
+}
+
+void ShinyChunkMerkle::finish( uint64_t fileLen, uint64_t chunkSize, const char * treeRoot, char * output ) {
+    char lens[2*sizeof(uint64_t)];
+    for( int i=0; i<8; ++i ) {
+        lens[i] = (char)((fileLen >> (i*8)) & 0xff);
+        lens[8 + i] = (char)((chunkSize >> (i*8)) & 0xff);
+    }
+    ShinySHA256 sha;
+    sha.update( lens, sizeof(lens) );
+    sha.update( treeRoot, ROOT_LEN );
+    sha.finish( output );
+}
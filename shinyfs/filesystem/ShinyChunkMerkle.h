@@ -0,0 +1,94 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkMerkle_h
+#define shinyfs_ShinyChunkMerkle_h
+
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <vector>
+#include "../util/ShinySHA256.h"
+
+/*
+ A Merkle tree over one file's chunks, so the whole file can be summed up in one hash that only costs a few small
+ hashes to bring up to date after a write, instead of going back over everything.
+
+ Each leaf is the CRC-32C of one chunk, taken as if the chunk ran all the way to its end (chunkSize, or the end of the
+ file for the last one), so short chunks and holes come out the same as the zeros they read back as.  Every FANOUT
+ leaves get hashed together (SHA-256 of their CRCs, 4 bytes each, little-endian), then every FANOUT of those, and so
+ on up until there's just one.  The root of the file is the SHA-256 of its length and chunk size (8 bytes each,
+ little-endian) followed by that.  A file with no chunks at all has the SHA-256 of nothing at the top of its tree, and
+ an inline file is hashed as if its data were its one and only chunk.  Since it's all in terms of chunks, the same
+ data chunked up differently has a different root.
+
+ The tree doesn't go out and read anything itself.  Whoever keeps it (ShinyChunkStore) tells it about chunks as
+ they're written, by their CRC and length when they're known and with invalidate() when they aren't (a delta, say),
+ and reads whatever getUnread() says it's missing before asking for the root.  Nothing in here is thread-safe.
+ */
+
+class ShinyChunkMerkle {
+public:
+    // How many leaves (or hashes) get hashed together at each level
+    static const uint64_t FANOUT = 16;
+    static const uint64_t ROOT_LEN = ShinySHA256::DIGEST_LEN;
+
+    // A tree for a file with chunks chunkSize long, and nothing in it yet
+    ShinyChunkMerkle( uint64_t chunkSize );
+
+    uint64_t getChunkSize();
+
+    // Makes the tree cover a file fileLen bytes long.  Any chunks it didn't cover before have to be read, and so do the
+    // chunks that were and are now the last one, since where they end has moved
+    void resize( uint64_t fileLen );
+
+    // chunk now holds len bytes (before the zeros that run to its end) that CRC to crc.  Holes are 0 and 0.  If len
+    // runs past the end of the file, the chunk gets read again before the next root(), since only the part inside
+    // the file counts
+    void set( uint64_t chunk, uint32_t crc, uint64_t len );
+
+    // chunk has changed, but we don't know to what, so it has to be read before the next root()
+    void invalidate( uint64_t chunk );
+
+    // Goes up by one with every set() and invalidate(), so whoever's off reading chunks for us can tell whether
+    // anything changed while they were gone
+    uint64_t getGeneration();
+
+    // Every chunk that has to be read before there's a root, in order
+    void getUnread( std::vector<uint64_t> & chunks );
+
+    // Works out the root of the file, rehashing only the parts of the tree that changed since last time.  Returns
+    // false if there are chunks to read first
+    bool root( char * output );
+
+    // The root of an inline file, whose len bytes are all in data
+    static void inlineRoot( const char * data, uint64_t len, uint64_t chunkSize, char * output );
+private:
+    // What we know about each chunk: its CRC and length as it's stored, zeros at the end not included
+    struct Leaf {
+        uint32_t crc;
+        uint32_t len;
+    };
+
+    // How many bytes of the file chunk covers, and the CRC of all of them
+    uint64_t getExtent( uint64_t chunk );
+    uint32_t getLeafCRC( uint64_t chunk );
+
+    // Hashes the length and chunk size of a file in with what's at the top of its tree, for its root
+    static void finish( uint64_t fileLen, uint64_t chunkSize, const char * treeRoot, char * output );
+
+    uint64_t chunkSize;
+    uint64_t fileLen;
+    uint64_t generation;
+    std::vector<Leaf> leaves;
+
+    // Chunks we don't know about yet: the ones in unread, and every chunk from readFrom on
+    std::set<uint64_t> unread;
+    uint64_t readFrom;
+
+    // Leaves that have changed since the last root(), whose hashes all the way up need redoing
+    std::set<uint64_t> stale;
+
+    // Every level of hashes above the leaves, bottom up, ROOT_LEN bytes apiece.  The last one has just the one
+    std::vector<std::string> levels;
+};
+
+#endif // shinyfs_ShinyChunkMerkle_h
@@ -0,0 +1,248 @@
+//
+//  ShinyChunkPrefetcher.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkPrefetcher.h"
+#include "ShinyMetaFileSnapshot.h"
+#include <string.h>
+#include <vector>
+
+#define min( x, y ) ((x) > (y) ? (y) : (x))
+
+// Reads one chunk ahead into its buffer, on one of the DB workers
+class ShinyChunkPrefetchJob : public ShinyDBJob {
+public:
+    ShinyChunkPrefetchJob( ShinyChunkPrefetcher * prefetcher, ShinyChunkPrefetcher::Stream * stream, uint64_t chunk, ShinyChunkPrefetcher::Buffer * buffer )
+        : prefetcher(prefetcher), stream(stream), chunk(chunk), buffer(buffer), generation(stream->generation) {
+        this->setCallback( &ShinyChunkPrefetcher::prefetched, prefetcher );
+        this->setAutoDelete( true );
+    }
+
+    ShinyChunkPrefetcher * prefetcher;
+    ShinyChunkPrefetcher::Stream * stream;
+    uint64_t chunk;
+    ShinyChunkPrefetcher::Buffer * buffer;
+    uint64_t generation;
+protected:
+    // Nobody else touches the buffer until we're done, so there's no need for the prefetcher's lock in here
+    virtual void run( ShinyDBWrapper * db ) {
+        ShinyChunkReader reader( this->prefetcher->store, this->stream->fileID, this->chunk, this->chunk );
+        uint64_t chunkLen;
+        this->buffer->ok = reader.copy( this->chunk, 0, this->buffer->data, this->buffer->len, &chunkLen );
+        if( this->buffer->ok && chunkLen < this->buffer->len )
+            memset( this->buffer->data + chunkLen, 0, this->buffer->len - chunkLen );
+    }
+};
+
+
+ShinyChunkPrefetcher::ShinyChunkPrefetcher( ShinyChunkStore * store, ShinyDBAsync * async ) : store(store), async(async), tick(0), inFlight(0) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->cond, NULL );
+}
+
+ShinyChunkPrefetcher::~ShinyChunkPrefetcher() {
+    pthread_mutex_lock( &this->mutex );
+    while( this->inFlight )
+        pthread_cond_wait( &this->cond, &this->mutex );
+    while( !this->streams.empty() )
+        this->retire( this->streams.begin()->second );
+    pthread_mutex_unlock( &this->mutex );
+
+    pthread_cond_destroy( &this->cond );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+uint64_t ShinyChunkPrefetcher::read( ShinyMetaFileSnapshot * file, uint64_t offset, char * data, uint64_t len ) {
+    // Inlined files don't have any chunks to read ahead
+    uint64_t fileLen = file->getLen();
+    if( file->isInline() || offset >= fileLen )
+        return file->read( this->store, offset, data, len );
+    len = min( len, fileLen - offset );
+    uint64_t end = offset + len;
+    const uint64_t chunkSize = file->getChunkSize();
+
+    pthread_mutex_lock( &this->mutex );
+    Stream * stream = this->grab( file );
+
+    // Picking up where we left off, or somewhere we guessed we'd be going anyway (FUSE threads can get a little out
+    // of order), means we're being streamed, so read further ahead.  Anything else, and nothing we've read ahead is
+    // going to be any use
+    uint64_t maxWindow = min( MAX_WINDOW, MAX_BYTES/chunkSize );
+    if( maxWindow == 0 )
+        maxWindow = 1;
+    if( offset == stream->nextOffset || stream->chunks.find( offset/chunkSize ) != stream->chunks.end() )
+        stream->window = stream->window ? min( stream->window*2, maxWindow ) : min( MIN_WINDOW, maxWindow );
+    else {
+        stream->window = 0;
+        this->drop( stream );
+    }
+    stream->nextOffset = end;
+
+    // Hand over whatever's been read ahead, and read in the rest ourselves, as few goes as we can
+    uint64_t pos = offset;
+    while( pos < end ) {
+        uint64_t chunk = pos/chunkSize;
+        uint64_t chunkStart = chunk*chunkSize;
+        uint64_t chunkEnd = min( chunkStart + chunkSize, end );
+        Buffer * buffer = this->waitFor( stream, chunk );
+        if( buffer && chunkEnd - chunkStart <= buffer->len ) {
+            memcpy( data + (pos - offset), buffer->data + (pos - chunkStart), chunkEnd - pos );
+            pos = chunkEnd;
+            continue;
+        }
+
+        uint64_t runEnd = chunkEnd;
+        while( runEnd < end && stream->chunks.find( runEnd/chunkSize ) == stream->chunks.end() )
+            runEnd = min( runEnd + chunkSize, end );
+
+        uint64_t runLen = runEnd - pos;
+        pthread_mutex_unlock( &this->mutex );
+        uint64_t bytesRead = file->read( this->store, this->async, pos, data + (pos - offset), runLen );
+        pthread_mutex_lock( &this->mutex );
+        pos += bytesRead;
+        if( bytesRead != runLen )
+            break;
+    }
+
+    // Chunks we've read all the way past won't be asked for again
+    for( std::map<uint64_t, Buffer *>::iterator itty = stream->chunks.begin(); itty != stream->chunks.end() && (itty->first + 1)*chunkSize <= end; ) {
+        if( !itty->second->done ) {
+            ++itty;
+            continue;
+        }
+        delete [] itty->second->data;
+        delete( itty->second );
+        stream->chunks.erase( itty++ );
+    }
+
+    // Get the next window's worth of chunks going (the ones that aren't already), without going past the end
+    std::vector<ShinyChunkPrefetchJob *> jobs;
+    uint64_t endChunk = (fileLen + chunkSize - 1)/chunkSize;
+    for( uint64_t chunk = end/chunkSize; chunk < end/chunkSize + stream->window && chunk < endChunk; ++chunk ) {
+        // Holes the file knows about read back as zeros without any help from us
+        if( stream->chunks.find( chunk ) != stream->chunks.end() || !file->mightHaveData( chunk ) )
+            continue;
+        Buffer * buffer = new Buffer;
+        buffer->len = min( chunkSize, fileLen - chunk*chunkSize );
+        buffer->data = new char[buffer->len];
+        buffer->done = false;
+        buffer->ok = false;
+        stream->chunks[chunk] = buffer;
+        stream->refs++;
+        this->inFlight++;
+        jobs.push_back( new ShinyChunkPrefetchJob( this, stream, chunk, buffer ) );
+    }
+    this->release( stream );
+    pthread_mutex_unlock( &this->mutex );
+
+    // submit() can block if the workers are swamped, so don't hold everyone else up while it does
+    for( uint64_t i=0; i<jobs.size(); ++i )
+        this->async->submit( jobs[i] );
+    return pos - offset;
+}
+
+void ShinyChunkPrefetcher::forget( uint64_t fileID ) {
+    pthread_mutex_lock( &this->mutex );
+    std::map<uint64_t, Stream *>::iterator itty = this->streams.find( fileID );
+    if( itty != this->streams.end() )
+        this->retire( itty->second );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+ShinyChunkPrefetcher::Stream * ShinyChunkPrefetcher::grab( ShinyMetaFileSnapshot * file ) {
+    Stream * stream;
+    std::map<uint64_t, Stream *>::iterator itty = this->streams.find( file->getFileID() );
+    if( itty != this->streams.end() && itty->second->chunkSize == file->getChunkSize() )
+        stream = itty->second;
+    else {
+        if( itty != this->streams.end() )
+            this->retire( itty->second );
+
+        // Make room by getting rid of whoever's gone the longest without being read
+        if( this->streams.size() >= MAX_STREAMS ) {
+            Stream * oldest = NULL;
+            for( itty = this->streams.begin(); itty != this->streams.end(); ++itty ) {
+                if( !oldest || itty->second->lastUsed < oldest->lastUsed )
+                    oldest = itty->second;
+            }
+            this->retire( oldest );
+        }
+
+        // Nothing's sequential until the second read
+        stream = new Stream;
+        stream->fileID = file->getFileID();
+        stream->chunkSize = file->getChunkSize();
+        stream->nextOffset = (uint64_t)-1;
+        stream->window = 0;
+        stream->generation = 0;
+        stream->refs = 0;
+        stream->retired = false;
+        this->streams[stream->fileID] = stream;
+    }
+    stream->lastUsed = this->tick++;
+    stream->refs++;
+    return stream;
+}
+
+void ShinyChunkPrefetcher::release( Stream * stream ) {
+    if( --stream->refs || !stream->retired )
+        return;
+
+    // Nobody's reading ahead for us anymore, so everything left is done
+    for( std::map<uint64_t, Buffer *>::iterator itty = stream->chunks.begin(); itty != stream->chunks.end(); ++itty ) {
+        delete [] itty->second->data;
+        delete( itty->second );
+    }
+    delete( stream );
+}
+
+void ShinyChunkPrefetcher::drop( Stream * stream ) {
+    for( std::map<uint64_t, Buffer *>::iterator itty = stream->chunks.begin(); itty != stream->chunks.end(); ++itty ) {
+        if( itty->second->done ) {
+            delete [] itty->second->data;
+            delete( itty->second );
+        }
+    }
+    stream->chunks.clear();
+    stream->generation++;
+}
+
+void ShinyChunkPrefetcher::retire( Stream * stream ) {
+    this->streams.erase( stream->fileID );
+    this->drop( stream );
+    stream->retired = true;
+
+    // Borrow a ref, so that if nobody else has one, it gets deleted right here
+    stream->refs++;
+    this->release( stream );
+}
+
+ShinyChunkPrefetcher::Buffer * ShinyChunkPrefetcher::waitFor( Stream * stream, uint64_t chunk ) {
+    // The buffer could get dropped while we wait, so look it up fresh every time we wake up
+    while( true ) {
+        std::map<uint64_t, Buffer *>::iterator itty = stream->chunks.find( chunk );
+        if( itty == stream->chunks.end() )
+            return NULL;
+        if( itty->second->done )
+            return itty->second->ok ? itty->second : NULL;
+        pthread_cond_wait( &this->cond, &this->mutex );
+    }
+}
+
+void ShinyChunkPrefetcher::prefetched( ShinyDBJob * job, void * data ) {
+    ShinyChunkPrefetcher * prefetcher = (ShinyChunkPrefetcher *) data;
+    ShinyChunkPrefetchJob * prefetchJob = (ShinyChunkPrefetchJob *) job;
+
+    pthread_mutex_lock( &prefetcher->mutex );
+    // If the stream's been dropped since we got going, our buffer isn't in it anymore, and nobody wants it
+    prefetchJob->buffer->done = true;
+    if( prefetchJob->generation != prefetchJob->stream->generation ) {
+        delete [] prefetchJob->buffer->data;
+        delete( prefetchJob->buffer );
+    }
+    prefetcher->release( prefetchJob->stream );
+    prefetcher->inFlight--;
+    pthread_cond_broadcast( &prefetcher->cond );
+    pthread_mutex_unlock( &prefetcher->mutex );
+}
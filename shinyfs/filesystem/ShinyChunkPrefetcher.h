@@ -0,0 +1,110 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkPrefetcher_h
+#define shinyfs_ShinyChunkPrefetcher_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include "ShinyChunkStore.h"
+#include "ShinyDBAsync.h"
+
+/*
+ Read-ahead for files being read front to back.  FUSE hands us reads of 128KB at most, so without this, streaming
+ a big file means fetching a chunk or two, handing them back, and sitting idle until the next read shows up.  Instead,
+ once a file has been read sequentially, the next few chunks get read on ShinyDBAsync's workers while FUSE is off
+ handing the last ones back, and are waiting in memory by the time it asks for them.
+
+ Every file that's being read keeps a stream: where its last read ended, and the chunks read ahead for it (some of
+ which may still be on their way).  Each read that picks up where the last one left off (or lands in chunks we
+ already read ahead) doubles the window of chunks we read ahead, up to MAX_WINDOW chunks or MAX_BYTES, whichever is
+ less.  Anything else throws the whole stream away and shuts the window, so random reads don't pay for any of this.
+
+ Streams are keyed off of file IDs, since file handles only live for a single read.  Only the MAX_STREAMS most
+ recently read files get one.  Anything that changes a file's data has to forget() it, or we'd go on handing out
+ what it used to hold.
+ */
+
+class ShinyMetaFileSnapshot;
+class ShinyChunkPrefetchJob;
+class ShinyChunkPrefetcher {
+friend class ShinyChunkPrefetchJob;
+/////// CREATION ///////
+public:
+    // Chunks get read ahead through store, on async's workers
+    ShinyChunkPrefetcher( ShinyChunkStore * store, ShinyDBAsync * async );
+
+    // Waits for any chunks still being read ahead, then throws everything away
+    ~ShinyChunkPrefetcher();
+
+/////// READING ///////
+public:
+    // The most chunks, and the most bytes, any one file gets to have read ahead, and how many files get read ahead
+    static const uint64_t MAX_WINDOW = 64;
+    static const uint64_t MAX_BYTES = 4*1024*1024;
+    static const uint64_t MAX_STREAMS = 32;
+
+    // How many chunks the window starts out at, once a file has been read sequentially
+    static const uint64_t MIN_WINDOW = 2;
+
+    // Same as file->read(), but out of whatever's been read ahead where we can, and reading ahead for next time
+    uint64_t read( ShinyMetaFileSnapshot * file, uint64_t offset, char * data, uint64_t len );
+
+    // Throws away everything read ahead for fileID, for when its data has changed
+    void forget( uint64_t fileID );
+private:
+    // One chunk read ahead (or on its way, until done).  If it couldn't be read, ok is false and reads go to the DB
+    struct Buffer {
+        char * data;
+        uint64_t len;
+        bool done;
+        bool ok;
+    };
+
+    // Everything we know about how a file is being read.  Chunks still being read ahead, and any read() in the middle
+    // of using the stream, each hold a ref, and the stream only gets deleted once it's been retired and the last ref
+    // is gone.  Dropping a stream's chunks bumps its generation, so chunks that were on their way get thrown out
+    // when they get here
+    struct Stream {
+        uint64_t fileID;
+        uint64_t chunkSize;
+        uint64_t nextOffset;
+        uint64_t window;
+        uint64_t lastUsed;
+        uint64_t generation;
+        uint64_t refs;
+        bool retired;
+        std::map<uint64_t, Buffer *> chunks;
+    };
+
+    // Finds (or makes) file's stream and takes a ref on it, retiring the least recently used stream if there are too
+    // many.  Needs mutex
+    Stream * grab( ShinyMetaFileSnapshot * file );
+
+    // Gives up a ref on stream, deleting it if it's retired and that was the last one.  Needs mutex
+    void release( Stream * stream );
+
+    // Throws away everything read ahead for stream; chunks still on their way are deleted when they get here.
+    // Needs mutex
+    void drop( Stream * stream );
+
+    // Takes stream out of streams for good.  Needs mutex
+    void retire( Stream * stream );
+
+    // Waits for chunk of stream if it's on its way, and returns it if it's been read ahead.  Needs mutex
+    Buffer * waitFor( Stream * stream, uint64_t chunk );
+
+    // Called by each ShinyChunkPrefetchJob once its chunk has been read
+    static void prefetched( ShinyDBJob * job, void * data );
+
+    ShinyChunkStore * store;
+    ShinyDBAsync * async;
+
+    // Protected by mutex.  cond is broadcast whenever a chunk gets here
+    std::map<uint64_t, Stream *> streams;
+    uint64_t tick;
+    uint64_t inFlight;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+#endif // shinyfs_ShinyChunkPrefetcher_h
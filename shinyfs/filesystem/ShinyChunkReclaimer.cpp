@@ -0,0 +1,227 @@
+//
+//  ShinyChunkReclaimer.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkReclaimer.h"
+#include <base/Logger.h>
+#include <errno.h>
+#include <time.h>
+#include <map>
+
+// Released file IDs get a tombstone under PREFIX followed by the ID, big-endian, so they all sort together (and in
+// the order they were handed out, oldest first)
+class ShinyTombstoneKey {
+public:
+    static const uint64_t LEN = 1 + sizeof(uint64_t);
+    static const char PREFIX = 'd';
+
+    ShinyTombstoneKey( uint64_t fileID ) {
+        this->key[0] = PREFIX;
+        ShinyDBChunkKey::encode( this->key + 1, fileID );
+    }
+
+    const char * data() {
+        return this->key;
+    }
+
+    uint64_t size() {
+        return LEN;
+    }
+
+    static bool isTombstoneKey( const char * key, uint64_t keyLen ) {
+        return keyLen == LEN && key[0] == PREFIX;
+    }
+private:
+    char key[LEN];
+};
+
+
+ShinyChunkReclaimer::ShinyChunkReclaimer( ShinyChunkStore * store ) : store(store), work(true), stopping(false), sweeping(false), sweepEndID(0), threadStarted(false) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->cond, NULL );
+
+    // Not the end of the world if this doesn't work, garbage just piles up (in the DB, where it'll wait for us)
+    if( pthread_create( &this->thread, NULL, &ShinyChunkReclaimer::reclaimLoop, this ) == 0 )
+        this->threadStarted = true;
+    else
+        ERROR( "Could not start chunk reclaimer thread, deleted files will keep taking up space!" );
+}
+
+ShinyChunkReclaimer::~ShinyChunkReclaimer() {
+    pthread_mutex_lock( &this->mutex );
+    this->stopping = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+
+    if( this->threadStarted )
+        pthread_join( this->thread, NULL );
+
+    pthread_cond_destroy( &this->cond );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+void ShinyChunkReclaimer::release( uint64_t fileID ) {
+    ShinyTombstoneKey tombstone( fileID );
+    if( this->store->getDB()->put( tombstone.data(), tombstone.size(), "", 0 ) == (uint64_t)-1 ) {
+        ERROR( "Could not mark file %llu for reclaiming: %s", fileID, this->store->getDB()->getError() );
+        return;
+    }
+
+    // Nobody's going to be asking after its Merkle root anymore
+    this->store->forgetRoot( fileID );
+
+    pthread_mutex_lock( &this->mutex );
+    this->work = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+void ShinyChunkReclaimer::sweepOrphans( const std::set<uint64_t> & liveIDs, uint64_t endID ) {
+    pthread_mutex_lock( &this->mutex );
+    this->liveIDs = liveIDs;
+    this->sweepEndID = endID;
+    this->sweeping = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+void * ShinyChunkReclaimer::reclaimLoop( void * data ) {
+    ShinyChunkReclaimer * reclaimer = (ShinyChunkReclaimer *) data;
+
+    while( true ) {
+        pthread_mutex_lock( &reclaimer->mutex );
+        while( !reclaimer->work && !reclaimer->sweeping && !reclaimer->stopping )
+            pthread_cond_wait( &reclaimer->cond, &reclaimer->mutex );
+        if( reclaimer->stopping ) {
+            pthread_mutex_unlock( &reclaimer->mutex );
+            break;
+        }
+
+        // Clear work before we look, so a release() that comes in while we're busy gets us to go around again
+        bool sweeping = reclaimer->sweeping;
+        reclaimer->work = false;
+        pthread_mutex_unlock( &reclaimer->mutex );
+
+        if( sweeping )
+            reclaimer->sweep();
+
+        // Work through the tombstones until there aren't any left, taking a breather between every batch
+        while( reclaimer->reclaimBatch() ) {
+            if( !reclaimer->nap( (double)BATCH/RATE ) )
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+bool ShinyChunkReclaimer::reclaimBatch() {
+    ShinyDBWrapper * db = this->store->getDB();
+    ShinyDBIterator * it = db->newIterator();
+
+    // Whatever we land on when we seek to the bare prefix is the oldest tombstone (if there are any at all)
+    const char prefix = ShinyTombstoneKey::PREFIX;
+    it->seek( &prefix, 1 );
+    if( !it->valid() || !ShinyTombstoneKey::isTombstoneKey( it->key(), it->keySize() ) ) {
+        delete( it );
+        return false;
+    }
+    uint64_t fileID = ShinyDBChunkKey::decode( it->key() + 1 );
+
+    // A released layer isn't covering anything up anymore, so its chunks can be deleted for real rather than whited
+    // out, and its backing can go too if nothing else is layered on top of it
+    uint64_t orphaned = this->store->unlayer( fileID );
+    if( orphaned )
+        this->release( orphaned );
+
+    // Gather up the next batch of its chunks.  Going through the store means shared chunks get their refcounts
+    // dropped, instead of just disappearing out from under everyone else
+    ShinyDBChunkKey key( fileID );
+    ShinyChunkBatch * batch = this->store->newBatch();
+    uint64_t numChunks = 0;
+    for( it->seek( key.data(), key.size() ); numChunks < BATCH && it->valid(); it->next(), ++numChunks ) {
+        if( !ShinyDBChunkKey::isChunkKey( it->key(), it->keySize() ) || ShinyDBChunkKey::decode( it->key() + 1 ) != fileID )
+            break;
+        batch->del( fileID, ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) ) );
+    }
+    delete( it );
+
+    if( numChunks ) {
+        if( !this->store->write( batch ) )
+            ERROR( "Could not reclaim chunks of file %llu: %s", fileID, this->store->getError() );
+    } else {
+        // Nothing left, so this file is finally, truly gone
+        ShinyTombstoneKey tombstone( fileID );
+        if( !db->del( tombstone.data(), tombstone.size() ) )
+            ERROR( "Could not clear tombstone of file %llu: %s", fileID, db->getError() );
+    }
+    delete( batch );
+    return true;
+}
+
+void ShinyChunkReclaimer::sweep() {
+    pthread_mutex_lock( &this->mutex );
+    std::set<uint64_t> live;
+    live.swap( this->liveIDs );
+    uint64_t endID = this->sweepEndID;
+    this->sweeping = false;
+    pthread_mutex_unlock( &this->mutex );
+
+    // Hop from file to file: land on the first chunk of whatever ID comes next, then seek right past the rest of
+    // its chunks, so this costs a seek per file rather than a step per chunk.  Backings don't belong to any file in
+    // the tree, but they aren't orphans; they go once the last layer on top of them does
+    std::set<uint64_t> orphans;
+    ShinyDBIterator * it = this->store->getDB()->newIterator();
+    ShinyDBChunkKey key( 0 );
+    for( it->seek( key.data(), key.size() ); it->valid() && ShinyDBChunkKey::isChunkKey( it->key(), it->keySize() ); ) {
+        uint64_t fileID = ShinyDBChunkKey::decode( it->key() + 1 );
+        if( fileID >= endID )
+            break;
+        if( live.find( fileID ) == live.end() && !this->store->isBacking( fileID ) )
+            orphans.insert( fileID );
+
+        ShinyDBChunkKey nextFile( fileID + 1 );
+        it->seek( nextFile.data(), nextFile.size() );
+    }
+    delete( it );
+
+    // A layer can be an orphan without having written a single chunk.  And if the tree is from before some file got
+    // cloned, that file is still in it under the ID that became the backing, so the layers nobody owns get dropped
+    // without taking it down with them
+    std::map<uint64_t, uint64_t> layers;
+    this->store->getLayerMap( layers );
+    for( std::map<uint64_t, uint64_t>::iterator itty = layers.begin(); itty != layers.end(); ++itty ) {
+        if( itty->first >= endID || live.find( itty->first ) != live.end() || this->store->isBacking( itty->first ) )
+            continue;
+        if( live.find( itty->second ) != live.end() )
+            this->store->unlayer( itty->first );
+        orphans.insert( itty->first );
+    }
+
+    // Releasing an ID that's already been released is harmless, it just gets the same tombstone again
+    for( std::set<uint64_t>::iterator itty = orphans.begin(); itty != orphans.end(); ++itty )
+        this->release( *itty );
+    if( !orphans.empty() )
+        LOG( "Found orphaned chunks belonging to %llu files, reclaiming them", (uint64_t)orphans.size() );
+}
+
+bool ShinyChunkReclaimer::nap( double secs ) {
+    struct timespec deadline;
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (time_t)secs)*1e9);
+    if( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    // release() wakes us up too, but that doesn't mean we get to skip the rest of our nap
+    pthread_mutex_lock( &this->mutex );
+    while( !this->stopping ) {
+        if( pthread_cond_timedwait( &this->cond, &this->mutex, &deadline ) == ETIMEDOUT )
+            break;
+    }
+    bool keepGoing = !this->stopping;
+    pthread_mutex_unlock( &this->mutex );
+    return keepGoing;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkReclaimer_h
+#define shinyfs_ShinyChunkReclaimer_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <set>
+#include "ShinyChunkStore.h"
+
+/*
+ Deletes the chunks of files nobody is using anymore, in the background and at a polite pace, so that unlinking
+ (or truncating to nothing) a 50GB file costs the caller one small DB put instead of a few hundred thousand deletes.
+
+ A file's ID is its generation: once an ID has been handed to release(), nothing will ever read or write chunks
+ under it again (truncating to zero just moves the file over to a brand new ID).  release() writes a tombstone for
+ the ID into the DB and wakes up our thread, which works through the tombstones a batch of chunks at a time.  The
+ tombstones stay put until every last chunk is gone, so a crash or unmount halfway through just means we pick up
+ where we left off next time.  Releasing a layer (see ShinyChunkStore::clone()) releases its backing along with it,
+ once nothing else is layered on top.
+
+ Anything that slips through the cracks anyway (files created after the tree was last saved, before a crash, say)
+ gets found by sweepOrphans(), which looks for chunks under IDs that no file in the tree owns.
+ */
+
+class ShinyChunkReclaimer {
+/////// CREATION ///////
+public:
+    // Starts up the reclaimer thread, which gets going on any tombstones left over from last time right away
+    ShinyChunkReclaimer( ShinyChunkStore * store );
+
+    // Stops the thread, leaving whatever it hadn't gotten to yet for next time
+    ~ShinyChunkReclaimer();
+
+/////// RECLAIMING ///////
+public:
+    // Chunks get deleted this many at a time, and no more than RATE chunks a second, so that reclaiming never hogs
+    // the DB (or the disk) from everyone who's actually using it
+    static const uint64_t BATCH = 256;
+    static const uint64_t RATE = 4096;
+
+    // Marks every chunk stored under fileID as garbage.  Returns as soon as the tombstone is in the DB
+    void release( uint64_t fileID );
+
+    // Looks through the DB for chunks (and layers) belonging to IDs under endID that aren't in liveIDs, and releases
+    // them.  liveIDs should hold the ID of every file in the tree; IDs from endID on are left alone, since files
+    // created while the sweep is running get those.  Backings are left for their layers to take care of
+    void sweepOrphans( const std::set<uint64_t> & liveIDs, uint64_t endID );
+private:
+    // What our thread spends its life doing
+    static void * reclaimLoop( void * data );
+
+    // Deletes up to BATCH chunks of the first tombstoned file, getting rid of its tombstone once there's nothing
+    // left.  Returns false once there are no tombstones left at all
+    bool reclaimBatch();
+
+    // The actual orphan hunt, run on our thread
+    void sweep();
+
+    // Sleeps for secs, or until we're told to stop.  Returns false if it's time to stop
+    bool nap( double secs );
+
+    ShinyChunkStore * store;
+
+    // Protected by mutex: work gets set whenever there might be something new to do, and sweeping whenever
+    // sweepOrphans() has handed us liveIDs to work with
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool work;
+    bool stopping;
+    bool sweeping;
+    std::set<uint64_t> liveIDs;
+    uint64_t sweepEndID;
+
+    pthread_t thread;
+    bool threadStarted;
+};
+
+#endif // shinyfs_ShinyChunkReclaimer_h
@@ -0,0 +1,93 @@
+//
+//  ShinyChunkScratch.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkScratch.h"
+
+pthread_key_t ShinyChunkScratch::poolKey;
+pthread_once_t ShinyChunkScratch::poolOnce = PTHREAD_ONCE_INIT;
+
+ShinyChunkScratch::ShinyChunkScratch() {
+    this->buffer.data = NULL;
+    this->buffer.len = 0;
+}
+
+ShinyChunkScratch::~ShinyChunkScratch() {
+    if( !this->buffer.data )
+        return;
+
+    // Back into the pool it goes, unless the pool's full of bigger ones already
+    Pool * pool = getPool();
+    if( pool->count < MAX_SPARE ) {
+        pool->spare[pool->count++] = this->buffer;
+        return;
+    }
+    uint64_t smallest = 0;
+    for( uint64_t i=1; i<pool->count; ++i ) {
+        if( pool->spare[i].len < pool->spare[smallest].len )
+            smallest = i;
+    }
+    if( pool->spare[smallest].len < this->buffer.len ) {
+        delete [] pool->spare[smallest].data;
+        pool->spare[smallest] = this->buffer;
+    } else
+        delete [] this->buffer.data;
+}
+
+char * ShinyChunkScratch::grow( uint64_t len ) {
+    if( this->buffer.len >= len )
+        return this->buffer.data;
+
+    // Borrow the smallest spare that's big enough, or failing that, the biggest one (which we'll have to grow, but
+    // that's one less buffer lying around too small to be any use)
+    Pool * pool = getPool();
+    if( !this->buffer.data && pool->count ) {
+        uint64_t best = 0;
+        for( uint64_t i=1; i<pool->count; ++i ) {
+            bool fits = pool->spare[i].len >= len;
+            bool bestFits = pool->spare[best].len >= len;
+            if( fits ? (!bestFits || pool->spare[i].len < pool->spare[best].len) : (!bestFits && pool->spare[i].len > pool->spare[best].len) )
+                best = i;
+        }
+        this->buffer = pool->spare[best];
+        pool->spare[best] = pool->spare[--pool->count];
+    }
+
+    if( this->buffer.len < len ) {
+        delete [] this->buffer.data;
+        this->buffer.data = new char[len];
+        this->buffer.len = len;
+    }
+    return this->buffer.data;
+}
+
+char * ShinyChunkScratch::data() {
+    return this->buffer.data;
+}
+
+uint64_t ShinyChunkScratch::size() {
+    return this->buffer.len;
+}
+
+ShinyChunkScratch::Pool * ShinyChunkScratch::getPool() {
+    pthread_once( &poolOnce, &ShinyChunkScratch::makeKey );
+    Pool * pool = (Pool *) pthread_getspecific( poolKey );
+    if( !pool ) {
+        pool = new Pool;
+        pool->count = 0;
+        pthread_setspecific( poolKey, pool );
+    }
+    return pool;
+}
+
+void ShinyChunkScratch::freePool( void * data ) {
+    Pool * pool = (Pool *) data;
+    for( uint64_t i=0; i<pool->count; ++i )
+        delete [] pool->spare[i].data;
+    delete( pool );
+}
+
+void ShinyChunkScratch::makeKey() {
+    pthread_key_create( &poolKey, &ShinyChunkScratch::freePool );
+}
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkScratch_h
+#define shinyfs_ShinyChunkScratch_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ Somewhere to put a chunk for a little while: patching a chunk together for a write, decompressing one for a read,
+ compressing one on its way into a batch.  Every read and write needs one or two of these, and going to the heap
+ for a chunk-sized buffer every single time adds up (and churns the allocator from every FUSE thread at once).
+
+ So instead, each thread keeps the buffers it's done with, and hands them back out the next time it needs one.
+ Buffers only ever grow, so once a thread has seen the biggest chunk it's going to see, it never allocates again.
+ Each thread hangs on to MAX_SPARE of them at most, the biggest ones it's got; anything past that goes back to the
+ heap.
+
+ A ShinyChunkScratch doesn't borrow anything until it's grow()n, and gives it back when it dies.  Every one alive at
+ once has a buffer all to itself, so nesting them (a write's chunk, and the reader it reads that chunk through) is
+ fine.  They aren't meant to be handed between threads, though nothing breaks if one dies somewhere other than where
+ it was made, its buffer just ends up with that thread instead.
+ */
+
+class ShinyChunkScratch {
+public:
+    // How many buffers each thread keeps around when nobody's using them
+    static const uint64_t MAX_SPARE = 4;
+
+    ShinyChunkScratch();
+    ~ShinyChunkScratch();
+
+    // Makes sure there's room for at least len bytes and returns it.  Whatever was in there before is gone if it had
+    // to get bigger
+    char * grow( uint64_t len );
+
+    // What grow() last returned (NULL if it's never been called), and how much room there is in it
+    char * data();
+    uint64_t size();
+private:
+    // Two of us sharing a buffer would be the end of it
+    ShinyChunkScratch( const ShinyChunkScratch & other );
+    ShinyChunkScratch & operator=( const ShinyChunkScratch & other );
+
+    struct Buffer {
+        char * data;
+        uint64_t len;
+    };
+
+    // The buffers this thread isn't using right now
+    struct Pool {
+        Buffer spare[MAX_SPARE];
+        uint64_t count;
+    };
+
+    // This thread's pool, made the first time it's asked for
+    static Pool * getPool();
+
+    // Frees a thread's pool when the thread exits
+    static void freePool( void * pool );
+    static void makeKey();
+
+    static pthread_key_t poolKey;
+    static pthread_once_t poolOnce;
+
+    Buffer buffer;
+};
+
+#endif // shinyfs_ShinyChunkScratch_h
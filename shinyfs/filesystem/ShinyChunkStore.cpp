@@ -0,0 +1,1381 @@
+//
+//  ShinyChunkStore.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkStore.h"
+#include "../util/ShinySHA256.h"
+#include "../util/ShinyCRC32C.h"
+#include <base/Logger.h>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Content-addressed data lives under a prefix byte followed by the SHA-256 of the data; DATA_PREFIX for the data
+// itself, REFCOUNT_PREFIX for how many chunk keys are pointing at it (a big-endian uint64_t, same as the IDs in our
+// keys and a layer's backing.  The small fields packed in front of chunk and delta data, like the raw length in the
+// codec header or a delta's offset, are little-endian)
+class ShinyChunkHashKey {
+public:
+    static const uint64_t LEN = 1 + ShinySHA256::DIGEST_LEN;
+    static const char DATA_PREFIX = 'h';
+    static const char REFCOUNT_PREFIX = 'r';
+
+    ShinyChunkHashKey( char prefix, const char * hash ) {
+        this->key[0] = prefix;
+        memcpy( this->key + 1, hash, ShinySHA256::DIGEST_LEN );
+    }
+
+    const char * data() {
+        return this->key;
+    }
+
+    uint64_t size() {
+        return LEN;
+    }
+private:
+    char key[LEN];
+};
+
+// A chunk's deltas live under PREFIX, the file ID and chunk (just like a ShinyDBChunkKey), and then a sequence number,
+// all big-endian, so they sit together in the order they were logged.  The value is the offset into the chunk as
+// 4 bytes, little-endian, then the checksum if the store keeps them, then the new data
+class ShinyChunkDeltaKey {
+public:
+    static const uint64_t LEN = 1 + 3*sizeof(uint64_t);
+    static const uint64_t CHUNK_LEN = 1 + 2*sizeof(uint64_t);
+    static const uint64_t OFFSET_LEN = sizeof(uint32_t);
+    static const char PREFIX = 'p';
+
+    ShinyChunkDeltaKey( uint64_t fileID, uint64_t chunk, uint64_t seq = 0 ) {
+        this->key[0] = PREFIX;
+        ShinyDBChunkKey::encode( this->key + 1, fileID );
+        ShinyDBChunkKey::encode( this->key + 1 + sizeof(uint64_t), chunk );
+        ShinyDBChunkKey::encode( this->key + 1 + 2*sizeof(uint64_t), seq );
+    }
+
+    const char * data() {
+        return this->key;
+    }
+
+    uint64_t size() {
+        return LEN;
+    }
+
+    // Whether key is one of the deltas of the same chunk as we are
+    bool sameChunk( const char * key, uint64_t keyLen ) {
+        return keyLen == LEN && memcmp( key, this->key, CHUNK_LEN ) == 0;
+    }
+
+    static bool isDeltaKey( const char * key, uint64_t keyLen ) {
+        return keyLen == LEN && key[0] == PREFIX;
+    }
+
+    static uint32_t decodeOffset( const char * value ) {
+        const unsigned char * bytes = (const unsigned char *)value;
+        return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    }
+private:
+    char key[LEN];
+};
+
+// A layer's backing is stored under PREFIX followed by the layer's ID, big-endian, so they're all in one place when
+// we load them up.  The value is the backing's ID, also big-endian
+class ShinyChunkLayerKey {
+public:
+    static const uint64_t LEN = 1 + sizeof(uint64_t);
+    static const char PREFIX = 'l';
+
+    ShinyChunkLayerKey( uint64_t fileID ) {
+        this->key[0] = PREFIX;
+        ShinyDBChunkKey::encode( this->key + 1, fileID );
+    }
+
+    const char * data() {
+        return this->key;
+    }
+
+    uint64_t size() {
+        return LEN;
+    }
+
+    static bool isLayerKey( const char * key, uint64_t keyLen ) {
+        return keyLen == LEN && key[0] == PREFIX;
+    }
+private:
+    char key[LEN];
+};
+
+
+ShinyChunkReader::ShinyChunkReader( ShinyChunkStore * store, uint64_t fileID, uint64_t firstChunk, uint64_t lastChunk )
+    : store(store), key(fileID, firstChunk), source(fileID), it(NULL), itChunk(0), itStarted(false), itFound(false), compactions(0), error(NULL)
+{
+    // A file's chunk keys all sit next to each other in the DB, so for more than one chunk we seek once and then
+    // just step along from chunk to chunk
+    if( lastChunk > firstChunk ) {
+        if( store->getCache() )
+            store->getCache()->getEpochs( this->epochs );
+        this->compactions = store->getCompactions();
+        this->it = store->getDB()->newIterator();
+    }
+}
+
+ShinyChunkReader::~ShinyChunkReader() {
+    delete( this->it );
+}
+
+bool ShinyChunkReader::read( uint64_t chunk, const char ** data, uint64_t * len ) {
+    const char * value;
+    uint64_t valueLen;
+    if( !this->find( chunk, &value, &valueLen ) )
+        return false;
+
+    // Chunks with deltas logged against them have to be put back together first, and so does anything we found
+    // before a compaction, since its deltas could've been folded in and thrown away since (merge() takes a fresh look)
+    uint64_t compactions;
+    if( value && (this->store->getDeltas( this->source, chunk, NULL, &compactions ) || compactions != this->compactions) )
+        return this->merge( chunk, data, len );
+
+    // Holes are nothing at all
+    if( !value ) {
+        *data = NULL;
+        *len = 0;
+        return true;
+    }
+
+    uint8_t codecID;
+    const char * payload;
+    uint64_t payloadLen, rawLen;
+    uint32_t crc;
+    if( !this->unpack( value, valueLen, &codecID, &payload, &payloadLen, &rawLen, &crc ) )
+        return false;
+
+    if( codecID == ShinyChunkCodec::ID_RAW ) {
+        if( !this->check( payload, rawLen, crc ) )
+            return false;
+        *data = payload;
+        *len = rawLen;
+        return true;
+    }
+
+    // Compressed, so we've got nowhere to put it but our own scratch space
+    if( !this->decompressScratch( codecID, payload, payloadLen, rawLen ) || !this->check( this->scratch.data(), rawLen, crc ) )
+        return false;
+    *data = this->scratch.data();
+    *len = rawLen;
+    return true;
+}
+
+bool ShinyChunkReader::copy( uint64_t chunk, uint64_t offset, char * output, uint64_t len, uint64_t * chunkLen ) {
+    // Anything we've read lately is all ready to go
+    ShinyChunkCache * cache = this->store->getCache();
+    uint64_t epoch = 0;
+    if( cache ) {
+        if( cache->get( this->key.getFileID(), chunk, offset, output, len, chunkLen, &epoch ) )
+            return true;
+        if( this->it )
+            epoch = this->epochs[ShinyChunkCache::getShard( this->key.getFileID(), chunk )];
+    }
+
+    const char * value;
+    uint64_t valueLen;
+    if( !this->find( chunk, &value, &valueLen ) )
+        return false;
+
+    // Holes have nothing to copy, the caller fills in the zeros however it likes
+    if( !value ) {
+        *chunkLen = 0;
+        this->cacheChunk( chunk, NULL, 0, epoch );
+        return true;
+    }
+
+    // There's no getting around our scratch space for chunks with deltas, they get merged in there and copied out.
+    // Same goes for anything we found before a compaction, which might be missing the deltas it threw away
+    uint64_t compactions;
+    if( this->store->getDeltas( this->source, chunk, NULL, &compactions ) || compactions != this->compactions ) {
+        const char * merged;
+        if( !this->merge( chunk, &merged, chunkLen ) )
+            return false;
+        uint64_t mergedLen = offset < *chunkLen ? *chunkLen - offset : 0;
+        memcpy( output, merged + offset, mergedLen < len ? mergedLen : len );
+        return true;
+    }
+
+    uint8_t codecID;
+    const char * payload;
+    uint64_t payloadLen, rawLen;
+    uint32_t crc;
+    if( !this->unpack( value, valueLen, &codecID, &payload, &payloadLen, &rawLen, &crc ) )
+        return false;
+
+    *chunkLen = rawLen;
+    uint64_t copyLen = offset < rawLen ? rawLen - offset : 0;
+    if( copyLen > len )
+        copyLen = len;
+
+    // Anything that isn't compressed gets copied straight out of the DB.  The whole chunk gets checked, even if the
+    // caller only wants some of it, since the whole chunk is what gets cached
+    if( codecID == ShinyChunkCodec::ID_RAW ) {
+        if( !this->check( payload, rawLen, crc ) )
+            return false;
+        memcpy( output, payload + offset, copyLen );
+        this->cacheChunk( chunk, payload, rawLen, epoch );
+        return true;
+    }
+
+    // If the caller wants the whole chunk, it goes straight into their buffer, otherwise we've got to decompress
+    // the whole thing somewhere else and copy out the part they're after
+    if( offset == 0 && copyLen == rawLen ) {
+        if( !this->decompress( codecID, payload, payloadLen, output, rawLen ) || !this->check( output, rawLen, crc ) )
+            return false;
+        this->cacheChunk( chunk, output, rawLen, epoch );
+        return true;
+    }
+    if( !this->decompressScratch( codecID, payload, payloadLen, rawLen ) || !this->check( this->scratch.data(), rawLen, crc ) )
+        return false;
+    memcpy( output, this->scratch.data() + offset, copyLen );
+    this->cacheChunk( chunk, this->scratch.data(), rawLen, epoch );
+    return true;
+}
+
+bool ShinyChunkReader::find( uint64_t chunk, const char ** data, uint64_t * len ) {
+    ShinyDBWrapper * db = this->store->getDB();
+    this->key.setChunk( chunk );
+
+    // First, find whatever is stored under the chunk's own key
+    const char * value;
+    uint64_t valueLen;
+    if( this->it ) {
+        // Only bother seeking if we aren't just moving on to the very next chunk.  If the last one was a hole, the
+        // iterator is already sitting on whatever came after it, so it stays put
+        if( this->itStarted && chunk == this->itChunk + 1 ) {
+            if( this->itFound )
+                this->it->next();
+        } else
+            this->it->seek( this->key.data(), this->key.size() );
+        this->itStarted = true;
+        this->itChunk = chunk;
+
+        // If the iterator isn't sitting on exactly this chunk, then it's a hole (or we ran off the end, same thing),
+        // unless we're a layer and it's down there somewhere
+        this->itFound = this->it->at( this->key.data(), this->key.size() );
+        if( !this->itFound )
+            return this->findBacking( chunk, data, len );
+        value = this->it->value();
+        valueLen = this->it->valueSize();
+    } else {
+        this->compactions = this->store->getCompactions();
+        if( !db->getView( this->key.data(), this->key.size(), &this->view ) )
+            return this->findBacking( chunk, data, len );
+        value = this->view.data();
+        valueLen = this->view.size();
+    }
+    this->source = this->key.getFileID();
+    return this->resolve( value, valueLen, data, len );
+}
+
+bool ShinyChunkReader::findBacking( uint64_t chunk, const char ** data, uint64_t * len ) {
+    // Backings never change, so plain old lookups are fine; they're only ever made for chunks a layer hasn't written
+    for( uint64_t backing = this->store->getBacking( this->key.getFileID() ); backing; backing = this->store->getBacking( backing ) ) {
+        ShinyDBChunkKey backingKey( backing, chunk );
+        if( this->store->getDB()->getView( backingKey.data(), backingKey.size(), &this->view ) ) {
+            this->source = backing;
+            return this->resolve( this->view.data(), this->view.size(), data, len );
+        }
+    }
+    this->source = this->key.getFileID();
+    *data = NULL;
+    *len = 0;
+    return true;
+}
+
+bool ShinyChunkReader::resolve( const char * value, uint64_t valueLen, const char ** data, uint64_t * len ) {
+    // Nothing ever stores an empty chunk (that's a hole), so an empty value is a layer's whiteout
+    if( valueLen == 0 ) {
+        *data = NULL;
+        *len = 0;
+        return true;
+    }
+    if( this->store->getMode() == ShinyChunkStore::MODE_DIRECT ) {
+        *data = value;
+        *len = valueLen;
+        return true;
+    }
+
+    // In MODE_DEDUP, all that got us was the hash, the data is stored under that
+    if( valueLen != ShinySHA256::DIGEST_LEN ) {
+        this->error = "corrupt chunk hash";
+        return false;
+    }
+    ShinyChunkHashKey dataKey( ShinyChunkHashKey::DATA_PREFIX, value );
+    if( !this->store->getDB()->getView( dataKey.data(), dataKey.size(), &this->dataView ) ) {
+        this->error = "chunk data missing";
+        return false;
+    }
+    *data = this->dataView.data();
+    *len = this->dataView.size();
+    return true;
+}
+
+bool ShinyChunkReader::merge( uint64_t chunk, const char ** data, uint64_t * len ) {
+    pthread_mutex_lock( &this->store->writeLock );
+    bool success = this->mergeLocked( chunk, data, len );
+
+    // Nothing can be invalidated while we've got the write lock, so whatever the epoch is now, what we merged is
+    // still up to date
+    ShinyChunkCache * cache = this->store->getCache();
+    if( success && cache )
+        this->cacheChunk( chunk, *data, *len, cache->getEpoch( this->key.getFileID(), chunk ) );
+    pthread_mutex_unlock( &this->store->writeLock );
+    return success;
+}
+
+bool ShinyChunkReader::mergeLocked( uint64_t chunk, const char ** data, uint64_t * len ) {
+    // Take a fresh look at the chunk itself rather than trusting whatever our iterator saw, since that could be from
+    // before the deltas we're about to lay over it (or, for a layer, from before it wrote the chunk at all)
+    const char * value = NULL;
+    uint64_t valueLen = 0;
+    this->key.setChunk( chunk );
+    if( this->store->getDB()->getView( this->key.data(), this->key.size(), &this->view ) ) {
+        this->source = this->key.getFileID();
+        if( !this->resolve( this->view.data(), this->view.size(), &value, &valueLen ) )
+            return false;
+    } else if( !this->findBacking( chunk, &value, &valueLen ) )
+        return false;
+
+    uint64_t fileID = this->source;
+    ShinyChunkStore::DeltaMap::iterator deltas = this->store->deltas.find( std::make_pair( fileID, chunk ) );
+    uint64_t deltaEnd = deltas == this->store->deltas.end() ? 0 : deltas->second.end;
+
+    uint8_t codecID = ShinyChunkCodec::ID_RAW;
+    const char * payload = value;
+    uint64_t payloadLen = valueLen, rawLen = valueLen;
+    uint32_t crc = 0;
+    if( value && !this->unpack( value, valueLen, &codecID, &payload, &payloadLen, &rawLen, &crc ) )
+        return false;
+
+    // The chunk ends wherever it or its furthest-reaching delta does, whichever is later, with zeros in between
+    uint64_t mergedLen = rawLen > deltaEnd ? rawLen : deltaEnd;
+    char * merged = this->scratch.grow( mergedLen );
+    if( codecID == ShinyChunkCodec::ID_RAW )
+        memcpy( merged, payload, rawLen );
+    else if( !this->decompress( codecID, payload, payloadLen, merged, rawLen ) )
+        return false;
+    if( value && !this->check( merged, rawLen, crc ) )
+        return false;
+    memset( merged + rawLen, 0, mergedLen - rawLen );
+    this->view.release();
+    this->dataView.release();
+
+    if( !this->store->applyDeltas( fileID, chunk, merged, mergedLen ) ) {
+        this->error = "corrupt chunk delta";
+        return false;
+    }
+    *data = mergedLen ? merged : NULL;
+    *len = mergedLen;
+    return true;
+}
+
+bool ShinyChunkReader::unpack( const char * value, uint64_t valueLen, uint8_t * codecID, const char ** payload, uint64_t * payloadLen, uint64_t * rawLen, uint32_t * crc ) {
+    uint64_t headerLen = this->store->chunkHeaderLen;
+    if( valueLen < headerLen ) {
+        this->error = "corrupt chunk header";
+        return false;
+    }
+    *codecID = ShinyChunkCodec::ID_RAW;
+    *payload = value + headerLen;
+    *payloadLen = valueLen - headerLen;
+    *rawLen = *payloadLen;
+    *crc = 0;
+
+    if( this->store->getCodec() ) {
+        *codecID = (uint8_t)value[0];
+        const unsigned char * lenBytes = (const unsigned char *)value + 1;
+        *rawLen = (uint64_t)lenBytes[0] | ((uint64_t)lenBytes[1] << 8) | ((uint64_t)lenBytes[2] << 16) | ((uint64_t)lenBytes[3] << 24);
+        if( *codecID == ShinyChunkCodec::ID_RAW && *payloadLen != *rawLen ) {
+            this->error = "corrupt chunk header";
+            return false;
+        }
+        value += ShinyChunkStore::HEADER_LEN;
+    }
+    if( this->store->getChecksums() )
+        *crc = ShinyCRC32C::decode( value );
+    return true;
+}
+
+bool ShinyChunkReader::check( const char * data, uint64_t len, uint32_t crc ) {
+    if( this->store->getChecksums() && ShinyCRC32C::hash( data, len ) != crc ) {
+        this->error = "chunk checksum mismatch";
+        return false;
+    }
+    return true;
+}
+
+bool ShinyChunkReader::decompress( uint8_t codecID, const char * payload, uint64_t payloadLen, char * output, uint64_t rawLen ) {
+    ShinyChunkCodec * codec = ShinyChunkCodec::get( codecID );
+    if( !codec ) {
+        this->error = "chunk compressed with unknown codec";
+        return false;
+    }
+    if( !codec->decompress( payload, payloadLen, output, rawLen ) ) {
+        this->error = "corrupt compressed chunk";
+        return false;
+    }
+    return true;
+}
+
+void ShinyChunkReader::cacheChunk( uint64_t chunk, const char * data, uint64_t len, uint64_t epoch ) {
+    ShinyChunkCache * cache = this->store->getCache();
+    if( cache )
+        cache->put( this->key.getFileID(), chunk, data, len, epoch );
+}
+
+bool ShinyChunkReader::decompressScratch( uint8_t codecID, const char * payload, uint64_t payloadLen, uint64_t rawLen ) {
+    return this->decompress( codecID, payload, payloadLen, this->scratch.grow( rawLen ), rawLen );
+}
+
+const char * ShinyChunkReader::getError() {
+    return this->error;
+}
+
+
+ShinyChunkBatch::ShinyChunkBatch( ShinyChunkStore * store ) : store(store), batch(NULL), size(0) {
+    if( store->getMode() == ShinyChunkStore::MODE_DIRECT )
+        this->batch = store->getDB()->newBatch();
+}
+
+ShinyChunkBatch::~ShinyChunkBatch() {
+    delete( this->batch );
+}
+
+void ShinyChunkBatch::encode( const char * data, uint64_t len, uint32_t crc, const char ** value, uint64_t * valueLen ) {
+    // No codec and no checksum, no header, the data is stored just as it is
+    uint64_t headerLen = this->store->chunkHeaderLen;
+    if( !headerLen ) {
+        *value = data;
+        *valueLen = len;
+        return;
+    }
+
+    char * encoded = this->scratch.grow( headerLen + len );
+    char * payload = encoded + headerLen;
+    uint64_t payloadLen = 0;
+
+    // If the codec can't fit it into the space we're willing to give it, it wasn't worth it, so store it raw
+    ShinyChunkCodec * codec = this->store->getCodec();
+    if( codec ) {
+        payloadLen = codec->compress( data, len, payload, len - len/ShinyChunkStore::MIN_SAVINGS );
+        encoded[0] = (char)(payloadLen ? codec->getID() : ShinyChunkCodec::ID_RAW);
+        for( int i=0; i<4; ++i )
+            encoded[1 + i] = (char)((len >> (i*8)) & 0xff);
+    }
+    if( !payloadLen ) {
+        memcpy( payload, data, len );
+        payloadLen = len;
+    }
+    if( this->store->getChecksums() )
+        ShinyCRC32C::encode( crc, payload - ShinyChunkStore::CHECKSUM_LEN );
+
+    *value = encoded;
+    *valueLen = headerLen + payloadLen;
+}
+
+void ShinyChunkBatch::put( uint64_t fileID, uint64_t chunk, const char * data, uint64_t len ) {
+    // No sense storing a chunk full of zeros, a hole reads back exactly the same
+    if( ShinyChunkStore::isZero( data, len ) ) {
+        this->del( fileID, chunk );
+        return;
+    }
+
+    // The checksum is of the data as it is, before any compressing, and doubles as the chunk's leaf in its Merkle tree
+    std::pair<uint64_t, uint64_t> slot( fileID, chunk );
+    uint32_t crc = 0;
+    this->replaced.insert( slot );
+    if( this->store->getChecksums() ) {
+        crc = ShinyCRC32C::hash( data, len );
+        this->leaves[slot] = std::make_pair( crc, len );
+    } else
+        this->leaves.erase( slot );
+
+    ShinyDBChunkKey key( fileID, chunk );
+    const char * value;
+    uint64_t valueLen;
+    if( this->batch ) {
+        this->encode( data, len, crc, &value, &valueLen );
+        this->batch->put( key.data(), key.size(), value, valueLen );
+        return;
+    }
+
+    // Hash before compressing, so that the same data always dedups, whatever codec it's been through
+    char hash[ShinySHA256::DIGEST_LEN];
+    ShinySHA256::hash( data, len, hash );
+    std::string hashStr( hash, sizeof(hash) );
+    this->slots[std::string( key.data(), key.size() )] = hashStr;
+    this->size += key.size() + hashStr.size();
+
+    // The same data showing up more than once in a batch (a file full of zeros, say) only gets held on to once
+    if( this->hashData.find( hashStr ) == this->hashData.end() ) {
+        this->encode( data, len, crc, &value, &valueLen );
+        this->hashData[hashStr].assign( value, valueLen );
+        this->size += valueLen;
+    }
+}
+
+void ShinyChunkBatch::del( uint64_t fileID, uint64_t chunk ) {
+    std::pair<uint64_t, uint64_t> slot( fileID, chunk );
+    this->replaced.insert( slot );
+    this->leaves[slot] = std::make_pair( 0, 0 );
+    ShinyDBChunkKey key( fileID, chunk );
+    if( this->batch ) {
+        // A layer has to cover up whatever its backing has here, so it gets a whiteout instead
+        if( this->store->needsWhiteout( fileID, chunk ) )
+            this->batch->put( key.data(), key.size(), "", 0 );
+        else
+            this->batch->del( key.data(), key.size() );
+        return;
+    }
+
+    this->slots[std::string( key.data(), key.size() )] = std::string();
+    this->size += key.size();
+}
+
+void ShinyChunkBatch::patch( uint64_t fileID, uint64_t chunk, uint64_t offset, const char * data, uint64_t len ) {
+    Patch patch;
+    patch.fileID = fileID;
+    patch.chunk = chunk;
+    uint64_t headerLen = this->store->deltaHeaderLen;
+    patch.value.resize( headerLen + len );
+    for( int i=0; i<4; ++i )
+        patch.value[i] = (char)((offset >> (i*8)) & 0xff);
+    memcpy( &patch.value[headerLen], data, len );
+    if( this->store->getChecksums() ) {
+        uint32_t crc = ShinyCRC32C::extend( ShinyCRC32C::hash( patch.value.data(), ShinyChunkDeltaKey::OFFSET_LEN ), data, len );
+        ShinyCRC32C::encode( crc, &patch.value[ShinyChunkDeltaKey::OFFSET_LEN] );
+    }
+    this->patches.push_back( patch );
+    this->size += ShinyChunkDeltaKey::LEN + patch.value.size();
+}
+
+void ShinyChunkBatch::clear() {
+    if( this->batch )
+        this->batch->clear();
+    this->slots.clear();
+    this->hashData.clear();
+    this->patches.clear();
+    this->replaced.clear();
+    this->leaves.clear();
+    this->size = 0;
+}
+
+uint64_t ShinyChunkBatch::getSize() {
+    // In MODE_DIRECT, size only counts the patches, everything else is already in the DB's batch
+    return this->batch ? this->batch->getSize() + this->size : this->size;
+}
+
+
+ShinyChunkStore::ShinyChunkStore( ShinyDBWrapper * db, Mode mode, ShinyChunkCodec * codec, uint64_t cacheSize, bool checksums ) : nextTreeSerial(0), db(db), mode(mode), codec(codec), cache(NULL), checksums(checksums), nextDeltaSeq(0), compactions(0) {
+    this->chunkHeaderLen = (codec ? HEADER_LEN : 0) + (checksums ? CHECKSUM_LEN : 0);
+    this->deltaHeaderLen = ShinyChunkDeltaKey::OFFSET_LEN + (checksums ? CHECKSUM_LEN : 0);
+    pthread_mutex_init( &this->writeLock, NULL );
+    pthread_mutex_init( &this->layerLock, NULL );
+    pthread_mutex_init( &this->merkleLock, NULL );
+    if( cacheSize )
+        this->cache = new ShinyChunkCache( cacheSize );
+    this->loadDeltas();
+    this->loadLayers();
+}
+
+ShinyChunkStore::~ShinyChunkStore() {
+    if( this->cache ) {
+        ShinyChunkCache::Stats stats;
+        this->cache->getStats( &stats );
+        if( stats.hits + stats.misses )
+            LOG( "Chunk cache hit rate was %.1f%% (%llu hits, %llu misses, %llu evictions)", 100.0*stats.hits/(stats.hits + stats.misses), stats.hits, stats.misses, stats.evictions );
+        delete( this->cache );
+    }
+    for( std::map<uint64_t, Tree>::iterator itty = this->trees.begin(); itty != this->trees.end(); ++itty )
+        delete( itty->second.merkle );
+    pthread_mutex_destroy( &this->merkleLock );
+    pthread_mutex_destroy( &this->layerLock );
+    pthread_mutex_destroy( &this->writeLock );
+}
+
+ShinyChunkStore::Mode ShinyChunkStore::getMode() {
+    return this->mode;
+}
+
+ShinyChunkCodec * ShinyChunkStore::getCodec() {
+    return this->codec;
+}
+
+ShinyDBWrapper * ShinyChunkStore::getDB() {
+    return this->db;
+}
+
+bool ShinyChunkStore::getChecksums() {
+    return this->checksums;
+}
+
+ShinyChunkCache * ShinyChunkStore::getCache() {
+    return this->cache;
+}
+
+const char * ShinyChunkStore::getModeName( Mode mode ) {
+    switch( mode ) {
+        case MODE_DIRECT:
+            return "direct";
+        case MODE_DEDUP:
+            return "dedup";
+    }
+    return "unknown";
+}
+
+ShinyChunkBatch * ShinyChunkStore::newBatch() {
+    return new ShinyChunkBatch( this );
+}
+
+bool ShinyChunkStore::write( ShinyChunkBatch * batch ) {
+    pthread_mutex_lock( &this->writeLock );
+    bool success = this->writeLocked( batch );
+    pthread_mutex_unlock( &this->writeLock );
+    return success;
+}
+
+bool ShinyChunkStore::writeLocked( ShinyChunkBatch * batch ) {
+    ShinyDBView view;
+
+    // A patch against a hole has nothing to be logged against (and a chunk that was nothing but deltas would be
+    // invisible to nextData() and the reclaimer), so those are stored as plain old chunks instead.  Checking costs a
+    // lookup, but only for the first delta a chunk gets; after that we know it's there
+    std::vector<bool> logged( batch->patches.size(), true );
+    std::map<std::pair<uint64_t, uint64_t>, std::string> holes;
+    for( uint64_t i=0; i<batch->patches.size(); ++i ) {
+        ShinyChunkBatch::Patch & patch = batch->patches[i];
+        std::pair<uint64_t, uint64_t> slot( patch.fileID, patch.chunk );
+        std::map<std::pair<uint64_t, uint64_t>, std::string>::iterator hole = holes.find( slot );
+        if( hole == holes.end() ) {
+            if( this->deltas.find( slot ) != this->deltas.end() )
+                continue;
+            ShinyDBChunkKey key( patch.fileID, patch.chunk );
+            bool stored = this->db->getView( key.data(), key.size(), &view );
+            if( stored && view.size() )
+                continue;
+            hole = holes.insert( std::make_pair( slot, std::string() ) ).first;
+
+            // A layer that hasn't written this chunk yet (and hasn't whited it out) is patching whatever shows through
+            // from its backing, so that's what it starts out from
+            if( !stored && this->getBacking( patch.fileID ) ) {
+                ShinyChunkReader reader( this, patch.fileID, patch.chunk, patch.chunk );
+                const char * data;
+                uint64_t len;
+                if( !reader.mergeLocked( patch.chunk, &data, &len ) ) {
+                    ERROR( "Could not read chunk %llu of file %llu from its backing: %s", patch.chunk, patch.fileID, reader.getError() );
+                    return false;
+                }
+                hole->second.assign( data ? data : "", len );
+            }
+        }
+
+        uint64_t offset = ShinyChunkDeltaKey::decodeOffset( patch.value.data() );
+        uint64_t len = patch.value.size() - this->deltaHeaderLen;
+        if( hole->second.size() < offset + len )
+            hole->second.resize( offset + len, '\0' );
+        hole->second.replace( offset, len, patch.value, this->deltaHeaderLen, len );
+        logged[i] = false;
+    }
+    view.release();
+    for( std::map<std::pair<uint64_t, uint64_t>, std::string>::iterator itty = holes.begin(); itty != holes.end(); ++itty )
+        batch->put( itty->first.first, itty->first.second, itty->second.data(), itty->second.size() );
+
+    // In MODE_DIRECT the DB's batch already has the chunks in it, so the deltas just go in alongside them
+    ShinyDBBatch * dbBatch = this->mode == MODE_DIRECT ? batch->batch : this->db->newBatch();
+
+    // Chunks that are being replaced outright take their deltas with them
+    ShinyDBIterator * it = NULL;
+    for( std::set<std::pair<uint64_t, uint64_t> >::iterator itty = batch->replaced.begin(); itty != batch->replaced.end(); ++itty ) {
+        if( this->deltas.find( *itty ) == this->deltas.end() )
+            continue;
+        if( !it )
+            it = this->db->newIterator();
+
+        ShinyChunkDeltaKey deltaKey( itty->first, itty->second );
+        for( it->seek( deltaKey.data(), deltaKey.size() ); it->valid() && deltaKey.sameChunk( it->key(), it->keySize() ); it->next() )
+            dbBatch->del( it->key(), it->keySize() );
+    }
+    delete( it );
+
+    // Everything else gets logged, each delta with the next sequence number
+    std::vector<uint64_t> seqs( batch->patches.size() );
+    for( uint64_t i=0; i<batch->patches.size(); ++i ) {
+        if( !logged[i] )
+            continue;
+        ShinyChunkBatch::Patch & patch = batch->patches[i];
+        seqs[i] = this->nextDeltaSeq++;
+        ShinyChunkDeltaKey deltaKey( patch.fileID, patch.chunk, seqs[i] );
+        dbBatch->put( deltaKey.data(), deltaKey.size(), patch.value.data(), patch.value.size() );
+    }
+
+    bool success = true;
+    if( this->mode == MODE_DEDUP ) {
+        // Everything, chunk keys, refcounts and new data, goes out in one DB batch, so the counts never disagree with
+        // what's actually pointing at them
+        std::map<std::string, int64_t> refDeltas;
+
+        // Point each chunk key at its new hash, keeping track of which hashes gain a reference and which lose one
+        for( std::map<std::string, std::string>::iterator itty = batch->slots.begin(); itty != batch->slots.end(); ++itty ) {
+            const std::string & slotKey = itty->first;
+            const std::string & hash = itty->second;
+
+            if( this->db->getView( slotKey.data(), slotKey.size(), &view ) && view.size() == ShinySHA256::DIGEST_LEN )
+                refDeltas[std::string( view.data(), view.size() )]--;
+
+            if( hash.empty() ) {
+                // Same as in ShinyChunkBatch::del(), layers get whiteouts
+                if( this->needsWhiteout( ShinyDBChunkKey::decode( slotKey.data() + 1 ), ShinyDBChunkKey::decode( slotKey.data() + 1 + sizeof(uint64_t) ) ) )
+                    dbBatch->put( slotKey.data(), slotKey.size(), "", 0 );
+                else
+                    dbBatch->del( slotKey.data(), slotKey.size() );
+            } else {
+                dbBatch->put( slotKey.data(), slotKey.size(), hash.data(), hash.size() );
+                refDeltas[hash]++;
+            }
+        }
+
+        // Now settle up the refcounts.  Data only gets written when nobody had it before us, which is the whole point;
+        // a chunk we already have costs us a hash and a refcount.  Once nobody points at some data, out it goes.
+        for( std::map<std::string, int64_t>::iterator itty = refDeltas.begin(); itty != refDeltas.end(); ++itty ) {
+            // Rewriting a chunk with exactly what was there already doesn't change a thing
+            if( itty->second == 0 )
+                continue;
+
+            ShinyChunkHashKey refKey( ShinyChunkHashKey::REFCOUNT_PREFIX, itty->first.data() );
+            ShinyChunkHashKey dataKey( ShinyChunkHashKey::DATA_PREFIX, itty->first.data() );
+
+            uint64_t refs = 0;
+            if( this->db->getView( refKey.data(), refKey.size(), &view ) && view.size() == sizeof(uint64_t) )
+                refs = ShinyDBChunkKey::decode( view.data() );
+
+            int64_t newRefs = (int64_t)refs + itty->second;
+            if( newRefs <= 0 ) {
+                if( newRefs < 0 )
+                    WARN( "Chunk refcount dropped below zero, filecache has lost track of something!" );
+                dbBatch->del( refKey.data(), refKey.size() );
+                dbBatch->del( dataKey.data(), dataKey.size() );
+            } else {
+                if( refs == 0 ) {
+                    std::map<std::string, std::string>::iterator data = batch->hashData.find( itty->first );
+                    if( data == batch->hashData.end() ) {
+                        ERROR( "New chunk data went missing from batch!" );
+                        success = false;
+                        break;
+                    }
+                    dbBatch->put( dataKey.data(), dataKey.size(), data->second.data(), data->second.size() );
+                }
+                char refsValue[sizeof(uint64_t)];
+                ShinyDBChunkKey::encode( refsValue, newRefs );
+                dbBatch->put( refKey.data(), refKey.size(), refsValue, sizeof(uint64_t) );
+            }
+        }
+    }
+
+    // Don't hang on to anything in the DB while we write to it
+    view.release();
+    if( success )
+        success = this->db->write( dbBatch );
+    if( dbBatch != batch->batch )
+        delete( dbBatch );
+    if( !success )
+        return false;
+
+    // Only once it's all in the DB do we start believing in the new deltas, and stop believing whatever's cached
+    for( std::set<std::pair<uint64_t, uint64_t> >::iterator itty = batch->replaced.begin(); itty != batch->replaced.end(); ++itty ) {
+        this->deltas.erase( *itty );
+        if( this->cache )
+            this->cache->invalidate( itty->first, itty->second );
+    }
+    for( uint64_t i=0; i<batch->patches.size(); ++i ) {
+        if( !logged[i] )
+            continue;
+        ShinyChunkBatch::Patch & patch = batch->patches[i];
+        if( this->cache )
+            this->cache->invalidate( patch.fileID, patch.chunk );
+        uint64_t len = patch.value.size() - this->deltaHeaderLen;
+        uint64_t end = ShinyChunkDeltaKey::decodeOffset( patch.value.data() ) + len;
+        DeltaInfo & info = this->deltas[std::make_pair( patch.fileID, patch.chunk )];
+        info.count++;
+        info.bytes += len;
+        if( info.end < end )
+            info.end = end;
+        info.lastSeq = seqs[i];
+    }
+    this->updateTrees( batch, logged );
+    return true;
+}
+
+const char * ShinyChunkStore::getError() {
+    return this->db->getError();
+}
+
+uint64_t ShinyChunkStore::nextData( uint64_t fileID, uint64_t chunk, uint64_t endChunk ) {
+    if( chunk >= endChunk )
+        return endChunk;
+    ShinyDBIterator * it = this->db->newIterator();
+    uint64_t found = endChunk;
+
+    // Holes aren't stored at all, so whatever key we land on is the next chunk with data, as long as it's still ours
+    if( !this->getBacking( fileID ) ) {
+        ShinyDBChunkKey key( fileID, chunk );
+        it->seek( key.data(), key.size() );
+        if( it->valid() && ShinyDBChunkKey::isChunkKey( it->key(), it->keySize() ) && ShinyDBChunkKey::decode( it->key() + 1 ) == fileID ) {
+            uint64_t dataChunk = ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) );
+            if( dataChunk < endChunk )
+                found = dataChunk;
+        }
+        delete( it );
+        return found;
+    }
+
+    // A layer's next key is only a candidate, and so is the next key of every backing on down.  Whichever comes first
+    // might turn out to be a whiteout (or covered up by one), in which case we go around again from just past it
+    while( chunk < endChunk ) {
+        found = endChunk;
+        for( uint64_t id = fileID; id; id = this->getBacking( id ) ) {
+            ShinyDBChunkKey key( id, chunk );
+            it->seek( key.data(), key.size() );
+            if( !it->valid() || !ShinyDBChunkKey::isChunkKey( it->key(), it->keySize() ) || ShinyDBChunkKey::decode( it->key() + 1 ) != id )
+                continue;
+            uint64_t dataChunk = ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) );
+            if( dataChunk < found )
+                found = dataChunk;
+        }
+        if( found >= endChunk || this->hasData( fileID, found ) )
+            break;
+        chunk = found + 1;
+        found = endChunk;
+    }
+    delete( it );
+    return found;
+}
+
+uint64_t ShinyChunkStore::nextHole( uint64_t fileID, uint64_t chunk, uint64_t endChunk ) {
+    if( chunk >= endChunk )
+        return endChunk;
+
+    // Layers can't just go by which keys are there, so they look at every chunk, backings, whiteouts and all
+    if( this->getBacking( fileID ) ) {
+        while( chunk < endChunk && this->hasData( fileID, chunk ) )
+            chunk++;
+        return chunk;
+    }
+
+    // Walk along the file's chunks for as long as they're all there; the first one that's missing is our hole
+    ShinyDBChunkKey key( fileID, chunk );
+    ShinyDBIterator * it = this->db->newIterator();
+    it->seek( key.data(), key.size() );
+    for( ; chunk < endChunk; ++chunk ) {
+        key.setChunk( chunk );
+        if( !it->at( key.data(), key.size() ) )
+            break;
+        it->next();
+    }
+    delete( it );
+    return chunk;
+}
+
+bool ShinyChunkStore::hasData( uint64_t fileID, uint64_t chunk ) {
+    // Whoever has a key for the chunk first, on the way down, decides; a whiteout means it's a hole
+    ShinyDBView view;
+    for( uint64_t id = fileID; id; id = this->getBacking( id ) ) {
+        ShinyDBChunkKey key( id, chunk );
+        if( this->db->getView( key.data(), key.size(), &view ) )
+            return view.size() != 0;
+    }
+    return false;
+}
+
+bool ShinyChunkStore::needsWhiteout( uint64_t fileID, uint64_t chunk ) {
+    // Nothing to cover up if there's nothing underneath, in which case plain old deleting the key does the job
+    uint64_t backing = this->getBacking( fileID );
+    return backing && this->hasData( backing, chunk );
+}
+
+bool ShinyChunkStore::isZero( const char * data, uint64_t len ) {
+    uint64_t i = 0;
+#ifdef __SSE2__
+    // OR together 64 bytes at a time so there's only one compare per cache line.  Data usually isn't zero, and when
+    // it isn't we find out within the first line or two
+    const __m128i zero = _mm_setzero_si128();
+    for( ; i + 64 <= len; i += 64 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i *)(data + i) );
+        __m128i b = _mm_loadu_si128( (const __m128i *)(data + i + 16) );
+        __m128i c = _mm_loadu_si128( (const __m128i *)(data + i + 32) );
+        __m128i d = _mm_loadu_si128( (const __m128i *)(data + i + 48) );
+        __m128i all = _mm_or_si128( _mm_or_si128( a, b ), _mm_or_si128( c, d ) );
+        if( _mm_movemask_epi8( _mm_cmpeq_epi8( all, zero ) ) != 0xffff )
+            return false;
+    }
+#endif
+    // Whatever's left (or everything, without SSE2) goes a word at a time, then a byte at a time
+    for( ; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t) ) {
+        uint64_t word;
+        memcpy( &word, data + i, sizeof(uint64_t) );
+        if( word )
+            return false;
+    }
+    for( ; i < len; ++i ) {
+        if( data[i] )
+            return false;
+    }
+    return true;
+}
+
+bool ShinyChunkStore::getRoot( uint64_t fileID, uint64_t fileLen, uint64_t chunkSize, char * root ) {
+    // Whatever the tree is missing gets read without merkleLock (reading can mean merging, which takes writeLock), so
+    // by the time we're back, it might have been written to.  If so, what we read is no good, and we go around again
+    std::vector<uint64_t> chunks;
+    std::vector<std::pair<uint32_t, uint64_t> > leaves;
+    uint64_t serial = 0, generation = 0;
+    for( uint64_t tries=0; tries<MAX_ROOT_TRIES; ++tries ) {
+        pthread_mutex_lock( &this->merkleLock );
+        Tree & tree = this->getTree( fileID, chunkSize );
+        tree.merkle->resize( fileLen );
+        if( !leaves.empty() && tree.serial == serial && tree.merkle->getGeneration() == generation ) {
+            for( uint64_t i=0; i<chunks.size(); ++i )
+                tree.merkle->set( chunks[i], leaves[i].first, leaves[i].second );
+        }
+        if( tree.merkle->root( root ) ) {
+            pthread_mutex_unlock( &this->merkleLock );
+            return true;
+        }
+        tree.merkle->getUnread( chunks );
+        serial = tree.serial;
+        generation = tree.merkle->getGeneration();
+        pthread_mutex_unlock( &this->merkleLock );
+        if( chunks.empty() )
+            continue;
+
+        // Only as much of each chunk as is inside the file counts
+        leaves.resize( chunks.size() );
+        ShinyChunkReader reader( this, fileID, chunks.front(), chunks.back() );
+        for( uint64_t i=0; i<chunks.size(); ++i ) {
+            const char * data;
+            uint64_t len;
+            if( !reader.read( chunks[i], &data, &len ) ) {
+                ERROR( "Could not read chunk %llu of file %llu for its Merkle tree: %s", chunks[i], fileID, reader.getError() );
+                return false;
+            }
+            uint64_t extent = fileLen - chunks[i]*chunkSize;
+            if( len > extent )
+                len = extent;
+            leaves[i] = std::make_pair( data ? ShinyCRC32C::hash( data, len ) : 0, data ? len : 0 );
+        }
+    }
+    ERROR( "File %llu kept changing out from under its Merkle tree", fileID );
+    return false;
+}
+
+void ShinyChunkStore::forgetRoot( uint64_t fileID ) {
+    pthread_mutex_lock( &this->merkleLock );
+    this->dropTree( fileID );
+    pthread_mutex_unlock( &this->merkleLock );
+}
+
+bool ShinyChunkStore::verify( uint64_t fileID, uint64_t numChunks ) {
+    // read() never looks at the cache, so this really does check everything that's in the DB
+    if( !numChunks )
+        return true;
+    bool success = true;
+    ShinyChunkReader reader( this, fileID, 0, numChunks - 1 );
+    for( uint64_t chunk=0; chunk<numChunks; ++chunk ) {
+        const char * data;
+        uint64_t len;
+        if( !reader.read( chunk, &data, &len ) ) {
+            ERROR( "Chunk %llu of file %llu is no good: %s", chunk, fileID, reader.getError() );
+            success = false;
+        }
+    }
+    return success;
+}
+
+ShinyChunkStore::Tree & ShinyChunkStore::getTree( uint64_t fileID, uint64_t chunkSize ) {
+    // A tree over the wrong size of chunks is no use to anybody (the file's been re-chunked, under a new ID even, so
+    // this really shouldn't happen)
+    std::map<uint64_t, Tree>::iterator tree = this->trees.find( fileID );
+    if( tree != this->trees.end() && tree->second.merkle->getChunkSize() != chunkSize ) {
+        this->dropTree( fileID );
+        tree = this->trees.end();
+    }
+    if( tree == this->trees.end() ) {
+        if( this->trees.size() >= MAX_TREES )
+            this->dropTree( this->treeOrder.front() );
+        Tree newTree;
+        newTree.merkle = new ShinyChunkMerkle( chunkSize );
+        newTree.serial = this->nextTreeSerial++;
+        tree = this->trees.insert( std::make_pair( fileID, newTree ) ).first;
+        this->treeOrder.push_back( fileID );
+    }
+    return tree->second;
+}
+
+void ShinyChunkStore::dropTree( uint64_t fileID ) {
+    std::map<uint64_t, Tree>::iterator tree = this->trees.find( fileID );
+    if( tree == this->trees.end() )
+        return;
+    delete( tree->second.merkle );
+    this->trees.erase( tree );
+    this->treeOrder.remove( fileID );
+}
+
+void ShinyChunkStore::updateTrees( ShinyChunkBatch * batch, const std::vector<bool> & logged ) {
+    pthread_mutex_lock( &this->merkleLock );
+    if( !this->trees.empty() ) {
+        // Chunks put outright (with checksums) or deleted, we know all about; anything else has to be read again
+        for( std::set<std::pair<uint64_t, uint64_t> >::iterator itty = batch->replaced.begin(); itty != batch->replaced.end(); ++itty ) {
+            std::map<uint64_t, Tree>::iterator tree = this->trees.find( itty->first );
+            if( tree == this->trees.end() )
+                continue;
+            std::map<std::pair<uint64_t, uint64_t>, std::pair<uint32_t, uint64_t> >::iterator leaf = batch->leaves.find( *itty );
+            if( leaf != batch->leaves.end() )
+                tree->second.merkle->set( itty->second, leaf->second.first, leaf->second.second );
+            else
+                tree->second.merkle->invalidate( itty->second );
+        }
+        for( uint64_t i=0; i<batch->patches.size(); ++i ) {
+            std::map<uint64_t, Tree>::iterator tree = this->trees.find( batch->patches[i].fileID );
+            if( logged[i] && tree != this->trees.end() )
+                tree->second.merkle->invalidate( batch->patches[i].chunk );
+        }
+    }
+    pthread_mutex_unlock( &this->merkleLock );
+}
+
+uint64_t ShinyChunkStore::getDeltas( uint64_t fileID, uint64_t chunk, uint64_t * bytes, uint64_t * compactions ) {
+    pthread_mutex_lock( &this->writeLock );
+    DeltaMap::iterator info = this->deltas.find( std::make_pair( fileID, chunk ) );
+    uint64_t count = info == this->deltas.end() ? 0 : info->second.count;
+    if( bytes )
+        *bytes = info == this->deltas.end() ? 0 : info->second.bytes;
+    if( compactions )
+        *compactions = this->compactions;
+    pthread_mutex_unlock( &this->writeLock );
+    return count;
+}
+
+uint64_t ShinyChunkStore::getCompactions() {
+    pthread_mutex_lock( &this->writeLock );
+    uint64_t compactions = this->compactions;
+    pthread_mutex_unlock( &this->writeLock );
+    return compactions;
+}
+
+uint64_t ShinyChunkStore::getDeltaSeq() {
+    pthread_mutex_lock( &this->writeLock );
+    uint64_t seq = this->nextDeltaSeq;
+    pthread_mutex_unlock( &this->writeLock );
+    return seq;
+}
+
+uint64_t ShinyChunkStore::compact( uint64_t maxChunks, uint64_t before ) {
+    // The whole thing happens under writeLock, so nobody can log a delta between us merging a chunk and putting it
+    // back (which throws away every delta it has)
+    uint64_t compacted;
+    pthread_mutex_lock( &this->writeLock );
+    this->compactLocked( 0, maxChunks, before, &compacted );
+    pthread_mutex_unlock( &this->writeLock );
+    return compacted;
+}
+
+bool ShinyChunkStore::compactLocked( uint64_t fileID, uint64_t maxChunks, uint64_t before, uint64_t * compacted ) {
+    ShinyChunkBatch * batch = this->newBatch();
+    bool success = true;
+    *compacted = 0;
+
+    DeltaMap::iterator itty = fileID ? this->deltas.lower_bound( std::make_pair( fileID, (uint64_t)0 ) ) : this->deltas.begin();
+    for( ; itty != this->deltas.end() && *compacted < maxChunks; ++itty ) {
+        if( fileID && itty->first.first != fileID )
+            break;
+        if( itty->second.lastSeq >= before )
+            continue;
+
+        // Whatever's layered on a backing shares its chunks (and their deltas) as they were when it got frozen, so
+        // putting them back would be writing to something that isn't supposed to change anymore
+        uint64_t chunkID = itty->first.first;
+        uint64_t chunk = itty->first.second;
+        if( this->isBacking( chunkID ) )
+            continue;
+
+        ShinyChunkReader reader( this, chunkID, chunk, chunk );
+        const char * data;
+        uint64_t len;
+        if( !reader.mergeLocked( chunk, &data, &len ) ) {
+            ERROR( "Could not merge deltas of chunk %llu of file %llu: %s", chunk, chunkID, reader.getError() );
+            success = false;
+            continue;
+        }
+        batch->put( chunkID, chunk, data, len );
+        (*compacted)++;
+    }
+
+    if( *compacted && !this->writeLocked( batch ) ) {
+        ERROR( "Could not write compacted chunks: %s", this->getError() );
+        *compacted = 0;
+        success = false;
+    }
+
+    // Readers that found anything before this point can't trust a missing delta to mean there never was one
+    if( *compacted )
+        this->compactions++;
+
+    delete( batch );
+    return success;
+}
+
+void ShinyChunkStore::loadDeltas() {
+    // Deltas only live in the DB between being logged and being compacted, so there usually aren't many of them
+    const char prefix = ShinyChunkDeltaKey::PREFIX;
+    ShinyDBIterator * it = this->db->newIterator();
+    for( it->seek( &prefix, 1 ); it->valid() && ShinyChunkDeltaKey::isDeltaKey( it->key(), it->keySize() ); it->next() ) {
+        if( it->valueSize() < this->deltaHeaderLen ) {
+            WARN( "Skipping corrupt chunk delta" );
+            continue;
+        }
+        uint64_t fileID = ShinyDBChunkKey::decode( it->key() + 1 );
+        uint64_t chunk = ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) );
+        uint64_t seq = ShinyDBChunkKey::decode( it->key() + 1 + 2*sizeof(uint64_t) );
+        uint64_t len = it->valueSize() - this->deltaHeaderLen;
+        uint64_t end = ShinyChunkDeltaKey::decodeOffset( it->value() ) + len;
+
+        DeltaInfo & info = this->deltas[std::make_pair( fileID, chunk )];
+        info.count++;
+        info.bytes += len;
+        if( info.end < end )
+            info.end = end;
+        if( info.lastSeq < seq )
+            info.lastSeq = seq;
+        if( this->nextDeltaSeq <= seq )
+            this->nextDeltaSeq = seq + 1;
+    }
+    delete( it );
+
+    if( !this->deltas.empty() )
+        LOG( "Found deltas waiting to be compacted on %llu chunks", (uint64_t)this->deltas.size() );
+}
+
+bool ShinyChunkStore::clone( uint64_t fileID, uint64_t newID, uint64_t cloneID ) {
+    // Once it's frozen, fileID's chunks can't be put back anymore, so any deltas it has get folded in first (or
+    // they'd be merged on every read of every layer on top of it, forever)
+    uint64_t compacted;
+    pthread_mutex_lock( &this->writeLock );
+    bool folded = this->compactLocked( fileID, (uint64_t)-1, (uint64_t)-1, &compacted );
+    pthread_mutex_unlock( &this->writeLock );
+    if( !folded )
+        return false;
+
+    pthread_mutex_lock( &this->layerLock );
+
+    // A layer with nothing of its own is just its backing all over again, so there's no sense stacking on top of it.
+    // Deltas only ever get logged against chunks a layer has stored, so checking for chunk keys is enough
+    uint64_t backing = fileID;
+    std::map<uint64_t, uint64_t>::iterator layer = this->backings.find( fileID );
+    if( layer != this->backings.end() ) {
+        ShinyDBChunkKey key( fileID );
+        ShinyDBIterator * it = this->db->newIterator();
+        it->seek( key.data(), key.size() );
+        if( !it->valid() || !ShinyDBChunkKey::isChunkKey( it->key(), it->keySize() ) || ShinyDBChunkKey::decode( it->key() + 1 ) != fileID )
+            backing = layer->second;
+        delete( it );
+    }
+
+    // Both new layers (and, if we're skipping over fileID, forgetting about it) go in together
+    ShinyDBBatch * batch = this->db->newBatch();
+    ShinyChunkLayerKey newKey( newID ), cloneKey( cloneID );
+    char backingValue[sizeof(uint64_t)];
+    ShinyDBChunkKey::encode( backingValue, backing );
+    batch->put( newKey.data(), newKey.size(), backingValue, sizeof(uint64_t) );
+    batch->put( cloneKey.data(), cloneKey.size(), backingValue, sizeof(uint64_t) );
+    if( backing != fileID ) {
+        ShinyChunkLayerKey oldKey( fileID );
+        batch->del( oldKey.data(), oldKey.size() );
+    }
+    bool success = this->db->write( batch );
+    delete( batch );
+
+    if( success ) {
+        this->backings[newID] = backing;
+        this->backings[cloneID] = backing;
+        this->layerRefs[backing] += 2;
+        if( backing != fileID ) {
+            this->backings.erase( fileID );
+            this->layerRefs[backing]--;
+        }
+    }
+    pthread_mutex_unlock( &this->layerLock );
+
+    // Both layers start out with exactly the chunks fileID has, so they start out with its tree too
+    if( success ) {
+        pthread_mutex_lock( &this->merkleLock );
+        std::map<uint64_t, Tree>::iterator tree = this->trees.find( fileID );
+        if( tree != this->trees.end() ) {
+            ShinyChunkMerkle merkle( *tree->second.merkle );
+            this->dropTree( fileID );
+            *this->getTree( newID, merkle.getChunkSize() ).merkle = merkle;
+            *this->getTree( cloneID, merkle.getChunkSize() ).merkle = merkle;
+        }
+        pthread_mutex_unlock( &this->merkleLock );
+    }
+    return success;
+}
+
+bool ShinyChunkStore::flatten( uint64_t backing, uint64_t newID ) {
+    // Nothing ever writes to backing again, so it can be copied out a batch at a time without holding anyone up.
+    // Whiteouts come back as holes, and holes don't get copied at all
+    const uint64_t end = (uint64_t)-1;
+    ShinyChunkBatch * batch = this->newBatch();
+    bool success = true;
+    for( uint64_t chunk = this->nextData( backing, 0, end ); chunk != end; chunk = this->nextData( backing, chunk + 1, end ) ) {
+        ShinyChunkReader reader( this, backing, chunk, chunk );
+        const char * data;
+        uint64_t len;
+        if( !reader.read( chunk, &data, &len ) ) {
+            ERROR( "Could not read chunk %llu of backing %llu: %s", chunk, backing, reader.getError() );
+            success = false;
+            break;
+        }
+        if( len )
+            batch->put( newID, chunk, data, len );
+        if( batch->getSize() > FLATTEN_BATCHSIZE ) {
+            if( !(success = this->write( batch )) )
+                break;
+            batch->clear();
+        }
+    }
+    if( success && !(success = this->write( batch )) )
+        ERROR( "Could not flatten backing %llu: %s", backing, this->getError() );
+    delete( batch );
+    if( !success )
+        return false;
+
+    // Then everyone on top of backing moves over to newID all at once.  Whoever's been layered on since we started
+    // (clone() skipping over an empty layer lands right on backing) moves too, since newID holds just what they saw
+    pthread_mutex_lock( &this->layerLock );
+    std::vector<uint64_t> layers;
+    for( std::map<uint64_t, uint64_t>::iterator itty = this->backings.begin(); itty != this->backings.end(); ++itty ) {
+        if( itty->second == backing )
+            layers.push_back( itty->first );
+    }
+    if( !layers.empty() ) {
+        ShinyDBBatch * layerBatch = this->db->newBatch();
+        char backingValue[sizeof(uint64_t)];
+        ShinyDBChunkKey::encode( backingValue, newID );
+        for( uint64_t i=0; i<layers.size(); ++i ) {
+            ShinyChunkLayerKey key( layers[i] );
+            layerBatch->put( key.data(), key.size(), backingValue, sizeof(uint64_t) );
+        }
+        success = this->db->write( layerBatch );
+        delete( layerBatch );
+        if( success ) {
+            for( uint64_t i=0; i<layers.size(); ++i )
+                this->backings[layers[i]] = newID;
+            this->layerRefs[newID] = layers.size();
+            this->layerRefs.erase( backing );
+        } else
+            ERROR( "Could not move layers of %llu over to %llu: %s", backing, newID, this->db->getError() );
+    } else
+        success = false;
+    pthread_mutex_unlock( &this->layerLock );
+    return success;
+}
+
+uint64_t ShinyChunkStore::getBacking( uint64_t fileID ) {
+    pthread_mutex_lock( &this->layerLock );
+    std::map<uint64_t, uint64_t>::iterator layer = this->backings.find( fileID );
+    uint64_t backing = layer == this->backings.end() ? 0 : layer->second;
+    pthread_mutex_unlock( &this->layerLock );
+    return backing;
+}
+
+uint64_t ShinyChunkStore::getLayers( uint64_t fileID ) {
+    uint64_t layers = 0;
+    for( uint64_t id = fileID; id; id = this->getBacking( id ) )
+        layers++;
+    return layers;
+}
+
+bool ShinyChunkStore::isBacking( uint64_t fileID ) {
+    pthread_mutex_lock( &this->layerLock );
+    bool backing = this->layerRefs.find( fileID ) != this->layerRefs.end();
+    pthread_mutex_unlock( &this->layerLock );
+    return backing;
+}
+
+void ShinyChunkStore::getLayerMap( std::map<uint64_t, uint64_t> & layerMap ) {
+    pthread_mutex_lock( &this->layerLock );
+    layerMap = this->backings;
+    pthread_mutex_unlock( &this->layerLock );
+}
+
+uint64_t ShinyChunkStore::unlayer( uint64_t fileID ) {
+    pthread_mutex_lock( &this->layerLock );
+    uint64_t orphaned = 0;
+    std::map<uint64_t, uint64_t>::iterator layer = this->backings.find( fileID );
+    if( layer != this->backings.end() ) {
+        ShinyChunkLayerKey key( fileID );
+        if( !this->db->del( key.data(), key.size() ) )
+            ERROR( "Could not forget layer %llu: %s", fileID, this->db->getError() );
+
+        uint64_t backing = layer->second;
+        this->backings.erase( layer );
+        if( --this->layerRefs[backing] == 0 ) {
+            this->layerRefs.erase( backing );
+            orphaned = backing;
+        }
+    }
+    pthread_mutex_unlock( &this->layerLock );
+    return orphaned;
+}
+
+void ShinyChunkStore::loadLayers() {
+    const char prefix = ShinyChunkLayerKey::PREFIX;
+    ShinyDBIterator * it = this->db->newIterator();
+    for( it->seek( &prefix, 1 ); it->valid() && ShinyChunkLayerKey::isLayerKey( it->key(), it->keySize() ); it->next() ) {
+        if( it->valueSize() != sizeof(uint64_t) ) {
+            WARN( "Skipping corrupt layer" );
+            continue;
+        }
+        uint64_t backing = ShinyDBChunkKey::decode( it->value() );
+        this->backings[ShinyDBChunkKey::decode( it->key() + 1 )] = backing;
+        this->layerRefs[backing]++;
+    }
+    delete( it );
+}
+
+bool ShinyChunkStore::applyDeltas( uint64_t fileID, uint64_t chunk, char * output, uint64_t outputLen ) {
+    ShinyChunkDeltaKey deltaKey( fileID, chunk );
+    ShinyDBIterator * it = this->db->newIterator();
+    bool success = true;
+    for( it->seek( deltaKey.data(), deltaKey.size() ); it->valid() && deltaKey.sameChunk( it->key(), it->keySize() ); it->next() ) {
+        const char * value = it->value();
+        if( it->valueSize() < this->deltaHeaderLen ) {
+            success = false;
+            break;
+        }
+        uint64_t len = it->valueSize() - this->deltaHeaderLen;
+        uint64_t offset = ShinyChunkDeltaKey::decodeOffset( value );
+        if( offset + len > outputLen ) {
+            success = false;
+            break;
+        }
+
+        // A delta's checksum covers its offset too, so one that got mangled can't land somewhere it shouldn't
+        const char * data = value + this->deltaHeaderLen;
+        if( this->checksums && ShinyCRC32C::extend( ShinyCRC32C::hash( value, ShinyChunkDeltaKey::OFFSET_LEN ), data, len ) != ShinyCRC32C::decode( value + ShinyChunkDeltaKey::OFFSET_LEN ) ) {
+            success = false;
+            break;
+        }
+        memcpy( output + offset, data, len );
+    }
+    delete( it );
+    return success;
+}
@@ -0,0 +1,448 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkStore_h
+#define shinyfs_ShinyChunkStore_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ShinyDBWrapper.h"
+#include "ShinyChunkCodec.h"
+#include "ShinyChunkCache.h"
+#include "ShinyChunkScratch.h"
+#include "ShinyChunkMerkle.h"
+#include "../util/ShinyCRC32C.h"
+
+/*
+ Sits in between files and the DB, and decides how the chunks of a file are actually laid out in there.  Files
+ only ever talk about (file ID, chunk index) pairs; reading goes through a ShinyChunkReader, and writing through
+ a ShinyChunkBatch that gets handed to write().  There are two ways the chunks can be stored:
+
+ MODE_DIRECT: Each chunk's data sits right under its ShinyDBChunkKey.  Simple and fast, and what we've always done.
+
+ MODE_DEDUP: Content-addressed.  A chunk's key just holds the SHA-256 of its data, and the data itself is stored
+    (once!) under that hash, along with a count of how many chunks, in any file, point at it.  Files that share
+    data (VM images, build outputs, copies of copies) share chunks, and writing a chunk that's already stored
+    somewhere only touches the hash and the refcount instead of writing the data all over again.  Data is
+    deleted once nothing points at it anymore.
+
+ On top of either of those, chunks can be compressed with a ShinyChunkCodec.  Compressed chunks start with a small
+ header, the codec's ID and the uncompressed length, and chunks that don't compress worth a darn are stored raw
+ (but still with a header).  When we're deduping, chunks are hashed before they're compressed, so the same data
+ dedups no matter what it was compressed with.
+
+ Chunks (and deltas) can also carry a CRC-32C of their data, which every read off the DB checks, so a chunk that
+ got mangled on its way to or from the disk is an error instead of garbage handed back to whoever asked.  It's taken
+ before compression, right after the codec's header, so it checks the decompressor's work too.  Holes and whiteouts
+ have nothing to check.  Whatever comes back out of the cache was checked on its way in.
+
+ The mode, codec and whether there are checksums are picked when a filecache is created, and stick with it from then
+ on (see ShinyFilesystem)
+
+ Files are sparse: a chunk that isn't stored at all is a hole, and reads back as zeros, as does anything past the
+ end of a chunk that was stored short.  Chunks that are nothing but zeros are never stored, they're left as holes.
+
+ Small writes into the middle of a chunk don't have to rewrite the whole thing: they can be logged as deltas (just
+ an offset and the new bytes) under their own keys, next to each other and in the order they were written.  Reads
+ merge a chunk's deltas back over it, and compact() eventually folds them in for good.  Putting or deleting a chunk
+ outright throws its deltas away.  Deltas are only ever logged against chunks that are actually stored; patching a
+ hole just stores the patch as the chunk.
+
+ Chunks that get read through copy() end up in a ShinyChunkCache (unless the store was made without one), fully
+ decoded, so reading them again skips the DB, the decompression and the merging.  Every chunk a batch touches gets
+ invalidated as soon as the batch is in the DB.
+
+ Files can be cloned without copying a single chunk (see clone()).  The ID being cloned is frozen right where it
+ stands, and the file and its clone each carry on under a brand new ID, layered on top of it: any chunk a layer
+ doesn't have shows through from its backing (or from that one's backing, and so on down), and writes only ever touch
+ the layer.  That means a layer can't just delete a chunk (or leave a chunk of zeros out), since whatever was
+ underneath would show right back through, so it stores an empty whiteout there instead, which reads back as a hole.
+ A backing sticks around for as long as anything is layered on top of it; once the last layer is reclaimed, so is it.
+ */
+
+class ShinyChunkStore;
+
+// Reads chunks of one file, hanging on to whatever it used to find the last one (views, an iterator) so reading
+// the next one is cheap.  Chunks come back borrowed, just like a ShinyDBView, and are only good until the next
+// read() or until the reader dies
+class ShinyChunkReader {
+friend class ShinyChunkStore;
+public:
+    // We're going to be reading chunks firstChunk through lastChunk of fileID (or at least some of them).  If that's
+    // more than one chunk, we walk through them with an iterator instead of looking each one up from scratch
+    ShinyChunkReader( ShinyChunkStore * store, uint64_t fileID, uint64_t firstChunk, uint64_t lastChunk );
+    ~ShinyChunkReader();
+
+    // Points data/len at chunk, returns false if it couldn't be read.  Holes come back with a len of 0.  Fastest when
+    // chunks are read in order
+    bool read( uint64_t chunk, const char ** data, uint64_t * len );
+
+    // Copies up to len bytes of chunk, starting from offset, into output and sets chunkLen to the full length of the
+    // chunk (so the caller can tell how much got copied, and whether it was a short one; holes have a chunkLen of 0).
+    // Returns false if the chunk couldn't be read.  This is the one to use for compressed chunks, since whenever
+    // output wants the whole chunk it gets decompressed straight in there, instead of into our scratch space and then
+    // copied over.  It's also the one that goes through the store's cache
+    bool copy( uint64_t chunk, uint64_t offset, char * output, uint64_t len, uint64_t * chunkLen );
+
+    // Why the last read()/copy() came back false
+    const char * getError();
+private:
+    // Finds whatever is stored for chunk, header and all, and sets source to the ID it was found under (ours, or a
+    // backing's if we're a layer).  value is set to NULL for holes
+    bool find( uint64_t chunk, const char ** value, uint64_t * valueLen );
+
+    // For a chunk a layer doesn't have: looks for it down through the layer's backings, front to back
+    bool findBacking( uint64_t chunk, const char ** value, uint64_t * valueLen );
+
+    // In MODE_DEDUP, turns the hash stored under a chunk's key into the data it points at (everything else has the
+    // data right there already).  Whiteouts resolve to a hole
+    bool resolve( const char * value, uint64_t valueLen, const char ** data, uint64_t * len );
+
+    // Puts chunk back together from what's stored for it plus all of its deltas, in our scratch space.  merge() grabs
+    // the store's write lock for the duration (and caches the result), mergeLocked() is for when the store already
+    // has it
+    bool merge( uint64_t chunk, const char ** data, uint64_t * len );
+    bool mergeLocked( uint64_t chunk, const char ** data, uint64_t * len );
+
+    // Picks apart a stored chunk's header (if it has one) and its checksum (if it has one), pointing payload at
+    // whatever comes after them.  Chunks stored without a codec come back as ID_RAW
+    bool unpack( const char * value, uint64_t valueLen, uint8_t * codecID, const char ** payload, uint64_t * payloadLen, uint64_t * rawLen, uint32_t * crc );
+
+    // Checks a chunk's len bytes of data, all decompressed, against the crc it was stored with (if the store keeps
+    // checksums at all)
+    bool check( const char * data, uint64_t len, uint32_t crc );
+
+    // Hands the whole of chunk, as read from the DB, to the store's cache
+    void cacheChunk( uint64_t chunk, const char * data, uint64_t len, uint64_t epoch );
+
+    // Decompresses a payload into output, which has to have room for all rawLen bytes of it
+    bool decompress( uint8_t codecID, const char * payload, uint64_t payloadLen, char * output, uint64_t rawLen );
+
+    // Same as above, but into our scratch space, which gets bigger if it has to
+    bool decompressScratch( uint8_t codecID, const char * payload, uint64_t payloadLen, uint64_t rawLen );
+
+    ShinyChunkStore * store;
+    ShinyDBChunkKey key;
+
+    // Which ID the last chunk we found was actually stored under, since that's who its deltas are logged against
+    uint64_t source;
+
+    // For single chunks (and chunks showing through from a backing), and for the data of chunks in MODE_DEDUP
+    ShinyDBView view;
+    ShinyDBView dataView;
+
+    // For runs of chunks, along with the last chunk it was looking for, and whether it found it
+    ShinyDBIterator * it;
+    uint64_t itChunk;
+    bool itStarted;
+    bool itFound;
+
+    // The cache's epochs from before the iterator was made, since that's how old everything it finds could be
+    uint64_t epochs[ShinyChunkCache::SHARDS];
+
+    // The store's compaction count from before the iterator was made (or the last view was taken).  If it's moved on
+    // since, whatever we found could be from before a compaction threw its deltas away, so getDeltas() saying there
+    // aren't any doesn't mean what we found is the whole chunk
+    uint64_t compactions;
+
+    const char * error;
+
+    // Where compressed chunks get decompressed to when they can't go straight to the caller (borrowed from this
+    // thread's spares, so readers don't cost an allocation apiece)
+    ShinyChunkScratch scratch;
+};
+
+// A bunch of chunk puts, patches and deletes that go into the DB all at once (or not at all) via
+// ShinyChunkStore::write().  Just like a ShinyDBBatch, nothing put in here can be read back until it's been written.
+// Get one from newBatch()
+class ShinyChunkBatch {
+friend class ShinyChunkStore;
+public:
+    ~ShinyChunkBatch();
+
+    // Queues up storing data as chunk of fileID, or getting rid of that chunk (leaving a hole, or a whiteout if fileID
+    // is a layer).  data is copied, so it can be reused.  Putting a chunk of all zeros is the same as deleting it
+    void put( uint64_t fileID, uint64_t chunk, const char * data, uint64_t len );
+    void del( uint64_t fileID, uint64_t chunk );
+
+    // Queues up overwriting len bytes of chunk, starting at offset, with data, by logging it as a delta instead of
+    // storing the chunk all over again.  The chunk grows if data runs past its end.  Don't patch a chunk in the same
+    // batch that puts or deletes it
+    void patch( uint64_t fileID, uint64_t chunk, uint64_t offset, const char * data, uint64_t len );
+
+    // Throws away everything queued up so far
+    void clear();
+
+    // Roughly how many bytes are queued up
+    uint64_t getSize();
+private:
+    ShinyChunkBatch( ShinyChunkStore * store );
+
+    // Compresses data if the store has a codec, and puts crc in front of it if the store keeps checksums, pointing
+    // value at what should actually be stored
+    void encode( const char * data, uint64_t len, uint32_t crc, const char ** value, uint64_t * valueLen );
+
+    ShinyChunkStore * store;
+
+    // Compressed chunks get built here
+    ShinyChunkScratch scratch;
+
+    // MODE_DIRECT just passes everything straight on through to a batch of the DB's
+    ShinyDBBatch * batch;
+
+    // MODE_DEDUP can't work out the refcounts until write(), so until then we keep track of which hash each touched
+    // chunk key is going to point at (empty for deletes), and the data behind every hash we've been handed
+    std::map<std::string, std::string> slots;
+    std::map<std::string, std::string> hashData;
+    uint64_t size;
+
+    // Patches can't get their keys until write() hands out their sequence numbers, so until then they wait here,
+    // offset and all, in the order they came in
+    struct Patch {
+        uint64_t fileID;
+        uint64_t chunk;
+        std::string value;
+    };
+    std::vector<Patch> patches;
+
+    // Every chunk that gets put or deleted outright, since any deltas it has get thrown away along with it
+    std::set<std::pair<uint64_t, uint64_t> > replaced;
+
+    // The CRC and length of what each of those chunks is replaced with (0 and 0 for deletes), for whatever Merkle
+    // trees the store is keeping.  Only puts to a store with checksums have their CRC handy; the rest aren't in here
+    std::map<std::pair<uint64_t, uint64_t>, std::pair<uint32_t, uint64_t> > leaves;
+};
+
+class ShinyChunkStore {
+friend class ShinyChunkReader;
+friend class ShinyChunkBatch;
+/////// CREATION ///////
+public:
+    enum Mode {
+        MODE_DIRECT = 0,
+        MODE_DEDUP = 1,
+    };
+
+    // codec can be NULL, in which case chunks are stored just as they are, with no header.  cacheSize is how much
+    // memory the chunk cache gets; 0 means no cache at all.  checksums puts a CRC-32C in front of every chunk and delta
+    ShinyChunkStore( ShinyDBWrapper * db, Mode mode = MODE_DIRECT, ShinyChunkCodec * codec = NULL, uint64_t cacheSize = ShinyChunkCache::DEFAULT_SIZE, bool checksums = false );
+    ~ShinyChunkStore();
+
+    Mode getMode();
+    ShinyChunkCodec * getCodec();
+    ShinyDBWrapper * getDB();
+    bool getChecksums();
+
+    // NULL if we were made without a cache
+    ShinyChunkCache * getCache();
+
+    // Human-readable name for mode, for logging
+    static const char * getModeName( Mode mode );
+
+/////// CHUNKS ///////
+public:
+    // With a codec, every chunk starts with the ID of the codec it was compressed with (ShinyChunkCodec::ID_RAW if
+    // it wasn't), then its uncompressed length as 4 bytes, little-endian
+    static const uint64_t HEADER_LEN = 1 + sizeof(uint32_t);
+
+    // With checksums, that's followed by the CRC-32C of the chunk's uncompressed data, 4 bytes, little-endian.  Deltas
+    // have theirs right after their offset, taken over the offset and the data both
+    static const uint64_t CHECKSUM_LEN = ShinyCRC32C::LEN;
+
+    // Compressed chunks have to come out at least 1/MIN_SAVINGS smaller than they started, or they're stored raw;
+    // otherwise we'd be paying to decompress them every time they're read, for next to nothing
+    static const uint64_t MIN_SAVINGS = 8;
+
+    // Creates an empty batch for use with write(), caller is responsible for deleting it
+    ShinyChunkBatch * newBatch();
+
+    // Applies everything in batch atomically.  Returns false on failure, in which case none of the batch made it
+    // into the DB.  Patches against holes get turned into puts on the way, and the bookkeeping for the deltas goes
+    // into the batch too, so clear() it (or throw it away) afterwards rather than writing it again
+    bool write( ShinyChunkBatch * batch );
+
+    // Returns the last error that occured on the calling thread
+    const char * getError();
+
+/////// HOLES ///////
+public:
+    // Finds the first chunk of fileID from chunk up to (but not including) endChunk that has data stored, or that is
+    // a hole, respectively.  Returns endChunk if there isn't one.  This is what lseek()'s SEEK_DATA/SEEK_HOLE use
+    uint64_t nextData( uint64_t fileID, uint64_t chunk, uint64_t endChunk );
+    uint64_t nextHole( uint64_t fileID, uint64_t chunk, uint64_t endChunk );
+
+    // Whether data is nothing but zeros, checked 64 bytes at a time where we've got SSE2
+    static bool isZero( const char * data, uint64_t len );
+private:
+    // Whether chunk of fileID has data, taking whiteouts and backings into account, for layers
+    bool hasData( uint64_t fileID, uint64_t chunk );
+
+    // Whether deleting a chunk of fileID means putting down a whiteout, i.e. whether one of its backings has it
+    bool needsWhiteout( uint64_t fileID, uint64_t chunk );
+
+/////// LAYERS ///////
+public:
+    // Every layer a chunk has to be looked for in costs a lookup, so once a clone leaves a file this many layers deep,
+    // what it's layered on gets flattened out in the background (see flatten() and ShinyMetaFile::cloneChunks())
+    static const uint64_t MAX_LAYERS = 8;
+
+    // flatten() writes its copy out in batches of no more than this many bytes
+    static const uint64_t FLATTEN_BATCHSIZE = 64*1024*1024;
+
+    // Freezes fileID and layers newID (for the file itself to carry on under) and cloneID (for its clone) on top of it,
+    // so the two share every chunk until one of them writes.  Nothing may write to fileID from here on.  Costs a
+    // couple of small puts, no matter how big the file is.  If fileID is a layer that has nothing of its own yet, it's
+    // skipped over, and newID and cloneID go right on top of its backing instead (so cloning over and over doesn't
+    // pile up empty layers).  Any deltas fileID has get folded into its chunks first.  Returns false if it couldn't
+    // be written
+    bool clone( uint64_t fileID, uint64_t newID, uint64_t cloneID );
+
+    // Copies everything backing holds (its own chunks and whatever shows through from its backings) under newID, as a
+    // plain old file, then puts every layer that was on top of backing on top of newID instead, so none of them is
+    // more than two layers deep anymore.  backing is frozen, so the layers on top can carry on being written the whole
+    // time.  Costs a read and a write of everything backing holds.  Returns true if backing is done being a backing
+    // and should be released, false if newID should be released instead (it couldn't be written, or nothing was left
+    // on top of backing by the time we were done)
+    bool flatten( uint64_t backing, uint64_t newID );
+
+    // The ID fileID is layered on top of, or 0 if it isn't a layer
+    uint64_t getBacking( uint64_t fileID );
+
+    // How many IDs deep a chunk of fileID might have to be looked for: 1 for a plain old file, 2 for a layer on top
+    // of one, etc.
+    uint64_t getLayers( uint64_t fileID );
+
+    // Whether anything is layered on top of fileID
+    bool isBacking( uint64_t fileID );
+
+    // Every layer there is, along with its backing, for ShinyChunkReclaimer::sweepOrphans()
+    void getLayerMap( std::map<uint64_t, uint64_t> & layerMap );
+
+    // For the reclaimer, once fileID has been released: forgets that fileID was a layer at all, so its chunks can be
+    // deleted for real (instead of whited out).  Returns its backing if nothing else is layered on it anymore, so the
+    // caller can release that too, or 0 otherwise
+    uint64_t unlayer( uint64_t fileID );
+private:
+    void loadLayers();
+
+    // What every layer is layered on, and how many layers each backing has on top of it.  Protected by layerLock
+    std::map<uint64_t, uint64_t> backings;
+    std::map<uint64_t, uint64_t> layerRefs;
+    pthread_mutex_t layerLock;
+
+/////// MERKLE TREES ///////
+public:
+    // How many files' trees we hang on to at once (oldest gets dropped first), and how many times getRoot() goes back
+    // for chunks that changed while it was reading them before giving up
+    static const uint64_t MAX_TREES = 16;
+    static const uint64_t MAX_ROOT_TRIES = 4;
+
+    // Works out the root of the Merkle tree (see ShinyChunkMerkle) of fileID, which is fileLen bytes long in chunks of
+    // chunkSize, into root (ShinyChunkMerkle::ROOT_LEN bytes).  The first time, that means reading every chunk, but the
+    // tree is kept up to date as chunks get written from then on, so next time around it's only whatever we couldn't
+    // work out from the writes themselves (deltas, and everything if we don't keep checksums).  Returns false if the
+    // chunks couldn't all be read
+    bool getRoot( uint64_t fileID, uint64_t fileLen, uint64_t chunkSize, char * root );
+
+    // Throws away fileID's tree, for when it's gone for good
+    void forgetRoot( uint64_t fileID );
+
+    // Reads every one of the first numChunks chunks of fileID straight from the DB, deltas and all, so every checksum
+    // gets checked.  Returns false if any of them didn't
+    bool verify( uint64_t fileID, uint64_t numChunks );
+private:
+    struct Tree {
+        ShinyChunkMerkle * merkle;
+
+        // Every tree gets its own, so getRoot() can tell if the tree it was reading chunks for got dropped (and maybe
+        // made all over again) while it was gone
+        uint64_t serial;
+    };
+
+    // fileID's tree, made from scratch if we don't have one with chunks of chunkSize.  merkleLock has to be held
+    Tree & getTree( uint64_t fileID, uint64_t chunkSize );
+    void dropTree( uint64_t fileID );
+
+    // Tells the trees of every file batch touched what it did, once it's in the DB.  writeLock has to be held, so
+    // nothing can get written in between
+    void updateTrees( ShinyChunkBatch * batch, const std::vector<bool> & logged );
+
+    // Protected by merkleLock, which is only ever taken with writeLock already held (or neither), and never held while
+    // reading chunks.  treeOrder is oldest first
+    std::map<uint64_t, Tree> trees;
+    std::list<uint64_t> treeOrder;
+    uint64_t nextTreeSerial;
+    pthread_mutex_t merkleLock;
+
+/////// DELTAS ///////
+public:
+    // No chunk gets more than this many deltas logged against it; past that, reading it means merging so many of
+    // them that just rewriting the chunk is cheaper
+    static const uint64_t MAX_DELTAS = 16;
+
+    // How many deltas are logged against chunk of fileID, and if bytes isn't NULL, how much data they hold.  If
+    // compactions isn't NULL, it gets how many times compact() has put chunks back, as of the same moment
+    uint64_t getDeltas( uint64_t fileID, uint64_t chunk, uint64_t * bytes = NULL, uint64_t * compactions = NULL );
+
+    // How many times compact() has put merged chunks back (and thrown their deltas away)
+    uint64_t getCompactions();
+
+    // Every delta gets a sequence number one higher than the last; this is the one the next delta will get
+    uint64_t getDeltaSeq();
+
+    // Folds the deltas of up to maxChunks chunks back into them, skipping any chunk that's had a delta logged at or
+    // after sequence number before (it's probably still being written to).  Chunks of IDs something is layered on
+    // are skipped too, since they're frozen (clone() folds their deltas in before freezing them, anyway).  Returns
+    // how many chunks got compacted
+    uint64_t compact( uint64_t maxChunks, uint64_t before );
+private:
+    // compact(), for when we've already got writeLock, and for only fileID's chunks if fileID isn't 0.  compacted
+    // gets how many chunks got compacted.  Returns false if any chunk's deltas couldn't be merged or written
+    bool compactLocked( uint64_t fileID, uint64_t maxChunks, uint64_t before, uint64_t * compacted );
+
+    // What we know about the deltas of each chunk that has any: how many, how much data, the furthest any of them
+    // reaches into the chunk, and the sequence number of the newest.  Rebuilt from the DB by loadDeltas() on startup
+    struct DeltaInfo {
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t end;
+        uint64_t lastSeq;
+    };
+    typedef std::map<std::pair<uint64_t, uint64_t>, DeltaInfo> DeltaMap;
+
+    void loadDeltas();
+
+    // write(), for when we've already got writeLock
+    bool writeLocked( ShinyChunkBatch * batch );
+
+    // Applies every delta of chunk over output, in order.  Returns false if one of them doesn't fit in outputLen
+    bool applyDeltas( uint64_t fileID, uint64_t chunk, char * output, uint64_t outputLen );
+
+    ShinyDBWrapper * db;
+    Mode mode;
+    ShinyChunkCodec * codec;
+    ShinyChunkCache * cache;
+    bool checksums;
+
+    // How much comes before the data in a chunk (the codec's header and the checksum) and in a delta (the offset and
+    // the checksum), going by the codec and whether we keep checksums
+    uint64_t chunkHeaderLen;
+    uint64_t deltaHeaderLen;
+
+    // Protected by writeLock
+    DeltaMap deltas;
+    uint64_t nextDeltaSeq;
+    uint64_t compactions;
+
+    // Held for every write(), and while merging a chunk's deltas.  In MODE_DEDUP, refcounts get read, bumped and
+    // written back, so two writes going at once (even to different files, since they can share data) would step all
+    // over each other's counts.  And a chunk's deltas have to be read, merged and thrown away all in one go, or a
+    // delta logged halfway through could be thrown away without ever being merged
+    pthread_mutex_t writeLock;
+};
+
+#endif // shinyfs_ShinyChunkStore_h
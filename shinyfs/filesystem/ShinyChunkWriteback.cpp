@@ -0,0 +1,313 @@
+//
+//  ShinyChunkWriteback.cpp
+//  shinyfs
+//
+
+#include "ShinyChunkWriteback.h"
+#include "ShinyMetaFileSnapshot.h"
+#include <base/Logger.h>
+#include <string.h>
+
+#define min( x, y ) ((x) > (y) ? (y) : (x))
+#define max( x, y ) ((x) > (y) ? (x) : (y))
+
+ShinyChunkWriteback::ShinyChunkWriteback( ShinyChunkStore * store ) : store(store), bytes(0), tick(0) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->idle, NULL );
+    this->spares.reserve( MAX_SPARES );
+}
+
+ShinyChunkWriteback::~ShinyChunkWriteback() {
+    // If the DB won't take them now, it never will
+    this->flushAll();
+    pthread_mutex_lock( &this->mutex );
+    for( std::map<uint64_t, File *>::iterator itty = this->files.begin(); itty != this->files.end(); ++itty ) {
+        ERROR( "Throwing away %llu buffered chunks of file %llu", itty->second->chunks.size(), itty->first );
+        this->freeChunks( itty->second->chunks, itty->second->chunkSize );
+        delete( itty->second );
+    }
+    for( uint64_t i=0; i<this->spares.size(); ++i ) {
+        delete [] this->spares[i]->data;
+        delete( this->spares[i] );
+    }
+    pthread_mutex_unlock( &this->mutex );
+
+    pthread_cond_destroy( &this->idle );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+bool ShinyChunkWriteback::write( ShinyMetaFileSnapshot * file, uint64_t offset, const char * data, uint64_t len ) {
+    const uint64_t fileID = file->getFileID();
+    const uint64_t chunkSize = file->getChunkSize();
+    const uint64_t fileLen = file->getLen();
+
+    // Whole chunks (and inlined files) are already as cheap to write as they're going to get
+    if( file->isInline() || len == 0 || len >= chunkSize )
+        return false;
+
+    pthread_mutex_lock( &this->mutex );
+    this->waitIdle( fileID );
+    this->setBusy( fileID, true );
+
+    // A file only changes chunk size by being rechunked, which flushes it first, so this shouldn't happen.  But if it
+    // does, the old chunks can't be mixed in with the new ones
+    std::map<uint64_t, File *>::iterator itty = this->files.find( fileID );
+    if( itty != this->files.end() && itty->second->chunkSize != chunkSize ) {
+        if( !this->flushFile( fileID ) ) {
+            this->setBusy( fileID, false );
+            pthread_cond_broadcast( &this->idle );
+            pthread_mutex_unlock( &this->mutex );
+            return false;
+        }
+        itty = this->files.find( fileID );
+    }
+    if( itty == this->files.end() ) {
+        File * newFile = new File;
+        newFile->chunkSize = chunkSize;
+        itty = this->files.insert( std::make_pair( fileID, newFile ) ).first;
+    }
+    File * buffered = itty->second;
+    buffered->lastUsed = this->tick++;
+
+    // A small write can still straddle two chunks
+    bool success = true;
+    for( uint64_t chunk = offset/chunkSize; chunk <= (offset + len - 1)/chunkSize; ++chunk ) {
+        uint64_t chunkStart = chunk*chunkSize;
+        uint64_t writeStart = offset > chunkStart ? offset - chunkStart : 0;
+        uint64_t writeEnd = min( chunkSize, offset + len - chunkStart );
+
+        // First time we've seen this chunk, so start from whatever it's got in it now.  Chunks never hold anything
+        // past the end of the file, so there's no need to go looking for them out there, or for holes the file knows
+        // about
+        Chunk * bufferedChunk;
+        uint64_t pos = findChunk( buffered->chunks, chunk );
+        if( pos < buffered->chunks.size() && buffered->chunks[pos]->index == chunk )
+            bufferedChunk = buffered->chunks[pos];
+        else {
+            bufferedChunk = this->newChunk( chunkSize );
+            bufferedChunk->index = chunk;
+            bufferedChunk->len = 0;
+            if( chunkStart < fileLen && (writeStart > 0 || writeEnd < min( chunkSize, fileLen - chunkStart )) && file->mightHaveData( chunk ) ) {
+                // Nobody else touches our file while it's busy, so it's safe to let go while we're out at the DB
+                uint64_t oldLen = min( chunkSize, fileLen - chunkStart ), chunkLen;
+                pthread_mutex_unlock( &this->mutex );
+                ShinyChunkReader reader( this->store, fileID, chunk, chunk );
+                bool copied = reader.copy( chunk, 0, bufferedChunk->data, oldLen, &chunkLen );
+                if( !copied )
+                    ERROR( "Could not read chunk %llu of file %llu from cache: %s", chunk, fileID, reader.getError() );
+                pthread_mutex_lock( &this->mutex );
+                if( !copied ) {
+                    this->freeChunk( bufferedChunk );
+                    success = false;
+                    break;
+                }
+                bufferedChunk->len = min( chunkLen, oldLen );
+            }
+            buffered->chunks.insert( buffered->chunks.begin() + pos, bufferedChunk );
+            this->bytes += chunkSize;
+        }
+
+        // Anything between what was there and what we're writing is a hole, and so reads back as zeros
+        if( writeStart > bufferedChunk->len )
+            memset( bufferedChunk->data + bufferedChunk->len, 0, writeStart - bufferedChunk->len );
+        memcpy( bufferedChunk->data + writeStart, data + (chunkStart + writeStart - offset), writeEnd - writeStart );
+        bufferedChunk->len = max( bufferedChunk->len, writeEnd );
+
+        // Made it to the end of the chunk, so that's probably the last we'll see of it
+        if( writeEnd == chunkSize ) {
+            buffered->complete.push_back( bufferedChunk );
+            buffered->chunks.erase( buffered->chunks.begin() + pos );
+        }
+    }
+
+    // Out go the finished chunks (or back they go, if they won't).  If we couldn't buffer all of it, whoever called
+    // us is going to flush() before writing it themselves, so the part we did buffer stays put until then
+    if( this->writeOut( fileID, buffered->complete ) )
+        this->freeChunks( buffered->complete, chunkSize );
+    else {
+        for( uint64_t i=0; i<buffered->complete.size(); ++i ) {
+            Chunk * completeChunk = buffered->complete[i];
+            buffered->chunks.insert( buffered->chunks.begin() + findChunk( buffered->chunks, completeChunk->index ), completeChunk );
+        }
+        buffered->complete.clear();
+    }
+
+    // Too much buffered, so write out whoever's gone the longest without being written to, until there isn't
+    while( this->bytes > MAX_BYTES ) {
+        uint64_t oldestID = 0;
+        File * oldest = NULL;
+        for( itty = this->files.begin(); itty != this->files.end(); ++itty ) {
+            bool available = itty->first == fileID || !this->isBusy( itty->first );
+            if( available && (!oldest || itty->second->lastUsed < oldest->lastUsed) ) {
+                oldestID = itty->first;
+                oldest = itty->second;
+            }
+        }
+        if( !oldest )
+            break;
+
+        if( oldestID != fileID )
+            this->setBusy( oldestID, true );
+        bool flushed = this->flushFile( oldestID );
+        if( oldestID != fileID )
+            this->setBusy( oldestID, false );
+        if( !flushed )
+            break;
+    }
+
+    this->setBusy( fileID, false );
+    pthread_cond_broadcast( &this->idle );
+    pthread_mutex_unlock( &this->mutex );
+    return success;
+}
+
+bool ShinyChunkWriteback::flush( uint64_t fileID ) {
+    // Even with nothing buffered, somebody could be halfway through writing it out, and whoever's asking wants it to
+    // be in the DB by the time we get back
+    pthread_mutex_lock( &this->mutex );
+    this->waitIdle( fileID );
+    bool success = true;
+    if( this->files.find( fileID ) != this->files.end() ) {
+        this->setBusy( fileID, true );
+        success = this->flushFile( fileID );
+        this->setBusy( fileID, false );
+        pthread_cond_broadcast( &this->idle );
+    }
+    pthread_mutex_unlock( &this->mutex );
+    return success;
+}
+
+bool ShinyChunkWriteback::flushAll() {
+    // Grab the IDs up front, since the map changes under us every time we let go of the lock
+    pthread_mutex_lock( &this->mutex );
+    std::set<uint64_t> fileIDs;
+    for( std::map<uint64_t, File *>::iterator itty = this->files.begin(); itty != this->files.end(); ++itty )
+        fileIDs.insert( itty->first );
+    pthread_mutex_unlock( &this->mutex );
+
+    bool success = true;
+    for( std::set<uint64_t>::iterator itty = fileIDs.begin(); itty != fileIDs.end(); ++itty )
+        success = this->flush( *itty ) && success;
+    return success;
+}
+
+void ShinyChunkWriteback::discard( uint64_t fileID ) {
+    pthread_mutex_lock( &this->mutex );
+    this->waitIdle( fileID );
+    std::map<uint64_t, File *>::iterator itty = this->files.find( fileID );
+    if( itty != this->files.end() ) {
+        this->freeChunks( itty->second->chunks, itty->second->chunkSize );
+        delete( itty->second );
+        this->files.erase( itty );
+    }
+    pthread_mutex_unlock( &this->mutex );
+}
+
+void ShinyChunkWriteback::waitIdle( uint64_t fileID ) {
+    while( this->isBusy( fileID ) )
+        pthread_cond_wait( &this->idle, &this->mutex );
+}
+
+bool ShinyChunkWriteback::isBusy( uint64_t fileID ) {
+    for( uint64_t i=0; i<this->busy.size(); ++i ) {
+        if( this->busy[i] == fileID )
+            return true;
+    }
+    return false;
+}
+
+void ShinyChunkWriteback::setBusy( uint64_t fileID, bool isBusy ) {
+    if( isBusy ) {
+        this->busy.push_back( fileID );
+        return;
+    }
+    for( uint64_t i=0; i<this->busy.size(); ++i ) {
+        if( this->busy[i] == fileID ) {
+            this->busy[i] = this->busy.back();
+            this->busy.pop_back();
+            return;
+        }
+    }
+}
+
+bool ShinyChunkWriteback::writeOut( uint64_t fileID, std::vector<Chunk *> & chunks ) {
+    if( chunks.empty() )
+        return true;
+
+    // Every chunk gets replaced outright, so there's nothing to read, and any deltas logged against them go too
+    pthread_mutex_unlock( &this->mutex );
+    ShinyChunkBatch * batch = this->store->newBatch();
+    for( uint64_t i=0; i<chunks.size(); ++i )
+        batch->put( fileID, chunks[i]->index, chunks[i]->data, chunks[i]->len );
+    bool success = this->store->write( batch );
+    if( !success )
+        ERROR( "Could not write buffered chunks of file %llu to cache: %s", fileID, this->store->getError() );
+    delete( batch );
+    pthread_mutex_lock( &this->mutex );
+    return success;
+}
+
+bool ShinyChunkWriteback::flushFile( uint64_t fileID ) {
+    std::map<uint64_t, File *>::iterator itty = this->files.find( fileID );
+    if( itty == this->files.end() )
+        return true;
+
+    // The file is busy, so its entry stays put (and nobody adds to it) while we're out at the DB
+    File * buffered = itty->second;
+    if( !this->writeOut( fileID, buffered->chunks ) )
+        return false;
+    this->freeChunks( buffered->chunks, buffered->chunkSize );
+    this->files.erase( fileID );
+    delete( buffered );
+    return true;
+}
+
+void ShinyChunkWriteback::freeChunks( std::vector<Chunk *> & chunks, uint64_t chunkSize ) {
+    for( uint64_t i=0; i<chunks.size(); ++i ) {
+        this->freeChunk( chunks[i] );
+        this->bytes -= chunkSize;
+    }
+    chunks.clear();
+}
+
+ShinyChunkWriteback::Chunk * ShinyChunkWriteback::newChunk( uint64_t chunkSize ) {
+    Chunk * chunk;
+    if( this->spares.empty() ) {
+        chunk = new Chunk;
+        chunk->data = NULL;
+        chunk->size = 0;
+    } else {
+        chunk = this->spares.back();
+        this->spares.pop_back();
+    }
+
+    // Files can have different chunk sizes, so a spare might not be big enough
+    if( chunk->size < chunkSize ) {
+        delete [] chunk->data;
+        chunk->data = new char[chunkSize];
+        chunk->size = chunkSize;
+    }
+    return chunk;
+}
+
+void ShinyChunkWriteback::freeChunk( Chunk * chunk ) {
+    if( this->spares.size() < MAX_SPARES ) {
+        this->spares.push_back( chunk );
+        return;
+    }
+    delete [] chunk->data;
+    delete( chunk );
+}
+
+uint64_t ShinyChunkWriteback::findChunk( std::vector<Chunk *> & chunks, uint64_t index ) {
+    // Binary search, though there's hardly ever more than one or two of them
+    uint64_t lo = 0, hi = chunks.size();
+    while( lo < hi ) {
+        uint64_t mid = (lo + hi)/2;
+        if( chunks[mid]->index < index )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
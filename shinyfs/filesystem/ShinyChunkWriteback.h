@@ -0,0 +1,128 @@
+#pragma once
+#ifndef shinyfs_ShinyChunkWriteback_h
+#define shinyfs_ShinyChunkWriteback_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <vector>
+#include "ShinyChunkStore.h"
+
+/*
+ Soaks up small writes so that they hit the DB a whole chunk at a time.  The kernel hands FUSE writes of 4KB at a
+ time unless whoever's writing says otherwise, so things like a small-block dd or a logger appending a line at a
+ time would otherwise have every one of those go through a chunk read-modify-write (or a delta, which just puts the
+ same work off until compaction).
+
+ Instead, writes smaller than a chunk land in an in-memory copy of the chunk they're in (read in from the DB the
+ first time it's written to, unless it's past the end of the file and so has nothing in it yet).  A chunk gets
+ written out, all in one put, as soon as a write reaches the end of it.  Whatever's still sitting around gets written
+ out when the file is flushed (on fsync() and when it's closed), and when there's more than MAX_BYTES of it in all,
+ the least recently written file gets flushed to make room.
+
+ The DB doesn't know anything about what's sitting in here, so anything that reads a file's chunks (reads, seeks,
+ truncates, rechunks) has to flush() it first.  Files that are going away should be discard()ed instead.  Writes
+ that aren't buffered flush the file themselves, so they never land underneath older buffered data, and don't go to
+ the DB at all if that flush fails.
+
+ None of this costs an allocation once it's warmed up: written out chunks go back on a short list of spares for the
+ next ones to be buffered, and a file's entry (and the room it's made for its chunks) sticks around until it's
+ flushed or discarded, rather than going away every time it has nothing buffered.
+
+ Chunks are keyed off of file IDs, since file handles only live for a single write.  The same file only ever has one
+ thread working on its chunks at a time (the others wait), and the lock is let go of while that thread is out at
+ the DB, so files don't hold each other up.
+ */
+
+class ShinyMetaFileSnapshot;
+class ShinyChunkWriteback {
+/////// CREATION ///////
+public:
+    // The most bytes of chunks we'll hang on to across all files before we start writing them out
+    static const uint64_t MAX_BYTES = 16*1024*1024;
+
+    // How many written out chunks we hang on to for reuse
+    static const uint64_t MAX_SPARES = 8;
+
+    // Buffered chunks get written out through store
+    ShinyChunkWriteback( ShinyChunkStore * store );
+
+    // Writes out whatever's still buffered
+    ~ShinyChunkWriteback();
+
+/////// WRITING ///////
+public:
+    // Buffers len bytes of data at offset of file, if it's smaller than a chunk and file isn't inlined.  Returns
+    // false if it didn't, in which case writing it is up to whoever called us, once they've flush()ed file (and not
+    // at all if that fails, or it'd land underneath older buffered data).  Either way, file itself is left alone, so
+    // growing it is up to the caller
+    bool write( ShinyMetaFileSnapshot * file, uint64_t offset, const char * data, uint64_t len );
+
+    // Writes out whatever's buffered for fileID (or for every file).  Returns false if it couldn't be, in which case
+    // it stays buffered
+    bool flush( uint64_t fileID );
+    bool flushAll();
+
+    // Throws away whatever's buffered for fileID, for when it's been deleted or started over under a new ID
+    void discard( uint64_t fileID );
+private:
+    // A buffered chunk: which one it is, what it holds now, and how much of that there is (anything past len reads
+    // back as zeros).  size is how much room data has, which can be more than the file's chunk size if it was used
+    // for a bigger one before
+    struct Chunk {
+        uint64_t index;
+        char * data;
+        uint64_t len;
+        uint64_t size;
+    };
+
+    // Everything buffered for one file, with its chunks kept in order.  complete is where write() puts the chunks it
+    // finishes off, on their way out to the DB
+    struct File {
+        uint64_t chunkSize;
+        uint64_t lastUsed;
+        std::vector<Chunk *> chunks;
+        std::vector<Chunk *> complete;
+    };
+
+    // Waits until nobody else is working on fileID's chunks.  Needs mutex
+    void waitIdle( uint64_t fileID );
+
+    // Whether somebody's working on fileID's chunks, and saying that we are (or aren't anymore).  Needs mutex
+    bool isBusy( uint64_t fileID );
+    void setBusy( uint64_t fileID, bool isBusy );
+
+    // Writes chunks of fileID out to the DB in one batch, letting go of mutex while it does.  Needs mutex, and
+    // fileID to be busy
+    bool writeOut( uint64_t fileID, std::vector<Chunk *> & chunks );
+
+    // Writes out and frees every chunk of fileID, putting them back if they couldn't be written.  Needs mutex, and
+    // fileID to be busy
+    bool flushFile( uint64_t fileID );
+
+    // Frees chunks, and stops counting them against MAX_BYTES.  Needs mutex
+    void freeChunks( std::vector<Chunk *> & chunks, uint64_t chunkSize );
+
+    // Hands out a chunk with room for chunkSize bytes, a spare if there is one, and takes one back.  Needs mutex
+    Chunk * newChunk( uint64_t chunkSize );
+    void freeChunk( Chunk * chunk );
+
+    // Where the chunk with index is in chunks, or where it'd go if it isn't there
+    static uint64_t findChunk( std::vector<Chunk *> & chunks, uint64_t index );
+
+    ShinyChunkStore * store;
+
+    // Protected by mutex.  busy is the files somebody's working on, and idle is broadcast whenever one is done.  It's
+    // never longer than the number of threads writing, and a vector holds on to its room, so marking a file busy on
+    // every write doesn't cost an allocation on every write
+    std::map<uint64_t, File *> files;
+    std::vector<uint64_t> busy;
+    std::vector<Chunk *> spares;
+    uint64_t bytes;
+    uint64_t tick;
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+};
+
+#endif // shinyfs_ShinyChunkWriteback_h
@@ -0,0 +1,141 @@
+//
+//  ShinyDBAsync.cpp
+//  shinyfs
+//
+
+#include "ShinyDBAsync.h"
+#include <base/Logger.h>
+
+ShinyDBJob::ShinyDBJob() : done(false), autoDelete(false), callback(NULL), callbackData(NULL) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->cond, NULL );
+}
+
+ShinyDBJob::~ShinyDBJob() {
+    pthread_cond_destroy( &this->cond );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+void ShinyDBJob::wait() {
+    pthread_mutex_lock( &this->mutex );
+    while( !this->done )
+        pthread_cond_wait( &this->cond, &this->mutex );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+bool ShinyDBJob::isDone() {
+    pthread_mutex_lock( &this->mutex );
+    bool retVal = this->done;
+    pthread_mutex_unlock( &this->mutex );
+    return retVal;
+}
+
+void ShinyDBJob::setCallback( Callback callback, void * data ) {
+    this->callback = callback;
+    this->callbackData = data;
+}
+
+void ShinyDBJob::setAutoDelete( bool autoDelete ) {
+    this->autoDelete = autoDelete;
+}
+
+void ShinyDBJob::finish() {
+    if( this->callback )
+        this->callback( this, this->callbackData );
+
+    // Nobody's going to wait() on an autoDelete job, so we're the last ones to touch it
+    if( this->autoDelete ) {
+        delete( this );
+        return;
+    }
+
+    pthread_mutex_lock( &this->mutex );
+    this->done = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+
+ShinyDBAsync::ShinyDBAsync( ShinyDBWrapper * db, uint64_t numThreads, uint64_t maxQueued ) : db(db), queueLen(0), maxQueued(maxQueued), shuttingDown(false) {
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->notEmpty, NULL );
+    pthread_cond_init( &this->notFull, NULL );
+
+    for( uint64_t i=0; i<numThreads; ++i ) {
+        pthread_t thread;
+        if( pthread_create( &thread, NULL, &ShinyDBAsync::workerLoop, this ) != 0 ) {
+            ERROR( "Could not start DB worker thread %llu!", i );
+            continue;
+        }
+        this->threads.push_back( thread );
+    }
+
+    // If we couldn't get a single worker going, nothing submitted would ever finish
+    if( this->threads.empty() )
+        throw "Unable to start DB worker threads";
+}
+
+ShinyDBAsync::~ShinyDBAsync() {
+    // Let the workers know that once the queue runs dry, they're done
+    pthread_mutex_lock( &this->mutex );
+    this->shuttingDown = true;
+    pthread_cond_broadcast( &this->notEmpty );
+    pthread_mutex_unlock( &this->mutex );
+
+    for( uint64_t i=0; i<this->threads.size(); ++i )
+        pthread_join( this->threads[i], NULL );
+
+    pthread_cond_destroy( &this->notFull );
+    pthread_cond_destroy( &this->notEmpty );
+    pthread_mutex_destroy( &this->mutex );
+}
+
+void ShinyDBAsync::submit( ShinyDBJob * job ) {
+    pthread_mutex_lock( &this->mutex );
+    while( this->queueLen >= this->maxQueued )
+        pthread_cond_wait( &this->notFull, &this->mutex );
+
+    this->queue.push_back( job );
+    this->queueLen++;
+    pthread_cond_signal( &this->notEmpty );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+void ShinyDBAsync::submitFollowUp( ShinyDBJob * job ) {
+    // These can run the queue past maxQueued for a bit, but each one comes out of a single save or clone
+    pthread_mutex_lock( &this->mutex );
+    this->queue.push_back( job );
+    this->queueLen++;
+    pthread_cond_signal( &this->notEmpty );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+ShinyDBWrapper * ShinyDBAsync::getDB() {
+    return this->db;
+}
+
+void * ShinyDBAsync::workerLoop( void * data ) {
+    ShinyDBAsync * async = (ShinyDBAsync *) data;
+
+    while( true ) {
+        pthread_mutex_lock( &async->mutex );
+        while( async->queue.empty() && !async->shuttingDown )
+            pthread_cond_wait( &async->notEmpty, &async->mutex );
+
+        // Only quit once there's nothing left to do, so nobody gets stuck in wait() forever
+        if( async->queue.empty() ) {
+            pthread_mutex_unlock( &async->mutex );
+            break;
+        }
+
+        ShinyDBJob * job = async->queue.front();
+        async->queue.pop_front();
+        async->queueLen--;
+        pthread_cond_signal( &async->notFull );
+        pthread_mutex_unlock( &async->mutex );
+
+        job->run( async->db );
+        job->finish();
+    }
+    return NULL;
+}
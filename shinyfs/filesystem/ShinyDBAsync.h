@@ -0,0 +1,92 @@
+#pragma once
+#ifndef shinyfs_ShinyDBAsync_h
+#define shinyfs_ShinyDBAsync_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include "ShinyDBWrapper.h"
+
+/*
+ A pool of worker threads that do DB work on everybody else's behalf, so the FUSE and mediator threads can get a
+ bunch of chunk operations going at once (or not wait on them at all) instead of sitting on the DB one op at a time.
+ Work gets packaged up into a ShinyDBJob, handed to submit(), and then the job doubles as its own future; wait() on
+ it, or give it a callback, or mark it to be deleted once it's done and just forget about it.
+ */
+
+class ShinyDBJob {
+friend class ShinyDBAsync;
+public:
+    ShinyDBJob();
+    virtual ~ShinyDBJob();
+
+    // Blocks until a worker has finished run()'ing this job (and calling its callback, if it has one)
+    void wait();
+
+    // Whether the job has finished yet, doesn't block
+    bool isDone();
+
+    // Gets called from the worker thread right after run(), good for kicking off whatever comes next
+    typedef void (*Callback)( ShinyDBJob * job, void * data );
+    void setCallback( Callback callback, void * data );
+
+    // Fire-and-forget: the worker deletes this job once it's done, so nobody can wait() on it
+    void setAutoDelete( bool autoDelete );
+protected:
+    // This is where the actual work goes, called on one of the worker threads
+    virtual void run( ShinyDBWrapper * db ) = 0;
+private:
+    // Called by the worker when run() is done, wakes up everybody in wait()
+    void finish();
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    bool autoDelete;
+
+    Callback callback;
+    void * callbackData;
+};
+
+class ShinyDBAsync {
+/////// CREATION ///////
+public:
+    // Spins up numThreads workers to run jobs against db.  No more than maxQueued jobs can be waiting at any one
+    // time; after that, submit() blocks until the workers catch up
+    ShinyDBAsync( ShinyDBWrapper * db, uint64_t numThreads = 4, uint64_t maxQueued = 256 );
+
+    // Finishes off everything still queued up, then shuts the workers down
+    ~ShinyDBAsync();
+
+/////// JOBS ///////
+public:
+    // Queues job up for the next free worker. Blocks if the queue is full
+    void submit( ShinyDBJob * job );
+
+    // Same, but never blocks, full queue or not.  This is for work that a job kicks off from a worker: if every
+    // worker sat waiting for room in the queue, there'd be nobody left to make any
+    void submitFollowUp( ShinyDBJob * job );
+
+    // The DB all the work is done against, for anybody who'd rather just do it themselves
+    ShinyDBWrapper * getDB();
+private:
+    // What each worker thread spends its life doing
+    static void * workerLoop( void * data );
+
+    ShinyDBWrapper * db;
+
+    // Jobs waiting on a worker, protected by mutex.  notEmpty wakes up workers, notFull wakes up submit()
+    std::list<ShinyDBJob *> queue;
+    uint64_t queueLen;
+    uint64_t maxQueued;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    // Set when it's time for the workers to pack it up
+    bool shuttingDown;
+    std::vector<pthread_t> threads;
+};
+
+#endif // shinyfs_ShinyDBAsync_h
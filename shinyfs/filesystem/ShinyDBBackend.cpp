@@ -0,0 +1,184 @@
+//
+//  ShinyDBBackend.cpp
+//  shinyfs
+//
+
+#include "ShinyDBBackend.h"
+#include "ShinyDBBackendMemory.h"
+#include "ShinyDBBackendLevelDB.h"
+#include "ShinyDBBackendLMDB.h"
+#include <base/Logger.h>
+#include <string.h>
+
+ShinyDBBackend * ShinyDBBackend::open( const char * spec ) {
+    // Split "<engine>:<path>" up into its two halves.  No engine means LevelDB, like it always used to be
+    const char * colon = strchr( spec, ':' );
+    std::string engine = colon ? std::string( spec, colon - spec ) : std::string( "leveldb" );
+    const char * path = colon ? colon + 1 : spec;
+
+    if( engine == "memory" )
+        return new ShinyDBBackendMemory();
+#ifdef LEVELDB
+    if( engine == "leveldb" )
+        return new ShinyDBBackendLevelDB( path );
+#endif
+#ifdef LMDB
+    if( engine == "lmdb" )
+        return new ShinyDBBackendLMDB( path );
+#endif
+
+    ERROR( "Unknown (or not compiled in) database engine \"%s\" in %s", engine.c_str(), spec );
+    throw "Unknown database engine";
+}
+
+ShinyDBBackend::~ShinyDBBackend() {
+}
+
+
+ShinyDBChunkKey::ShinyDBChunkKey( uint64_t fileID, uint64_t chunk ) {
+    this->key[0] = PREFIX;
+    encode( this->key + 1, fileID );
+    encode( this->key + 1 + sizeof(uint64_t), chunk );
+}
+
+void ShinyDBChunkKey::setChunk( uint64_t chunk ) {
+    encode( this->key + 1 + sizeof(uint64_t), chunk );
+}
+
+uint64_t ShinyDBChunkKey::getFileID() {
+    return decode( this->key + 1 );
+}
+
+uint64_t ShinyDBChunkKey::getChunk() {
+    return decode( this->key + 1 + sizeof(uint64_t) );
+}
+
+const char * ShinyDBChunkKey::data() {
+    return this->key;
+}
+
+uint64_t ShinyDBChunkKey::size() {
+    return LEN;
+}
+
+bool ShinyDBChunkKey::isChunkKey( const char * key, uint64_t keyLen ) {
+    return keyLen == LEN && key[0] == PREFIX;
+}
+
+uint64_t ShinyDBChunkKey::decode( const char * input ) {
+    // Spelled out byte by byte so we don't care what endianness we're running on; compilers turn this into a
+    // single load and byte swap anyway
+    const unsigned char * in = (const unsigned char *) input;
+    return ((uint64_t)in[0] << 56) | ((uint64_t)in[1] << 48) | ((uint64_t)in[2] << 40) | ((uint64_t)in[3] << 32) |
+           ((uint64_t)in[4] << 24) | ((uint64_t)in[5] << 16) | ((uint64_t)in[6] << 8) | (uint64_t)in[7];
+}
+
+void ShinyDBChunkKey::encode( char * output, uint64_t value ) {
+    for( int i=7; i>=0; --i ) {
+        output[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+
+ShinyDBPin::~ShinyDBPin() {
+}
+
+
+ShinyDBView::ShinyDBView() : viewData(NULL), viewSize(0), pinOwner(NULL), pin(NULL) {
+}
+
+ShinyDBView::~ShinyDBView() {
+    this->release();
+
+    // release() keeps the pin around for reuse, but we're done with it for good now
+    delete( this->pin );
+}
+
+const char * ShinyDBView::data() {
+    return this->viewData;
+}
+
+uint64_t ShinyDBView::size() {
+    return this->viewSize;
+}
+
+void ShinyDBView::release() {
+    if( this->pin )
+        this->pin->release();
+    this->viewData = NULL;
+    this->viewSize = 0;
+}
+
+void ShinyDBView::set( const char * data, uint64_t size ) {
+    this->viewData = data;
+    this->viewSize = size;
+}
+
+ShinyDBPin * ShinyDBView::getPin( ShinyDBBackend * owner ) {
+    // Somebody else's pin is of no use to owner, so get rid of it
+    if( this->pinOwner != owner ) {
+        delete( this->pin );
+        this->pin = NULL;
+        this->pinOwner = NULL;
+    }
+    return this->pin;
+}
+
+void ShinyDBView::setPin( ShinyDBBackend * owner, ShinyDBPin * newPin ) {
+    if( this->pin != newPin )
+        delete( this->pin );
+    this->pin = newPin;
+    this->pinOwner = owner;
+}
+
+
+ShinyDBIterator::~ShinyDBIterator() {
+}
+
+bool ShinyDBIterator::at( const char * key, uint64_t keyLen ) {
+    return this->valid() && this->keySize() == keyLen && memcmp( this->key(), key, keyLen ) == 0;
+}
+
+
+ShinyDBBatch::ShinyDBBatch() : size(0) {
+}
+
+ShinyDBBatch::~ShinyDBBatch() {
+}
+
+void ShinyDBBatch::put( const char * key, const char * buffer, uint64_t size ) {
+    this->put( key, strlen(key), buffer, size );
+}
+
+void ShinyDBBatch::del( const char * key ) {
+    this->del( key, strlen(key) );
+}
+
+uint64_t ShinyDBBatch::getSize() {
+    return this->size;
+}
+
+
+ShinyDBListBatch::ShinyDBListBatch() {
+}
+
+ShinyDBListBatch::~ShinyDBListBatch() {
+}
+
+void ShinyDBListBatch::put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+    BatchOp op = { false, std::string( key, keyLen ), std::string( buffer, size ) };
+    this->ops.push_back( op );
+    this->size += keyLen + size;
+}
+
+void ShinyDBListBatch::del( const char * key, uint64_t keyLen ) {
+    BatchOp op = { true, std::string( key, keyLen ), std::string() };
+    this->ops.push_back( op );
+    this->size += keyLen;
+}
+
+void ShinyDBListBatch::clear() {
+    this->ops.clear();
+    this->size = 0;
+}
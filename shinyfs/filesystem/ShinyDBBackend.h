@@ -0,0 +1,192 @@
+#pragma once
+#ifndef shinyfs_ShinyDBBackend_h
+#define shinyfs_ShinyDBBackend_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ Everything that actually stores data for ShinyDBWrapper lives behind the ShinyDBBackend interface, so we can
+ pick the storage engine at runtime instead of at compile time.  Engines are chosen with a spec string, in the
+ form "<engine>:<path>", e.g. "leveldb:filecache", "lmdb:filecache" or "memory:".  A spec without an engine
+ prefix is taken to be a LevelDB path, so old configs keep working.
+ */
+
+class ShinyDBBackend;
+
+// File data lives in the DB in chunks, under fixed-width binary keys: a PREFIX byte, then the ID of the file and
+// the index of the chunk, both big-endian.  That way all of a file's chunks sort together and in order, the keys
+// don't care what the file is called or where it lives, and they can be built without any allocation at all.  Plain
+// bytewise order already sorts them by file and then by chunk, so every backend can use its default comparator
+class ShinyDBChunkKey {
+public:
+    static const uint64_t LEN = 1 + 2*sizeof(uint64_t);
+    static const char PREFIX = 'c';
+
+    ShinyDBChunkKey( uint64_t fileID, uint64_t chunk = 0 );
+
+    // Move the key over to another chunk of the same file
+    void setChunk( uint64_t chunk );
+
+    uint64_t getFileID();
+    uint64_t getChunk();
+
+    const char * data();
+    uint64_t size();
+
+    // Helpers for poking at raw keys, e.g. while iterating over the DB
+    static bool isChunkKey( const char * key, uint64_t keyLen );
+    static uint64_t decode( const char * input );
+    static void encode( char * output, uint64_t value );
+private:
+    char key[LEN];
+};
+
+// Whatever a backend needs to keep a value pinned in memory while a ShinyDBView is looking at it
+// (a buffer for LevelDB, a read transaction for LMDB, a reference for the in-memory engine, etc...)
+class ShinyDBPin {
+public:
+    virtual ~ShinyDBPin();
+
+    // Lets go of the currently pinned value, but hangs on to anything that can be reused by the next getView()
+    virtual void release() = 0;
+};
+
+// A borrowed, read-only view of a value living inside the DB.  Where the backend allows it, the view points
+// straight into the DB's own memory (e.g. LMDB's memory map) so nothing gets copied until the caller copies out of
+// data().  The view is only good until release() is called, the view is handed to getView()
+// again, or it dies.  Reuse one view across a bunch of gets (e.g. all the chunks of a read) to reuse its pin.
+class ShinyDBView {
+public:
+    ShinyDBView();
+    ~ShinyDBView();
+
+    // Pointer to/length of the value we're currently looking at
+    const char * data();
+    uint64_t size();
+
+    // Lets go of whatever the DB has pinned for us
+    void release();
+
+    // These are only for backends; point the view at some data, and get/set the pin that keeps it alive.
+    // getPin() only returns pins belonging to owner, so a view can be passed between different DBs safely
+    void set( const char * data, uint64_t size );
+    ShinyDBPin * getPin( ShinyDBBackend * owner );
+    void setPin( ShinyDBBackend * owner, ShinyDBPin * newPin );
+private:
+    const char * viewData;
+    uint64_t viewSize;
+
+    ShinyDBBackend * pinOwner;
+    ShinyDBPin * pin;
+};
+
+// Walks through the DB in key order, starting from wherever you seek() to.  Keys and values are borrowed just like
+// a ShinyDBView's, and are only good until the next seek()/next() or until the iterator dies.  Since all of a
+// file's chunks sit right next to each other, this lets us stream through them with a single seek, instead of a
+// full lookup per chunk.  Get one from newIterator(), and delete it when you're done
+class ShinyDBIterator {
+public:
+    virtual ~ShinyDBIterator();
+
+    // Moves to the first key that is >= key
+    virtual void seek( const char * key, uint64_t keyLen ) = 0;
+
+    // Moves on to the next key
+    virtual void next() = 0;
+
+    // Whether we're sitting on a key right now; false once we've run off the end (or something broke)
+    virtual bool valid() = 0;
+
+    // Pointer to/length of the key and value we're sitting on
+    virtual const char * key() = 0;
+    virtual uint64_t keySize() = 0;
+    virtual const char * value() = 0;
+    virtual uint64_t valueSize() = 0;
+
+    // Returns the last error that occured
+    virtual const char * getError() = 0;
+
+    // Whether we're sitting on exactly key (e.g. to check we haven't run off the end of a file into the next one)
+    bool at( const char * key, uint64_t keyLen );
+};
+
+// A bunch of puts and deletes that get applied to the DB all at once (or not at all), via ShinyDBWrapper::write().
+// Note that nothing put into a batch is visible to get() until the batch has been written! Get one from newBatch()
+class ShinyDBBatch {
+public:
+    virtual ~ShinyDBBatch();
+
+    // Queues up a put/delete, copying key and buffer so the caller can reuse them right away
+    virtual void put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) = 0;
+    virtual void del( const char * key, uint64_t keyLen ) = 0;
+
+    // Same as above, but for zero-terminated keys
+    void put( const char * key, const char * buffer, uint64_t size );
+    void del( const char * key );
+
+    // Throws away everything queued up so far
+    virtual void clear() = 0;
+
+    // Roughly how many bytes of keys and values are queued up
+    uint64_t getSize();
+protected:
+    ShinyDBBatch();
+
+    uint64_t size;
+};
+
+// The simplest batch there is, just a list of operations.  Used by backends that don't have a batch of their own,
+// and apply the list inside of a transaction instead
+class ShinyDBListBatch : public ShinyDBBatch {
+public:
+    ShinyDBListBatch();
+    ~ShinyDBListBatch();
+
+    virtual void put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size );
+    virtual void del( const char * key, uint64_t keyLen );
+    virtual void clear();
+
+    struct BatchOp {
+        bool isDelete;
+        std::string key;
+        std::string value;
+    };
+    std::vector<BatchOp> ops;
+};
+
+class ShinyDBBackend {
+/////// CREATION ///////
+public:
+    // Opens up the engine named in spec (see the top of this file), throws if the engine is unknown or won't open
+    static ShinyDBBackend * open( const char * spec );
+
+    virtual ~ShinyDBBackend();
+
+    // Returns the name of this engine, e.g. "leveldb"
+    virtual const char * getName() = 0;
+
+/////// DATA ///////
+public:
+    // Points view at the value stored under key without copying it, returns false if it isn't there
+    virtual bool getView( const char * key, uint64_t keyLen, ShinyDBView * view ) = 0;
+
+    // Stores/removes a single value. Deleting something that isn't there is not an error
+    virtual bool put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) = 0;
+    virtual bool del( const char * key, uint64_t keyLen ) = 0;
+
+    // Creates a new iterator, not pointing at anything until it's been seek()'ed
+    virtual ShinyDBIterator * newIterator() = 0;
+
+    // Creates a new, empty batch that this backend knows how to write()
+    virtual ShinyDBBatch * newBatch() = 0;
+
+    // Applies everything in batch atomically.  Returns false on failure, in which case none of it happened
+    virtual bool write( ShinyDBBatch * batch ) = 0;
+
+    // Returns the last error that occured on the calling thread (every thread gets its own, since they all share us)
+    virtual const char * getError() = 0;
+};
+
+#endif // shinyfs_ShinyDBBackend_h
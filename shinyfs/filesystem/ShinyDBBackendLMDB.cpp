@@ -0,0 +1,257 @@
+//
+//  ShinyDBBackendLMDB.cpp
+//  shinyfs
+//
+
+#include "ShinyDBBackendLMDB.h"
+#ifdef LMDB
+#include <base/Logger.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+// A view's pin is a read transaction, which keeps the pages it's looking at from being recycled.  On release we
+// only reset the transaction, so the next getView() can renew it instead of grabbing a fresh reader slot
+class ShinyDBLMDBPin : public ShinyDBPin {
+public:
+    ShinyDBLMDBPin( MDB_txn * txn ) : txn(txn), active(true) {
+    }
+
+    ~ShinyDBLMDBPin() {
+        mdb_txn_abort( this->txn );
+    }
+
+    virtual void release() {
+        if( this->active ) {
+            mdb_txn_reset( this->txn );
+            this->active = false;
+        }
+    }
+
+    MDB_txn * txn;
+    bool active;
+};
+
+// A cursor, living inside its very own read transaction.  Everything it points at is straight out of the map, and
+// stays put for as long as the transaction is open, no matter who writes what in the meantime
+class ShinyDBLMDBIterator : public ShinyDBIterator {
+public:
+    ShinyDBLMDBIterator( MDB_env * env, MDB_dbi dbi ) : txn(NULL), cursor(NULL), rc(MDB_NOTFOUND) {
+        if( (this->rc = mdb_txn_begin( env, NULL, MDB_RDONLY, &this->txn )) != MDB_SUCCESS ) {
+            this->txn = NULL;
+            return;
+        }
+        if( (this->rc = mdb_cursor_open( this->txn, dbi, &this->cursor )) != MDB_SUCCESS )
+            this->cursor = NULL;
+        
+        // Not valid 'till somebody seeks
+        this->rc = MDB_NOTFOUND;
+    }
+
+    ~ShinyDBLMDBIterator() {
+        if( this->cursor )
+            mdb_cursor_close( this->cursor );
+        if( this->txn )
+            mdb_txn_abort( this->txn );
+    }
+
+    virtual void seek( const char * key, uint64_t keyLen ) {
+        if( !this->cursor )
+            return;
+        this->currKey.mv_size = keyLen;
+        this->currKey.mv_data = (void *)key;
+        this->rc = mdb_cursor_get( this->cursor, &this->currKey, &this->currValue, MDB_SET_RANGE );
+    }
+
+    virtual void next() {
+        if( this->cursor && this->rc == MDB_SUCCESS )
+            this->rc = mdb_cursor_get( this->cursor, &this->currKey, &this->currValue, MDB_NEXT );
+    }
+
+    virtual bool valid() {
+        return this->rc == MDB_SUCCESS;
+    }
+
+    virtual const char * key() {
+        return (const char *)this->currKey.mv_data;
+    }
+
+    virtual uint64_t keySize() {
+        return this->currKey.mv_size;
+    }
+
+    virtual const char * value() {
+        return (const char *)this->currValue.mv_data;
+    }
+
+    virtual uint64_t valueSize() {
+        return this->currValue.mv_size;
+    }
+
+    virtual const char * getError() {
+        return mdb_strerror( this->rc );
+    }
+private:
+    MDB_txn * txn;
+    MDB_cursor * cursor;
+    MDB_val currKey;
+    MDB_val currValue;
+    int rc;
+};
+
+
+ShinyDBBackendLMDB::ShinyDBBackendLMDB( const char * path ) : env(NULL) {
+    // LMDB wants a directory to put its data and lock files into
+    if( mkdir( path, 0755 ) != 0 && errno != EEXIST ) {
+        ERROR( "Unable to create filecache directory %s", path );
+        throw "Unable to open filecache";
+    }
+    pthread_key_create( &this->errorKey, NULL );
+
+    // NOTLS lets one thread have more than one view out at a time, and NOSYNC matches the durability we get out
+    // of LevelDB's default (non-sync) writes; the OS gets around to flushing, but a crash won't corrupt anything
+    int rc;
+    if( (rc = mdb_env_create( &this->env )) != MDB_SUCCESS ||
+        (rc = mdb_env_set_mapsize( this->env, MAPSIZE )) != MDB_SUCCESS ||
+        (rc = mdb_env_set_maxreaders( this->env, MAXREADERS )) != MDB_SUCCESS ||
+        (rc = mdb_env_open( this->env, path, MDB_NOTLS | MDB_NOSYNC, 0644 )) != MDB_SUCCESS ) {
+        ERROR( "Unable to open filecache in %s: %s", path, mdb_strerror( rc ) );
+        if( this->env )
+            mdb_env_close( this->env );
+        pthread_key_delete( this->errorKey );
+        throw "Unable to open filecache";
+    }
+
+    // Open up the main (unnamed) database once; the handle is good for the life of the environment
+    MDB_txn * txn;
+    if( (rc = mdb_txn_begin( this->env, NULL, 0, &txn )) != MDB_SUCCESS ||
+        (rc = mdb_dbi_open( txn, NULL, 0, &this->dbi )) != MDB_SUCCESS ||
+        (rc = mdb_txn_commit( txn )) != MDB_SUCCESS ) {
+        ERROR( "Unable to open database in %s: %s", path, mdb_strerror( rc ) );
+        mdb_env_close( this->env );
+        pthread_key_delete( this->errorKey );
+        throw "Unable to open filecache";
+    }
+}
+
+ShinyDBBackendLMDB::~ShinyDBBackendLMDB() {
+    mdb_env_close( this->env );
+    pthread_key_delete( this->errorKey );
+}
+
+const char * ShinyDBBackendLMDB::getName() {
+    return "lmdb";
+}
+
+bool ShinyDBBackendLMDB::getView( const char * key, uint64_t keyLen, ShinyDBView * view ) {
+    view->release();
+    int rc;
+
+    ShinyDBLMDBPin * pin = (ShinyDBLMDBPin *) view->getPin( this );
+    if( pin ) {
+        if( (rc = mdb_txn_renew( pin->txn )) != MDB_SUCCESS )
+            return this->setError( rc );
+        pin->active = true;
+    } else {
+        MDB_txn * txn;
+        if( (rc = mdb_txn_begin( this->env, NULL, MDB_RDONLY, &txn )) != MDB_SUCCESS )
+            return this->setError( rc );
+        pin = new ShinyDBLMDBPin( txn );
+        view->setPin( this, pin );
+    }
+
+    MDB_val mkey = { keyLen, (void *)key };
+    MDB_val mdata;
+    if( (rc = mdb_get( pin->txn, this->dbi, &mkey, &mdata )) != MDB_SUCCESS ) {
+        pin->release();
+        return this->setError( rc );
+    }
+
+    // Straight out of the memory map!
+    view->set( (const char *)mdata.mv_data, mdata.mv_size );
+    return this->setError( rc );
+}
+
+bool ShinyDBBackendLMDB::put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+    int rc;
+    MDB_txn * txn;
+    if( (rc = mdb_txn_begin( this->env, NULL, 0, &txn )) != MDB_SUCCESS )
+        return this->setError( rc );
+
+    MDB_val mkey = { keyLen, (void *)key };
+    MDB_val mdata = { size, (void *)buffer };
+    if( (rc = mdb_put( txn, this->dbi, &mkey, &mdata, 0 )) != MDB_SUCCESS ) {
+        mdb_txn_abort( txn );
+        return this->setError( rc );
+    }
+
+    rc = mdb_txn_commit( txn );
+    return this->setError( rc );
+}
+
+bool ShinyDBBackendLMDB::del( const char * key, uint64_t keyLen ) {
+    int rc;
+    MDB_txn * txn;
+    if( (rc = mdb_txn_begin( this->env, NULL, 0, &txn )) != MDB_SUCCESS )
+        return this->setError( rc );
+
+    MDB_val mkey = { keyLen, (void *)key };
+    rc = mdb_del( txn, this->dbi, &mkey, NULL );
+    if( rc != MDB_SUCCESS && rc != MDB_NOTFOUND ) {
+        mdb_txn_abort( txn );
+        return this->setError( rc );
+    }
+
+    rc = mdb_txn_commit( txn );
+    return this->setError( rc );
+}
+
+ShinyDBIterator * ShinyDBBackendLMDB::newIterator() {
+    return new ShinyDBLMDBIterator( this->env, this->dbi );
+}
+
+ShinyDBBatch * ShinyDBBackendLMDB::newBatch() {
+    return new ShinyDBListBatch();
+}
+
+bool ShinyDBBackendLMDB::write( ShinyDBBatch * batch ) {
+    int rc;
+    std::vector<ShinyDBListBatch::BatchOp> & ops = ((ShinyDBListBatch *)batch)->ops;
+
+    MDB_txn * txn;
+    if( (rc = mdb_txn_begin( this->env, NULL, 0, &txn )) != MDB_SUCCESS )
+        return this->setError( rc );
+
+    for( uint64_t i=0; i<ops.size(); ++i ) {
+        MDB_val mkey = { ops[i].key.size(), (void *)ops[i].key.data() };
+        if( ops[i].isDelete ) {
+            // Deleting something that isn't there is just fine by us
+            rc = mdb_del( txn, this->dbi, &mkey, NULL );
+            if( rc == MDB_NOTFOUND )
+                rc = MDB_SUCCESS;
+        } else {
+            MDB_val mdata = { ops[i].value.size(), (void *)ops[i].value.data() };
+            rc = mdb_put( txn, this->dbi, &mkey, &mdata, 0 );
+        }
+
+        // Roll the whole thing back if anything goes wrong
+        if( rc != MDB_SUCCESS ) {
+            mdb_txn_abort( txn );
+            return this->setError( rc );
+        }
+    }
+
+    rc = mdb_txn_commit( txn );
+    return this->setError( rc );
+}
+
+bool ShinyDBBackendLMDB::setError( int rc ) {
+    // A return code fits right in the slot, no need to allocate anything
+    pthread_setspecific( this->errorKey, (void *)(intptr_t)rc );
+    return rc == MDB_SUCCESS;
+}
+
+const char * ShinyDBBackendLMDB::getError() {
+    return mdb_strerror( (int)(intptr_t)pthread_getspecific( this->errorKey ) );
+}
+
+#endif // LMDB
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef shinyfs_ShinyDBBackendLMDB_h
+#define shinyfs_ShinyDBBackendLMDB_h
+
+#include "ShinyDBBackend.h"
+
+#ifdef LMDB
+#include <lmdb.h>
+#include <pthread.h>
+
+// A copy-on-write B+tree living in one big memory map.  Reads are about as cheap as they get (a view is just a
+// pointer into the map, held steady by a read transaction), writes are slower than LevelDB but never stall on
+// compaction.  Note that path is a directory, and that keys can be no longer than 511 bytes
+class ShinyDBBackendLMDB : public ShinyDBBackend {
+public:
+    ShinyDBBackendLMDB( const char * path );
+    ~ShinyDBBackendLMDB();
+
+    virtual const char * getName();
+
+    virtual bool getView( const char * key, uint64_t keyLen, ShinyDBView * view );
+    virtual bool put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size );
+    virtual bool del( const char * key, uint64_t keyLen );
+
+    virtual ShinyDBIterator * newIterator();
+    virtual ShinyDBBatch * newBatch();
+    virtual bool write( ShinyDBBatch * batch );
+
+    virtual const char * getError();
+private:
+    // How big the map is allowed to get.  This is just address space, the file only grows as we fill it up
+    static const uint64_t MAPSIZE = 1ULL << 40;
+
+    // Upper bound on how many views can be out at once, since every view is holding a read transaction
+    static const unsigned int MAXREADERS = 1024;
+
+    MDB_env * env;
+    MDB_dbi dbi;
+
+    // Last return code each thread got from LMDB, for getError().  Every thread using us gets its own, so one
+    // thread's failure never turns up in another's getError().  setError() remembers rc, and returns whether it's
+    // a success
+    pthread_key_t errorKey;
+    bool setError( int rc );
+};
+
+#endif // LMDB
+#endif // shinyfs_ShinyDBBackendLMDB_h
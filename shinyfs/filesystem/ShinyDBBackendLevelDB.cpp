@@ -0,0 +1,185 @@
+//
+//  ShinyDBBackendLevelDB.cpp
+//  shinyfs
+//
+
+#include "ShinyDBBackendLevelDB.h"
+#ifdef LEVELDB
+#include <base/Logger.h>
+#include <leveldb/filter_policy.h>
+
+// LevelDB already has a perfectly good batch, so we just wrap it
+class ShinyDBLevelDBBatch : public ShinyDBBatch {
+public:
+    virtual void put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+        this->batch.Put( leveldb::Slice( key, keyLen ), leveldb::Slice( buffer, size ) );
+        this->size += keyLen + size;
+    }
+
+    virtual void del( const char * key, uint64_t keyLen ) {
+        this->batch.Delete( leveldb::Slice( key, keyLen ) );
+        this->size += keyLen;
+    }
+
+    virtual void clear() {
+        this->batch.Clear();
+        this->size = 0;
+    }
+
+    leveldb::WriteBatch batch;
+};
+
+// LevelDB has no way of handing out a value without copying it (short of an iterator, which skips the bloom filters
+// and sticks with whatever the DB looked like when it was made), so Get() copies into a buffer the pin hangs on to.
+// Reusing the view reuses the buffer, so that's one memcpy per get and no allocation once it's big enough
+class ShinyDBLevelDBPin : public ShinyDBPin {
+public:
+    virtual void release() {
+        // Nothing to do, the next Get() just writes over the old value
+    }
+
+    std::string value;
+};
+
+// Just a thin coat of paint over LevelDB's own iterator
+class ShinyDBLevelDBIterator : public ShinyDBIterator {
+public:
+    ShinyDBLevelDBIterator( leveldb::Iterator * it ) : it(it) {
+    }
+
+    ~ShinyDBLevelDBIterator() {
+        delete( this->it );
+    }
+
+    virtual void seek( const char * key, uint64_t keyLen ) {
+        this->it->Seek( leveldb::Slice( key, keyLen ) );
+    }
+
+    virtual void next() {
+        this->it->Next();
+    }
+
+    virtual bool valid() {
+        return this->it->Valid();
+    }
+
+    virtual const char * key() {
+        return this->it->key().data();
+    }
+
+    virtual uint64_t keySize() {
+        return this->it->key().size();
+    }
+
+    virtual const char * value() {
+        return this->it->value().data();
+    }
+
+    virtual uint64_t valueSize() {
+        return this->it->value().size();
+    }
+
+    virtual const char * getError() {
+        this->error = this->it->status().ToString();
+        return this->error.c_str();
+    }
+
+    leveldb::Iterator * it;
+    std::string error;
+};
+
+
+ShinyDBBackendLevelDB::ShinyDBBackendLevelDB( const char * path ) {
+    pthread_key_create( &this->errorKey, &ShinyDBBackendLevelDB::freeError );
+    leveldb::Options options;
+    options.create_if_missing = true;
+
+    // Holes, dedup lookups and delta checks all ask for keys that aren't there, so let Get() rule them out without
+    // reading any blocks.  Tables written before this just don't have a filter, which LevelDB copes with fine
+    this->filterPolicy = leveldb::NewBloomFilterPolicy( 10 );
+    options.filter_policy = this->filterPolicy;
+    leveldb::Status status = leveldb::DB::Open( options, path, &this->db );
+    if( !status.ok() ) {
+        ERROR( "Unable to open filecache in %s: %s", path, status.ToString().c_str() );
+        delete( this->filterPolicy );
+        pthread_key_delete( this->errorKey );
+        throw "Unable to open filecache";
+    }
+}
+
+ShinyDBBackendLevelDB::~ShinyDBBackendLevelDB() {
+    delete( this->db );
+    delete( this->filterPolicy );
+
+    // Only our own thread's status can be cleaned up from here, anyone else's goes when their thread does
+    freeError( pthread_getspecific( this->errorKey ) );
+    pthread_key_delete( this->errorKey );
+}
+
+const char * ShinyDBBackendLevelDB::getName() {
+    return "leveldb";
+}
+
+bool ShinyDBBackendLevelDB::getView( const char * key, uint64_t keyLen, ShinyDBView * view ) {
+    view->release();
+
+    ShinyDBLevelDBPin * pin = (ShinyDBLevelDBPin *) view->getPin( this );
+    if( !pin ) {
+        pin = new ShinyDBLevelDBPin();
+        view->setPin( this, pin );
+    }
+
+    if( !this->setStatus( this->db->Get( leveldb::ReadOptions(), leveldb::Slice( key, keyLen ), &pin->value ) ) )
+        return false;
+    view->set( pin->value.data(), pin->value.size() );
+    return true;
+}
+
+bool ShinyDBBackendLevelDB::put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+    return this->setStatus( this->db->Put( leveldb::WriteOptions(), leveldb::Slice( key, keyLen ), leveldb::Slice( buffer, size ) ) );
+}
+
+bool ShinyDBBackendLevelDB::del( const char * key, uint64_t keyLen ) {
+    return this->setStatus( this->db->Delete( leveldb::WriteOptions(), leveldb::Slice( key, keyLen ) ) );
+}
+
+ShinyDBIterator * ShinyDBBackendLevelDB::newIterator() {
+    return new ShinyDBLevelDBIterator( this->db->NewIterator( leveldb::ReadOptions() ) );
+}
+
+ShinyDBBatch * ShinyDBBackendLevelDB::newBatch() {
+    return new ShinyDBLevelDBBatch();
+}
+
+bool ShinyDBBackendLevelDB::write( ShinyDBBatch * batch ) {
+    return this->setStatus( this->db->Write( leveldb::WriteOptions(), &((ShinyDBLevelDBBatch *)batch)->batch ) );
+}
+
+bool ShinyDBBackendLevelDB::setStatus( const leveldb::Status & status ) {
+    ThreadStatus * threadStatus = (ThreadStatus *) pthread_getspecific( this->errorKey );
+    if( !threadStatus ) {
+        // Nothing's gone wrong on this thread yet, so there's nothing to remember
+        if( status.ok() )
+            return true;
+        threadStatus = new ThreadStatus;
+        pthread_setspecific( this->errorKey, threadStatus );
+    }
+    threadStatus->status = status;
+    return status.ok();
+}
+
+void ShinyDBBackendLevelDB::freeError( void * threadStatus ) {
+    delete( (ThreadStatus *) threadStatus );
+}
+
+const char * ShinyDBBackendLevelDB::getError() {
+    ThreadStatus * threadStatus = (ThreadStatus *) pthread_getspecific( this->errorKey );
+    if( !threadStatus )
+        return "OK";
+
+    // Gotta keep the string around somewhere, or we'd be handing out a pointer into a temporary
+    threadStatus->error = threadStatus->status.ToString();
+    return threadStatus->error.c_str();
+}
+
+#endif // LEVELDB
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef shinyfs_ShinyDBBackendLevelDB_h
+#define shinyfs_ShinyDBBackendLevelDB_h
+
+#include "ShinyDBBackend.h"
+
+#ifdef LEVELDB
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <pthread.h>
+
+// The LSM-tree engine we've been using all along.  Great at soaking up writes, though views are a copy of the value
+// (into a buffer the view reuses), since LevelDB's Get() has no way to hand out its own memory
+class ShinyDBBackendLevelDB : public ShinyDBBackend {
+public:
+    ShinyDBBackendLevelDB( const char * path );
+    ~ShinyDBBackendLevelDB();
+
+    virtual const char * getName();
+
+    virtual bool getView( const char * key, uint64_t keyLen, ShinyDBView * view );
+    virtual bool put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size );
+    virtual bool del( const char * key, uint64_t keyLen );
+
+    virtual ShinyDBIterator * newIterator();
+    virtual ShinyDBBatch * newBatch();
+    virtual bool write( ShinyDBBatch * batch );
+
+    virtual const char * getError();
+private:
+    leveldb::DB * db;
+    const leveldb::FilterPolicy * filterPolicy;
+
+    // The last status each thread got from LevelDB, and where getError() keeps the string it hands out.  Every
+    // thread using us gets its own, so one thread's failure never turns up in another's getError().  setStatus()
+    // remembers status, and returns whether it's ok
+    struct ThreadStatus {
+        leveldb::Status status;
+        std::string error;
+    };
+    pthread_key_t errorKey;
+    bool setStatus( const leveldb::Status & status );
+    static void freeError( void * threadStatus );
+};
+
+#endif // LEVELDB
+#endif // shinyfs_ShinyDBBackendLevelDB_h
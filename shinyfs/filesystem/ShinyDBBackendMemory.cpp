@@ -0,0 +1,158 @@
+//
+//  ShinyDBBackendMemory.cpp
+//  shinyfs
+//
+
+#include "ShinyDBBackendMemory.h"
+
+// The pin for a memory view is just a reference on the value, so it can't disappear out from under us
+class ShinyDBMemoryPin : public ShinyDBPin {
+public:
+    virtual void release() {
+        this->value.reset();
+    }
+
+    std::shared_ptr<const std::string> value;
+};
+
+// std::map iterators don't survive somebody else erasing what they point at, so instead of holding on to one,
+// we remember the key we're at (and hold a reference on its value), and look up where to go next every time
+class ShinyDBMemoryIterator : public ShinyDBIterator {
+public:
+    ShinyDBMemoryIterator( ShinyDBBackendMemory * db ) : db(db) {
+    }
+
+    virtual void seek( const char * key, uint64_t keyLen ) {
+        pthread_rwlock_rdlock( &db->lock );
+        this->load( db->store.lower_bound( std::string( key, keyLen ) ) );
+        pthread_rwlock_unlock( &db->lock );
+    }
+
+    virtual void next() {
+        pthread_rwlock_rdlock( &db->lock );
+        this->load( db->store.upper_bound( this->currKey ) );
+        pthread_rwlock_unlock( &db->lock );
+    }
+
+    virtual bool valid() {
+        return (bool) this->currValue;
+    }
+
+    virtual const char * key() {
+        return this->currKey.data();
+    }
+
+    virtual uint64_t keySize() {
+        return this->currKey.size();
+    }
+
+    virtual const char * value() {
+        return this->currValue->data();
+    }
+
+    virtual uint64_t valueSize() {
+        return this->currValue->size();
+    }
+
+    virtual const char * getError() {
+        return "OK";
+    }
+private:
+    // Grab the key/value that itty points at (must be called with the lock held)
+    void load( ShinyDBBackendMemory::Store::iterator itty ) {
+        if( itty != db->store.end() ) {
+            this->currKey = (*itty).first;
+            this->currValue = (*itty).second;
+        } else
+            this->currValue.reset();
+    }
+
+    ShinyDBBackendMemory * db;
+    std::string currKey;
+    ShinyDBBackendMemory::Value currValue;
+};
+
+
+ShinyDBBackendMemory::ShinyDBBackendMemory() {
+    pthread_rwlock_init( &this->lock, NULL );
+}
+
+ShinyDBBackendMemory::~ShinyDBBackendMemory() {
+    pthread_rwlock_destroy( &this->lock );
+}
+
+const char * ShinyDBBackendMemory::getName() {
+    return "memory";
+}
+
+bool ShinyDBBackendMemory::getView( const char * key, uint64_t keyLen, ShinyDBView * view ) {
+    view->release();
+
+    ShinyDBMemoryPin * pin = (ShinyDBMemoryPin *) view->getPin( this );
+    if( !pin ) {
+        pin = new ShinyDBMemoryPin();
+        view->setPin( this, pin );
+    }
+
+    pthread_rwlock_rdlock( &this->lock );
+    Store::iterator itty = this->store.find( std::string( key, keyLen ) );
+    if( itty != this->store.end() )
+        pin->value = (*itty).second;
+    pthread_rwlock_unlock( &this->lock );
+
+    if( !pin->value )
+        return false;
+    view->set( pin->value->data(), pin->value->size() );
+    return true;
+}
+
+bool ShinyDBBackendMemory::put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+    // Do the copy outside of the lock, no need to make everyone else wait on a memcpy
+    Value value( new std::string( buffer, size ) );
+
+    pthread_rwlock_wrlock( &this->lock );
+    this->store[std::string( key, keyLen )] = value;
+    pthread_rwlock_unlock( &this->lock );
+    return true;
+}
+
+bool ShinyDBBackendMemory::del( const char * key, uint64_t keyLen ) {
+    pthread_rwlock_wrlock( &this->lock );
+    this->store.erase( std::string( key, keyLen ) );
+    pthread_rwlock_unlock( &this->lock );
+    return true;
+}
+
+ShinyDBIterator * ShinyDBBackendMemory::newIterator() {
+    return new ShinyDBMemoryIterator( this );
+}
+
+ShinyDBBatch * ShinyDBBackendMemory::newBatch() {
+    return new ShinyDBListBatch();
+}
+
+bool ShinyDBBackendMemory::write( ShinyDBBatch * batch ) {
+    std::vector<ShinyDBListBatch::BatchOp> & ops = ((ShinyDBListBatch *)batch)->ops;
+
+    // Build all the values up front, then swap them all in under one lock so nobody sees half a batch
+    std::vector<Value> values( ops.size() );
+    for( uint64_t i=0; i<ops.size(); ++i ) {
+        if( !ops[i].isDelete )
+            values[i].reset( new std::string( ops[i].value ) );
+    }
+
+    pthread_rwlock_wrlock( &this->lock );
+    for( uint64_t i=0; i<ops.size(); ++i ) {
+        if( ops[i].isDelete )
+            this->store.erase( ops[i].key );
+        else
+            this->store[ops[i].key] = values[i];
+    }
+    pthread_rwlock_unlock( &this->lock );
+    return true;
+}
+
+const char * ShinyDBBackendMemory::getError() {
+    // Nothing can go wrong here, we're just a map!
+    return "OK";
+}
@@ -0,0 +1,39 @@
+#pragma once
+#ifndef shinyfs_ShinyDBBackendMemory_h
+#define shinyfs_ShinyDBBackendMemory_h
+
+#include "ShinyDBBackend.h"
+#include <pthread.h>
+#include <map>
+#include <memory>
+
+// Keeps everything in a big sorted map in RAM.  Nothing survives a restart, so this is really only for tests,
+// benchmarks, and scratch filesystems.  Values are reference counted, so a view stays valid even if somebody
+// overwrites or deletes the value it's looking at.
+class ShinyDBBackendMemory : public ShinyDBBackend {
+friend class ShinyDBMemoryIterator;
+public:
+    ShinyDBBackendMemory();
+    ~ShinyDBBackendMemory();
+
+    virtual const char * getName();
+
+    virtual bool getView( const char * key, uint64_t keyLen, ShinyDBView * view );
+    virtual bool put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size );
+    virtual bool del( const char * key, uint64_t keyLen );
+
+    virtual ShinyDBIterator * newIterator();
+    virtual ShinyDBBatch * newBatch();
+    virtual bool write( ShinyDBBatch * batch );
+
+    virtual const char * getError();
+private:
+    typedef std::shared_ptr<const std::string> Value;
+    typedef std::map<std::string, Value> Store;
+
+    // Lots of readers, or one writer at a time
+    pthread_rwlock_t lock;
+    Store store;
+};
+
+#endif // shinyfs_ShinyDBBackendMemory_h
@@ -8,78 +8,74 @@
 
 #include "ShinyDBWrapper.h"
 #include <base/Logger.h>
+#include <string.h>
 
 #define min( x, y ) ((x) > (y)? (y) : (x))
 
-ShinyDBWrapper::ShinyDBWrapper( const char * path ) {
-#ifdef KYOTOCABINET
-    if( !this->db.open( path, kyotocabinet::PolyDB::OWRITER | kyotocabinet::PolyDB::OCREATE ) ) {
-        ERROR( "Unable to open filecache in %s", filecache );
-        throw "Unable to open filecache";
-    }
-#endif
-#ifdef LEVELDB
-    leveldb::Options options;
-    options.create_if_missing = true;
-    this->status = leveldb::DB::Open( options, path, &this->db );
-    if( !this->status.ok() ) {
-        ERROR( "Unable to open filecache in %s", path );
-        throw "Unable to open filecache";
-    }
-#endif
+ShinyDBWrapper::ShinyDBWrapper( const char * spec ) {
+    this->backend = ShinyDBBackend::open( spec );
+    LOG( "Opened %s filecache from %s", this->backend->getName(), spec );
 }
 
 ShinyDBWrapper::~ShinyDBWrapper() {
-#ifdef KYOTOCABINET
-    this->db.close();
-#endif
-#ifdef LEVELDB
-    delete db;
-#endif
+    delete( this->backend );
 }
 
 uint64_t ShinyDBWrapper::get(const char *key, char *buffer, uint64_t maxsize) {
-#ifdef KYOTOCABINET
-    return this->db.get( key, strlen(key), buffer, maxsize );
-#endif
-#ifdef LEVELDB
-    std::string stupidDBBuffer;
-    status = this->db->Get( leveldb::ReadOptions(), key, &stupidDBBuffer );
-    if( status.ok() ) {
-        uint64_t len = min(maxsize, stupidDBBuffer.length());
-        memcpy( buffer, stupidDBBuffer.c_str(), len );
-        return len;
-    }
-    return -1;
-#endif
+    return this->get( key, strlen(key), buffer, maxsize );
+}
+
+uint64_t ShinyDBWrapper::get( const char * key, uint64_t keyLen, char * buffer, uint64_t maxsize ) {
+    // Go through a view, so the only copy made is the one straight into buffer
+    ShinyDBView view;
+    if( !this->getView( key, keyLen, &view ) )
+        return -1;
+
+    uint64_t len = min(maxsize, view.size());
+    memcpy( buffer, view.data(), len );
+    return len;
+}
+
+bool ShinyDBWrapper::getView( const char * key, ShinyDBView * view ) {
+    return this->backend->getView( key, strlen(key), view );
+}
+
+bool ShinyDBWrapper::getView( const char * key, uint64_t keyLen, ShinyDBView * view ) {
+    return this->backend->getView( key, keyLen, view );
 }
 
 uint64_t ShinyDBWrapper::put(const char *key, const char *buffer, uint64_t size) {
-#ifdef KYOTOCABINET
-    return this->db.set( key, strlen(key), buffer, maxsize );
-#endif
-#ifdef LEVELDB
-    leveldb::Slice buffSlice( buffer, size );
-    status = this->db->Put( leveldb::WriteOptions(), key, buffSlice );
-    return status.ok() ? size : -1;
-#endif
+    return this->put( key, strlen(key), buffer, size );
+}
+
+uint64_t ShinyDBWrapper::put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size ) {
+    return this->backend->put( key, keyLen, buffer, size ) ? size : -1;
 }
 
 bool ShinyDBWrapper::del(const char *key) {
-#ifdef KYOTOCABINET
-    return db.remove( key, strlen(key) );
-#endif
-#ifdef LEVELDB
-    status = db->Delete( leveldb::WriteOptions(), key );
-    return status.ok();
-#endif
+    return this->backend->del( key, strlen(key) );
+}
+
+bool ShinyDBWrapper::del( const char * key, uint64_t keyLen ) {
+    return this->backend->del( key, keyLen );
+}
+
+ShinyDBIterator * ShinyDBWrapper::newIterator() {
+    return this->backend->newIterator();
+}
+
+ShinyDBBatch * ShinyDBWrapper::newBatch() {
+    return this->backend->newBatch();
+}
+
+bool ShinyDBWrapper::write( ShinyDBBatch * batch ) {
+    return this->backend->write( batch );
 }
 
 const char * ShinyDBWrapper::getError() {
-#ifdef KYOTOCABINET
-    return this->db.error().name();
-#endif
-#ifdef LEVELDB
-    return this->status.ToString().c_str();
-#endif
-}
\ No newline at end of file
+    return this->backend->getError();
+}
+
+const char * ShinyDBWrapper::getEngine() {
+    return this->backend->getName();
+}
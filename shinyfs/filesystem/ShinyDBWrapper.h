@@ -2,43 +2,48 @@
 #define shinyfs_ShinyDBWrapper_h
 
 #include <stdint.h>
+#include "ShinyDBBackend.h"
 
-#ifdef KYOTOCABINET
-#include <kcpolydb.h>
-#endif
-
-#ifdef LEVELDB
-#include <leveldb/db.h>
-#endif
-
-#if !defined(KYOTOCABINET)
-#if !defined(LEVELDB)
-#warning "No database backend selected!"
-#endif
-#endif
-
+// The front door to the DB.  All the real work is done by whichever ShinyDBBackend the spec we were opened with
+// picked out (see ShinyDBBackend.h), so the rest of shinyfs doesn't have to know or care what's storing its data
 class ShinyDBWrapper {
 public:
-    ShinyDBWrapper( const char * path );
+    // spec is "<engine>:<path>", e.g. "leveldb:filecache", "lmdb:filecache" or "memory:"; a plain path means LevelDB
+    ShinyDBWrapper( const char * spec );
     ~ShinyDBWrapper();
-    
+
     // Assumes key is zero-terminated
     uint64_t get( const char * key, char * buffer, uint64_t maxsize );
     uint64_t put( const char * key, const char * buffer, uint64_t size );
     bool del( const char * key );
-    
-    // Returns the last error that occured
+
+    // Same as above, but for binary keys (like ShinyDBChunkKey) that can't be zero-terminated
+    uint64_t get( const char * key, uint64_t keyLen, char * buffer, uint64_t maxsize );
+    uint64_t put( const char * key, uint64_t keyLen, const char * buffer, uint64_t size );
+    bool del( const char * key, uint64_t keyLen );
+
+    // Points view at the value stored under key without copying it, returns false if it isn't there
+    bool getView( const char * key, ShinyDBView * view );
+    bool getView( const char * key, uint64_t keyLen, ShinyDBView * view );
+
+    // Creates an iterator for walking through keys in order, caller is responsible for deleting it
+    ShinyDBIterator * newIterator();
+
+    // Creates an empty batch for use with write(), caller is responsible for deleting it
+    ShinyDBBatch * newBatch();
+
+    // Applies everything in batch atomically. Returns false on failure, in which case none of the batch
+    // made it into the DB.  The batch is left untouched either way.
+    bool write( ShinyDBBatch * batch );
+
+    // Returns the last error that occured on the calling thread
     const char * getError();
+
+    // Returns the name of the engine we're running on top of
+    const char * getEngine();
 private:
-#ifdef KYOTOCABINET
-    kyotocabinet::PolyDB db;
-#endif // KYOTOCABINET
-    
-#ifdef LEVELDB
-    leveldb::DB * db;
-    leveldb::Status status;
-#endif // LEVELDB
+    ShinyDBBackend * backend;
 };
 
 
-#endif // shinyfs_ShinyDBWrapper_h
\ No newline at end of file
+#endif // shinyfs_ShinyDBWrapper_h
@@ -0,0 +1,488 @@
+//
+//  ShinyFileHistory.cpp
+//  shinyfs
+//
+
+#include "ShinyFileHistory.h"
+#include "../util/ShinyDelta.h"
+#include <base/Logger.h>
+#include <string.h>
+#include <sys/time.h>
+#include <map>
+
+#define min( x, y ) ((x) > (y) ? (y) : (x))
+
+// Keys are in microseconds, so two versions saved in the same second still get keys of their own
+#define USECS           1000000ULL
+
+// Versions go under PREFIX, then the history ID and the time they were saved (in microseconds), both big-endian, so
+// a file's versions all sort together, oldest first
+class ShinyVersionKey {
+public:
+    static const uint64_t LEN = 1 + 2*sizeof(uint64_t);
+    static const char PREFIX = 'v';
+
+    ShinyVersionKey( uint64_t historyID, uint64_t when = 0 ) {
+        this->key[0] = PREFIX;
+        ShinyDBChunkKey::encode( this->key + 1, historyID );
+        ShinyDBChunkKey::encode( this->key + 1 + sizeof(uint64_t), when );
+    }
+
+    const char * data() {
+        return this->key;
+    }
+
+    uint64_t size() {
+        return LEN;
+    }
+
+    static bool isVersionKey( const char * key, uint64_t keyLen ) {
+        return keyLen == LEN && key[0] == PREFIX;
+    }
+private:
+    char key[LEN];
+};
+
+// Every version's value starts off with its kind, then its length, chunk size and clone ID (0 unless it's a
+// KIND_CLONE), and whatever comes after that is its data (KIND_INLINE) or delta (KIND_DELTA)
+static const uint64_t VALUE_HEADER_LEN = 1 + 3*sizeof(uint64_t);
+
+static uint64_t now() {
+    struct timeval tv;
+    gettimeofday( &tv, NULL );
+    return (uint64_t)tv.tv_sec*USECS + tv.tv_usec;
+}
+
+
+ShinyFileHistory::ShinyFileHistory( ShinyChunkStore * store, ShinyChunkReclaimer * reclaimer ) : store(store), reclaimer(reclaimer), stopping(false), sweeping(false), sweepEndID(0), threadStarted(false) {
+    pthread_mutex_init( &this->readLock, NULL );
+    pthread_mutex_init( &this->mutex, NULL );
+    pthread_cond_init( &this->cond, NULL );
+
+    // Without the thread, versions still get saved, they just never get turned into deltas or trimmed
+    if( pthread_create( &this->thread, NULL, &ShinyFileHistory::historyLoop, this ) == 0 )
+        this->threadStarted = true;
+    else
+        ERROR( "Could not start file history thread, old versions of files will take up a lot more space!" );
+}
+
+ShinyFileHistory::~ShinyFileHistory() {
+    pthread_mutex_lock( &this->mutex );
+    this->stopping = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+
+    if( this->threadStarted )
+        pthread_join( this->thread, NULL );
+
+    pthread_cond_destroy( &this->cond );
+    pthread_mutex_destroy( &this->mutex );
+    pthread_mutex_destroy( &this->readLock );
+}
+
+bool ShinyFileHistory::save( uint64_t historyID, uint64_t fileLen, uint64_t chunkSize, uint64_t cloneID, const char * data ) {
+    if( fileLen > MAX_FILESIZE )
+        return false;
+
+    // Keys only ever go up, even if the clock doesn't, so saving never lands on top of a version that's already there
+    // (which somebody could be reading, or have a delta against)
+    uint64_t when = now();
+    ShinyDBWrapper * db = this->store->getDB();
+    ShinyDBIterator * it = db->newIterator();
+    ShinyVersionKey first( historyID );
+    for( it->seek( first.data(), first.size() ); it->valid(); it->next() ) {
+        if( !ShinyVersionKey::isVersionKey( it->key(), it->keySize() ) || ShinyDBChunkKey::decode( it->key() + 1 ) != historyID )
+            break;
+        uint64_t last = ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) );
+        if( when <= last )
+            when = last + 1;
+    }
+    delete( it );
+
+    std::string value( VALUE_HEADER_LEN, '\0' );
+    value[0] = (char)(cloneID ? KIND_CLONE : KIND_INLINE);
+    ShinyDBChunkKey::encode( &value[1], fileLen );
+    ShinyDBChunkKey::encode( &value[1 + sizeof(uint64_t)], chunkSize );
+    ShinyDBChunkKey::encode( &value[1 + 2*sizeof(uint64_t)], cloneID );
+    if( !cloneID && fileLen )
+        value.append( data, fileLen );
+
+    ShinyVersionKey key( historyID, when );
+    if( db->put( key.data(), key.size(), value.data(), value.size() ) == (uint64_t)-1 ) {
+        ERROR( "Could not save version of file history %llu: %s", historyID, db->getError() );
+        return false;
+    }
+
+    // The version before this one can be boiled down now
+    pthread_mutex_lock( &this->mutex );
+    this->dirty.insert( historyID );
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+    return true;
+}
+
+void ShinyFileHistory::getVersions( uint64_t historyID, std::vector<uint64_t> & times ) {
+    times.clear();
+    std::vector<Version> versions;
+    pthread_mutex_lock( &this->readLock );
+    this->loadVersions( historyID, versions );
+    pthread_mutex_unlock( &this->readLock );
+
+    // Anything with a newer version in the same second is as good as gone (and will be, once our thread gets to it)
+    for( uint64_t i=0; i<versions.size(); ++i ) {
+        if( i + 1 < versions.size() && versions[i].when/USECS == versions[i + 1].when/USECS )
+            continue;
+        times.push_back( versions[i].when/USECS );
+    }
+}
+
+bool ShinyFileHistory::read( uint64_t historyID, uint64_t when, std::string & data ) {
+    // Held the whole way through, so our thread can't release a clone or rewrite a delta we still need
+    pthread_mutex_lock( &this->readLock );
+    std::vector<Version> versions;
+    bool success = this->loadVersions( historyID, versions );
+
+    // The newest version that was around as of when
+    uint64_t i = versions.size();
+    while( i > 0 && versions[i - 1].when/USECS > when )
+        i--;
+    success = success && i > 0 && this->readVersion( historyID, versions, i - 1, data );
+    pthread_mutex_unlock( &this->readLock );
+    return success;
+}
+
+void ShinyFileHistory::forget( uint64_t historyID ) {
+    pthread_mutex_lock( &this->mutex );
+    this->dirty.erase( historyID );
+    this->forgotten.insert( historyID );
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+}
+
+void ShinyFileHistory::sweepOrphans( const std::set<uint64_t> & liveHistoryIDs, const std::set<uint64_t> & liveFileIDs, uint64_t endID ) {
+    pthread_mutex_lock( &this->mutex );
+    this->liveHistoryIDs = liveHistoryIDs;
+    this->liveFileIDs = liveFileIDs;
+    this->sweepEndID = endID;
+    this->sweeping = true;
+    pthread_cond_broadcast( &this->cond );
+    pthread_mutex_unlock( &this->mutex );
+
+    // Without our thread there's no sweep, and the reclaimer had better not go looking for orphans without knowing
+    // which clones are ours, so it doesn't
+    if( !this->threadStarted )
+        WARN( "No file history thread, so orphaned chunks won't be looked for" );
+}
+
+bool ShinyFileHistory::loadVersions( uint64_t historyID, std::vector<Version> & versions ) {
+    versions.clear();
+    bool success = true;
+    ShinyDBIterator * it = this->store->getDB()->newIterator();
+    ShinyVersionKey first( historyID );
+    for( it->seek( first.data(), first.size() ); it->valid(); it->next() ) {
+        if( !ShinyVersionKey::isVersionKey( it->key(), it->keySize() ) || ShinyDBChunkKey::decode( it->key() + 1 ) != historyID )
+            break;
+        if( it->valueSize() < VALUE_HEADER_LEN ) {
+            ERROR( "Version of file history %llu is garbled!", historyID );
+            success = false;
+            continue;
+        }
+
+        Version version;
+        const char * value = it->value();
+        version.when = ShinyDBChunkKey::decode( it->key() + 1 + sizeof(uint64_t) );
+        version.kind = (uint8_t)value[0];
+        version.fileLen = ShinyDBChunkKey::decode( value + 1 );
+        version.chunkSize = ShinyDBChunkKey::decode( value + 1 + sizeof(uint64_t) );
+        version.cloneID = ShinyDBChunkKey::decode( value + 1 + 2*sizeof(uint64_t) );
+        version.value.assign( value + VALUE_HEADER_LEN, it->valueSize() - VALUE_HEADER_LEN );
+        versions.push_back( version );
+    }
+    delete( it );
+    return success;
+}
+
+bool ShinyFileHistory::readVersion( uint64_t historyID, std::vector<Version> & versions, uint64_t i, std::string & data ) {
+    // Find the closest version after i that's got its data in full, and undo deltas from there on back
+    uint64_t base = i;
+    while( base < versions.size() && versions[base].kind == KIND_DELTA )
+        base++;
+    if( base == versions.size() ) {
+        ERROR( "File history %llu has nothing but deltas!", historyID );
+        return false;
+    }
+
+    if( versions[base].kind == KIND_CLONE ) {
+        if( !this->readClone( versions[base].cloneID, versions[base].fileLen, versions[base].chunkSize, data ) )
+            return false;
+    } else
+        data = versions[base].value;
+
+    std::string older;
+    while( base > i ) {
+        base--;
+        if( !ShinyDelta::decode( data.data(), data.size(), versions[base].value.data(), versions[base].value.size(), older ) ) {
+            ERROR( "Delta of file history %llu is garbled!", historyID );
+            return false;
+        }
+        data.swap( older );
+    }
+    return true;
+}
+
+bool ShinyFileHistory::readClone( uint64_t cloneID, uint64_t fileLen, uint64_t chunkSize, std::string & data ) {
+    data.assign( fileLen, '\0' );
+    if( fileLen == 0 )
+        return true;
+
+    // Holes (and anything past the end of a short chunk) are already zeros
+    uint64_t numChunks = (fileLen + chunkSize - 1)/chunkSize;
+    ShinyChunkReader reader( this->store, cloneID, 0, numChunks - 1 );
+    for( uint64_t chunk=0; chunk<numChunks; ++chunk ) {
+        uint64_t chunkLen;
+        if( !reader.copy( chunk, 0, &data[chunk*chunkSize], min( chunkSize, fileLen - chunk*chunkSize ), &chunkLen ) ) {
+            ERROR( "Could not read chunk %llu of version %llu: %s", chunk, cloneID, reader.getError() );
+            return false;
+        }
+    }
+    return true;
+}
+
+void ShinyFileHistory::tidy( uint64_t historyID ) {
+    std::vector<Version> versions;
+    if( !this->loadVersions( historyID, versions ) || versions.size() < 2 )
+        return;
+    const uint64_t newest = versions.size() - 1;
+
+    // First, work out from the times alone which versions stay: the newest always does, anything with a newer
+    // version in the same second can't be asked for, and past MAX_VERSIONS or MAX_AGE, everything older goes.  Age
+    // goes by when a version got replaced, not when it was saved, so a file that sat untouched for a year doesn't
+    // lose the version from before that the moment it changes
+    uint64_t t = now();
+    std::vector<bool> keep( versions.size(), false );
+    keep[newest] = true;
+    uint64_t numKept = 0;
+    uint64_t next = newest;
+    for( uint64_t i=newest; i-- > 0; ) {
+        if( numKept >= MAX_VERSIONS || (t > versions[next].when && t - versions[next].when > MAX_AGE*USECS) )
+            break;
+        if( versions[i].when/USECS == versions[next].when/USECS )
+            continue;
+        keep[i] = true;
+        numKept++;
+        next = i;
+    }
+
+    // Every delta is against the version right after it, so a version has to be (re)made if it isn't a delta yet or
+    // the one after it is going away.  Those, and every version in between them and the newest, have to be read
+    uint64_t lowest = versions.size();
+    for( uint64_t i=0; i<newest && lowest == versions.size(); ++i ) {
+        if( keep[i] && (versions[i].kind != KIND_DELTA || !keep[i + 1]) )
+            lowest = i;
+    }
+
+    // Now go from newest to oldest, reading each version (where we have to) from the one after it, and making new
+    // deltas against the next one that's staying.  The deltas add up as we go, and once there's more than MAX_BYTES
+    // of them, that version and everything older goes too
+    std::map<uint64_t, std::string> deltas;
+    std::string after, current, keptAfter;
+    bool readable = true;
+    uint64_t bytes = 0;
+    for( uint64_t i=newest + 1; i-- > 0; ) {
+        if( i >= lowest ) {
+            if( versions[i].kind == KIND_DELTA ) {
+                readable = readable && i < newest && ShinyDelta::decode( after.data(), after.size(), versions[i].value.data(), versions[i].value.size(), current );
+            } else if( versions[i].kind == KIND_CLONE )
+                readable = this->readClone( versions[i].cloneID, versions[i].fileLen, versions[i].chunkSize, current );
+            else {
+                current = versions[i].value;
+                readable = true;
+            }
+        }
+        if( !keep[i] ) {
+            after.swap( current );
+            continue;
+        }
+        if( i < newest ) {
+            uint64_t size = versions[i].value.size();
+            if( i >= lowest && (versions[i].kind != KIND_DELTA || !keep[i + 1]) ) {
+                // Versions we can't read can't be turned into anything, so they go (and so does everything older,
+                // since they can't be read without them either)
+                if( !readable ) {
+                    ERROR( "Could not read version of file history %llu, dropping it and everything older", historyID );
+                    for( uint64_t j=0; j<=i; ++j )
+                        keep[j] = false;
+                    break;
+                }
+                const std::string & source = keep[i + 1] ? after : keptAfter;
+                ShinyDelta::encode( source.data(), source.size(), current.data(), current.size(), deltas[i] );
+                size = deltas[i].size();
+            }
+            if( bytes + size > MAX_BYTES ) {
+                for( uint64_t j=0; j<=i; ++j )
+                    keep[j] = false;
+                deltas.erase( i );
+                break;
+            }
+            bytes += size;
+        }
+
+        // The next one down might need this one to make its delta against, if the ones in between are going
+        if( i >= lowest && i > 0 && !keep[i - 1] )
+            keptAfter = current;
+        after.swap( current );
+    }
+
+    // Out with whatever's going and in with the new deltas, all at once, and the clones they had can go after that
+    std::vector<uint64_t> releases;
+    ShinyDBWrapper * db = this->store->getDB();
+    ShinyDBBatch * batch = db->newBatch();
+    for( uint64_t i=0; i<newest; ++i ) {
+        ShinyVersionKey key( historyID, versions[i].when );
+        if( !keep[i] )
+            batch->del( key.data(), key.size() );
+        else if( deltas.find( i ) != deltas.end() ) {
+            std::string value( VALUE_HEADER_LEN, '\0' );
+            value[0] = (char)KIND_DELTA;
+            ShinyDBChunkKey::encode( &value[1], versions[i].fileLen );
+            ShinyDBChunkKey::encode( &value[1 + sizeof(uint64_t)], versions[i].chunkSize );
+            value.append( deltas[i] );
+            batch->put( key.data(), key.size(), value.data(), value.size() );
+        } else
+            continue;
+        if( versions[i].kind == KIND_CLONE )
+            releases.push_back( versions[i].cloneID );
+    }
+
+    // Nobody can be in the middle of reading these while we swap them out, or be left holding a clone we've released.
+    // And if there's nothing to do, we don't bother the DB at all
+    if( batch->getSize() ) {
+        pthread_mutex_lock( &this->readLock );
+        if( db->write( batch ) ) {
+            for( uint64_t i=0; i<releases.size(); ++i )
+                this->reclaimer->release( releases[i] );
+        } else
+            ERROR( "Could not tidy up file history %llu: %s", historyID, db->getError() );
+        pthread_mutex_unlock( &this->readLock );
+    }
+    delete( batch );
+}
+
+void ShinyFileHistory::drop( uint64_t historyID, bool releaseClones ) {
+    std::vector<Version> versions;
+    this->loadVersions( historyID, versions );
+    ShinyDBWrapper * db = this->store->getDB();
+    ShinyDBBatch * batch = db->newBatch();
+    for( uint64_t i=0; i<versions.size(); ++i ) {
+        ShinyVersionKey key( historyID, versions[i].when );
+        batch->del( key.data(), key.size() );
+    }
+
+    pthread_mutex_lock( &this->readLock );
+    if( db->write( batch ) ) {
+        for( uint64_t i=0; releaseClones && i<versions.size(); ++i ) {
+            if( versions[i].kind == KIND_CLONE )
+                this->reclaimer->release( versions[i].cloneID );
+        }
+    } else
+        ERROR( "Could not throw away file history %llu: %s", historyID, db->getError() );
+    pthread_mutex_unlock( &this->readLock );
+    delete( batch );
+}
+
+void ShinyFileHistory::sweep() {
+    pthread_mutex_lock( &this->mutex );
+    std::set<uint64_t> liveHistory, liveFiles;
+    liveHistory.swap( this->liveHistoryIDs );
+    liveFiles.swap( this->liveFileIDs );
+    uint64_t endID = this->sweepEndID;
+    this->sweeping = false;
+    pthread_mutex_unlock( &this->mutex );
+
+    // Go through every version there is, a file's worth at a time
+    std::map<uint64_t, std::vector<std::pair<uint8_t, uint64_t> > > histories;
+    ShinyDBIterator * it = this->store->getDB()->newIterator();
+    const char prefix = ShinyVersionKey::PREFIX;
+    for( it->seek( &prefix, 1 ); it->valid() && ShinyVersionKey::isVersionKey( it->key(), it->keySize() ); it->next() ) {
+        if( it->valueSize() < VALUE_HEADER_LEN )
+            continue;
+        uint8_t kind = (uint8_t)it->value()[0];
+        histories[ShinyDBChunkKey::decode( it->key() + 1 )].push_back( std::make_pair( kind, ShinyDBChunkKey::decode( it->value() + 1 + 2*sizeof(uint64_t) ) ) );
+    }
+    delete( it );
+
+    // A clone layered (however far down) on a file that's in the tree means the tree is from before the version was
+    // saved, and that file has gone right on writing into what should have been frozen.  The versions from then on are
+    // garbage, and so is every delta against them.  Their clones are left out of what the reclaimer gets told is
+    // live, and it knows how to get rid of a layer like that without taking the file along with it.  Clones from endID
+    // on were made since we started up (so they're fine), and the reclaimer leaves them alone anyway
+    uint64_t numDropped = 0;
+    for( std::map<uint64_t, std::vector<std::pair<uint8_t, uint64_t> > >::iterator itty = histories.begin(); itty != histories.end(); ++itty ) {
+        bool dead = itty->first < endID && liveHistory.find( itty->first ) == liveHistory.end();
+        for( uint64_t i=0; i<itty->second.size() && !dead; ++i ) {
+            if( itty->second[i].first != KIND_CLONE || itty->second[i].second >= endID )
+                continue;
+            for( uint64_t backing = this->store->getBacking( itty->second[i].second ); backing && !dead; backing = this->store->getBacking( backing ) )
+                dead = liveFiles.find( backing ) != liveFiles.end();
+        }
+
+        if( dead ) {
+            this->drop( itty->first, false );
+            numDropped++;
+            continue;
+        }
+
+        // Everything else is a keeper, and anything that isn't all boiled down yet (because we stopped before we got
+        // to it last time) gets done now
+        bool untidy = false;
+        for( uint64_t i=0; i<itty->second.size(); ++i ) {
+            if( itty->second[i].first == KIND_CLONE )
+                liveFiles.insert( itty->second[i].second );
+            untidy = untidy || (i + 1 < itty->second.size() && itty->second[i].first != KIND_DELTA);
+        }
+        if( untidy ) {
+            pthread_mutex_lock( &this->mutex );
+            this->dirty.insert( itty->first );
+            pthread_mutex_unlock( &this->mutex );
+        }
+    }
+    if( numDropped )
+        LOG( "Threw away the history of %llu files that are gone (or that was saved after the tree was)", numDropped );
+
+    this->reclaimer->sweepOrphans( liveFiles, endID );
+}
+
+void * ShinyFileHistory::historyLoop( void * data ) {
+    ShinyFileHistory * history = (ShinyFileHistory *) data;
+
+    while( true ) {
+        pthread_mutex_lock( &history->mutex );
+        while( history->dirty.empty() && history->forgotten.empty() && !history->sweeping && !history->stopping )
+            pthread_cond_wait( &history->cond, &history->mutex );
+        if( history->stopping ) {
+            pthread_mutex_unlock( &history->mutex );
+            break;
+        }
+        bool sweeping = history->sweeping;
+        uint64_t historyID = 0;
+        bool forgetting = false;
+        if( !sweeping && !history->forgotten.empty() ) {
+            historyID = *history->forgotten.begin();
+            history->forgotten.erase( history->forgotten.begin() );
+            forgetting = true;
+        } else if( !sweeping ) {
+            historyID = *history->dirty.begin();
+            history->dirty.erase( history->dirty.begin() );
+        }
+        pthread_mutex_unlock( &history->mutex );
+
+        // Sweeping comes first, since until it's done the reclaimer is waiting on us to go after orphans
+        if( sweeping )
+            history->sweep();
+        else if( forgetting )
+            history->drop( historyID, true );
+        else
+            history->tidy( historyID );
+    }
+    return NULL;
+}
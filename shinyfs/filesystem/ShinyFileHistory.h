@@ -0,0 +1,145 @@
+#pragma once
+#ifndef shinyfs_ShinyFileHistory_h
+#define shinyfs_ShinyFileHistory_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <vector>
+#include "ShinyChunkStore.h"
+#include "ShinyChunkReclaimer.h"
+
+/*
+ Old versions of files, kept around so they can be read back as of some point in time.  Every time a file that was
+ written to gets closed, what it holds right then becomes its newest version (see ShinyMetaFile::saveVersion()), and
+ the version before that gets boiled down to a backward delta (see ShinyDelta.h): the directions for turning the
+ version after it back into it.  So only the newest version takes up any real room, and reading an old one means
+ starting from the newest and working backwards, a delta at a time.
+
+ Versions live in the DB under their own prefix, then the file's history ID and the time the version was saved (in
+ microseconds, and never the same twice), both big-endian, so all of a file's versions sit together, oldest first.  The history ID is handed out the first time a
+ file gets a version and sticks with it from then on (its file ID doesn't, see ShinyMetaFile::rewrite()), so a file
+ keeps its history through renames, re-chunking and truncating.  The newest version has the file's data in full:
+ right there in the value for files small enough to be inlined, and otherwise as a clone of the file (see
+ ShinyChunkStore::clone()), which costs a couple of small puts no matter how big it is.  Versions saved within the
+ same second as the one after them can't ever be asked for, so they just get dropped.
+
+ Turning a version into a delta means reading it and the one after it in full, so that happens in the background,
+ on our own thread, which is also the only one that ever changes or deletes versions that are already there.  Files
+ bigger than MAX_FILESIZE don't get versions at all, and each file only gets to keep so many old ones, taking up so
+ much room, for so long (see the limits below), with the oldest ones going first.
+ */
+
+class ShinyFileHistory {
+/////// CREATION ///////
+public:
+    // Starts up our thread.  Versions are read out of store, and their clones handed to reclaimer once they're done
+    ShinyFileHistory( ShinyChunkStore * store, ShinyChunkReclaimer * reclaimer );
+
+    // Stops the thread.  Anything it didn't get to is still in the DB, and gets done next time
+    ~ShinyFileHistory();
+
+/////// LIMITS ///////
+public:
+    // Files bigger than this don't get history, since making a delta means having two whole versions in memory
+    static const uint64_t MAX_FILESIZE = 64*1024*1024;
+
+    // The most old versions (not counting the newest) a file keeps, how many bytes they can add up to, and how long
+    // they're kept once they've been replaced.  Whichever runs out first, the oldest versions go
+    static const uint64_t MAX_VERSIONS = 64;
+    static const uint64_t MAX_BYTES = 16*1024*1024;
+    static const uint64_t MAX_AGE = 30*24*60*60;
+
+/////// VERSIONS ///////
+public:
+    // Saves what the file with history ID historyID holds right now as its newest version.  Its fileLen bytes are
+    // either in data (for an inlined file, with cloneID 0), or in chunkSize chunks under cloneID, which is ours from
+    // then on.  Returns false if the version wasn't saved (in which case cloneID is still the caller's to deal with)
+    bool save( uint64_t historyID, uint64_t fileLen, uint64_t chunkSize, uint64_t cloneID, const char * data );
+
+    // Fills times with when (in seconds since the epoch) every version we have of historyID was saved, oldest first
+    void getVersions( uint64_t historyID, std::vector<uint64_t> & times );
+
+    // Puts the file back together as it was as of when (in seconds, so the newest version saved in or before that
+    // second) into data.  Returns false if there's no such version, or it couldn't be read
+    bool read( uint64_t historyID, uint64_t when, std::string & data );
+
+    // Throws away all of historyID's versions, for a file that's been deleted.  Happens in the background
+    void forget( uint64_t historyID );
+
+    // Looks for versions belonging to history IDs under endID that aren't in liveHistoryIDs, and throws them away.
+    // Also throws away any version whose clone turns out to be layered right on top of a file in liveFileIDs, which
+    // means the tree was saved before the version was, and the file has been writing into what should have been
+    // frozen.  Once that's done, hands liveFileIDs (plus the clones of all the versions we kept) over to
+    // ShinyChunkReclaimer::sweepOrphans(), so it can go after everything nobody owns
+    void sweepOrphans( const std::set<uint64_t> & liveHistoryIDs, const std::set<uint64_t> & liveFileIDs, uint64_t endID );
+private:
+    // One version of a file, as it is in the DB.  Every version is one of these kinds
+    enum Kind {
+        // The data's all there in the value
+        KIND_INLINE,
+
+        // The data's in chunks under cloneID
+        KIND_CLONE,
+
+        // The value is a delta that turns the next version into this one
+        KIND_DELTA,
+    };
+    struct Version {
+        uint64_t when;
+        uint8_t kind;
+        uint64_t fileLen;
+        uint64_t chunkSize;
+        uint64_t cloneID;
+        std::string value;
+    };
+
+    // Every version of historyID, oldest first.  Returns false if one of them was garbled
+    bool loadVersions( uint64_t historyID, std::vector<Version> & versions );
+
+    // Reads the data of versions[i] into data, going through every version after it to get there if it's a delta
+    bool readVersion( uint64_t historyID, std::vector<Version> & versions, uint64_t i, std::string & data );
+
+    // Reads all fileLen bytes of a clone.  Holes come back as zeros
+    bool readClone( uint64_t cloneID, uint64_t fileLen, uint64_t chunkSize, std::string & data );
+
+    // Turns every version of historyID but the newest into a delta, drops the ones nobody can ask for, and trims off
+    // whatever's over the limits
+    void tidy( uint64_t historyID );
+
+    // Throws away every version of historyID (and releases their clones, unless releaseClones is false)
+    void drop( uint64_t historyID, bool releaseClones );
+
+    // The real sweepOrphans(), on our thread
+    void sweep();
+
+    // What our thread spends its life doing
+    static void * historyLoop( void * data );
+
+    ShinyChunkStore * store;
+    ShinyChunkReclaimer * reclaimer;
+
+    // Held while reading versions, and by our thread while it's changing (or releasing the clones of) any version
+    // that's already there, so nobody ever reads a clone that's on its way out.  save() doesn't need it, since a new
+    // version never lands on top of one that's already there
+    pthread_mutex_t readLock;
+
+    // Protected by mutex: which history IDs have new versions for us to tidy up, and which to throw away
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::set<uint64_t> dirty;
+    std::set<uint64_t> forgotten;
+    bool stopping;
+
+    // Protected by mutex too: what sweepOrphans() handed us, if it's waiting on us
+    bool sweeping;
+    std::set<uint64_t> liveHistoryIDs;
+    std::set<uint64_t> liveFileIDs;
+    uint64_t sweepEndID;
+
+    pthread_t thread;
+    bool threadStarted;
+};
+
+#endif // shinyfs_ShinyFileHistory_h
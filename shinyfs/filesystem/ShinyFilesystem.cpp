@@ -3,6 +3,7 @@
 #include "ShinyMetaFile.h"
 #include "ShinyMetaDir.h"
 #include "ShinyMetaRootDir.h"
+#include "../util/ShinyCRC32C.h"
 #include <base/Logger.h>
 
 //Used to stat() to tell if the directory exists
@@ -11,7 +12,33 @@
 
 
 // ShinyFilesystem constructor, takes in path to cache location? I need to split this out into a separate cache object.....
-ShinyFilesystem::ShinyFilesystem( const char * filecache ) : db( filecache ), root(NULL) {
+ShinyFilesystem::ShinyFilesystem( const char * filecache, ShinyChunkStore::Mode chunkMode, const char * chunkCodec, uint64_t chunkCacheSize ) : db( filecache ), root(NULL), pathHits(0), pathMisses(0) {
+    pthread_mutex_init( &this->fileIDLock, NULL );
+    this->async = new ShinyDBAsync( &this->db, ASYNC_THREADS );
+    
+    // Pick up file IDs right where the last run left off.  Anything it reserved but didn't use is just skipped
+    char idBuff[sizeof(uint64_t)];
+    bool freshCache = true;
+    if( this->db.get( this->getShinyFilesystemFileIDDBKey(), idBuff, sizeof(uint64_t) ) == sizeof(uint64_t) ) {
+        this->nextFileID = *((uint64_t *)&idBuff[0]);
+        freshCache = false;
+    } else
+        this->nextFileID = 1;
+    this->reservedFileID = this->nextFileID;
+    
+    try {
+        this->chunks = this->openChunkStore( filecache, freshCache, chunkMode, chunkCodec, chunkCacheSize );
+    } catch( const char * ) {
+        delete( this->async );
+        pthread_mutex_destroy( &this->fileIDLock );
+        throw;
+    }
+    this->reclaimer = new ShinyChunkReclaimer( this->chunks );
+    this->compactor = new ShinyChunkCompactor( this->chunks );
+    this->prefetcher = new ShinyChunkPrefetcher( this->chunks, this->async );
+    this->writeback = new ShinyChunkWriteback( this->chunks );
+    this->history = new ShinyFileHistory( this->chunks, this->reclaimer );
+    
     // Attempt to load the size of the metadata that was saved, if it exists, then
     // continue loading from the db. Otherwise, we need to start from scratch.
     char sizeBuff[sizeof(uint64_t)];
@@ -25,6 +52,17 @@ ShinyFilesystem::ShinyFilesystem( const char * filecache ) : db( filecache ), ro
     } else
         WARN( "Corrupt/missing metadata length: throwing it all away!" );
     
+    // Any chunks under an ID that isn't in the tree (and never will be, since every ID we hand out from here on is
+    // past nextFileID) are left over from a crash or some such, and can go, along with the history of any file that
+    // isn't in the tree.  The history goes first, and tells the reclaimer which old versions' chunks are still wanted.
+    // If we couldn't load the tree, though, we leave everything be; it's better to waste space than to throw away data
+    // someone might still dig out
+    if( root ) {
+        std::set<uint64_t> liveIDs, liveHistoryIDs;
+        this->collectFileIDs( this->root, liveIDs, liveHistoryIDs );
+        this->history->sweepOrphans( liveHistoryIDs, liveIDs, this->nextFileID );
+    }
+    
     // If we have no root, then "nothing remains" and we must make something entertaining up.
     if( !root ) {
         LOG( "Making crap up!" );
@@ -40,25 +78,121 @@ ShinyFilesystem::ShinyFilesystem( const char * filecache ) : db( filecache ), ro
     }
 }
 
+ShinyChunkStore * ShinyFilesystem::openChunkStore( const char * filecache, bool freshCache, ShinyChunkStore::Mode chunkMode, const char * chunkCodec, uint64_t chunkCacheSize ) {
+    // Once there's data in the filecache it's laid out one way or the other for good, so chunkMode and chunkCodec
+    // only count for brand new ones.  Filecaches from before we kept track all store their chunks directly, as is
+    char modeBuff[sizeof(uint64_t)];
+    uint64_t storedMode = freshCache ? chunkMode : ShinyChunkStore::MODE_DIRECT;
+    if( this->db.get( this->getShinyFilesystemChunkModeDBKey(), modeBuff, sizeof(uint64_t) ) == sizeof(uint64_t) )
+        storedMode = *((uint64_t *)&modeBuff[0]);
+    else if( this->db.put( this->getShinyFilesystemChunkModeDBKey(), (const char *)&storedMode, sizeof(uint64_t) ) != sizeof(uint64_t) )
+        ERROR( "Could not save chunk mode to filecache: %s", this->db.getError() );
+    
+    if( storedMode != ShinyChunkStore::MODE_DIRECT && storedMode != ShinyChunkStore::MODE_DEDUP ) {
+        ERROR( "Filecache %s has unknown chunk mode %llu!", filecache, storedMode );
+        throw "Unknown chunk mode";
+    }
+    if( storedMode != chunkMode )
+        WARN( "Filecache %s stores chunks in %s mode, not %s mode", filecache, ShinyChunkStore::getModeName( (ShinyChunkStore::Mode)storedMode ), ShinyChunkStore::getModeName( chunkMode ) );
+    
+    // Same deal for the codec, which is stored by name
+    char codecBuff[64];
+    std::string storedCodec = freshCache ? chunkCodec : "none";
+    uint64_t codecLen = this->db.get( this->getShinyFilesystemChunkCodecDBKey(), codecBuff, sizeof(codecBuff) );
+    if( codecLen != (uint64_t)-1 )
+        storedCodec.assign( codecBuff, codecLen );
+    else if( this->db.put( this->getShinyFilesystemChunkCodecDBKey(), storedCodec.c_str(), storedCodec.size() ) != storedCodec.size() )
+        ERROR( "Could not save chunk codec to filecache: %s", this->db.getError() );
+    
+    ShinyChunkCodec * codec = NULL;
+    if( storedCodec != "none" && !(codec = ShinyChunkCodec::get( storedCodec.c_str() )) ) {
+        ERROR( "Filecache %s is compressed with unknown (or not compiled in) codec \"%s\"", filecache, storedCodec.c_str() );
+        throw "Unknown chunk codec";
+    }
+    if( storedCodec != chunkCodec )
+        WARN( "Filecache %s compresses chunks with %s, not %s", filecache, storedCodec.c_str(), chunkCodec );
+    
+    // Chunks only have room for a checksum if they were stored with one from the start, so filecaches from before
+    // there were checksums go without, and new ones always get them
+    char checksumsBuff[sizeof(uint64_t)];
+    uint64_t storedChecksums = freshCache ? 1 : 0;
+    if( this->db.get( this->getShinyFilesystemChunkChecksumsDBKey(), checksumsBuff, sizeof(uint64_t) ) == sizeof(uint64_t) )
+        storedChecksums = *((uint64_t *)&checksumsBuff[0]);
+    else if( this->db.put( this->getShinyFilesystemChunkChecksumsDBKey(), (const char *)&storedChecksums, sizeof(uint64_t) ) != sizeof(uint64_t) )
+        ERROR( "Could not save chunk checksums setting to filecache: %s", this->db.getError() );
+    
+    LOG( "Storing chunks in %s mode, compressed with %s, %s", ShinyChunkStore::getModeName( (ShinyChunkStore::Mode)storedMode ), storedCodec.c_str(), storedChecksums ? "with checksums" : "without checksums" );
+    if( storedChecksums && !ShinyCRC32C::isHardware() )
+        WARN( "No CRC32 instruction on this CPU, checksums will cost more than they should" );
+    return new ShinyChunkStore( &this->db, (ShinyChunkStore::Mode)storedMode, codec, chunkCacheSize, storedChecksums != 0 );
+}
+
 ShinyFilesystem::~ShinyFilesystem() {
+    // Let the workers finish up whatever they're doing before we go pulling the DB out from under them
+    // (that includes anything still being read ahead)
+    delete( this->async );
+    delete( this->prefetcher );
+    
+    // (save() writes out anything still buffered)
     this->save();
+    delete( this->writeback );
     
     //Clear out the nodes (amazing how they just take care of themselves, so nicely and all!)
     delete( this->root );
+    
+    // The paths, on the other hand, we have to take care of ourselves
+    this->pathNodes.clear();
+    for( std::unordered_map<ShinyMetaNodeSnapshot *, const char *>::iterator itty = this->nodePaths.begin(); itty != this->nodePaths.end(); ++itty )
+        delete [] itty->second;
+    this->nodePaths.clear();
+    
+    // Whatever the history and the reclaimer haven't gotten to yet is still in the DB, they'll finish up next time
+    delete( this->history );
+    delete( this->reclaimer );
+    delete( this->compactor );
+    delete( this->chunks );
+    pthread_mutex_destroy( &this->fileIDLock );
+}
+
+void ShinyFilesystem::collectFileIDs( ShinyMetaNodeSnapshot * node, std::set<uint64_t> & fileIDs, std::set<uint64_t> & historyIDs ) {
+    if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_FILE ) {
+        ShinyMetaFileSnapshot * file = dynamic_cast<ShinyMetaFileSnapshot *>(node);
+        fileIDs.insert( file->getFileID() );
+        if( file->getHistoryID() )
+            historyIDs.insert( file->getHistoryID() );
+    } else if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR || node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_ROOTDIR ) {
+        const std::vector<ShinyMetaNodeSnapshot *> * nodes = dynamic_cast<ShinyMetaDirSnapshot *>(node)->getNodes();
+        for( uint64_t i=0; i<nodes->size(); ++i )
+            this->collectFileIDs( (*nodes)[i], fileIDs, historyIDs );
+    }
+}
+
+void ShinyFilesystem::releaseTree( ShinyMetaNode * node ) {
+    if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_FILE )
+        ((ShinyMetaFile *)node)->releaseChunks();
+    else if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR ) {
+        const std::vector<ShinyMetaNode *> * nodes = ((ShinyMetaDir *)node)->getNodes();
+        for( uint64_t i=0; i<nodes->size(); ++i )
+            this->releaseTree( (*nodes)[i] );
+    }
+}
+
+bool ShinyFilesystem::checkTree( ShinyMetaNode * node ) {
+    bool retVal = true;
+    if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_FILE )
+        retVal &= ((ShinyMetaFile *)node)->sanityCheck();
+    else if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR || node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_ROOTDIR ) {
+        const std::vector<ShinyMetaNode *> * nodes = ((ShinyMetaDir *)node)->getNodes();
+        for( uint64_t i=0; i<nodes->size(); ++i )
+            retVal &= this->checkTree( (*nodes)[i] );
+    }
+    return retVal;
 }
 
 //Searches a ShinyMetaDir's listing for a name, returning the child
 ShinyMetaNodeSnapshot * ShinyFilesystem::findMatchingChild( ShinyMetaDirSnapshot * parent, const char * childName, uint64_t childNameLen ) {
-    const std::vector<ShinyMetaNodeSnapshot *> list = *parent->getNodes();
-    for( uint64_t i = 0; i < list.size(); ++i ) {
-        // Compare names
-        if( strlen(list[i]->getName()) == childNameLen && memcmp( list[i]->getName(), childName, childNameLen ) == 0 ) {
-            // If it works, return this index we iterated over
-            return list[i];
-        }
-    }
-    //If we made it all the way through without finding a match for that file, quit out
-    return NULL;
+    // The dir knows where it filed everybody, so there's no need to go through them all (see ShinyMetaDirSnapshot)
+    return parent->findNode( childName, childNameLen );
 }
 
 ShinyMetaNodeSnapshot * ShinyFilesystem::findNode( const char * path ) {
@@ -67,36 +201,79 @@ ShinyMetaNodeSnapshot * ShinyFilesystem::findNode( const char * path ) {
         return NULL;
     }
     
+    // Most of the time it's a path we've already been down (every FUSE call for a file comes through here)
+    std::unordered_map<const char *, ShinyMetaNodeSnapshot *, PathHash, PathEqual>::iterator cached = this->pathNodes.find( path );
+    if( cached != this->pathNodes.end() ) {
+        this->pathHits++;
+        return cached->second;
+    }
+    this->pathMisses++;
+    
     ShinyMetaNodeSnapshot * currNode = this->root;
-    unsigned long filenameBegin = 1;
-    for( unsigned int i=1; i<strlen(path); ++i ) {
-        if( path[i] == '/' ) {
-            //If this one actually _is_ a directory, let's get its listing
-            if( currNode->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR || currNode->getNodeType() == ShinyMetaNodeSnapshot::TYPE_ROOTDIR ) {
-                //Search currNode's children for a name match
-                ShinyMetaNodeSnapshot * childNode = findMatchingChild( dynamic_cast<ShinyMetaDir *>(currNode), &path[filenameBegin], i - filenameBegin );
-                if( !childNode )
-                    return NULL;
-                else {
-                    currNode = childNode;
-                    filenameBegin = i+1;
-                }
-            } else
+    uint64_t pathLen = strlen( path );
+    uint64_t filenameBegin = 1;
+    for( uint64_t i=1; i<=pathLen; ++i ) {
+        // Every slash (and the end of the path) finishes off a name, unless there wasn't one there (e.g. "a//b")
+        if( i < pathLen && path[i] != '/' )
+            continue;
+        if( i > filenameBegin ) {
+            //If this one actually _is_ a directory, search its children for a name match
+            if( currNode->getNodeType() != ShinyMetaNodeSnapshot::TYPE_DIR && currNode->getNodeType() != ShinyMetaNodeSnapshot::TYPE_ROOTDIR )
+                return NULL;
+            currNode = findMatchingChild( dynamic_cast<ShinyMetaDir *>(currNode), &path[filenameBegin], i - filenameBegin );
+            if( !currNode )
                 return NULL;
-            
-            //Update the beginning of the next filename to be the character after this slash
-            filenameBegin = i+1;
         }
+        
+        //Update the beginning of the next filename to be the character after this slash
+        filenameBegin = i+1;
     }
-    if( filenameBegin < strlen(path) ) {
-        ShinyMetaNodeSnapshot * childNode = findMatchingChild( dynamic_cast<ShinyMetaDir *>(currNode), &path[filenameBegin], strlen(path) - filenameBegin );
-        if( !childNode )
-            return NULL;
-        currNode = childNode;
-    }
+    
+    // Remember it under its proper path (which is what FUSE hands us anyway), the root's easy enough to find as is
+    if( currNode != this->root )
+        this->pathNodes[this->getNodePath( currNode )] = currNode;
     return currNode;
 }
 
+uint64_t ShinyFilesystem::getPathCacheHits() {
+    return this->pathHits;
+}
+
+uint64_t ShinyFilesystem::getPathCacheMisses() {
+    return this->pathMisses;
+}
+
+// FNV-1a, same as dirs use for their children's names
+size_t ShinyFilesystem::PathHash::operator()( const char * path ) const {
+    uint64_t hash = 14695981039346656037ULL;
+    for( ; *path; ++path )
+        hash = (hash ^ (uint8_t)*path) * 1099511628211ULL;
+    return hash;
+}
+
+bool ShinyFilesystem::PathEqual::operator()( const char * a, const char * b ) const {
+    return strcmp( a, b ) == 0;
+}
+
+void ShinyFilesystem::forgetPath( ShinyMetaNodeSnapshot * node ) {
+    // Nothing cached, nothing to forget (and no need to go through a whole tree to find that out)
+    if( this->nodePaths.empty() )
+        return;
+    
+    std::unordered_map<ShinyMetaNodeSnapshot *, const char *>::iterator itty = this->nodePaths.find( node );
+    if( itty != this->nodePaths.end() ) {
+        this->pathNodes.erase( itty->second );
+        delete [] itty->second;
+        this->nodePaths.erase( itty );
+    }
+    
+    if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR || node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_ROOTDIR ) {
+        const std::vector<ShinyMetaNodeSnapshot *> * nodes = dynamic_cast<ShinyMetaDirSnapshot *>(node)->getNodes();
+        for( uint64_t i=0; i<nodes->size(); ++i )
+            this->forgetPath( (*nodes)[i] );
+    }
+}
+
 ShinyMetaDirSnapshot * ShinyFilesystem::findParentNode( const char *path ) {
     //Start at the end of the string
     uint64_t len = strlen( path );
@@ -176,10 +353,84 @@ const char * ShinyFilesystem::getNodePath( ShinyMetaNodeSnapshot *node ) {
     return this->nodePaths[node] = path;
 }
 
+ShinyMetaNode * ShinyFilesystem::clone( ShinyMetaNode * node, const char * newName, ShinyMetaDir * parent ) {
+    ShinyMetaNode * copy = NULL;
+    if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_FILE ) {
+        ShinyMetaFile * file = new ShinyMetaFile( newName, parent );
+        if( !((ShinyMetaFile *)node)->clone( this, file ) ) {
+            delete( file );
+            return NULL;
+        }
+        copy = file;
+    } else if( node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_DIR || node->getNodeType() == ShinyMetaNodeSnapshot::TYPE_ROOTDIR ) {
+        ShinyMetaDir * dir = new ShinyMetaDir( newName, parent );
+        
+        // Go off of a copy of the listing, so there's no way we can end up walking through what we're adding
+        std::vector<ShinyMetaNode *> nodes( *((ShinyMetaDir *)node)->getNodes() );
+        for( uint64_t i=0; i<nodes.size(); ++i ) {
+            if( !this->clone( nodes[i], nodes[i]->getName(), dir ) ) {
+                this->releaseTree( dir );
+                delete( dir );
+                return NULL;
+            }
+        }
+        copy = dir;
+    } else {
+        WARN( "Don't know how to clone %s! (%d)", node->getPath(), node->getNodeType() );
+        return NULL;
+    }
+    
+    // A copy is a brand new node as far as times go, but it's still got the same owner and permissions
+    copy->setPermissions( node->getPermissions() );
+    copy->setUID( node->getUID() );
+    copy->setGID( node->getGID() );
+    return copy;
+}
+
+uint64_t ShinyFilesystem::newFileID() {
+    pthread_mutex_lock( &this->fileIDLock );
+    
+    // Out of reserved IDs?  Grab another block of them, and make sure the DB knows about it before we hand any out
+    if( this->nextFileID == this->reservedFileID ) {
+        uint64_t newReserved = this->reservedFileID + FILEID_BLOCK;
+        if( this->db.put( this->getShinyFilesystemFileIDDBKey(), (const char *)&newReserved, sizeof(uint64_t) ) != sizeof(uint64_t) )
+            ERROR( "Could not reserve file IDs in filecache: %s", this->db.getError() );
+        this->reservedFileID = newReserved;
+    }
+    uint64_t fileID = this->nextFileID++;
+    
+    pthread_mutex_unlock( &this->fileIDLock );
+    return fileID;
+}
+
 ShinyDBWrapper * ShinyFilesystem::getDB() {
     return &this->db;
 }
 
+ShinyDBAsync * ShinyFilesystem::getAsync() {
+    return this->async;
+}
+
+ShinyChunkStore * ShinyFilesystem::getChunkStore() {
+    return this->chunks;
+}
+
+ShinyChunkReclaimer * ShinyFilesystem::getReclaimer() {
+    return this->reclaimer;
+}
+
+ShinyChunkPrefetcher * ShinyFilesystem::getPrefetcher() {
+    return this->prefetcher;
+}
+
+ShinyChunkWriteback * ShinyFilesystem::getWriteback() {
+    return this->writeback;
+}
+
+ShinyFileHistory * ShinyFilesystem::getHistory() {
+    return this->history;
+}
+
 const char * ShinyFilesystem::getShinyFilesystemDBKey() {
     return "?shinyfs.state";
 }
@@ -188,10 +439,28 @@ const char * ShinyFilesystem::getShinyFilesystemSizeDBKey() {
     return "?shinyfs.statesize";
 }
 
+const char * ShinyFilesystem::getShinyFilesystemFileIDDBKey() {
+    return "?shinyfs.nextfileid";
+}
+
+const char * ShinyFilesystem::getShinyFilesystemChunkModeDBKey() {
+    return "?shinyfs.chunkmode";
+}
+
+const char * ShinyFilesystem::getShinyFilesystemChunkCodecDBKey() {
+    return "?shinyfs.chunkcodec";
+}
+
+const char * ShinyFilesystem::getShinyFilesystemChunkChecksumsDBKey() {
+    return "?shinyfs.chunkchecksums";
+}
+
 bool ShinyFilesystem::sanityCheck( void ) {
     bool retVal = true;
     //Call sanity check on all of them.
     //The nodes will return false if there is an error
+    if( this->root )
+        retVal &= this->checkTree( (ShinyMetaNode *) this->root );
     return retVal;
 }
 
@@ -340,6 +609,9 @@ ShinyMetaRootDir * ShinyFilesystem::unserialize( const char *input ) {
 }
 
 void ShinyFilesystem::save() {
+    // The tree is about to say how long every file is, so the data had better be there to back it up
+    this->writeback->flushAll();
+    
     // First, serialize everything out
     char * output;
     uint64_t len = this->serialize( &output );
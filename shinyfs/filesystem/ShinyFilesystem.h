@@ -3,9 +3,18 @@
 #define ShinyFilesystem_H
 
 #include <unordered_map>
+#include <set>
+#include <pthread.h>
 
 #include "ShinyMetaNode.h"
 #include "ShinyDBWrapper.h"
+#include "ShinyDBAsync.h"
+#include "ShinyChunkStore.h"
+#include "ShinyChunkReclaimer.h"
+#include "ShinyChunkCompactor.h"
+#include "ShinyChunkPrefetcher.h"
+#include "ShinyChunkWriteback.h"
+#include "ShinyFileHistory.h"
 
 /*
  This guy is responsible ONLY for management of the filesystem tree. Metadata, etc. are all directly
@@ -26,11 +35,16 @@ class ShinyFilesystem {
     friend class ShinyMetaRootDirSnapshot;
     friend class ShinyMetaRootDir;
     friend class ShinyMetaFileHandle;
+    friend class ShinyFilesystemMediator;
     
 /////// INITIALIZATION/SAVING LOADING ///////
 public:
     //Creates the ShinyCache to do serving of cached content, and sets up a few zmq helper stuffs
-    ShinyFilesystem( const char * filecache );
+    //filecache is handed straight to ShinyDBWrapper, e.g. "leveldb:filecache", "lmdb:filecache" or "memory:"
+    //chunkMode is how file data gets laid out and chunkCodec what it's compressed with, e.g. "lz", "zlib" or "none"
+    //(see ShinyChunkStore.h), but only for a brand new filecache; an existing one keeps whatever it was created with
+    //chunkCacheSize is the memory budget of the chunk cache (see ShinyChunkCache.h), and can change from run to run
+    ShinyFilesystem( const char * filecache, ShinyChunkStore::Mode chunkMode = ShinyChunkStore::MODE_DIRECT, const char * chunkCodec = "lz", uint64_t chunkCacheSize = ShinyChunkCache::DEFAULT_SIZE );
     
     //Obligatory cleanup chump
     ~ShinyFilesystem();
@@ -55,21 +69,68 @@ protected:
 
 /////// NODE ROUTINES ///////
 public:
-    // Find a node from its path
+    // Find a node from its path.  Paths that have been found before come straight out of pathNodes
     ShinyMetaNode * findNode( const char * path );
     
+    // How many findNode() calls were answered from pathNodes, and how many had to go looking
+    uint64_t getPathCacheHits();
+    uint64_t getPathCacheMisses();
+    
     // Finds the parent node of the file at path, where the file does not need exist
     ShinyMetaDir * findParentNode( const char * path );
     
+    // Hands out a never-before-seen file ID, for a new file (or a file starting over, see ShinyChunkReclaimer) to
+    // store its chunks under.  Safe to call from any thread
+    uint64_t newFileID();
+    
     // reconstructs the path of a node
     const char * getNodePath( ShinyMetaNodeSnapshot * node );
+    
+    // Copies node (and if it's a dir, everything under it) into parent as newName, without copying any file data:
+    // files get cloned (see ShinyMetaFile::clone()) and dirs are just metadata, so even a huge tree only costs a few
+    // small DB puts per file.  Returns the copy, or NULL if any of it couldn't be made (in which case none of it is
+    // left lying around).  Nothing under node can be in the middle of a read or write, newName can't already be in
+    // parent, and parent can't be under node
+    ShinyMetaNode * clone( ShinyMetaNode * node, const char * newName, ShinyMetaDir * parent );
 protected:
+    // Drops the cached path of node, and of everything under it, for when it's deleted, renamed or moved (every
+    // path under a dir goes through it, so they're all just as wrong)
+    void forgetPath( ShinyMetaNodeSnapshot * node );
+    
     // cached paths for nodes
     std::unordered_map<ShinyMetaNodeSnapshot *, const char *> nodePaths;
     
+    // And the other way around, for findNode().  The keys are the very same strings nodePaths holds on to (so they
+    // come and go together, see forgetPath()), and only nodes that are there are kept: nothing can show up at a
+    // path that's already got a node, so making a new node never leaves anything in here wrong
+    struct PathHash {
+        size_t operator()( const char * path ) const;
+    };
+    struct PathEqual {
+        bool operator()( const char * a, const char * b ) const;
+    };
+    std::unordered_map<const char *, ShinyMetaNodeSnapshot *, PathHash, PathEqual> pathNodes;
+    uint64_t pathHits;
+    uint64_t pathMisses;
+    
     // The root dir.  Come on, what do you want from me?!
     ShinyMetaRootDir * root;
+    
+    // The next file ID to hand out, and the point up to which IDs have been reserved in the DB.  File handles hand
+    // out IDs from FUSE threads when they truncate, so these are protected by fileIDLock
+    uint64_t nextFileID;
+    uint64_t reservedFileID;
+    pthread_mutex_t fileIDLock;
 private:
+    // Gathers up the ID (and history ID, if it has one) of every file under node, for ShinyFileHistory::sweepOrphans()
+    void collectFileIDs( ShinyMetaNodeSnapshot * node, std::set<uint64_t> & fileIDs, std::set<uint64_t> & historyIDs );
+    
+    // Hands the chunks of every file under node over to the reclaimer, for throwing away a half-made clone
+    void releaseTree( ShinyMetaNode * node );
+    
+    // Runs sanityCheck() on every file under node, returning false if any of them fail it
+    bool checkTree( ShinyMetaNode * node );
+
     // Helper function for searching nodes that belong to a parent
     ShinyMetaNodeSnapshot * findMatchingChild( ShinyMetaDirSnapshot * parent, const char * childName, uint64_t childNameLen );
     
@@ -78,12 +139,61 @@ private:
 protected:
     // Returns the DB object, (used for FileHandle and File to write and read, etc....)
     ShinyDBWrapper * getDB();
+    
+    // Returns the pool of DB worker threads, for when we want DB work done without waiting on it
+    ShinyDBAsync * getAsync();
+    
+    // Returns the chunk store sitting on top of the DB, which is what file data actually gets read/written through
+    ShinyChunkStore * getChunkStore();
+    
+    // Returns the reclaimer, which deletes the chunks of files that are gone (or have started over) in the background
+    ShinyChunkReclaimer * getReclaimer();
+    
+    // Returns the prefetcher, which reads ahead of files being read front to back
+    ShinyChunkPrefetcher * getPrefetcher();
+    
+    // Returns the writeback buffer, which soaks up small writes until they add up to whole chunks
+    ShinyChunkWriteback * getWriteback();
+    
+    // Returns the history, which keeps old versions of files around
+    ShinyFileHistory * getHistory();
 private:
     // The key used to store the ShinyFS tree when we serialize it
     const char * getShinyFilesystemDBKey();
     const char * getShinyFilesystemSizeDBKey();
+    const char * getShinyFilesystemFileIDDBKey();
+    const char * getShinyFilesystemChunkModeDBKey();
+    const char * getShinyFilesystemChunkCodecDBKey();
+    const char * getShinyFilesystemChunkChecksumsDBKey();
     ShinyDBWrapper db;
     
+    // How file data is laid out in db, and the helper that works it out (and remembers it) when we open it up
+    ShinyChunkStore * chunks;
+    ShinyChunkStore * openChunkStore( const char * filecache, bool freshCache, ShinyChunkStore::Mode chunkMode, const char * chunkCodec, uint64_t chunkCacheSize );
+    
+    // Cleans up after files that have been deleted, sitting on top of chunks
+    ShinyChunkReclaimer * reclaimer;
+    
+    // Folds the deltas that small writes leave in chunks back into them
+    ShinyChunkCompactor * compactor;
+    
+    // Reads ahead for files being streamed, on async's workers
+    ShinyChunkPrefetcher * prefetcher;
+    
+    // Holds on to small writes until they fill a chunk (or the file gets flushed), sitting on top of chunks
+    ShinyChunkWriteback * writeback;
+    
+    // Old versions of files, sitting on top of chunks, and handing the ones it's done with to reclaimer
+    ShinyFileHistory * history;
+    
+    // The workers that do DB work for everyone else, and how many of them there are
+    ShinyDBAsync * async;
+    static const uint64_t ASYNC_THREADS = 4;
+    
+    // File IDs get reserved in the DB this many at a time, so that we never hand out the same ID twice, even if
+    // we crash before the tree gets saved
+    static const uint64_t FILEID_BLOCK = 1024;
+    
 
 /////// MISC ///////
 public:
@@ -100,7 +210,7 @@ public:
     //Returns the version of this ShinyFS
     const uint64_t getVersion();
 protected:
-    static const uint64_t VERSION = 5;
+    static const uint64_t VERSION = 11;
 };
 
 #endif //SHINYFILESYSTEM_H
\ No newline at end of file
@@ -0,0 +1,66 @@
+//
+//  ShinyIOVec.cpp
+//  shinyfs
+//
+
+#include "ShinyIOVec.h"
+#include <string.h>
+
+#define min( x, y ) ((x) > (y) ? (y) : (x))
+
+ShinyIOVecCursor::ShinyIOVecCursor( const struct iovec * iov, int iovcnt ) : iov(iov), iovcnt(iovcnt), seg(0), segOffset(0) {
+    // Start out on the first iovec that actually has something in it
+    this->skip( 0 );
+}
+
+uint64_t ShinyIOVecCursor::total( const struct iovec * iov, int iovcnt ) {
+    uint64_t len = 0;
+    for( int i=0; i<iovcnt; ++i )
+        len += iov[i].iov_len;
+    return len;
+}
+
+char * ShinyIOVecCursor::next( uint64_t len ) {
+    if( this->seg >= this->iovcnt || this->iov[this->seg].iov_len - this->segOffset < len )
+        return NULL;
+    char * data = (char *)this->iov[this->seg].iov_base + this->segOffset;
+    this->skip( len );
+    return data;
+}
+
+const char * ShinyIOVecCursor::take( uint64_t len, ShinyChunkScratch * scratch ) {
+    const char * data = this->next( len );
+    if( data )
+        return data;
+    char * gathered = scratch->grow( len );
+    this->gather( gathered, len );
+    return gathered;
+}
+
+void ShinyIOVecCursor::gather( char * output, uint64_t len ) {
+    while( len && this->seg < this->iovcnt ) {
+        uint64_t n = min( len, this->iov[this->seg].iov_len - this->segOffset );
+        memcpy( output, (const char *)this->iov[this->seg].iov_base + this->segOffset, n );
+        output += n;
+        len -= n;
+        this->skip( n );
+    }
+}
+
+void ShinyIOVecCursor::scatter( const char * input, uint64_t len ) {
+    while( len && this->seg < this->iovcnt ) {
+        uint64_t n = min( len, this->iov[this->seg].iov_len - this->segOffset );
+        memcpy( (char *)this->iov[this->seg].iov_base + this->segOffset, input, n );
+        input += n;
+        len -= n;
+        this->skip( n );
+    }
+}
+
+void ShinyIOVecCursor::skip( uint64_t len ) {
+    this->segOffset += len;
+    while( this->seg < this->iovcnt && this->segOffset >= this->iov[this->seg].iov_len ) {
+        this->segOffset -= this->iov[this->seg].iov_len;
+        this->seg++;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#ifndef shinyfs_ShinyIOVec_h
+#define shinyfs_ShinyIOVec_h
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "ShinyChunkScratch.h"
+
+/*
+ Walks front to back through an iovec list as if it were all one buffer, so that readv() and writev() can cut it up
+ on chunk boundaries without copying the whole thing into one place first.  Wherever the part that lands in a chunk
+ sits in a single iovec it gets handed out just as it is; only the parts that straddle two iovecs ever get copied
+ anywhere else.
+ */
+
+class ShinyIOVecCursor {
+public:
+    ShinyIOVecCursor( const struct iovec * iov, int iovcnt );
+
+    // How many bytes there are in all of iov
+    static uint64_t total( const struct iovec * iov, int iovcnt );
+
+    // If the next len bytes are all in one iovec, returns them and moves past them.  Otherwise returns NULL and
+    // stays put
+    char * next( uint64_t len );
+
+    // Same as next(), but if they're split up, they get gathered into scratch and handed back from there
+    const char * take( uint64_t len, ShinyChunkScratch * scratch );
+
+    // Copies the next len bytes out into output (gathering them), or in from input (scattering it), and moves
+    // past them
+    void gather( char * output, uint64_t len );
+    void scatter( const char * input, uint64_t len );
+private:
+    // Moves len bytes along, stepping over any empty iovecs on the way
+    void skip( uint64_t len );
+
+    const struct iovec * iov;
+    int iovcnt;
+
+    // Where we are: which iovec, and how far into it
+    int seg;
+    uint64_t segOffset;
+};
+
+#endif // shinyfs_ShinyIOVec_h
@@ -1,11 +1,31 @@
 #include "ShinyMetaDirSnapshot.h"
+#include "ShinyFilesystem.h"
 #include <base/Logger.h>
 #include <sys/stat.h>
+#include <string.h>
+#include <algorithm>
+
+// Compares a node's name against the first nameLen bytes of name, strcmp()-style, without having to strlen() either
+static int compareName( const char * nodeName, const char * name, uint64_t nameLen ) {
+    int cmp = strncmp( nodeName, name, nameLen );
+    if( cmp == 0 && nodeName[nameLen] )
+        return 1;
+    return cmp;
+}
+
+// For sorting nodes by name, once a dir gets small enough to go back to being sorted
+static bool nameLess( ShinyMetaNodeSnapshot * a, ShinyMetaNodeSnapshot * b ) {
+    return strcmp( a->getName(), b->getName() ) < 0;
+}
 
 ShinyMetaDirSnapshot::ShinyMetaDirSnapshot( const char ** serializedInput, ShinyMetaDirSnapshot * parent ) : ShinyMetaNodeSnapshot( serializedInput, parent ) {
     this->unserialize( serializedInput );
 }
 
+ShinyMetaDirSnapshot::ShinyMetaDirSnapshot() {
+    // This only to be called when we're actually creating a new node from a subclass
+}
+
 ShinyMetaDirSnapshot::~ShinyMetaDirSnapshot() {
     // Deletes all nodes this guy contains.  Nodes automagically remove themselves from us
     while( !nodes.empty() ) {
@@ -39,37 +59,169 @@ void ShinyMetaDirSnapshot::addNode( ShinyMetaNodeSnapshot *newNode ) {
         return;
     }
     
-    //Insert so that list is always sorted in ascending order of name
-    int64_t i;
-    for( i=0; i<this->nodes.size(); ++i ) {
-        // This means we are in a position to insert our new node into the list
-        if( strcmp( this->nodes[i]->getName(), newNode->getName() ) == -1 ) {
-            // Do a quick check against the next node (if there is one) to make sure they're no duplicates
-            if( i < this->nodes.size() - 1 && strcmp( this->nodes[i+1]->getName(), newNode->getName() ) == 0 ) {
-                WARN( "File %s already exists in %s! Duplicates are not allowed!", newNode->getName(), this->getName() );
-                return;
-            }
-            break;
+    const char * name = newNode->getName();
+    uint64_t nameLen = strlen( name );
+    if( this->slots.empty() ) {
+        //Insert so that list is always sorted in ascending order of name, making sure there are no duplicates
+        uint64_t i = this->lowerBound( name, nameLen );
+        if( i < this->nodes.size() && compareName( this->nodes[i]->getName(), name, nameLen ) == 0 ) {
+            WARN( "File %s already exists in %s! Duplicates are not allowed!", name, this->getName() );
+            return;
         }
+        this->nodes.insert( this->nodes.begin() + i, newNode );
+        
+        // Too many of us for a binary search to keep up, time for a table
+        if( this->nodes.size() > HASH_MIN )
+            this->rehash();
+        return;
+    }
+    
+    uint32_t hash = hashName( name, nameLen );
+    uint64_t slot = this->findSlot( name, nameLen, hash );
+    if( this->slots[slot].index != EMPTY ) {
+        WARN( "File %s already exists in %s! Duplicates are not allowed!", name, this->getName() );
+        return;
     }
-    nodes.insert(nodes.begin() + i, newNode );
+    this->slots[slot].hash = hash;
+    this->slots[slot].nameLen = (uint32_t)nameLen;
+    this->slots[slot].index = (uint32_t)this->nodes.size();
+    this->nodes.push_back( newNode );
+    
+    // Never more than half full, so nobody has to probe too far
+    if( this->nodes.size()*2 > this->slots.size() )
+        this->rehash();
 }
 
 void ShinyMetaDirSnapshot::delNode(ShinyMetaNodeSnapshot *delNode) {
+    // Whether it's being deleted or moved, the path it (and everything under it) used to have is no good anymore
+    ShinyFilesystem * fs = this->getFS();
+    if( fs )
+        fs->forgetPath( delNode );
+    
+    const char * name = delNode->getName();
+    uint64_t nameLen = strlen( name );
+    if( this->slots.empty() ) {
+        uint64_t i = this->lowerBound( name, nameLen );
+        if( i < this->nodes.size() && this->nodes[i] == delNode ) {
+            this->nodes.erase( this->nodes.begin() + i );
+            return;
+        }
+    } else {
+        uint64_t slot = this->findSlot( name, nameLen, hashName( name, nameLen ) );
+        uint32_t index = this->slots[slot].index;
+        if( index != EMPTY && this->nodes[index] == delNode ) {
+            this->clearSlot( slot );
+            
+            // The last node moves into the hole, so its slot has to know where it went.  That gets looked up before
+            // it moves, while every slot still points at somebody who's actually there
+            if( index + 1 < this->nodes.size() ) {
+                ShinyMetaNodeSnapshot * last = this->nodes.back();
+                const char * lastName = last->getName();
+                uint64_t lastLen = strlen( lastName );
+                this->slots[this->findSlot( lastName, lastLen, hashName( lastName, lastLen ) )].index = index;
+                this->nodes[index] = last;
+            }
+            this->nodes.pop_back();
+            
+            // Small enough for a binary search again
+            if( this->nodes.size() < HASH_MIN/2 ) {
+                this->slots.clear();
+                std::sort( this->nodes.begin(), this->nodes.end(), nameLess );
+            }
+            return;
+        }
+    }
+    
+    // Not where its name says it should be, so somebody renamed it without taking it out first.  Dig it out the
+    // slow way, and file everyone else again
     for( uint64_t i=0; i<this->nodes.size(); ++i ) {
         if( this->nodes[i] == delNode ) {
+            WARN( "%s was renamed while it was still in %s!", name, this->getName() );
             this->nodes.erase( this->nodes.begin() + i );
+            if( !this->slots.empty() )
+                this->rehash();
             return;
         }
     }
 }
 
 ShinyMetaNodeSnapshot * ShinyMetaDirSnapshot::findNode( const char *name ) {
-    for( uint64_t i=0; i<this->nodes.size(); ++i ) {
-        if( strcmp(this->nodes[i]->getName(), name) == 0 )
+    return this->findNode( name, strlen( name ) );
+}
+
+ShinyMetaNodeSnapshot * ShinyMetaDirSnapshot::findNode( const char * name, uint64_t nameLen ) {
+    if( this->slots.empty() ) {
+        uint64_t i = this->lowerBound( name, nameLen );
+        if( i < this->nodes.size() && compareName( this->nodes[i]->getName(), name, nameLen ) == 0 )
             return this->nodes[i];
+        return NULL;
+    }
+    
+    uint32_t index = this->slots[this->findSlot( name, nameLen, hashName( name, nameLen ) )].index;
+    return index == EMPTY ? NULL : this->nodes[index];
+}
+
+uint32_t ShinyMetaDirSnapshot::hashName( const char * name, uint64_t nameLen ) {
+    uint32_t hash = 2166136261u;
+    for( uint64_t i=0; i<nameLen; ++i )
+        hash = (hash ^ (uint8_t)name[i])*16777619u;
+    return hash;
+}
+
+uint64_t ShinyMetaDirSnapshot::lowerBound( const char * name, uint64_t nameLen ) {
+    uint64_t lo = 0, hi = this->nodes.size();
+    while( lo < hi ) {
+        uint64_t mid = lo + (hi - lo)/2;
+        if( compareName( this->nodes[mid]->getName(), name, nameLen ) < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+uint64_t ShinyMetaDirSnapshot::findSlot( const char * name, uint64_t nameLen, uint32_t hash ) {
+    // Linear probing: a name is either in the slot its hash picks, or somewhere after it, before the next empty one
+    const uint64_t mask = this->slots.size() - 1;
+    for( uint64_t slot = hash & mask; ; slot = (slot + 1) & mask ) {
+        const Slot & s = this->slots[slot];
+        if( s.index == EMPTY )
+            return slot;
+        if( s.hash == hash && s.nameLen == nameLen && memcmp( this->nodes[s.index]->getName(), name, nameLen ) == 0 )
+            return slot;
+    }
+}
+
+void ShinyMetaDirSnapshot::clearSlot( uint64_t slot ) {
+    // Anyone after the hole who'd rather be in it (or further back) moves up into it, leaving a new hole behind them
+    const uint64_t mask = this->slots.size() - 1;
+    uint64_t hole = slot;
+    for( uint64_t next = (hole + 1) & mask; this->slots[next].index != EMPTY; next = (next + 1) & mask ) {
+        uint64_t home = this->slots[next].hash & mask;
+        if( ((next - home) & mask) >= ((next - hole) & mask) ) {
+            this->slots[hole] = this->slots[next];
+            hole = next;
+        }
+    }
+    this->slots[hole].index = EMPTY;
+}
+
+void ShinyMetaDirSnapshot::rehash() {
+    // A quarter full at most, so we can double before we have to do this again
+    uint64_t size = 1;
+    while( size < 4*this->nodes.size() )
+        size <<= 1;
+    Slot empty = { 0, 0, EMPTY };
+    this->slots.assign( size, empty );
+    for( uint64_t i=0; i<this->nodes.size(); ++i ) {
+        const char * name = this->nodes[i]->getName();
+        uint64_t nameLen = strlen( name );
+        uint32_t hash = hashName( name, nameLen );
+        Slot & s = this->slots[this->findSlot( name, nameLen, hash )];
+        s.hash = hash;
+        s.nameLen = (uint32_t)nameLen;
+        s.index = (uint32_t)i;
     }
-    return NULL;
 }
 
 uint64_t ShinyMetaDirSnapshot::getNumNodes( void ) {
@@ -5,6 +5,17 @@
 #include <vector>
 #include "ShinyMetaNodeSnapshot.h"
 
+/*
+ Children are kept two different ways, depending on how many of them there are.  Up to HASH_MIN of them, nodes is
+ kept sorted by name, and finding one is a binary search; that's only a handful of string compares, and there's
+ nothing else to keep up to date.  Past that, nodes stops being kept in any order (new ones go on the end, and the
+ last one gets moved into the hole left by a deleted one), and finding one goes through an open-addressed hash table
+ instead.  Each slot holds the name's hash and length right next to where the node is in nodes, so a lookup only
+ ever touches the name of a node whose hash and length already matched, and adding or deleting a child costs the
+ same whether there are a thousand of them or ten million.  Once a dir shrinks back under HASH_MIN/2, the table is
+ thrown away and nodes gets sorted again.
+ */
+
 class ShinyMetaDirSnapshot : virtual public ShinyMetaNodeSnapshot {
 friend class ShinyMetaNodeSnapshot;
 /////// CREATION ///////
@@ -22,21 +33,54 @@ protected:
 
 /////// NODE MANAGEMENT ///////
 public:
-    // Returns a directory listing
+    // Dirs with more children than this find them through a hash table instead of a binary search
+    static const uint64_t HASH_MIN = 128;
+    
+    // Returns a directory listing, sorted by name for small dirs, and in no order at all for big ones (see above)
     const std::vector<ShinyMetaNodeSnapshot *> * getNodes();
     
     // Finds a node and returns it, NULL otherwise
     ShinyMetaNodeSnapshot * findNode( const char * name );
     
+    // Same, but name is nameLen bytes long and doesn't have to be \0-terminated (a piece of a path, say)
+    ShinyMetaNodeSnapshot * findNode( const char * name, uint64_t nameLen );
+    
     // Returns the number of children that belong to this dir
     uint64_t getNumNodes();
 protected:
-    // These are protected so only ShinyFilesystem and ShinyMetaNodes can use them
+    // These are protected so only ShinyFilesystem and ShinyMetaNodes can use them.  A node's name can't change
+    // while it's in here, since that's what it's filed under, so renaming means deleting it and adding it back
     void addNode( ShinyMetaNodeSnapshot * newNode );
     void delNode( ShinyMetaNodeSnapshot * delNode );
     
     // All of this dir's child nodes
     std::vector<ShinyMetaNodeSnapshot *> nodes;
+private:
+    // One slot of the hash table.  Empty slots have an index of EMPTY
+    struct Slot {
+        uint32_t hash;
+        uint32_t nameLen;
+        uint32_t index;
+    };
+    static const uint32_t EMPTY = 0xffffffff;
+    
+    // FNV-1a, which is plenty for file names
+    static uint32_t hashName( const char * name, uint64_t nameLen );
+    
+    // Where nodes has (or would have, if it isn't there) name, while it's sorted
+    uint64_t lowerBound( const char * name, uint64_t nameLen );
+    
+    // The slot name is in, or the empty one it would go in
+    uint64_t findSlot( const char * name, uint64_t nameLen, uint32_t hash );
+    
+    // Empties out slot, shifting whoever comes after it back so nobody's left on the wrong side of an empty one
+    void clearSlot( uint64_t slot );
+    
+    // Builds the table from scratch, with room for at least twice as many nodes as we've got
+    void rehash();
+    
+    // Empty until we get past HASH_MIN nodes, and always a power of two in size after that
+    std::vector<Slot> slots;
 
 /////// MISC ///////
 public:
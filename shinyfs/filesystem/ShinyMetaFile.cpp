@@ -1,11 +1,38 @@
 #include "ShinyMetaFile.h"
 #include "ShinyFilesystem.h"
 #include "ShinyMetaDir.h"
+#include "ShinyIOVec.h"
 #include <base/Logger.h>
+#include <string.h>
 
 #define min( x, y ) ((x) > (y) ? (y) : (x))
+#define max( x, y ) ((x) > (y) ? (x) : (y))
+
+// Flattens out what a file that's been cloned too many layers deep is layered on (see ShinyChunkStore::flatten()),
+// and hands whichever of it and the copy isn't needed anymore to the reclaimer
+class ShinyMetaFileFlattenJob : public ShinyDBJob {
+public:
+    ShinyMetaFileFlattenJob( ShinyChunkStore * store, ShinyChunkReclaimer * reclaimer, uint64_t backing, uint64_t newID )
+        : store(store), reclaimer(reclaimer), backing(backing), newID(newID) {
+    }
+protected:
+    virtual void run( ShinyDBWrapper * db ) {
+        if( this->store->flatten( this->backing, this->newID ) )
+            this->reclaimer->release( this->backing );
+        else
+            this->reclaimer->release( this->newID );
+    }
+private:
+    ShinyChunkStore * store;
+    ShinyChunkReclaimer * reclaimer;
+    uint64_t backing;
+    uint64_t newID;
+};
 
 ShinyMetaFile::ShinyMetaFile( const char * newName, ShinyMetaDir * parent ) : ShinyMetaNode( newName, parent ) {
+    // Brand new file, so it gets a brand new ID to store its chunks under, for whenever it outgrows being inlined
+    this->fileID = parent->getFS()->newFileID();
+    this->inlined = true;
 }
 
 ShinyMetaFile::ShinyMetaFile( const char ** serializedInput, ShinyMetaDir * parent ) : ShinyMetaNode( serializedInput, parent ) {
@@ -16,161 +43,630 @@ ShinyMetaFile::~ShinyMetaFile() {
 }
 
 uint64_t ShinyMetaFile::write( uint64_t offset, const char * data, uint64_t len ) {
-    ShinyFilesystem * fs = ShinyMetaFileSnapshot::getFS();
-    return this->write( fs->getDB(), fs->getNodePath(this), offset, data, len );
+    return this->write( ShinyMetaFileSnapshot::getFS(), offset, data, len );
+}
+
+uint64_t ShinyMetaFile::writev( uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    return this->writev( ShinyMetaFileSnapshot::getFS(), offset, iov, iovcnt );
 }
 
 void ShinyMetaFile::setLen( uint64_t newLen ) {
-    this->setLen( ShinyMetaFileSnapshot::getFS()->getDB(), ShinyMetaFileSnapshot::getPath(), newLen );
+    this->setLen( ShinyMetaFileSnapshot::getFS(), newLen );
 }
 
-uint64_t ShinyMetaFile::write( ShinyDBWrapper * db, const char * path, uint64_t offset, const char * data, uint64_t len ) {
-    // If we're going to overwrite, then exteeenddd..... EXTEEEENNDDDD!!!
-    if( offset + len > this->getLen() )
-        this->setLen( db, path, offset + len );
-    
-    // First, figure out what "chunk" to start from:
-    uint64_t chunk = offset/CHUNKSIZE;
+bool ShinyMetaFile::flush() {
+    return ShinyMetaFileSnapshot::getFS()->getWriteback()->flush( this->fileID );
+}
+
+void ShinyMetaFile::releaseChunks() {
+    this->releaseData();
     
-    // This is the offset within that chunk that we need to start from
-    offset = offset - chunk*CHUNKSIZE;
+    // Nobody's going to be digging through our old versions anymore either
+    if( this->historyID ) {
+        ShinyMetaFileSnapshot::getFS()->getHistory()->forget( this->historyID );
+        this->historyID = 0;
+    }
+}
+
+void ShinyMetaFile::releaseData() {
+    // Inlined files never had any chunks to begin with.  Anything still buffered would only be written out after the
+    // reclaimer is done with us, so it just gets thrown away
+    if( this->inlined )
+        this->resizeInline( 0 );
+    else {
+        ShinyFilesystem * fs = ShinyMetaFileSnapshot::getFS();
+        fs->getWriteback()->discard( this->fileID );
+        fs->getReclaimer()->release( this->fileID );
+    }
+    this->fileLen = 0;
+    this->chunkMap.clear();
+}
+
+uint64_t ShinyMetaFile::write( ShinyFilesystem * fs, uint64_t offset, const char * data, uint64_t len ) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return this->writev( fs, offset, &iov, 1 );
+}
+
+uint64_t ShinyMetaFile::writev( ShinyFilesystem * fs, uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    uint64_t len = ShinyIOVecCursor::total( iov, iovcnt );
+    this->adaptChunkSize( fs, offset, len );
     
-    // We'll have to build a new key for every chunk
-    uint64_t pathlen = strlen(path);
-    char * key = new char[pathlen+16+1];   // enough room for "<path>[chunk]\0"
-    memcpy( key, path, pathlen );
+    // Small writes just get buffered until they add up to a whole chunk, and the file grows right away as if they'd
+    // been written (a small writev() gets buffered an iovec at a time, since it all lands in a chunk or two anyway).
+    // Anything else goes straight to the DB, after whatever was buffered
+    ShinyChunkWriteback * writeback = fs->getWriteback();
+    uint64_t written = 0;
+    int seg = 0;
+    if( !this->inlined && len < this->chunkSize ) {
+        for( ; seg < iovcnt; ++seg ) {
+            if( iov[seg].iov_len == 0 )
+                continue;
+            uint64_t segStart = offset + written;
+            if( !writeback->write( this, segStart, (const char *)iov[seg].iov_base, iov[seg].iov_len ) )
+                break;
+            this->chunkMap.add( segStart/this->chunkSize, (segStart + iov[seg].iov_len - 1)/this->chunkSize + 1 );
+            written += iov[seg].iov_len;
+            this->fileLen = max( this->fileLen, offset + written );
+        }
+        if( written )
+            this->set_mtime();
+    }
     
-    // This is where we will plop the chunk at the end of the key
-    char * keyChunk = key + pathlen;
+    // Whatever the writeback wouldn't take, once everything it had is written out.  If that can't be, this can't
+    // either, or it'd end up underneath older data that's still buffered
+    if( seg < iovcnt ) {
+        if( !this->inlined && !writeback->flush( this->fileID ) )
+            ERROR( "Could not write out what's buffered of file %llu ahead of a write", this->fileID );
+        else
+            written += this->writev( fs->getChunkStore(), offset + written, iov + seg, iovcnt - seg );
+    }
+    fs->getPrefetcher()->forget( this->fileID );
+    return written;
+}
+
+void ShinyMetaFile::setLen( ShinyFilesystem * fs, uint64_t newLen ) {
+    if( newLen == 0 )
+        this->startOver( fs );
+    else {
+        // Truncating reads back the chunk the new end lands in, so it had better be up to date
+        if( !fs->getWriteback()->flush( this->fileID ) ) {
+            ERROR( "Could not write out what's buffered of file %llu ahead of setting its length", this->fileID );
+            return;
+        }
+        this->setLen( fs->getChunkStore(), newLen );
+        fs->getPrefetcher()->forget( this->fileID );
+    }
+}
+
+void ShinyMetaFile::rechunk( ShinyFilesystem * fs, uint64_t newChunkSize ) {
+    // Whoever asked for this knows better than we do
+    this->autoChunkSize = false;
+    if( newChunkSize == this->chunkSize )
+        return;
+    if( newChunkSize < ShinyMetaFileSnapshot::MIN_CHUNKSIZE || newChunkSize > ShinyMetaFileSnapshot::MAX_CHUNKSIZE || (newChunkSize & (newChunkSize - 1)) ) {
+        ERROR( "Refusing to re-chunk file %llu into bogus %llu byte chunks", this->fileID, newChunkSize );
+        return;
+    }
     
-    // The total number of bytes written
-    uint64_t bytesWritten = 0;
+    // Nothing stored (in chunks, anyway) means nothing to move
+    if( this->fileLen == 0 || this->inlined ) {
+        this->chunkSize = newChunkSize;
+        return;
+    }
+    this->rewrite( fs, newChunkSize );
+}
+
+bool ShinyMetaFile::rewrite( ShinyFilesystem * fs, uint64_t newChunkSize ) {
+    // Everything goes under a new ID, so if we don't make it all the way, the file is exactly how it was before (and
+    // whatever we did get written is just more garbage for the reclaimer).  We copy what's in the DB, so anything
+    // buffered has to get there first
+    ShinyChunkStore * store = fs->getChunkStore();
+    if( !fs->getWriteback()->flush( this->fileID ) ) {
+        ERROR( "Could not rewrite file %llu, its buffered writes won't go out", this->fileID );
+        return false;
+    }
+    uint64_t newID = fs->newFileID();
+    ShinyChunkBatch * batch = store->newBatch();
+    ShinyChunkScratch scratch;
+    char * chunkData = scratch.grow( newChunkSize );
+    ShinyChunkMap newMap;
+    bool success = true;
     
-    // Start to read in from chunks:
-    while( len > bytesWritten ) {
-        // Build this chunk's key:
-        sprintf( keyChunk, "%.16llx", chunk );
+    // Hop from data to data, so holes stay holes (and don't cost us anything)
+    int64_t dataStart = this->seekData( store, 0 );
+    while( dataStart >= 0 && success ) {
+        uint64_t chunk = dataStart/newChunkSize;
+        uint64_t chunkStart = chunk*newChunkSize;
+        uint64_t chunkLen = min( newChunkSize, this->fileLen - chunkStart );
+        if( this->read( store, chunkStart, chunkData, chunkLen ) != chunkLen ) {
+            success = false;
+            break;
+        }
+        batch->put( newID, chunk, chunkData, chunkLen );
+        newMap.add( chunk, chunk + 1 );
         
-        // Two possibilities; there is data before where we are writing that we need to preserve,
-        // or there is data after where we are writing in the same chunk.
-        if( offset != 0 || (len - bytesWritten < CHUNKSIZE && this->getLen() > offset + len) ) {
-            char * previousData = new char[CHUNKSIZE];
-            db->get( key, previousData, CHUNKSIZE );
-            
-            // copy over the stuff we need to
-            uint64_t amntToCopy = min( CHUNKSIZE - offset, len - bytesWritten );
-            memcpy( previousData + offset, data + bytesWritten, amntToCopy );
-            
-            // Set this chunk back
-            if( !db->put( key, previousData, CHUNKSIZE ) ) {
-                ERROR( "Could not write chunk %s to cache: %s", key, db->getError() );
-            }
-            
-            // increment the amount we've written
-            bytesWritten += amntToCopy;
-            
-            // cleanup cleanup
-            delete( previousData );
-        } else {
-            // Otherwise, it's a lot simpler, and we just need to copy over as much junk as we can
-            uint64_t amntToCopy = min( CHUNKSIZE, len - bytesWritten );
-            if( !db->put( key, data + bytesWritten, amntToCopy ) ) {
-                ERROR( "Could not write chunk %s to cache: %s", key, db->getError() );
-            }
+        if( batch->getSize() > MAXBATCHSIZE ) {
+            success = store->write( batch );
+            batch->clear();
+        }
+        dataStart = chunkStart + chunkLen < this->fileLen ? this->seekData( store, chunkStart + chunkLen ) : -1;
+    }
+    if( success )
+        success = store->write( batch );
+    
+    delete( batch );
+    
+    if( !success ) {
+        ERROR( "Could not rewrite file %llu: %s", this->fileID, store->getError() );
+        fs->getReclaimer()->release( newID );
+        return false;
+    }
+    fs->getPrefetcher()->forget( this->fileID );
+    fs->getReclaimer()->release( this->fileID );
+    this->fileID = newID;
+    this->chunkSize = newChunkSize;
+    this->chunkMap = newMap;
+    return true;
+}
 
-            // increment the amount we've written
-            bytesWritten += amntToCopy;
+bool ShinyMetaFile::clone( ShinyFilesystem * fs, ShinyMetaFile * target ) {
+    if( target == this )
+        return true;
+    
+    if( this->inlined ) {
+        // No chunks to share, so the data just gets copied over (it's a few KB at most)
+        target->releaseData();
+        if( !target->inlined ) {
+            target->fileID = fs->newFileID();
+            target->inlined = true;
         }
+        target->resizeInline( this->fileLen );
+        if( this->fileLen )
+            memcpy( target->inlineData, this->inlineData, this->fileLen );
+    } else {
+        uint64_t cloneID = this->cloneChunks( fs );
+        if( !cloneID )
+            return false;
         
-        // reset offset to zero, as we move on to the next chunk now
-        offset = 0;
-        chunk++;
+        // Whatever target had before is gone, it's all ours now (though its history sticks around, same as if we'd
+        // been written over it)
+        target->releaseData();
+        target->fileID = cloneID;
+        target->inlined = false;
+        target->fileLen = this->fileLen;
+        target->chunkMap = this->chunkMap;
+    }
+    target->chunkSize = this->chunkSize;
+    target->autoChunkSize = this->autoChunkSize;
+    target->set_mtime();
+    return true;
+}
+
+uint64_t ShinyMetaFile::cloneChunks( ShinyFilesystem * fs ) {
+    // Whatever we share had better be the whole story, so anything buffered goes out first
+    ShinyChunkStore * store = fs->getChunkStore();
+    if( !fs->getWriteback()->flush( this->fileID ) ) {
+        ERROR( "Could not clone file %llu, its buffered writes won't go out", this->fileID );
+        return 0;
+    }
+    
+    uint64_t newID = fs->newFileID();
+    uint64_t cloneID = fs->newFileID();
+    if( !store->clone( this->fileID, newID, cloneID ) ) {
+        ERROR( "Could not clone file %llu: %s", this->fileID, store->getError() );
+        return 0;
+    }
+    
+    // Our old ID is frozen for good now, so nobody's going to want anything read ahead under it
+    fs->getPrefetcher()->forget( this->fileID );
+    this->fileID = newID;
+    
+    // If we're as many layers deep as we go, what we're layered on gets copied out flat, so we (and our clone) are
+    // only two deep again.  It's frozen, so that can happen in the background without anybody waiting on it.  We
+    // might well be on a DB worker ourselves (see saveVersion()), so it can't wait for room in the queue either
+    if( store->getLayers( newID ) >= ShinyChunkStore::MAX_LAYERS ) {
+        ShinyMetaFileFlattenJob * job = new ShinyMetaFileFlattenJob( store, fs->getReclaimer(), store->getBacking( newID ), fs->newFileID() );
+        job->setAutoDelete( true );
+        fs->getAsync()->submitFollowUp( job );
+    }
+    return cloneID;
+}
+
+bool ShinyMetaFile::saveVersion() {
+    return this->saveVersion( ShinyMetaFileSnapshot::getFS() );
+}
+
+bool ShinyMetaFile::saveVersion( ShinyFilesystem * fs ) {
+    if( this->fileLen > ShinyFileHistory::MAX_FILESIZE )
+        return false;
+    
+    // Our history gets its own ID the first time around, from the same place file IDs come from, so it can't ever
+    // collide with one from a file that's long gone
+    if( !this->historyID )
+        this->historyID = fs->newFileID();
+    
+    // Inlined files are small enough to just be copied
+    ShinyFileHistory * history = fs->getHistory();
+    if( this->inlined )
+        return history->save( this->historyID, this->fileLen, this->chunkSize, 0, this->inlineData );
+    
+    // Everyone else gets cloned, and we carry on from the clone without it
+    uint64_t cloneID = this->cloneChunks( fs );
+    if( !cloneID )
+        return false;
+    if( !history->save( this->historyID, this->fileLen, this->chunkSize, cloneID, NULL ) ) {
+        fs->getReclaimer()->release( cloneID );
+        return false;
+    }
+    return true;
+}
+
+void ShinyMetaFile::getVersions( std::vector<uint64_t> & times ) {
+    times.clear();
+    if( this->historyID )
+        ShinyMetaFileSnapshot::getFS()->getHistory()->getVersions( this->historyID, times );
+}
+
+bool ShinyMetaFile::checkout( uint64_t historyID, uint64_t when ) {
+    return this->checkout( ShinyMetaFileSnapshot::getFS(), historyID, when );
+}
+
+bool ShinyMetaFile::checkout( ShinyFilesystem * fs, uint64_t historyID, uint64_t when ) {
+    // Read it all in first, since historyID might be ours
+    std::string data;
+    if( !historyID || !fs->getHistory()->read( historyID, when, data ) )
+        return false;
+    
+    // Then it's written out just like a brand new file, under a brand new ID, with what we had set aside until it's
+    // all in.  Holes come back as chunks of zeros, which never get stored, so they're holes again
+    uint64_t oldID = this->fileID;
+    uint64_t oldLen = this->fileLen;
+    uint64_t oldChunkSize = this->chunkSize;
+    bool oldInlined = this->inlined;
+    char * oldInlineData = this->inlineData;
+    ShinyChunkMap oldMap = this->chunkMap;
+    this->fileID = fs->newFileID();
+    this->fileLen = 0;
+    this->inlined = true;
+    this->inlineData = NULL;
+    this->chunkMap.clear();
+    
+    bool success = data.empty() || this->write( fs, 0, data.data(), data.size() ) == data.size();
+    if( success && !this->inlined )
+        success = fs->getWriteback()->flush( this->fileID );
+    
+    // Whichever of the two we're not keeping gets thrown away
+    uint64_t discardID = success ? oldID : this->fileID;
+    bool discardInlined = success ? oldInlined : this->inlined;
+    char * discardData = success ? oldInlineData : this->inlineData;
+    if( discardInlined )
+        delete [] discardData;
+    else {
+        fs->getPrefetcher()->forget( discardID );
+        fs->getWriteback()->discard( discardID );
+        fs->getReclaimer()->release( discardID );
+    }
+    if( !success ) {
+        ERROR( "Could not write out version of file %llu", oldID );
+        this->fileID = oldID;
+        this->fileLen = oldLen;
+        this->chunkSize = oldChunkSize;
+        this->inlined = oldInlined;
+        this->inlineData = oldInlineData;
+        this->chunkMap = oldMap;
+        return false;
+    }
+    this->set_mtime();
+    
+    // Putting an old version back is as much a change as any, so it can be undone too
+    this->saveVersion( fs );
+    return true;
+}
+
+void ShinyMetaFile::adaptChunkSize( ShinyFilesystem * fs, uint64_t offset, uint64_t len ) {
+    if( offset == this->lastWriteEnd || offset == this->fileLen )
+        this->seqWrites++;
+    else if( len < this->chunkSize )
+        this->randomWrites++;
+    this->lastWriteEnd = offset + len;
+    
+    if( !this->autoChunkSize || this->fileLen > MAXAUTORECHUNK )
+        return;
+    uint64_t newChunkSize = this->pickChunkSize( max( this->fileLen, offset + len ) );
+    if( newChunkSize != this->chunkSize ) {
+        this->rechunk( fs, newChunkSize );
+        this->autoChunkSize = true;
     }
+}
+
+uint64_t ShinyMetaFile::pickChunkSize( uint64_t newLen ) {
+    // Big files written start to finish (media, archives, images) get read that way too, so the fewer, bigger chunks
+    // the better: less per-chunk overhead, and millions fewer keys in the DB
+    if( newLen >= LARGEFILESIZE && this->randomWrites == 0 )
+        return ShinyMetaFileSnapshot::MAX_CHUNKSIZE;
     
+    // Small files getting poked at all over (databases, indexes) would rather each little write touch a little chunk
+    if( newLen <= SMALLFILESIZE && this->randomWrites >= MINRANDOMWRITES && this->randomWrites > this->seqWrites )
+        return ShinyMetaFileSnapshot::MIN_CHUNKSIZE;
+    
+    return this->chunkSize;
+}
+
+void ShinyMetaFile::startOver( ShinyFilesystem * fs ) {
+    // Inlined files have no chunks to get rid of, so there's no sense burning an ID on them
+    if( !this->inlined ) {
+        fs->getPrefetcher()->forget( this->fileID );
+        fs->getWriteback()->discard( this->fileID );
+        fs->getReclaimer()->release( this->fileID );
+        this->fileID = fs->newFileID();
+        this->inlined = true;
+    } else
+        this->resizeInline( 0 );
+    this->fileLen = 0;
+    this->chunkMap.clear();
     this->set_mtime();
-    return bytesWritten;
 }
 
-void ShinyMetaFile::setLen( ShinyDBWrapper * db, const char * path, uint64_t newLen ) {
-    // We'll have to build a new key for every chunk
-    uint64_t pathlen = strlen(path);
-    char * key = new char[pathlen+16+1];   // enough room for "<path>[chunk]\0"
-    memcpy( key, path, pathlen );
+void ShinyMetaFile::resizeInline( uint64_t newLen ) {
+    if( newLen == this->fileLen )
+        return;
     
-    // This is where we will plop the chunk at the end of the key
-    char * keyChunk = key + pathlen;
+    // These are never more than a few KB, so just make a new one
+    char * newData = newLen ? new char[newLen] : NULL;
+    uint64_t keepLen = min( this->fileLen, newLen );
+    if( keepLen )
+        memcpy( newData, this->inlineData, keepLen );
+    if( newLen > keepLen )
+        memset( newData + keepLen, 0, newLen - keepLen );
     
-    // Figure out if we need to delete chunks, or create new ones
-    if( this->fileLen > newLen ) {
-        // While the lengths are not matched, delete chunks (or pieces of them)
-        while( this->fileLen != newLen ) {
-            // Find the length of the last chunk
-            uint64_t chunkLen = this->fileLen - (this->fileLen/CHUNKSIZE)*CHUNKSIZE;
-            chunkLen = (chunkLen == 0 ? CHUNKSIZE : chunkLen);
-            
-            // Get the key for the last chunk
-            sprintf( keyChunk, "%.16llx", this->fileLen/CHUNKSIZE );
+    delete [] this->inlineData;
+    this->inlineData = newData;
+    this->fileLen = newLen;
+}
+
+bool ShinyMetaFile::spill( ShinyChunkStore * store ) {
+    // INLINESIZE is never more than a chunk, so it all goes in chunk 0 (an empty file doesn't need even that)
+    if( this->fileLen ) {
+        ShinyChunkBatch * batch = store->newBatch();
+        batch->put( this->fileID, 0, this->inlineData, this->fileLen );
+        bool success = store->write( batch );
+        delete( batch );
+        if( !success ) {
+            ERROR( "Could not move inlined file %llu out to cache: %s", this->fileID, store->getError() );
+            return false;
+        }
+        this->chunkMap.add( 0, 1 );
+    }
+    
+    delete [] this->inlineData;
+    this->inlineData = NULL;
+    this->inlined = false;
+    return true;
+}
+
+uint64_t ShinyMetaFile::write( ShinyChunkStore * store, uint64_t offset, const char * data, uint64_t len ) {
+    // A plain old write is just a writev() with only the one buffer
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return this->writev( store, offset, &iov, 1 );
+}
+
+uint64_t ShinyMetaFile::writev( ShinyChunkStore * store, uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    // Nothing to write?  Then we're done already!
+    uint64_t len = ShinyIOVecCursor::total( iov, iovcnt );
+    if( len == 0 )
+        return 0;
+    
+    // Small enough to stay inlined?  Then there's no DB in it at all.  Otherwise, out to the chunks we go, and
+    // carry on as usual
+    ShinyIOVecCursor cursor( iov, iovcnt );
+    if( this->inlined ) {
+        if( offset + len <= ShinyMetaFileSnapshot::INLINESIZE ) {
+            if( offset + len > this->fileLen )
+                this->resizeInline( offset + len );
+            cursor.gather( this->inlineData + offset, len );
+            this->set_mtime();
+            return len;
+        }
+        if( !this->spill( store ) )
+            return 0;
+    }
+    
+    // If we're going to overwrite, then exteeenddd..... EXTEEEENNDDDD!!!
+    uint64_t oldLen = this->fileLen;
+    uint64_t newLen = max( oldLen, offset + len );
+    
+    // Every chunk we touch gets built exactly once, right here.  If we're writing past the end of the file, the gap
+    // in between is left as a hole, so we only ever touch the chunks data actually lands in
+    const uint64_t chunkSize = this->chunkSize;
+    uint64_t chunk = offset/chunkSize;
+    uint64_t lastChunk = (offset + len - 1)/chunkSize;
+    
+    // Scratch space for chunks we need to patch together, only borrowed if we actually need it.  It comes out of this
+    // thread's spares, so after the first write it doesn't cost an allocation at all.  gathered is for the same
+    // thing, but for when the part of iov a chunk gets is split across iovecs, so it can be put in one piece; data
+    // that's all in one iovec gets handed straight to the batch
+    ShinyChunkScratch scratch, gathered;
+    char * chunkData = NULL;
+    
+    // Used to peek at old chunk data, the batch holds all the new data until we write it out in one go
+    ShinyChunkReader reader( store, this->fileID, chunk, chunk );
+    ShinyChunkBatch * batch = store->newBatch();
+    
+    // The map has to know about these before any of them can make it into the DB, since a big write can go out in
+    // pieces, and it's no harm if some of them never do.  Only the first and last chunks can have anything of theirs
+    // left over, so those are the only ones we need to know about from before
+    bool firstHadData = this->chunkMap.has( chunk );
+    bool lastHadData = this->chunkMap.has( lastChunk );
+    this->chunkMap.add( chunk, lastChunk + 1 );
+    
+    // Everything before this chunk has made it into the DB, for when a big write goes out in pieces and one of them
+    // doesn't make it
+    uint64_t batchStart = chunk;
+    bool success = true;
+    for( ; chunk <= lastChunk; ++chunk ) {
+        // How long this chunk is going to be, and how much of it was there before we got here
+        uint64_t chunkStart = chunk*chunkSize;
+        uint64_t chunkLen = min( chunkSize, newLen - chunkStart );
+        uint64_t oldChunkLen = oldLen > chunkStart ? min( chunkSize, oldLen - chunkStart ) : 0;
+        
+        // The part of this chunk that data covers
+        uint64_t writeEnd = min( chunkLen, offset + len - chunkStart );
+        uint64_t writeStart = offset > chunkStart ? offset - chunkStart : 0;
+        
+        // Only small writes into data that's already there are worth logging as deltas; if there's nothing to keep
+        // from the old chunk we wouldn't be reading it in anyway
+        uint64_t deltaBytes = 0;
+        bool patch = oldChunkLen && (writeStart > 0 || writeEnd < oldChunkLen) && writeEnd - writeStart <= chunkSize/DELTAFRACTION &&
+                     store->getDeltas( this->fileID, chunk, &deltaBytes ) < ShinyChunkStore::MAX_DELTAS &&
+                     deltaBytes + writeEnd - writeStart <= chunkSize;
+        
+        if( writeStart == 0 && writeEnd == chunkLen ) {
+            // If we're overwriting this entire chunk, it's a lot simpler, we just hand data right over
+            batch->put( this->fileID, chunk, cursor.take( chunkLen, &gathered ), chunkLen );
+        } else if( patch ) {
+            // No need to read anything at all, the new data gets laid over the old whenever the chunk is read
+            batch->patch( this->fileID, chunk, writeStart, cursor.take( writeEnd - writeStart, &gathered ), writeEnd - writeStart );
+        } else {
+            // Otherwise, there is data before where we are writing that we need to preserve, or there is
+            // data after where we are writing in the same chunk.  Or both.  Patch it together!
+            if( !chunkData )
+                chunkData = scratch.grow( chunkSize );
             
-            // Should we take away this entire chunk, or just part of it?
-            if( this->fileLen - chunkLen >= newLen ) {
-                // TAKE THE LEG!  TAKE THE LEG DOCTOR! (remove the last chunk)
-                if( !db->del( key ) ) {
-                    WARN( "Couldn't remove chunk %s from cache, %s", key, db->getError() );
-                }
-                this->fileLen -= chunkLen;
-            } else {
-                // Here's the tricksy part, we have to remove PART of this chunk
-                // We will first get the part of the chunk that matters, and reset the key with that value
-                char * data = new char[this->fileLen - newLen];
-                if( !db->get( key, data, this->fileLen - newLen ) ) {
-                    ERROR( "Could not read chunk %s, from cache, %s", key, db->getError() );
-                }
-                if( !db->put( key, data, this->fileLen - newLen ) ) {
-                    ERROR( "Could not write chunk %s to cache, %s", key, db->getError() );
+            // Hang on to the old data (but only bother reading it in if we aren't about to stomp all over it, and it
+            // isn't a hole anyway)
+            uint64_t keepLen = 0;
+            bool hadData = chunk == lastChunk ? lastHadData : firstHadData;
+            if( oldChunkLen && (writeStart > 0 || writeEnd < oldChunkLen) && hadData ) {
+                uint64_t oldDataLen;
+                if( !reader.copy( chunk, 0, chunkData, oldChunkLen, &oldDataLen ) ) {
+                    // Which includes a chunk that fails its checksum.  Zeros in its place would get a brand new
+                    // checksum of their own, and then nobody would ever know, so this is as far as the write goes
+                    ERROR( "Could not read chunk %llu of file %llu from cache: %s", chunk, this->fileID, reader.getError() );
+                    success = false;
+                    break;
                 }
-                
-                delete( data );
-                this->fileLen = newLen;
+                keepLen = min( oldDataLen, oldChunkLen );
             }
-        }
-    } else {
-        while( this->fileLen != newLen ) {
-            // Find the length that would be added by fulfilling this chunk, or adding a new one
-            //uint32_t chunkLen = CHUNKSIZE - (this->fileLen - (this->fileLen/CHUNKSIZE)*CHUNKSIZE);
             
-            // Get the key for the last chunk
-            sprintf( keyChunk, "%.16llx", this->fileLen/CHUNKSIZE );
+            // Anything between the old data and ours is new territory, and so becomes zeros.  Anything after both
+            // doesn't need storing at all, since the end of a short chunk reads back as zeros anyway
+            uint64_t storeLen = max( keepLen, writeEnd );
+            memset( chunkData + keepLen, 0, storeLen - keepLen );
             
-            // Create a buffer large enough to hold this entire chunk
-            uint64_t newChunkLen = min(CHUNKSIZE, newLen - this->fileLen);
-            char * data = new char[newChunkLen];
-            
-            // Do we have junk we need to save by reading it in, appending zeros, then writing back?
-            if( this->fileLen % CHUNKSIZE ) {
-                // Get the existing data
-                if( !db->get( key, data, newChunkLen ) ) {
-                    ERROR( "Could not read chunk %s from cache, %s", key, db->getError() );
-                }
-            }
-            // write it in again
-            if( !db->put( key, data, newChunkLen ) ) {
-                ERROR( "Could not write chunk %s to cache, %s", key, db->getError() );
+            // copy over the stuff we need to
+            cursor.gather( chunkData + writeStart, writeEnd - writeStart );
+            batch->put( this->fileID, chunk, chunkData, storeLen );
+        }
+        
+        // Don't let gigantic writes hold everything in memory at once; they just won't be all-or-nothing.  If a
+        // piece doesn't make it, there's no point carrying on past the hole it leaves
+        if( batch->getSize() > MAXBATCHSIZE ) {
+            if( !(success = store->write( batch )) ) {
+                ERROR( "Could not write chunks of file %llu to cache: %s", this->fileID, store->getError() );
+                break;
             }
-            
-            this->fileLen += newChunkLen;
+            batch->clear();
+            batchStart = chunk + 1;
         }
     }
     
+    // Out they go (whatever's left of them, anyway), all at once
+    if( success ) {
+        if( store->write( batch ) )
+            batchStart = lastChunk + 1;
+        else
+            ERROR( "Could not write chunks of file %llu to cache: %s", this->fileID, store->getError() );
+    }
+    
+    // cleanup cleanup
+    delete( batch );
+    
+    // Only what made it into the DB counts as written, so a write that only got partway is a short write, and if
+    // none of it made it the file hasn't changed one bit
+    uint64_t written = batchStart*chunkSize > offset ? min( len, batchStart*chunkSize - offset ) : 0;
+    if( written == 0 )
+        return 0;
+    
+    this->fileLen = max( oldLen, offset + written );
+    this->set_mtime();
+    return written;
+}
+
+void ShinyMetaFile::setLen( ShinyChunkStore * store, uint64_t newLen ) {
+    // Inlined files just get their data resized, unless they're growing too big for that
+    if( this->inlined ) {
+        if( newLen <= ShinyMetaFileSnapshot::INLINESIZE ) {
+            this->resizeInline( newLen );
+            this->set_mtime();
+            return;
+        }
+        if( !this->spill( store ) )
+            return;
+    }
+    
+    // Growing a file is free: everything past the old end is a hole, and chunks never hold anything past the end of
+    // their file (that's what the trimming below is for), so there's nothing in the DB to touch at all
+    if( newLen >= this->fileLen ) {
+        this->fileLen = newLen;
+        this->set_mtime();
+        return;
+    }
+    
+    const uint64_t chunkSize = this->chunkSize;
+    
+    // All the deletes and puts go out together, so we're never left with a half-truncated file.  The only chunk
+    // we ever need to read back is the one the new end lands in
+    ShinyChunkReader reader( store, this->fileID, newLen/chunkSize, newLen/chunkSize );
+    ShinyChunkBatch * batch = store->newBatch();
+    const char * oldData;
+    uint64_t oldDataLen;
+    
+    // TAKE THE LEG!  TAKE THE LEG DOCTOR! (remove all chunks that are entirely past the new end, skipping over holes
+    // since there's nothing there to remove.  Only the runs the map has can have anything in them at all)
+    uint64_t endChunk = (this->fileLen + chunkSize - 1)/chunkSize;
+    uint64_t newEndChunk = (newLen + chunkSize - 1)/chunkSize;
+    for( uint64_t run = this->chunkMap.nextData( newEndChunk, endChunk ); run < endChunk; ) {
+        uint64_t runEnd = this->chunkMap.nextHole( run, endChunk );
+        for( uint64_t chunk = store->nextData( this->fileID, run, runEnd ); chunk < runEnd; chunk = store->nextData( this->fileID, chunk + 1, runEnd ) )
+            batch->del( this->fileID, chunk );
+        run = this->chunkMap.nextData( runEnd, endChunk );
+    }
+    
+    // Here's the tricksy part, if the new end lands in the middle of a chunk we have to remove PART of it.
+    // We just reset the chunk with the part of it that matters (unless it's a hole, or already short enough).  If we
+    // can't get at it, the file stays how it was; otherwise whatever's past the new end would come right back the
+    // next time the file grows, where there should be zeros
+    if( newLen % chunkSize && this->chunkMap.has( newLen/chunkSize ) ) {
+        if( !reader.read( newLen/chunkSize, &oldData, &oldDataLen ) ) {
+            ERROR( "Could not read chunk %llu of file %llu from cache, %s", newLen/chunkSize, this->fileID, reader.getError() );
+            delete( batch );
+            return;
+        }
+        if( oldDataLen > newLen % chunkSize )
+            batch->put( this->fileID, newLen/chunkSize, oldData, newLen % chunkSize );
+    }
+    
+    // write it all out
+    if( store->write( batch ) ) {
+        this->fileLen = newLen;
+        this->chunkMap.trim( newEndChunk );
+    } else
+        ERROR( "Could not resize file %llu in cache, %s", this->fileID, store->getError() );
+    
+    delete( batch );
     this->set_mtime();
 }
 
-/*
 bool ShinyMetaFile::sanityCheck( void ) {
-    //First, the basic stuff
-    bool retVal = ShinyMetaNode::sanityCheck();
+    //First, the basic stuff (once ShinyMetaNode has its sanityCheck() back, anyway)
+    bool retVal = true;
 
-    TODO( "Add in file hash checking here" );
+    // Then every chunk, checksums and all
+    retVal &= this->verify();
     
     return retVal;
-}
-*/
\ No newline at end of file
+}
\ No newline at end of file
@@ -2,18 +2,37 @@
 #ifndef SHINYMETAFILE_H
 #define SHINYMETAFILE_H
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "ShinyMetaNode.h"
 #include "ShinyMetaFileSnapshot.h"
-#include "ShinyDBWrapper.h"
+#include "ShinyChunkStore.h"
 
 class ShinyMetaDir;
 class ShinyMetaFile : public ShinyMetaNode {
 /////// DEFINES ///////
 public:
-    // The size of a "chunk" stored in the DB
+    // The size of a "chunk" stored in the DB, for new files (see ShinyMetaFileSnapshot)
     static const uint64_t CHUNKSIZE = 64*1024;
     
+    // Writes/truncates are applied to the DB as a single atomic batch, unless they'd queue up more than
+    // this many bytes, at which point they get written out in pieces so we don't eat all the RAM
+    static const uint64_t MAXBATCHSIZE = 64*1024*1024;
+    
+    // Writes that only cover part of a chunk, and no more than 1/DELTAFRACTION of it, get logged as deltas against
+    // the chunk instead of reading it in, patching it and writing the whole thing back out.  That's until the chunk's
+    // deltas add up to a whole chunk's worth, or there are ShinyChunkStore::MAX_DELTAS of them, then it's rewritten
+    static const uint64_t DELTAFRACTION = 4;
+    
+    // Chunk size policy (see pickChunkSize()).  Files that have only ever been written front to back get the biggest
+    // chunks once they grow to LARGEFILESIZE; files no bigger than SMALLFILESIZE that have had at least
+    // MINRANDOMWRITES small writes all over the place (and more of those than any other kind) get the smallest.
+    // Files only get re-chunked on their own while they're no bigger than MAXAUTORECHUNK, since it means copying them
+    static const uint64_t LARGEFILESIZE = 4*1024*1024;
+    static const uint64_t SMALLFILESIZE = 1024*1024;
+    static const uint64_t MINRANDOMWRITES = 16;
+    static const uint64_t MAXAUTORECHUNK = 16*1024*1024;
+    
 //////// CREATION ///////
 public:
     // Same as above, but adds this guy as a child to given parent (this is just for convenience, this just calls "addNode()" for you)
@@ -27,24 +46,119 @@ public:
     
 /////// ATTRIBUTES //////
 public:
-    // Set a new length for this file (is implicitly called by write())
-    // truncates if newLen < getLen(), appends zeros if newLen > getLen()
+    // Set a new length for this file
+    // truncates if newLen < getLen(), appends a hole (which reads back as zeros) if newLen > getLen().  Truncating
+    // to zero doesn't touch the DB at all, see startOver().  New files (and files truncated to zero) start out
+    // inlined, and stay that way until they grow past INLINESIZE
     virtual void setLen( uint64_t newLen );
     
     // Blocks until task completion. Should only be called from same thread as one that owns the
-    // ShinyFilesystem. Returns how many bytes we were able to read/write.
+    // ShinyFilesystem. Returns how many bytes we were able to read/write.  All chunks touched by a write
+    // go into the DB as one atomic batch, so a crash can't leave a write half-done.  Writes smaller than a chunk
+    // don't go to the DB until their chunk fills up or the file is flush()ed, but read back right away all the same
     virtual uint64_t write( uint64_t offset, const char * data, uint64_t len );
+    
+    // Same as write(), but gathered from iovcnt buffers, front to back.  iov gets cut up on chunk boundaries as it
+    // goes, so every chunk is still only touched once, and only the bits of it that straddle two iovecs ever get
+    // copied into one piece.  A writev() no bigger than a chunk gets buffered just like a small write()
+    virtual uint64_t writev( uint64_t offset, const struct iovec * iov, int iovcnt );
+    
+    // Small writes get buffered up until they fill a chunk (see ShinyChunkWriteback); this writes out whatever's
+    // still buffered for this file, for fsync() and close.  Returns false if it couldn't be
+    virtual bool flush();
+    
+    // Moves this file's data over to chunks of newChunkSize (a power of two, between MIN_CHUNKSIZE and
+    // MAX_CHUNKSIZE).  It all gets copied under a brand new ID and the old one goes to the reclaimer, so the file is
+    // never half one size and half the other.  Costs a read and a write of the whole file (minus holes), and the
+    // file sticks with newChunkSize from then on, rather than going with whatever pickChunkSize() thinks
+    void rechunk( ShinyFilesystem * fs, uint64_t newChunkSize );
+    
+    // Makes target (whatever was in it before is thrown away) a copy of this file without copying any data: we both
+    // end up layered on top of what this file is right now (see ShinyChunkStore::clone()), sharing every chunk until
+    // one of us writes it.  Takes a few small DB puts, however big the file is.  Both files move to new IDs, so
+    // neither can have anything in flight.  Returns false if it couldn't be done, leaving both files how they were
+    bool clone( ShinyFilesystem * fs, ShinyMetaFile * target );
+    
+    // Called when this file is being deleted for good; hands all of its chunks over to the ShinyChunkReclaimer (and
+    // its old versions over to the ShinyFileHistory) and returns right away, so whoever is unlinking us doesn't have
+    // to wait on the DB.  Since file IDs are never reused, it's safe to delete this node (and create new ones) as
+    // soon as this returns
+    void releaseChunks();
+    
+/////// HISTORY ///////
+public:
+    // Saves what's in the file right now as its newest version (see ShinyFileHistory), for when it's been closed after
+    // being written to.  Chunked files get cloned, so it costs a few small DB puts however big the file is (plus
+    // writing out whatever's still buffered), and the file moves to a new ID, so it can't have anything in flight.
+    // Files too big to keep history for are skipped.  The mediator has a DB worker do this on a ShinyMetaFileHandle,
+    // rather than holding everyone else up.  Returns false if no version got saved
+    virtual bool saveVersion();
+    
+    // Fills times with when (in seconds since the epoch) every saved version of the file was saved, oldest first
+    void getVersions( std::vector<uint64_t> & times );
+    
+    // Makes us hold what the file with history ID historyID held as of when (in seconds since the epoch, see
+    // ShinyFileHistory::read()), and saves that as a version of ours.  It all gets written under a brand new ID, and
+    // we only move over to it (throwing away whatever we held before) once it's all in the DB, so if it can't be
+    // written we're left just how we were.  We can't have anything in flight.  Costs a read and a write of the whole
+    // version, so the mediator has a DB worker do it on a ShinyMetaFileHandle.  Returns false if there's no such
+    // version or it couldn't be written
+    virtual bool checkout( uint64_t historyID, uint64_t when );
 protected:
+    // The real saveVersion()/checkout(), for whoever has the ShinyFilesystem handy
+    bool saveVersion( ShinyFilesystem * fs );
+    bool checkout( ShinyFilesystem * fs, uint64_t historyID, uint64_t when );
+    
+    // The real work of clone() for chunked files: freezes our chunks and layers a clone on top of them, which gets
+    // returned (or 0 if it couldn't be done), moving us over to a new ID of our own.  If that leaves us MAX_LAYERS
+    // deep, whatever we're layered on gets flattened out in the background (see ShinyChunkStore::flatten())
+    uint64_t cloneChunks( ShinyFilesystem * fs );
+    
+    // releaseChunks(), but the file keeps its history, for when it's being overwritten rather than deleted
+    void releaseData();
+    
+    // Keeps track of how we're being written to, and re-chunks us if pickChunkSize() says we'd be better off with
+    // another chunk size.  Called right before each write of len bytes at offset
+    void adaptChunkSize( ShinyFilesystem * fs, uint64_t offset, uint64_t len );
+    
+    // The chunk size this file should have once it's newLen long, going by how it's been written to so far (see
+    // ShinyMetaFileSnapshot::seqWrites and friends)
+    uint64_t pickChunkSize( uint64_t newLen );
+    
+    // The real work of rechunk(): copies all of our data over to chunks of newChunkSize under a brand new ID, and
+    // hands the old one to the reclaimer.  Returns false (leaving the file how it was) if it couldn't be
+    bool rewrite( ShinyFilesystem * fs, uint64_t newChunkSize );
+    
+    // Truncating to zero: rather than deleting every chunk, the old ID (and everything under it) goes to the
+    // reclaimer and we carry on under a brand new one, so it costs the same no matter how big the file was.  Either
+    // way, we're back to being inlined
+    void startOver( ShinyFilesystem * fs );
+    
+    // Resizes inlineData to newLen, zero-filling anything new.  newLen can't be more than INLINESIZE
+    void resizeInline( uint64_t newLen );
+    
+    // Moves an inlined file's data out into a chunk, for when it's about to grow past INLINESIZE.  Returns false
+    // (and leaves the file inlined) if it couldn't be written
+    bool spill( ShinyChunkStore * store );
+    
+    // The above setLen() and write() (and ShinyMetaFileHandle's) go through these guys, which keep the prefetcher
+    // and the writeback buffer in the loop, and sub out to the ones below for the DB work
+    uint64_t write( ShinyFilesystem * fs, uint64_t offset, const char * data, uint64_t len );
+    uint64_t writev( ShinyFilesystem * fs, uint64_t offset, const struct iovec * iov, int iovcnt );
+    void setLen( ShinyFilesystem * fs, uint64_t newLen );
+    
     // These are the peeps that do the real work, the above setLen() and write() sub out to thess guys,
-    // and just grab the db object from the ShinyFS, (which is why I have ShinyMetafileHandle for when
-    // the ShinyFS object is unreachable, but we have the db object at hand)
-    virtual uint64_t write( ShinyDBWrapper * db, const char * path, uint64_t offset, const char * data, uint64_t len );
-    virtual void setLen( ShinyDBWrapper * db, const char * path, uint64_t newLen );
+    // and just grab the chunk store from the ShinyFS, (which is why I have ShinyMetafileHandle for when
+    // the ShinyFS object is unreachable, but we have the chunk store at hand)
+    virtual uint64_t write( ShinyChunkStore * store, uint64_t offset, const char * data, uint64_t len );
+    virtual uint64_t writev( ShinyChunkStore * store, uint64_t offset, const struct iovec * iov, int iovcnt );
+    virtual void setLen( ShinyChunkStore * store, uint64_t newLen );
     
 /////// MISC ///////
 public:
-    //Performs various checks to make sure this node is all right
-    //virtual bool sanityCheck();
+    //Performs various checks to make sure this node is all right.  For now that's reading back every chunk and making
+    //sure it checks out (see verify()), since the node checks are still waiting on the snapshot rewrite
+    virtual bool sanityCheck();
     
     //Always returns TYPE_FILE, imagine that!
     //virtual ShinyMetaNode::NodeType getNodeType( void );
@@ -14,15 +14,66 @@ ShinyMetaFileHandle::~ShinyMetaFileHandle() {
 }
 
 uint64_t ShinyMetaFileHandle::read( uint64_t offset, char *data, uint64_t len ) {
-    return this->ShinyMetaFile::read( this->fs->getDB(), this->path, offset, data, len );
+    // Anything still buffered has to make it to the DB before we can read it back
+    this->fs->getWriteback()->flush( this->fileID );
+    
+    // Whatever's been read ahead gets handed straight back, and the rest gets spread across the DB workers, rather
+    // than going chunk by chunk on this thread
+    return this->fs->getPrefetcher()->read( this, offset, data, len );
 }
 
 uint64_t ShinyMetaFileHandle::write( uint64_t offset, const char *data, uint64_t len ) {
-    return this->ShinyMetaFile::write( this->fs->getDB(), this->path, offset, data, len );
+    return this->ShinyMetaFile::write( this->fs, offset, data, len );
+}
+
+uint64_t ShinyMetaFileHandle::readv( uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    // One buffer is just a read(), which gets read ahead for; the prefetcher only deals in plain buffers, so anything
+    // else goes chunk by chunk, straight into iov
+    if( iovcnt == 1 )
+        return this->read( offset, (char *)iov[0].iov_base, iov[0].iov_len );
+    this->fs->getWriteback()->flush( this->fileID );
+    return this->ShinyMetaFile::readv( this->fs->getChunkStore(), offset, iov, iovcnt );
+}
+
+uint64_t ShinyMetaFileHandle::writev( uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    return this->ShinyMetaFile::writev( this->fs, offset, iov, iovcnt );
 }
 
 void ShinyMetaFileHandle::setLen( uint64_t newLen ) {
-    this->ShinyMetaFile::setLen( this->fs->getDB(), this->path, newLen );
+    this->ShinyMetaFile::setLen( this->fs, newLen );
+}
+
+bool ShinyMetaFileHandle::flush() {
+    return this->fs->getWriteback()->flush( this->fileID );
+}
+
+int64_t ShinyMetaFileHandle::seekData( uint64_t offset ) {
+    // Buffered chunks are data too, but the DB doesn't know about them yet
+    this->fs->getWriteback()->flush( this->fileID );
+    return this->ShinyMetaFile::seekData( this->fs->getChunkStore(), offset );
+}
+
+int64_t ShinyMetaFileHandle::seekHole( uint64_t offset ) {
+    this->fs->getWriteback()->flush( this->fileID );
+    return this->ShinyMetaFile::seekHole( this->fs->getChunkStore(), offset );
+}
+
+bool ShinyMetaFileHandle::getMerkleRoot( char * root ) {
+    this->fs->getWriteback()->flush( this->fileID );
+    return this->ShinyMetaFile::getMerkleRoot( this->fs->getChunkStore(), root );
+}
+
+bool ShinyMetaFileHandle::verify() {
+    this->fs->getWriteback()->flush( this->fileID );
+    return this->ShinyMetaFile::verify( this->fs->getChunkStore() );
+}
+
+bool ShinyMetaFileHandle::saveVersion() {
+    return this->ShinyMetaFile::saveVersion( this->fs );
+}
+
+bool ShinyMetaFileHandle::checkout( uint64_t historyID, uint64_t when ) {
+    return this->ShinyMetaFile::checkout( this->fs, historyID, when );
 }
 
 ShinyMetaNode::NodeType ShinyMetaFileHandle::getNodeType() {
@@ -19,7 +19,8 @@ protected:
     // Gotta hang on to this sucker, so that we can use fs->getZMQContext()
     ShinyFilesystem * fs;
     
-    // Gotta hang on to the path, as we need it when talking to the db object
+    // The path we were opened with.  The db object doesn't need it anymore (chunks are keyed off of the file ID
+    // we got serialized with) but it's nice to know who we are when debugging
     const char * path;
 
 /////// ATTRIBUTES //////
@@ -32,6 +33,19 @@ public:
     virtual uint64_t write( uint64_t offset, const char * data, uint64_t len );
     virtual void setLen( uint64_t newLen );
     
+    // Scatter/gather versions of the above, for ShinyFuse's read_buf/write_buf
+    virtual uint64_t readv( uint64_t offset, const struct iovec * iov, int iovcnt );
+    virtual uint64_t writev( uint64_t offset, const struct iovec * iov, int iovcnt );
+    virtual bool flush();
+    virtual int64_t seekData( uint64_t offset );
+    virtual int64_t seekHole( uint64_t offset );
+    virtual bool getMerkleRoot( char * root );
+    virtual bool verify();
+    
+    // For the mediator's DB workers, which get handed a copy of the file to save a version of (or check one out into)
+    virtual bool saveVersion();
+    virtual bool checkout( uint64_t historyID, uint64_t when );
+    
     // Override this for simplicity
     virtual ShinyMetaNodeSnapshot::NodeType getNodeType();
 };
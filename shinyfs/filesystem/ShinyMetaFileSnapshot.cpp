@@ -1,30 +1,71 @@
 #include "ShinyFilesystem.h"
 #include "ShinyMetaFileSnapshot.h"
+#include "ShinyIOVec.h"
 #include <base/Logger.h>
+#include <string.h>
 
 #define min( x, y ) ((x) > (y) ? (y) : (x))
+#define max( x, y ) ((x) > (y) ? (x) : (y))
+
+// One piece of a big read, handed off to a DB worker
+class ShinyMetaFileReadJob : public ShinyDBJob {
+public:
+    ShinyMetaFileReadJob( ShinyMetaFileSnapshot * file, ShinyChunkStore * store, uint64_t offset, char * data, uint64_t len )
+        : file(file), store(store), offset(offset), data(data), len(len), bytesRead(0) {
+    }
+    
+    uint64_t getLen() {
+        return this->len;
+    }
+    
+    uint64_t getBytesRead() {
+        return this->bytesRead;
+    }
+protected:
+    // The store sits on top of the same DB the worker hands us, so we just go through that
+    virtual void run( ShinyDBWrapper * db ) {
+        this->bytesRead = this->file->read( this->store, this->offset, this->data, this->len );
+    }
+private:
+    ShinyMetaFileSnapshot * file;
+    ShinyChunkStore * store;
+    uint64_t offset;
+    char * data;
+    uint64_t len;
+    uint64_t bytesRead;
+};
 
 
 ShinyMetaFileSnapshot::ShinyMetaFileSnapshot( const char ** serializedInput, ShinyMetaDirSnapshot * parent )
-    : ShinyMetaNodeSnapshot( serializedInput, parent ), fileLen( 0 )
+    : ShinyMetaNodeSnapshot( serializedInput, parent ), fileLen( 0 ), fileID( 0 ), historyID( 0 ), chunkSize( CHUNKSIZE ),
+      seqWrites( 0 ), randomWrites( 0 ), lastWriteEnd( 0 ), autoChunkSize( true ), inlined( false ), inlineData( NULL )
 {
     this->unserialize( serializedInput );
 }
 
-ShinyMetaFileSnapshot::ShinyMetaFileSnapshot() {
+ShinyMetaFileSnapshot::ShinyMetaFileSnapshot()
+    : fileLen( 0 ), fileID( 0 ), historyID( 0 ), chunkSize( CHUNKSIZE ), seqWrites( 0 ), randomWrites( 0 ), lastWriteEnd( 0 ),
+      autoChunkSize( true ), inlined( false ), inlineData( NULL )
+{
     // This only to be called when we're actually creating a new node from ShinyMetaFile
 }
 
 ShinyMetaFileSnapshot::~ShinyMetaFileSnapshot() {
-    // Don't do anything right now
+    delete [] this->inlineData;
 }
 
 uint64_t ShinyMetaFileSnapshot::serializedLen( void ) {
     // Start off with the basic length
     size_t len = ShinyMetaNodeSnapshot::serializedLen();
     
-    // Add on length of file
-    len += sizeof(uint64_t);
+    // Add on ID, history ID, length and chunk size of file, how it's been written to, and whether it's inlined (along
+    // with the data, if so), then the chunk map
+    len += sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t);
+    len += sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint8_t);
+    len += sizeof(uint8_t);
+    if( this->inlined )
+        len += this->fileLen;
+    len += this->chunkMap.serializedLen();
     
     // returnamacate
     return len;
@@ -34,68 +75,177 @@ char * ShinyMetaFileSnapshot::serialize( char *output ) {
     //First serialize out the basic stuff into output
     output = ShinyMetaNodeSnapshot::serialize(output);
     
-    // Next, file length
+    // Next, file ID, history ID, length and chunk size
+    *((uint64_t *)output) = this->fileID;
+    output += sizeof(uint64_t);
+    *((uint64_t *)output) = this->historyID;
+    output += sizeof(uint64_t);
     *((uint64_t *)output) = this->fileLen;
     output += sizeof(uint64_t);
+    *((uint64_t *)output) = this->chunkSize;
+    output += sizeof(uint64_t);
     
-    return output;
+    // How we've been written to, for ShinyMetaFile::pickChunkSize()
+    *((uint64_t *)output) = this->seqWrites;
+    output += sizeof(uint64_t);
+    *((uint64_t *)output) = this->randomWrites;
+    output += sizeof(uint64_t);
+    *((uint64_t *)output) = this->lastWriteEnd;
+    output += sizeof(uint64_t);
+    *((uint8_t *)output) = this->autoChunkSize;
+    output += sizeof(uint8_t);
+    
+    // Then the data, if we've got it on us
+    *((uint8_t *)output) = this->inlined;
+    output += sizeof(uint8_t);
+    if( this->inlined && this->fileLen ) {
+        memcpy( output, this->inlineData, this->fileLen );
+        output += this->fileLen;
+    }
+    
+    // And where our chunks are, if we've got any
+    return this->chunkMap.serialize( output );
 }
 
 void ShinyMetaFileSnapshot::unserialize( const char ** input ) {
+    this->fileID = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->historyID = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
     this->fileLen = *((uint64_t *)*input);
     *input += sizeof(uint64_t);
+    this->chunkSize = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->seqWrites = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->randomWrites = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->lastWriteEnd = *((uint64_t *)*input);
+    *input += sizeof(uint64_t);
+    this->autoChunkSize = *((uint8_t *)*input);
+    *input += sizeof(uint8_t);
+    
+    // We get unserialized over and over as handles send back their changes, so out with the old data first
+    delete [] this->inlineData;
+    this->inlineData = NULL;
+    this->inlined = *((uint8_t *)*input);
+    *input += sizeof(uint8_t);
+    if( this->inlined && this->fileLen ) {
+        this->inlineData = new char[this->fileLen];
+        memcpy( this->inlineData, *input, this->fileLen );
+        *input += this->fileLen;
+    }
+    this->chunkMap.unserialize( input );
+    
+    // Anything else would have us reading the wrong bytes out of every chunk, so it's a good thing to notice early
+    if( this->chunkSize < MIN_CHUNKSIZE || this->chunkSize > MAX_CHUNKSIZE || (this->chunkSize & (this->chunkSize - 1)) )
+        ERROR( "File %llu has a bogus chunk size of %llu!", this->fileID, this->chunkSize );
 }
 
 uint64_t ShinyMetaFileSnapshot::getLen() {
     return this->fileLen;
 }
 
+uint64_t ShinyMetaFileSnapshot::getFileID() {
+    return this->fileID;
+}
+
+uint64_t ShinyMetaFileSnapshot::getChunkSize() {
+    return this->chunkSize;
+}
+
+uint64_t ShinyMetaFileSnapshot::getHistoryID() {
+    return this->historyID;
+}
+
+bool ShinyMetaFileSnapshot::isInline() {
+    return this->inlined;
+}
+
+bool ShinyMetaFileSnapshot::mightHaveData( uint64_t chunk ) {
+    return !this->inlined && this->chunkMap.has( chunk );
+}
+
 uint64_t ShinyMetaFileSnapshot::read( uint64_t offset, char * data, uint64_t len ) {
     ShinyFilesystem * fs = this->getFS();
-    return this->read( fs->getDB(), fs->getNodePath(this), offset, data, len );
+    fs->getWriteback()->flush( this->fileID );
+    return this->read( fs->getChunkStore(), offset, data, len );
+}
+
+uint64_t ShinyMetaFileSnapshot::readv( uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    ShinyFilesystem * fs = this->getFS();
+    fs->getWriteback()->flush( this->fileID );
+    return this->readv( fs->getChunkStore(), offset, iov, iovcnt );
 }
 
-uint64_t ShinyMetaFileSnapshot::read( ShinyDBWrapper * db, const char * path, uint64_t offset, char * data, uint64_t len ) {
-    // First, figure out what "chunk" to start from:
-    uint64_t chunk = offset/CHUNKSIZE;
+uint64_t ShinyMetaFileSnapshot::read( ShinyChunkStore * store, uint64_t offset, char * data, uint64_t len ) {
+    // A plain old read is just a readv() with only the one buffer
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    return this->readv( store, offset, &iov, 1 );
+}
+
+uint64_t ShinyMetaFileSnapshot::readv( ShinyChunkStore * store, uint64_t offset, const struct iovec * iov, int iovcnt ) {
+    // Holes mean running out of chunks doesn't tell us where the file ends anymore, so we stop at fileLen ourselves
+    if( offset >= this->fileLen )
+        return 0;
+    uint64_t len = min( ShinyIOVecCursor::total( iov, iovcnt ), this->fileLen - offset );
     
-    // This is the offset within that chunk that we need to start from
-    offset = offset - chunk*CHUNKSIZE;
+    // Nothing to read?  Easiest read ever.
+    if( len == 0 )
+        return 0;
     
-    // We'll have to build a new key for every chunk
-    uint64_t pathlen = strlen(path);
-    char * key = new char[pathlen+16+1];   // enough room for "<path>[chunk]\0"
-    memcpy( key, path, pathlen );
+    // Inlined files are easier still
+    ShinyIOVecCursor cursor( iov, iovcnt );
+    if( this->inlined ) {
+        cursor.scatter( this->inlineData + offset, len );
+        return len;
+    }
+    
+    // First, figure out what "chunk" to start from, and where we'll end up:
+    const uint64_t chunkSize = this->chunkSize;
+    uint64_t chunk = offset/chunkSize;
+    uint64_t lastChunk = (offset + len - 1)/chunkSize;
+    
+    // This is the offset within that chunk that we need to start from
+    offset = offset - chunk*chunkSize;
     
-    // This is where we will plop the chunk at the end of the key
-    char * keyChunk = key + pathlen;
+    // Each chunk goes straight from the DB into data, so each byte only gets copied once (and compressed chunks
+    // get decompressed right into data whenever we're after all of one).  The reader takes care of finding each
+    // chunk, however the store happens to have it laid out.  It only has to start from the first chunk that might
+    // have data, and if there isn't one, it never goes near the DB at all
+    ShinyChunkReader reader( store, this->fileID, this->chunkMap.nextData( chunk, lastChunk + 1 ), lastChunk );
     
-    // Temporary storage where we'll put chunks as we load them in,
-    // then we'll copy from the chunks into data for transport back to the user
-    char buffer[CHUNKSIZE];
+    // Chunks that land across more than one iovec get read in here first, and scattered out from there.  Still only
+    // one trip to the reader per chunk
+    ShinyChunkScratch scratch;
     
     // The total number of bytes read
     uint64_t bytesRead = 0;
     
     // Start to read in from chunks:
     while( len > bytesRead ) {
-        // Build this chunk's key:
-        sprintf( keyChunk, "%.16llx", chunk );
+        // We load in as many bytes into data as we can!
+        uint64_t amntToCopy = min( chunkSize - offset, len - bytesRead );
+        char * output = cursor.next( amntToCopy );
+        bool scattered = !output;
+        if( scattered )
+            output = scratch.grow( amntToCopy );
         
-        uint64_t bytesJustRead = db->get( key, buffer, CHUNKSIZE );
-        if( bytesJustRead == -1 ) {
-            ERROR( "Could not read chunk %s from cache: %s", key, db->getError() );
-            // This means we couldn't read this chunk, so we must have run into the end of the file.
+        // Holes in the map are holes, no need to go looking
+        uint64_t chunkLen = 0;
+        if( this->chunkMap.has( chunk ) && !reader.copy( chunk, offset, output, amntToCopy, &chunkLen ) ) {
+            ERROR( "Could not read chunk %llu of file %llu from cache: %s", chunk, this->fileID, reader.getError() );
             break;
         }
-        // Otherwise, we load in as many bytes into data as we can!
-        uint64_t amntToCopy = min( bytesJustRead - offset, len - bytesRead );
-        memcpy( data + bytesRead, buffer + offset, amntToCopy );
-        bytesRead += amntToCopy;
         
-        // If this chunk wasn't full, we're done
-        if( bytesJustRead != CHUNKSIZE )
-            break;
+        // Whatever the chunk didn't have (all of it, for a hole) is zeros
+        uint64_t bytesJustRead = chunkLen > offset ? min( chunkLen - offset, amntToCopy ) : 0;
+        memset( output + bytesJustRead, 0, amntToCopy - bytesJustRead );
+        if( scattered )
+            cursor.scatter( output, amntToCopy );
+        bytesRead += amntToCopy;
         
         // reset offset to zero, as we move on to the next chunk now
         offset = 0;
@@ -105,6 +255,117 @@ uint64_t ShinyMetaFileSnapshot::read( ShinyDBWrapper * db, const char * path, ui
     return bytesRead;
 }
 
+uint64_t ShinyMetaFileSnapshot::read( ShinyChunkStore * store, ShinyDBAsync * async, uint64_t offset, char * data, uint64_t len ) {
+    // There's nothing out past the end of the file, so don't go sending anyone off to look for it
+    if( offset >= this->fileLen )
+        return 0;
+    len = min( len, this->fileLen - offset );
+    
+    // Small reads aren't worth the trip through the queue, just do 'em right here
+    const uint64_t pieceLen = ASYNC_READ_CHUNKS*this->chunkSize;
+    if( len <= pieceLen )
+        return this->read( store, offset, data, len );
+    
+    // Cut the read up on piece boundaries (so no two pieces share a chunk), and get 'em all going at once
+    std::vector<ShinyMetaFileReadJob *> jobs;
+    for( uint64_t pos = offset; pos < offset + len; ) {
+        uint64_t end = min( (pos/pieceLen + 1)*pieceLen, offset + len );
+        ShinyMetaFileReadJob * job = new ShinyMetaFileReadJob( this, store, pos, data + (pos - offset), end - pos );
+        async->submit( job );
+        jobs.push_back( job );
+        pos = end;
+    }
+    
+    // Add up what came back, in order.  If a piece came up short, we've hit the end of the data, so nothing
+    // after it counts, even if it got read
+    uint64_t bytesRead = 0;
+    bool cutShort = false;
+    for( uint64_t i=0; i<jobs.size(); ++i ) {
+        jobs[i]->wait();
+        if( !cutShort ) {
+            bytesRead += jobs[i]->getBytesRead();
+            cutShort = jobs[i]->getBytesRead() != jobs[i]->getLen();
+        }
+        delete( jobs[i] );
+    }
+    return bytesRead;
+}
+
+int64_t ShinyMetaFileSnapshot::seekData( uint64_t offset ) {
+    ShinyFilesystem * fs = this->getFS();
+    fs->getWriteback()->flush( this->fileID );
+    return this->seekData( fs->getChunkStore(), offset );
+}
+
+int64_t ShinyMetaFileSnapshot::seekHole( uint64_t offset ) {
+    ShinyFilesystem * fs = this->getFS();
+    fs->getWriteback()->flush( this->fileID );
+    return this->seekHole( fs->getChunkStore(), offset );
+}
+
+int64_t ShinyMetaFileSnapshot::seekData( ShinyChunkStore * store, uint64_t offset ) {
+    if( offset >= this->fileLen )
+        return -1;
+    
+    // Inlined files are all data, and a chunk that's there at all counts as data, even if the end of it is zeros
+    if( this->inlined )
+        return offset;
+    
+    // Only runs the map has are worth asking the DB about, and they might turn out to be holes all the way through
+    uint64_t endChunk = (this->fileLen + this->chunkSize - 1)/this->chunkSize;
+    uint64_t chunk = offset/this->chunkSize;
+    while( (chunk = this->chunkMap.nextData( chunk, endChunk )) < endChunk ) {
+        uint64_t runEnd = this->chunkMap.nextHole( chunk, endChunk );
+        uint64_t dataChunk = store->nextData( this->fileID, chunk, runEnd );
+        if( dataChunk < runEnd )
+            return max( offset, dataChunk*this->chunkSize );
+        chunk = runEnd;
+    }
+    return -1;
+}
+
+int64_t ShinyMetaFileSnapshot::seekHole( ShinyChunkStore * store, uint64_t offset ) {
+    if( offset >= this->fileLen )
+        return -1;
+    
+    // If we run out of chunks without finding a hole, we've hit the end of the file, which always counts as one
+    if( this->inlined )
+        return this->fileLen;
+    // The map knows where the next sure-enough hole is, so the DB only has to look for one before that
+    uint64_t endChunk = (this->fileLen + this->chunkSize - 1)/this->chunkSize;
+    uint64_t chunk = offset/this->chunkSize;
+    chunk = store->nextHole( this->fileID, chunk, this->chunkMap.nextHole( chunk, endChunk ) );
+    return min( max( offset, chunk*this->chunkSize ), this->fileLen );
+}
+
+bool ShinyMetaFileSnapshot::getMerkleRoot( char * root ) {
+    // Anything still buffered isn't in the tree (or the DB) yet
+    ShinyFilesystem * fs = this->getFS();
+    fs->getWriteback()->flush( this->fileID );
+    return this->getMerkleRoot( fs->getChunkStore(), root );
+}
+
+bool ShinyMetaFileSnapshot::verify() {
+    ShinyFilesystem * fs = this->getFS();
+    fs->getWriteback()->flush( this->fileID );
+    return this->verify( fs->getChunkStore() );
+}
+
+bool ShinyMetaFileSnapshot::getMerkleRoot( ShinyChunkStore * store, char * root ) {
+    // Inlined files hash the same as if their data were their one and only chunk, which is what it'll be if they spill
+    if( this->inlined ) {
+        ShinyChunkMerkle::inlineRoot( this->inlineData, this->fileLen, this->chunkSize, root );
+        return true;
+    }
+    return store->getRoot( this->fileID, this->fileLen, this->chunkSize, root );
+}
+
+bool ShinyMetaFileSnapshot::verify( ShinyChunkStore * store ) {
+    if( this->inlined )
+        return true;
+    return store->verify( this->fileID, (this->fileLen + this->chunkSize - 1)/this->chunkSize );
+}
+
 ShinyMetaNodeSnapshot::NodeType ShinyMetaFileSnapshot::getNodeType( void ) {
     return ShinyMetaNodeSnapshot::TYPE_FILE;
 }
\ No newline at end of file
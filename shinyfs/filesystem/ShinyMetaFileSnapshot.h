@@ -2,18 +2,34 @@
 #ifndef ShinyMetaFileSnapshot_H
 #define ShinyMetaFileSnapshot_H
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "ShinyMetaNodeSnapshot.h"
-#include "ShinyDBWrapper.h"
+#include "ShinyChunkStore.h"
+#include "ShinyChunkMap.h"
+#include "ShinyDBAsync.h"
 
 class ShinyMetaDir;
 class ShinyMetaFileSnapshot : public ShinyMetaNodeSnapshot {
 friend class ShinyMetaFile;
+friend class ShinyMetaFileReadJob;
+friend class ShinyChunkPrefetcher;
 /////// DEFINES ///////
 public:
-    // The size of a "chunk" stored in the DB
+    // The size of a "chunk" stored in the DB, for new files.  Each file keeps track of its own chunk size (see
+    // ShinyMetaFile::pickChunkSize() for who gets what), which is always a power of two in between the MIN and MAX
     // NABIL: This should probably be defined in a Shiny_config.h eventually
     static const uint64_t CHUNKSIZE = 64*1024;
+    static const uint64_t MIN_CHUNKSIZE = 16*1024;
+    static const uint64_t MAX_CHUNKSIZE = 1024*1024;
+    
+    // Files no longer than this keep their bytes right in their serialized node instead of in chunks, so reading
+    // them never goes near the DB.  They move out to chunks (see ShinyMetaFile::spill()) once they grow past it.
+    // Always fits in a single chunk, whatever the file's chunk size
+    static const uint64_t INLINESIZE = 4*1024;
+    
+    // Reads bigger than this many chunks get split up into pieces this big, which all get read at once
+    static const uint64_t ASYNC_READ_CHUNKS = 4;
     
 //////// CREATION ///////
 public:
@@ -23,7 +39,8 @@ public:
     //Cleanup before DESTRUCTION
     ~ShinyMetaFileSnapshot();
     
-    // We add in the length of the file to our serialization format
+    // We add in the ID, history ID, length and chunk size of the file to our serialization format, along with how it's
+    // been written to, plus the data itself if the file is inlined, or which of its chunks have data if it isn't
     virtual uint64_t serializedLen( void );
     virtual char * serialize( char * output );
     virtual void unserialize( const char **input );
@@ -37,17 +54,95 @@ public:
     // Returns the length of the file in bytes
     virtual uint64_t getLen();
     
-    // Blocks until task completion. Not multithread safe. Returns number of bytes read.
+    // Returns the ID this file's chunks are stored under.  It never changes, no matter where the file moves to
+    uint64_t getFileID();
+    
+    // How many bytes of the file each of its chunks holds
+    uint64_t getChunkSize();
+    
+    // The ID this file's old versions are kept under (see ShinyFileHistory), or 0 if it's never had one saved
+    uint64_t getHistoryID();
+    
+    // Whether the file's data lives right here in the node (see INLINESIZE) rather than in chunks
+    bool isInline();
+    
+    // Whether chunk might have data in it (see chunkMap).  If not, it's a hole, and there's no need to look for it
+    bool mightHaveData( uint64_t chunk );
+    
+    // Blocks until task completion. Not multithread safe. Returns number of bytes read.  Holes read back as zeros,
+    // and the ones chunkMap knows about don't cost a trip to the DB
     virtual uint64_t read( uint64_t offset, char * data, uint64_t len );
+    
+    // Same as read(), but scattered across iovcnt buffers, front to back.  The file still only gets gone through
+    // once, chunk by chunk, no matter how iov cuts it up
+    virtual uint64_t readv( uint64_t offset, const struct iovec * iov, int iovcnt );
+    
+    // Where the next data/hole at or after offset starts, for lseek()'s SEEK_DATA and SEEK_HOLE.  Holes are tracked
+    // a chunk at a time, and there's always one at the end of the file.  Returns -1 if offset is past the end.  Only
+    // the runs of chunks chunkMap says might have data get looked for in the DB
+    virtual int64_t seekData( uint64_t offset );
+    virtual int64_t seekHole( uint64_t offset );
+    
+    // Fills root with the root of the file's Merkle tree (ShinyChunkMerkle::ROOT_LEN bytes, see ShinyChunkMerkle), so
+    // two files with the same data in the same size of chunks have the same root.  The store keeps the tree up to
+    // date as we're written to, so it's only the first one that has to read the whole file.  Returns false if our
+    // chunks couldn't all be read
+    virtual bool getMerkleRoot( char * root );
+    
+    // Reads every one of our chunks straight out of the DB, checking every checksum on the way (see
+    // ShinyChunkStore::verify()).  Returns false if any of them didn't check out
+    virtual bool verify();
 protected:
     // This is the guy that does the real work, the above read() subs out to this guy,
-    // and just grab the db object from the ShinyFS, (which is why I have ShinyMetafileHandle for when
-    // the ShinyFS object is unreachable, but we have the db object at hand)
-    virtual uint64_t read( ShinyDBWrapper * db, const char * path, uint64_t offset, char * data, uint64_t len );
+    // and just grab the chunk store from the ShinyFS, (which is why I have ShinyMetafileHandle for when
+    // the ShinyFS object is unreachable, but we have the chunk store at hand)
+    virtual uint64_t read( ShinyChunkStore * store, uint64_t offset, char * data, uint64_t len );
+    virtual uint64_t readv( ShinyChunkStore * store, uint64_t offset, const struct iovec * iov, int iovcnt );
+    
+    // Same as above, but big reads get cut up into pieces that async's workers all read at the same time
+    virtual uint64_t read( ShinyChunkStore * store, ShinyDBAsync * async, uint64_t offset, char * data, uint64_t len );
+    
+    // The real seekData()/seekHole()
+    virtual int64_t seekData( ShinyChunkStore * store, uint64_t offset );
+    virtual int64_t seekHole( ShinyChunkStore * store, uint64_t offset );
+    
+    // The real getMerkleRoot()/verify()
+    virtual bool getMerkleRoot( ShinyChunkStore * store, char * root );
+    virtual bool verify( ShinyChunkStore * store );
     
     // The length of this here file
     uint64_t fileLen;
     
+    // Handed out by ShinyFilesystem when the file is created, chunks are keyed off of this instead of the path
+    // so that renaming/moving a file doesn't have to touch its data at all
+    uint64_t fileID;
+    
+    // Handed out the first time a version of the file gets saved (see ShinyMetaFile::saveVersion()), and never
+    // changes after that, unlike fileID, so the file's history sticks with it through rewrites and truncates
+    uint64_t historyID;
+    
+    // How big this file's chunks are.  Changing it means moving all the data over to new chunks, so only
+    // ShinyMetaFile::rechunk() gets to do that
+    uint64_t chunkSize;
+    
+    // Writes that carried on from where the last one left off (or appended), and small ones that didn't, and whether
+    // ShinyMetaFile::pickChunkSize() still gets a say (it doesn't once rechunk() has been called on us).  These go
+    // out with the rest of us, since every write comes in on a ShinyMetaFileHandle made fresh from our serialization
+    uint64_t seqWrites;
+    uint64_t randomWrites;
+    uint64_t lastWriteEnd;
+    bool autoChunkSize;
+    
+    // If inlined, the file's fileLen bytes are in inlineData (which is NULL for an empty file) and it has no chunks
+    // at all.  Otherwise inlineData is always NULL
+    bool inlined;
+    char * inlineData;
+    
+    // Which of our chunks might have data (see ShinyChunkMap), so we know which ones are holes without asking the
+    // DB.  Every write adds the chunks it touches before they go out, and truncates take away the ones they cut
+    // off, so it never misses one that's really there.  Always empty while we're inlined
+    ShinyChunkMap chunkMap;
+    
 /////// MISC ///////
 public:
     //Performs various checks to make sure this node is all right
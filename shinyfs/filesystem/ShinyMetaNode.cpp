@@ -55,15 +55,17 @@ ShinyMetaDir * ShinyMetaNode::getParent() {
 }
 
 void ShinyMetaNode::setParent( ShinyMetaDir * newParent ) {
-    // Purge any cached node paths that we might have previously had
-    if( this->getParent() )
-        delete( snapshot.getFS()->nodePaths[&snapshot] );
-
+    // Purge any cached node paths that we (or anything under us) might have previously had
+    this->forgetPath();
+    
     snapshot.parent = dynamic_cast<ShinyMetaDirSnapshot *>(newParent->getSnapshot());
     this->set_ctime();
 }
 
 void ShinyMetaNode::setName( const char * newName ) {
+    // Same deal as setParent()
+    this->forgetPath();
+    
     if( snapshot.name )
         delete( snapshot.name );
     
@@ -73,6 +75,12 @@ void ShinyMetaNode::setName( const char * newName ) {
     this->set_ctime();
 }
 
+void ShinyMetaNode::forgetPath() {
+    ShinyFilesystem * fs = snapshot.getFS();
+    if( fs )
+        fs->forgetPath( &snapshot );
+}
+
 void ShinyMetaNode::setPermissions( uint16_t newPermissions ) {
     snapshot.permissions = newPermissions;
     this->set_ctime();
@@ -89,6 +89,10 @@ public:
 /////// MISC ///////
 public:
     typedef ShinyMetaDir parentType;
+private:
+    // Tells the FS our path (and everything under us's) is about to change, for setName() and setParent()
+    void forgetPath();
+public:
 /*
     //Performs any necessary checks (e.g. directories check for multiple entries of the same node, etc...)
     virtual bool sanityCheck( void );
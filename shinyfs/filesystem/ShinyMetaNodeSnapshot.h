@@ -83,8 +83,8 @@ public:
     // race conditions or data corruption, but it's good to be prepared
     const char * getPath();
     
-    // Gets the FS associated with this node
-    ShinyFilesystem * const getFS();
+    // Gets the FS associated with this node (by asking our parent, all the way up to the root, which actually knows)
+    virtual ShinyFilesystem * const getFS();
     
     // Birthed, Accessed (read), Changed (metadata), Modified (file data) times
     const uint64_t get_btime( void );
@@ -6,6 +6,7 @@
 #include "../filesystem/ShinyMetaFile.h"
 #include "../filesystem/ShinyMetaFileHandle.h"
 #include <string.h>
+#include <stdio.h>
 
 // Extreme laziness function to send a NACK to the other side
 void sendNACK( zmq::socket_t * sock, zmq::message_t * routing ) {
@@ -26,6 +27,68 @@ void sendACK( zmq::socket_t *sock, zmq::message_t * routing ) {
     sendMessages(sock, 3, routing, &blankMsg, &ackMsg );
 }
 
+// Does the DB work for a file on one of the DB workers, on a copy of the file, so the mediator doesn't have to sit
+// there waiting on it: either saving a version of it once it's been closed (see ShinyMetaFile::saveVersion()), or a
+// CHECKOUT into it (see ShinyMetaFile::checkout()).  Then the copy goes back to the mediator (in a SAVEDONE or a
+// CHECKOUTDONE), which lets go of the file
+class ShinyMediatorFileJob : public ShinyDBJob {
+public:
+    ShinyMediatorFileJob( ShinyFilesystemMediator * sfm, ShinyFilesystem * fs, const char * path, ShinyMetaFile * file )
+        : sfm(sfm), fs(fs), path(path), historyID(0), when(0), route(NULL), created(false)
+    {
+        this->node = new char[file->serializedLen()];
+        file->serialize( this->node );
+    }
+    
+    // For a CHECKOUT, with the route back to whoever sent it, and whether file was made just for it
+    ShinyMediatorFileJob( ShinyFilesystemMediator * sfm, ShinyFilesystem * fs, const char * path, ShinyMetaFile * file,
+                          uint64_t historyID, uint64_t when, zmq::message_t * route, bool created )
+        : sfm(sfm), fs(fs), path(path), historyID(historyID), when(when), route(route), created(created)
+    {
+        this->node = new char[file->serializedLen()];
+        file->serialize( this->node );
+    }
+    
+    ~ShinyMediatorFileJob() {
+        delete [] this->node;
+        delete( this->route );
+    }
+protected:
+    virtual void run( ShinyDBWrapper * db ) {
+        const char * data = this->node;
+        ShinyMetaFileHandle fh( &data, this->fs, this->path.c_str() );
+        bool success = this->route ? fh.checkout( this->historyID, this->when ) : fh.saveVersion();
+        
+        zmq::socket_t * sock = this->sfm->getMediator();
+        if( !sock ) {
+            ERROR( "Could not tell the mediator we're done with %s!", this->path.c_str() );
+            return;
+        }
+        zmq::message_t typeMsg; buildTypeMsg( this->route ? ShinyFilesystemMediator::CHECKOUTDONE : ShinyFilesystemMediator::SAVEDONE, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( this->path.c_str(), &pathMsg );
+        zmq::message_t nodeMsg; buildNodeMsg( &fh, &nodeMsg );
+        if( this->route ) {
+            uint8_t result[2] = { success, this->created };
+            zmq::message_t resultMsg; buildDataMsg( result, sizeof(result), &resultMsg );
+            sendMessages( sock, 5, &typeMsg, &pathMsg, &nodeMsg, this->route, &resultMsg );
+        } else
+            sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
+        
+        // No response, same as a WRITEDONE
+        delete( sock );
+    }
+private:
+    ShinyFilesystemMediator * sfm;
+    ShinyFilesystem * fs;
+    std::string path;
+    char * node;
+    
+    uint64_t historyID;
+    uint64_t when;
+    zmq::message_t * route;
+    bool created;
+};
+
 void * mediatorThreadLoop( void * data ) {
     // Grab this guy from the data
     ShinyFilesystemMediator * sfm = (ShinyFilesystemMediator *) data;
@@ -66,7 +129,7 @@ void * mediatorThreadLoop( void * data ) {
 
 
 
-ShinyFilesystemMediator::ShinyFilesystemMediator( ShinyFilesystem * fs, zmq::context_t * ctx ) : fs( fs ), ctx( ctx ) {
+ShinyFilesystemMediator::ShinyFilesystemMediator( ShinyFilesystem * fs, zmq::context_t * ctx ) : fs( fs ), ctx( ctx ), pendingJobs( 0 ), destroying( false ) {
     // Start up the mediator thread
     pthread_create( &this->thread, NULL, mediatorThreadLoop, this );
     
@@ -120,8 +183,10 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
         case ShinyFilesystemMediator::DESTROY: {
             // No actual response data, just sending response just to be polite
             sendACK( sock, fuseRoute );
-            // return false as we're signaling to mediator that it's time to die.  >:}
-            return false;
+            // return false as we're signaling to mediator that it's time to die.  >:}  Unless the DB workers are
+            // still busy with our files, in which case we hang around until the last of them checks back in
+            this->destroying = true;
+            return this->pendingJobs > 0;
         }
         case ShinyFilesystemMediator::GETATTR: {
             // Let's actually get the data fuse wants!
@@ -317,11 +382,27 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
         }
         case ShinyFilesystemMediator::READDONE:
         case ShinyFilesystemMediator::WRITEDONE:
-        case ShinyFilesystemMediator::TRUNCDONE: {
+        case ShinyFilesystemMediator::TRUNCDONE:
+        case ShinyFilesystemMediator::SAVEDONE:
+        case ShinyFilesystemMediator::CHECKOUTDONE: {
             // Grab the path, and the itty
             char * path = parseStringMsg( msgList[3] );
             std::string pathStr( path );
             std::map<std::string, OpenFileInfo *>::iterator itty = this->openFiles.find( pathStr );
+            
+            // A CHECKOUT that didn't work leaves the file how it was, and whoever sent it finds out either way
+            bool updated = true, created = false;
+            if( type == ShinyFilesystemMediator::CHECKOUTDONE ) {
+                const uint8_t * result = (const uint8_t *) msgList[6]->data();
+                updated = result[0];
+                created = result[1];
+                if( updated )
+                    sendACK( sock, msgList[5] );
+                else
+                    sendNACK( sock, msgList[5] );
+            }
+            if( type == ShinyFilesystemMediator::SAVEDONE || type == ShinyFilesystemMediator::CHECKOUTDONE )
+                this->pendingJobs--;
 
             // If it is in openFiles,
             if( itty != this->openFiles.end() ) {
@@ -330,15 +411,23 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
                 if( type == ShinyFilesystemMediator::WRITEDONE || type == ShinyFilesystemMediator::TRUNCDONE ) {
                     // We're not writelocked!  (at least, util we start writing again. XD)
                     ofi->writeLocked = false;
+                    ofi->written = true;
                 } else if( type == ShinyFilesystemMediator::READDONE ) {
                     // Decrease the number of concurrently running READS!
                     ofi->reads--;
+                } else {
+                    // The worker's done with it.  A file that was made just for a CHECKOUT that didn't work goes
+                    // right back away
+                    ofi->writeLocked = false;
+                    if( !updated && created )
+                        ofi->shouldDelete = true;
                 }
                 
                 // Update the file with the serialized version sent back
                 //LOG( "Updating %s due to a %s", path, (type == READDONE ? "READDONE" : (type == WRITEDONE ? "WRITEDONE" : "TRUNCDONE")) );
                 const char * data = (const char *) msgList[4]->data();
-                ofi->file->unserialize(&data);
+                if( updated )
+                    ofi->file->unserialize(&data);
                 //delete( fs );
                 
                 if( !ofi->writeLocked || ofi->reads == 0 ) {
@@ -411,9 +500,9 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
                     OpenFileInfo * ofi = (*itty).second;
                     ofi->shouldDelete = true;
                 } else {
-                    // Tell the db to delete him, if it's a file
+                    // Hand his chunks off to the reclaimer (which does the actual deleting in the background, we don't wait)
                     if( node->getNodeType() == ShinyMetaNode::TYPE_FILE )
-                        ((ShinyMetaFile *)node)->setLen( 0 );
+                        ((ShinyMetaFile *)node)->releaseChunks();
                     
                     // actually delete the sucker
                     delete( node );
@@ -439,18 +528,39 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
                 const char * oldName = ShinyMetaNode::basename( path );
                 const char * newName = ShinyMetaNode::basename( newPath );
                 ShinyMetaNode * node = oldParent->findNode( oldName );
+                ShinyMetaNode * target = newParent->findNode( newName );
+                
+                // Renaming over a dir isn't something we do (yet), and neither is renaming over a file someone has
+                // open, since its deletion gets queued up by path, which would end up pointing at node
+                bool replaceable = !target || target == node || (target->getNodeType() == ShinyMetaNode::TYPE_FILE &&
+                                    this->openFiles.find( std::string( newPath ) ) == this->openFiles.end());
                 
-                if( node ) {
-                    // Check to make sure we need to move it at all
-                    if( oldParent != newParent ) {
+                if( node && !replaceable ) {
+                    sendNACK( sock, fuseRoute );
+                } else if( node ) {
+                    // Renaming over a file replaces it, so it's just like it got unlinked first.  Otherwise its
+                    // chunks would be stuck in the DB with nobody pointing at them
+                    if( target && target != node ) {
+                        ((ShinyMetaFile *)target)->releaseChunks();
+                        delete( target );
+                    }
+                    
+                    // Note that this is all metadata; file chunks are keyed off of file IDs, not paths, so no
+                    // matter how big the file (or how many files are under this dir) there's no data to move
+                    // Check to make sure we need to move it at all.  Dirs file their nodes by name, so a node has
+                    // to come out of its dir before its name changes, and go back in after
+                    bool renamed = strcmp( oldName, newName ) != 0;
+                    if( oldParent != newParent || renamed ) {
                         oldParent->delNode( node );
+                        
+                        // Don't setName to the same thing we had before, lol
+                        if( renamed )
+                            node->setName( newName );
+                        if( oldParent != newParent )
+                            node->setParent( newParent );
                         newParent->addNode( node );
                     }
                     
-                    // Don't setName to the same thing we had before, lol
-                    if( strcmp( oldName, newName) != 0 )
-                        node->setName( newName );
-                    
                     // Send an ACK, for a job well done
                     sendACK( sock, fuseRoute );
                 } else {
@@ -486,6 +596,117 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
             delete( path );
             break;
         }
+        case ShinyFilesystemMediator::CLONE: {
+            // Grab the path, and the path of the copy
+            char * path = parseStringMsg( msgList[3] );
+            char * newPath = parseStringMsg( msgList[4] );
+            
+            ShinyMetaNode * node = fs->findNode( path );
+            ShinyMetaDir * newParent = fs->findParentNode( newPath );
+            ShinyMetaNode * target = fs->findNode( newPath );
+            
+            // Cloning something into itself would never end (and cloning something onto itself is pointless)
+            uint64_t pathLen = strlen( path );
+            bool inside = strncmp( newPath, path, pathLen ) == 0 && (newPath[pathLen] == '/' || newPath[pathLen] == 0);
+            
+            // Clones move the files they're made from over to new IDs, so nothing can be reading or writing them
+            // right then, whoever had them open is welcome to carry on afterwards.  Only files can replace files
+            if( !node || !newParent || inside || node->getNodeType() == ShinyMetaNode::TYPE_ROOTDIR || this->isBusy( path ) ) {
+                sendNACK( sock, fuseRoute );
+            } else if( target ) {
+                if( target->getNodeType() == ShinyMetaNode::TYPE_FILE && node->getNodeType() == ShinyMetaNode::TYPE_FILE &&
+                    !this->isBusy( newPath ) && ((ShinyMetaFile *)node)->clone( fs, (ShinyMetaFile *)target ) )
+                    sendACK( sock, fuseRoute );
+                else
+                    sendNACK( sock, fuseRoute );
+            } else {
+                // Note that however big the tree is, this is all metadata, the file data is shared
+                if( fs->clone( node, ShinyMetaNode::basename( newPath ), newParent ) )
+                    sendACK( sock, fuseRoute );
+                else
+                    sendNACK( sock, fuseRoute );
+            }
+            
+            delete( path );
+            delete( newPath );
+            break;
+        }
+        case ShinyFilesystemMediator::VERSIONS: {
+            char * path = parseStringMsg( msgList[3] );
+            
+            ShinyMetaNode * node = fs->findNode( path );
+            if( node && node->getNodeType() == ShinyMetaNode::TYPE_FILE ) {
+                std::vector<uint64_t> times;
+                ((ShinyMetaFile *)node)->getVersions( times );
+                
+                // Same as READDIR, a msg per version
+                std::vector<zmq::message_t *> list( 1 + 1 + 1 + times.size() );
+                list[0] = fuseRoute;
+                list[1] = blankMsg;
+                
+                zmq::message_t ackMsg; buildTypeMsg( ShinyFilesystemMediator::ACK, &ackMsg );
+                list[2] = &ackMsg;
+                
+                for( uint64_t i=0; i<times.size(); ++i ) {
+                    char timeStr[24];
+                    snprintf( timeStr, sizeof(timeStr), "%llu", (unsigned long long)times[i] );
+                    zmq::message_t * timeMsg = new zmq::message_t(); buildStringMsg( timeStr, timeMsg );
+                    list[3+i] = timeMsg;
+                }
+                
+                sendMessages( sock, list );
+                
+                for( uint64_t i=3; i<list.size(); ++i ) {
+                    delete( list[i] );
+                }
+            } else
+                sendNACK( sock, fuseRoute );
+            
+            delete( path );
+            break;
+        }
+        case ShinyFilesystemMediator::CHECKOUT: {
+            // Anything short of a path, a new path and a when is no good to us
+            if( msgList.size() < 6 || msgList[5]->size() != sizeof(uint64_t) ) {
+                WARN( "Malformed CHECKOUT message to mediator!" );
+                sendNACK( sock, fuseRoute );
+                break;
+            }
+            
+            // Grab the path, where the old version goes, and when it's from
+            char * path = parseStringMsg( msgList[3] );
+            char * newPath = parseStringMsg( msgList[4] );
+            uint64_t when;
+            memcpy( &when, msgList[5]->data(), sizeof(uint64_t) );
+            
+            ShinyMetaNode * node = fs->findNode( path );
+            ShinyMetaDir * newParent = fs->findParentNode( newPath );
+            ShinyMetaNode * target = fs->findNode( newPath );
+            
+            // Just like a CLONE, nothing can be reading or writing either file right then, and only files get replaced
+            if( !node || node->getNodeType() != ShinyMetaNode::TYPE_FILE || !newParent || this->isBusy( path ) || this->isBusy( newPath ) ||
+                (target && target->getNodeType() != ShinyMetaNode::TYPE_FILE) ) {
+                sendNACK( sock, fuseRoute );
+            } else {
+                // Putting a version back means reading and writing the whole thing, so a DB worker does it on a copy
+                // of target, which stays write locked until the worker's done (see CHECKOUTDONE), and that's when
+                // whoever asked gets their answer.  A brand new file goes right back away if it doesn't work out
+                ShinyMetaFile * file = (ShinyMetaFile *) target;
+                bool created = !file;
+                if( created ) {
+                    file = new ShinyMetaFile( ShinyMetaNode::basename( newPath ), newParent );
+                    file->setPermissions( node->getPermissions() );
+                }
+                zmq::message_t * savedRoute = new zmq::message_t();
+                savedRoute->copy( fuseRoute );
+                uint64_t historyID = ((ShinyMetaFile *)node)->getHistoryID();
+                this->startJob( newPath, file, new ShinyMediatorFileJob( this, fs, newPath, file, historyID, when, savedRoute, created ) );
+            }
+            
+            delete( path );
+            delete( newPath );
+            break;
+        }
         default: {
             WARN( "Unknown ShinyFuse message type! (%d) Sending NACK:", type );
             sendNACK( sock, fuseRoute );
@@ -493,7 +714,8 @@ bool ShinyFilesystemMediator::handleMessage( zmq::socket_t * sock, std::vector<z
         }
     }
     
-    return true;
+    // Once we've been told to go, the last job to check back in is our cue
+    return !this->destroying || this->pendingJobs > 0;
 }
 
 // Utility function to send an ACK and a node, routed to fuseRoute
@@ -549,13 +771,23 @@ void ShinyFilesystemMediator::startQueuedFO( zmq::socket_t *sock, OpenFileInfo *
 void ShinyFilesystemMediator::closeOFI( std::map<std::string, OpenFileInfo *>::iterator itty ) {
     OpenFileInfo * ofi = (*itty).second;
     
+    // Whatever it got written to hold is its newest version now (see ShinyFileHistory).  That's a DB worker's job, and
+    // until it's done the file stays in openFiles, write locked, with nobody left to close it; the SAVEDONE brings us
+    // right back here
+    if( ofi->written && !ofi->shouldDelete ) {
+        ofi->written = false;
+        ofi->shouldClose = true;
+        this->startJob( (*itty).first.c_str(), ofi->file, new ShinyMediatorFileJob( this, fs, (*itty).first.c_str(), ofi->file ) );
+        return;
+    }
+    
     // remove it from the map of open files
     this->openFiles.erase( itty );
     
     // If we should delete the file, because an unlink() was called against it
     // while some other process had it open....
     if( ofi->shouldDelete ) {
-        ofi->file->setLen( 0 );
+        ofi->file->releaseChunks();
         delete( ofi->file );
     }
     
@@ -563,6 +795,43 @@ void ShinyFilesystemMediator::closeOFI( std::map<std::string, OpenFileInfo *>::i
     delete( ofi );
 }
 
+void ShinyFilesystemMediator::startJob( const char * path, ShinyMetaFile * file, ShinyDBJob * job ) {
+    std::string pathStr( path );
+    std::map<std::string, OpenFileInfo *>::iterator itty = this->openFiles.find( pathStr );
+    OpenFileInfo * ofi;
+    if( itty == this->openFiles.end() ) {
+        // Nobody has it open, so it's opened just for the job, and closed again as soon as the job's done (unless
+        // somebody else opens it in the meantime)
+        ofi = new OpenFileInfo();
+        ofi->file = file;
+        ofi->shouldClose = true;
+        this->openFiles[pathStr] = ofi;
+    } else
+        ofi = (*itty).second;
+    ofi->writeLocked = true;
+    
+    this->pendingJobs++;
+    job->setAutoDelete( true );
+    fs->getAsync()->submit( job );
+}
+
+bool ShinyFilesystemMediator::isBusy( const char * path ) {
+    // Everything under path sorts right after it, so that's the only stretch of openFiles we need to look through
+    std::string pathStr( path );
+    for( std::map<std::string, OpenFileInfo *>::iterator itty = this->openFiles.lower_bound( pathStr ); itty != this->openFiles.end(); ++itty ) {
+        const std::string & openPath = (*itty).first;
+        if( openPath.compare( 0, pathStr.size(), pathStr ) != 0 )
+            break;
+        if( openPath.size() > pathStr.size() && openPath[pathStr.size()] != '/' )
+            continue;
+        
+        OpenFileInfo * ofi = (*itty).second;
+        if( ofi->writeLocked || ofi->reads > 0 || !ofi->queuedFileOperations.empty() )
+            return true;
+    }
+    return false;
+}
+
 const char * ShinyFilesystemMediator::getZMQEndpointFuse() {
     return "inproc://mediator.fuse";
 }
@@ -129,6 +129,42 @@ public:
         // [ACK] broker -> fuse
         // [NACK] broker -> fuse
         CHMOD,
+        
+        // [CLONE] fuse -> broker (copies a file, or a dir and everything under it, without copying any data)
+        //  - path
+        //  - newPath (a file that's already there gets replaced, as long as path is a file too)
+        // [ACK] broker -> fuse
+        // [NACK] broker -> fuse
+        CLONE,
+        
+        // [VERSIONS] fuse -> broker (lists the saved versions of a file, see ShinyFileHistory)
+        //  - path
+        // [ACK] broker -> fuse
+        //  - msg per version, when it was saved (seconds since the epoch, as a string), oldest first
+        // [NACK] broker -> fuse
+        VERSIONS,
+        
+        // [CHECKOUT] fuse -> broker (puts a file back how it was as of some time, or makes a copy of it how it was then)
+        //  - path
+        //  - newPath (can be path itself; a file that's already there gets replaced, otherwise a new one is made)
+        //  - when (uint64_t, seconds since the epoch)
+        // [ACK] broker -> fuse (once a DB worker has put it back, see CHECKOUTDONE)
+        // [NACK] broker -> fuse
+        CHECKOUT,
+        
+        // [SAVEDONE] worker -> broker (a DB worker is done saving a version of a file that got closed, see closeOFI())
+        //  - path
+        //  - node
+        // No response
+        SAVEDONE,
+        
+        // [CHECKOUTDONE] worker -> broker (a DB worker is done with a CHECKOUT, so whoever asked for it gets their answer)
+        //  - newPath
+        //  - node
+        //  - route back to whoever sent the CHECKOUT
+        //  - result (uint8_t, whether it worked), and whether newPath was made just for it (uint8_t)
+        // No response
+        CHECKOUTDONE,
     };
 
 /////// CREATION ////////
@@ -170,6 +206,7 @@ protected:
         bool shouldDelete;      // Whether unlink() was called on this guy before everything was closed, so we should delete it when it gets closed
         bool writeLocked;       // Whether a WRITE or TRUNC is underway, so we can't give out further WRITEs, TRUNCs, READs or fully CLOSE
         bool shouldClose;       // Whether a CLOSE was called while a WRITE or READ was underway, so we defer fully closing until later
+        bool written;           // Whether a WRITE or TRUNC has gone through since it was opened, so it gets a new version saved when it's closed
         uint16_t reads;         // How many READs are currently underway (not queued)
         std::list<QueuedFO> queuedFileOperations;   // The routing paths and type of each queued read/write, due to a writelock
     };
@@ -184,6 +221,19 @@ private:
     
     // Some simple cleanup to close a file
     void closeOFI( std::map<std::string, OpenFileInfo *>::iterator itty );
+    
+    // Whether the file at path (or any file under it, if it's a dir) has a READ, WRITE or TRUNC underway or queued up
+    bool isBusy( const char * path );
+    
+    // Hands job to the DB workers, with file (at path) write locked, just like for a WRITE, until the job sends back
+    // a SAVEDONE or CHECKOUTDONE.  If file isn't open, it gets an OpenFileInfo for the duration, so nobody else can
+    // get at it in the meantime
+    void startJob( const char * path, ShinyMetaFile * file, ShinyDBJob * job );
+    
+    // How many jobs we've handed the DB workers that haven't come back yet.  We don't go anywhere (even after a
+    // DESTROY) until they have, since they're working on our files
+    uint64_t pendingJobs;
+    bool destroying;
 };
 
 
@@ -3,16 +3,29 @@
 #include "../filesystem/ShinyMetaDir.h"
 #include "../filesystem/ShinyMetaRootDir.h"
 #include "../filesystem/ShinyMetaFile.h"
+#include "../filesystem/ShinyChunkScratch.h"
+#include "../filesystem/ShinyIOVec.h"
 #include "ShinyFilesystemMediator.h"
+#include "ShinyIoctl.h"
 #include "../util/zmqutils.h"
 #include <sys/errno.h>
+#include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
+// Asking for an xattr a node doesn't have
+#if defined( __OSX__ )
+#define ENOXATTR        ENOATTR
+#else
+#define ENOXATTR        ENODATA
+#endif
+
 ShinyFilesystemMediator * ShinyFuse::sfm;
 ShinyFilesystem * ShinyFuse::fs;
 zmq::context_t * ::ShinyFuse::ctx;
 
-bool ShinyFuse::init( const char * mountPoint ) {
+bool ShinyFuse::init( const char * mountPoint, const char * filecache, ShinyChunkStore::Mode chunkMode, const char * chunkCodec, uint64_t chunkCacheSize ) {
     //First, setup the callbacks
     struct fuse_operations shiny_operations;
     memset( &shiny_operations, 0, sizeof(shiny_operations) );
@@ -26,9 +39,19 @@ bool ShinyFuse::init( const char * mountPoint ) {
     
     shiny_operations.open = ShinyFuse::fuse_open;
     shiny_operations.release = ShinyFuse::fuse_release;
+    shiny_operations.fsync = ShinyFuse::fuse_fsync;
     shiny_operations.read = ShinyFuse::fuse_read;
+#if FUSE_VERSION >= 29
+    shiny_operations.read_buf = ShinyFuse::fuse_read_buf;
+#endif
+#if FUSE_VERSION >= 38
+    shiny_operations.lseek = ShinyFuse::fuse_lseek;
+#endif
 
     shiny_operations.write = ShinyFuse::fuse_write;
+#if FUSE_VERSION >= 29
+    shiny_operations.write_buf = ShinyFuse::fuse_write_buf;
+#endif
     shiny_operations.truncate = ShinyFuse::fuse_truncate;
 
     shiny_operations.mknod = ShinyFuse::fuse_mknod;
@@ -38,12 +61,19 @@ bool ShinyFuse::init( const char * mountPoint ) {
 
     //shiny_operations.access = ShinyFuse::fuse_access;
     shiny_operations.rename = ShinyFuse::fuse_rename;
+#if FUSE_VERSION >= 28
+    shiny_operations.ioctl = ShinyFuse::fuse_ioctl;
+#endif
+#if FUSE_VERSION >= 34
+    shiny_operations.copy_file_range = ShinyFuse::fuse_copy_file_range;
+#endif
+    shiny_operations.getxattr = ShinyFuse::fuse_getxattr;
+    shiny_operations.listxattr = ShinyFuse::fuse_listxattr;
     shiny_operations.chmod = ShinyFuse::fuse_chmod;
     //shiny_operations.chown = ShinyFuse::fuse_chown;
     
     ctx = new zmq::context_t( 1 );
-    //fs = new ShinyFilesystem( "filecache.kct#dfunit=8" );
-    fs = new ShinyFilesystem( "filecache" );
+    fs = new ShinyFilesystem( filecache, chunkMode, chunkCodec, chunkCacheSize );
     
     fs->save();
     sfm = new ShinyFilesystemMediator( fs, ctx );
@@ -126,6 +156,9 @@ int ShinyFuse::fuse_getattr( const char *path, struct stat * stbuff ) {
                     stbuff->st_mode |= S_IFREG | node->getPermissions();
                     stbuff->st_nlink = 1;                    
                     stbuff->st_size = ((ShinyMetaFile *)node)->getLen();
+                    
+                    // Tell whoever's asking to do their I/O a chunk at a time, since that's what it costs us anyway
+                    stbuff->st_blksize = ((ShinyMetaFile *)node)->getChunkSize();
                     break;
                 case ShinyMetaNodeSnapshot::TYPE_DIR:
                 case ShinyMetaNodeSnapshot::TYPE_ROOTDIR:
@@ -300,7 +333,37 @@ int ShinyFuse::fuse_open( const char *path, struct fuse_file_info *fi ) {
 
 int ShinyFuse::fuse_read(const char *path, char *buffer, size_t len, off_t offset, struct fuse_file_info * fi ) {
     LOG( "read:    [%s]", path );
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+    return readFile( path, &iov, 1, offset );
+}
+
+#if FUSE_VERSION >= 29
+int ShinyFuse::fuse_read_buf( const char * path, struct fuse_bufvec ** bufp, size_t len, off_t offset, struct fuse_file_info * fi ) {
+    LOG( "read_buf: [%s]", path );
+    
+    // FUSE free()s whatever we hand back once it's sent it along, so it all has to come from malloc()
+    struct fuse_bufvec * bufvec = (struct fuse_bufvec *) malloc( sizeof(struct fuse_bufvec) );
+    *bufvec = FUSE_BUFVEC_INIT( len );
+    bufvec->buf[0].mem = malloc( len );
     
+    struct iovec iov;
+    iov.iov_base = bufvec->buf[0].mem;
+    iov.iov_len = len;
+    int retval = readFile( path, &iov, 1, offset );
+    if( retval < 0 ) {
+        free( bufvec->buf[0].mem );
+        free( bufvec );
+        return retval;
+    }
+    bufvec->buf[0].size = retval;
+    *bufp = bufvec;
+    return 0;
+}
+#endif
+
+int ShinyFuse::readFile( const char * path, const struct iovec * iov, int iovcnt, off_t offset ) {
     zmq::socket_t * sock = sfm->getMediator();
     if( sock ) {
         zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::READREQ, &typeMsg );
@@ -317,15 +380,17 @@ int ShinyFuse::fuse_read(const char *path, char *buffer, size_t len, off_t offse
         if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
             // parse out the node
             const char * data = (const char *) msgList[1]->data();
-            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            // The handle only lives as long as this read does, so it lives on the stack, not the heap
+            ShinyMetaFileHandle fh( &data, fs, path );
             
-            // Go out to the cache and read!
-            uint64_t retval = fh->read( offset, buffer, len );
+            // Go out to the cache and read!  iov is FUSE's own reply buffer, so chunks get copied
+            // straight out of whatever view the DB hands us and into here.
+            uint64_t retval = fh.readv( offset, iov, iovcnt );
             
             // send out the READDONE
             buildTypeMsg( ShinyFilesystemMediator::READDONE, &typeMsg );
             buildStringMsg( path, &pathMsg );
-            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( &fh, &nodeMsg );
             
             // Send
             sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
@@ -348,6 +413,50 @@ int ShinyFuse::fuse_read(const char *path, char *buffer, size_t len, off_t offse
 
 int ShinyFuse::fuse_write( const char * path, const char * buffer, size_t len, off_t offset, struct fuse_file_info * fi ) {
     LOG( "write:   [%s] [%llu]", path, len );
+    struct iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = len;
+    return writeFile( path, &iov, 1, offset );
+}
+
+#if FUSE_VERSION >= 29
+int ShinyFuse::fuse_write_buf( const char * path, struct fuse_bufvec * buf, off_t offset, struct fuse_file_info * fi ) {
+    LOG( "write_buf: [%s] [%llu]", path, fuse_buf_size( buf ) );
+    
+    // Whatever's already in memory gets handed over just as it is, an iovec per buffer, and cut up into chunks from
+    // there, so it never has to be put back together in one piece
+    struct iovec iov[MAX_WRITE_IOVS];
+    int iovcnt = 0;
+    bool inMemory = buf->count - buf->idx <= MAX_WRITE_IOVS;
+    for( size_t i = buf->idx; i < buf->count && inMemory; ++i ) {
+        if( buf->buf[i].flags & FUSE_BUF_IS_FD ) {
+            inMemory = false;
+            break;
+        }
+        size_t skip = i == buf->idx ? buf->off : 0;
+        iov[iovcnt].iov_base = (char *)buf->buf[i].mem + skip;
+        iov[iovcnt].iov_len = buf->buf[i].size - skip;
+        iovcnt++;
+    }
+    if( inMemory )
+        return writeFile( path, iov, iovcnt, offset );
+    
+    // Spliced in through a pipe (or in more pieces than we care to keep track of), so it has to be read out into
+    // memory first.  That's this thread's scratch space, rather than a brand new buffer every time
+    size_t len = fuse_buf_size( buf );
+    ShinyChunkScratch scratch;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT( len );
+    dst.buf[0].mem = scratch.grow( len );
+    ssize_t copied = fuse_buf_copy( &dst, buf, (enum fuse_buf_copy_flags) 0 );
+    if( copied < 0 )
+        return (int)copied;
+    iov[0].iov_base = dst.buf[0].mem;
+    iov[0].iov_len = copied;
+    return writeFile( path, iov, 1, offset );
+}
+#endif
+
+int ShinyFuse::writeFile( const char * path, const struct iovec * iov, int iovcnt, off_t offset ) {
     zmq::socket_t * sock = sfm->getMediator();
     if( sock ) {
         zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::WRITEREQ, &typeMsg );
@@ -364,15 +473,15 @@ int ShinyFuse::fuse_write( const char * path, const char * buffer, size_t len, o
         if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
             // parse out the node
             const char * data = (const char *) msgList[1]->data();
-            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            ShinyMetaFileHandle fh( &data, fs, path );
             
-            // Go out to the cache and read!
-            uint64_t retval = fh->write( offset, buffer, len );
+            // Go out to the cache and write!
+            uint64_t retval = fh.writev( offset, iov, iovcnt );
             
             // send out the WRITEDONE
             buildTypeMsg( ShinyFilesystemMediator::WRITEDONE, &typeMsg );
             buildStringMsg( path, &pathMsg );
-            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( &fh, &nodeMsg );
             
             // Send
             sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
@@ -381,7 +490,10 @@ int ShinyFuse::fuse_write( const char * path, const char * buffer, size_t len, o
             delete( sock );
             freeMsgList(msgList);
             
-            // return the number of bytes written!
+            // return the number of bytes written!  Nothing at all means it couldn't be (say, older buffered writes
+            // wouldn't go out ahead of it), which is an error, not a short write
+            if( retval == 0 && ShinyIOVecCursor::total( iov, iovcnt ) > 0 )
+                return -EIO;
             return (int)retval;
         }
         
@@ -410,15 +522,15 @@ int ShinyFuse::fuse_truncate(const char * path, off_t len ) {
         if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
             // parse out the node
             const char * data = (const char *) msgList[1]->data();
-            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            ShinyMetaFileHandle fh( &data, fs, path );
             
             // Go out to the cache and truncate!
-            fh->setLen( len );
+            fh.setLen( len );
             
             // send out the TRUNCDONE
             buildTypeMsg( ShinyFilesystemMediator::TRUNCDONE, &typeMsg );
             buildStringMsg( path, &pathMsg );
-            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( &fh, &nodeMsg );
             
             // Send
             sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
@@ -438,10 +550,72 @@ int ShinyFuse::fuse_truncate(const char * path, off_t len ) {
     return -ENOENT;
 }
 
+#if FUSE_VERSION >= 38
+off_t ShinyFuse::fuse_lseek( const char * path, off_t offset, int whence, struct fuse_file_info * fi ) {
+    LOG( "lseek:   [%s] [%lld] [%d]", path, offset, whence );
+    
+    // The kernel handles all the plain old seeks itself, it only asks us where the data and holes are
+    if( whence != SEEK_DATA && whence != SEEK_HOLE )
+        return -EINVAL;
+    if( offset < 0 )
+        return -ENXIO;
+    
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        // Nothing gets read, but a READREQ gets us the node just the same
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::READREQ, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        
+        // Send
+        sendMessages( sock, 2, &typeMsg, &pathMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        
+        // ACK, and node waiting to be parsed
+        if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            // parse out the node
+            const char * data = (const char *) msgList[1]->data();
+            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            
+            // Go out to the cache and look for the next bit of data (or the next hole)
+            int64_t retval = whence == SEEK_DATA ? fh->seekData( offset ) : fh->seekHole( offset );
+            
+            // send out the READDONE
+            buildTypeMsg( ShinyFilesystemMediator::READDONE, &typeMsg );
+            buildStringMsg( path, &pathMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            
+            // Send
+            sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
+            
+            // wait for response?  no need!
+            delete( sock );
+            delete( fh );
+            
+            freeMsgList(msgList);
+            // -1 means offset was past the end of the file
+            return retval < 0 ? -ENXIO : (off_t)retval;
+        }
+        
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 )
+            WARN( "Unknown error in communication!" );
+        freeMsgList(msgList);
+        return -ENOENT;
+    }
+    return -EIO;
+}
+#endif
 
 int ShinyFuse::fuse_release(const char *path, struct fuse_file_info *fi) {
     LOG( "close [%s]", path );
     
+    // Readers never left anything buffered, so there's no need to make them wait on it
+    int flushed = 0;
+    if( (fi->flags & O_ACCMODE) != O_RDONLY )
+        flushed = flushFile( path );
+    
     zmq::socket_t * sock = sfm->getMediator();
     if( sock ) {
         zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::CLOSE, &typeMsg );
@@ -457,10 +631,10 @@ int ShinyFuse::fuse_release(const char *path, struct fuse_file_info *fi) {
         // cleanup before all the return's
         delete( sock );
         
-        // yay, it's an ACK, and we win
+        // yay, it's an ACK, and we win (unless our writes didn't make it out)
         if( msgList.size() == 1 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
             freeMsgList(msgList);
-            return 0;
+            return flushed;
         }
         
         // Otherwise, if it's not just a single NACK, we're in trouble
@@ -472,6 +646,107 @@ int ShinyFuse::fuse_release(const char *path, struct fuse_file_info *fi) {
     return -ENOENT;
 }
 
+int ShinyFuse::fuse_fsync( const char * path, int datasync, struct fuse_file_info * fi ) {
+    LOG( "fsync:   [%s]", path );
+    
+    // Everything besides buffered writes goes to the DB as soon as it happens, so there's nothing else to sync
+    return flushFile( path );
+}
+
+int ShinyFuse::flushFile( const char * path ) {
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        // Nothing gets read, but a READREQ gets us the node just the same, and keeps writes off of it while we flush
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::READREQ, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        
+        // Send
+        sendMessages( sock, 2, &typeMsg, &pathMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        
+        // ACK, and node waiting to be parsed
+        if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            // parse out the node
+            const char * data = (const char *) msgList[1]->data();
+            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            
+            // Out it goes!
+            bool success = fh->flush();
+            
+            // send out the READDONE
+            buildTypeMsg( ShinyFilesystemMediator::READDONE, &typeMsg );
+            buildStringMsg( path, &pathMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            
+            // Send
+            sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
+            
+            // wait for response?  no need!
+            delete( sock );
+            delete( fh );
+            
+            freeMsgList(msgList);
+            return success ? 0 : -EIO;
+        }
+        
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 )
+            WARN( "Unknown error in communication!" );
+        freeMsgList(msgList);
+        return -ENOENT;
+    }
+    return -EIO;
+}
+
+int ShinyFuse::merkleRoot( const char * path, char * root ) {
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        // Same as flushFile(), the READREQ keeps writes off of the file while we work out its root
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::READREQ, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        
+        // Send
+        sendMessages( sock, 2, &typeMsg, &pathMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        
+        // ACK, and node waiting to be parsed
+        if( msgList.size() == 2 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            // parse out the node
+            const char * data = (const char *) msgList[1]->data();
+            ShinyMetaFileHandle * fh = new ShinyMetaFileHandle( &data, fs, path );
+            
+            // (flushes whatever's buffered first)
+            bool success = fh->getMerkleRoot( root );
+            
+            // send out the READDONE
+            buildTypeMsg( ShinyFilesystemMediator::READDONE, &typeMsg );
+            buildStringMsg( path, &pathMsg );
+            zmq::message_t nodeMsg; buildNodeMsg( fh, &nodeMsg );
+            
+            // Send
+            sendMessages( sock, 3, &typeMsg, &pathMsg, &nodeMsg );
+            
+            // wait for response?  no need!
+            delete( sock );
+            delete( fh );
+            
+            freeMsgList(msgList);
+            return success ? 0 : -EIO;
+        }
+        
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 )
+            WARN( "Unknown error in communication!" );
+        freeMsgList(msgList);
+        return -ENOENT;
+    }
+    return -EIO;
+}
+
 int ShinyFuse::fuse_mknod( const char *path, mode_t mode, dev_t device ) {
     LOG( "mknod [%s]", path );
     
@@ -582,7 +857,7 @@ int ShinyFuse::fuse_rename( const char * path, const char * newPath ) {
     if( sock ) {
         zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::RENAME, &typeMsg );
         zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
-        zmq::message_t newPathMsg; buildStringMsg( path, &newPathMsg );
+        zmq::message_t newPathMsg; buildStringMsg( newPath, &newPathMsg );
         
         // Send
         sendMessages( sock, 3, &typeMsg, &pathMsg, &newPathMsg );
@@ -609,6 +884,215 @@ int ShinyFuse::fuse_rename( const char * path, const char * newPath ) {
     return -ENOENT;
 }
 
+#if FUSE_VERSION >= 28
+int ShinyFuse::fuse_ioctl( const char * path, int cmd, void * arg, struct fuse_file_info * fi, unsigned int flags, void * data ) {
+    LOG( "ioctl   [%s] [%d]", path, cmd );
+    if( (unsigned int)cmd == SHINYFS_IOC_MERKLE )
+        return merkleRoot( path, (char *)((struct shinyfs_merkle *) data)->root );
+    if( (unsigned int)cmd == SHINYFS_IOC_CHECKOUT ) {
+        struct shinyfs_checkout * checkout = (struct shinyfs_checkout *) data;
+        checkout->dest[SHINYFS_CLONE_PATH_MAX-1] = 0;
+        return checkoutNode( path, checkout->dest, checkout->when );
+    }
+    if( (unsigned int)cmd != SHINYFS_IOC_CLONE )
+        return -ENOTTY;
+    
+    // FUSE has already copied the struct in for us, but there's no telling whether whoever filled it in ended dest
+    struct shinyfs_clone * clone = (struct shinyfs_clone *) data;
+    clone->dest[SHINYFS_CLONE_PATH_MAX-1] = 0;
+    return cloneNode( path, clone->dest );
+}
+#endif
+
+#if FUSE_VERSION >= 34
+ssize_t ShinyFuse::fuse_copy_file_range( const char * path, struct fuse_file_info * fi, off_t offset, const char * newPath, struct fuse_file_info * newFi, off_t newOffset, size_t len, int flags ) {
+    LOG( "copy_file_range [%s -> %s] [%llu]", path, newPath, len );
+    struct stat st, newSt;
+    memset( &st, 0, sizeof(st) );
+    memset( &newSt, 0, sizeof(newSt) );
+    int retval = fuse_getattr( path, &st );
+    if( retval == 0 )
+        retval = fuse_getattr( newPath, &newSt );
+    if( retval != 0 )
+        return retval;
+    
+    // All of path, landing on top of all of newPath, is just a clone.  Anything less than that (or anything landing
+    // in the middle of newPath) and we'd have to share parts of chunks, so we don't bother
+    if( offset == 0 && newOffset == 0 && (uint64_t)len >= (uint64_t)st.st_size && newSt.st_size <= st.st_size && strcmp( path, newPath ) != 0 ) {
+        retval = cloneNode( path, newPath );
+        if( retval == 0 )
+            return st.st_size;
+    }
+    
+    // Copy it the old-fashioned way then, a block at a time through this thread's scratch space
+    ShinyChunkScratch scratch;
+    struct iovec iov;
+    iov.iov_base = scratch.grow( COPY_BLOCKSIZE );
+    size_t copied = 0;
+    while( copied < len ) {
+        iov.iov_len = len - copied < COPY_BLOCKSIZE ? len - copied : COPY_BLOCKSIZE;
+        int read = readFile( path, &iov, 1, offset + copied );
+        if( read < 0 )
+            return copied ? copied : read;
+        if( read == 0 )
+            break;
+        
+        iov.iov_len = read;
+        int written = writeFile( newPath, &iov, 1, newOffset + copied );
+        if( written < 0 )
+            return copied ? copied : written;
+        copied += written;
+        if( written < read )
+            break;
+    }
+    return copied;
+}
+#endif
+
+int ShinyFuse::cloneNode( const char * path, const char * newPath ) {
+    LOG( "clone  [%s -> %s]", path, newPath );
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::CLONE, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        zmq::message_t newPathMsg; buildStringMsg( newPath, &newPathMsg );
+        
+        // Send
+        sendMessages( sock, 3, &typeMsg, &pathMsg, &newPathMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        
+        // cleanup before all the return's
+        delete( sock );
+        
+        if( msgList.size() == 1 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            freeMsgList(msgList);
+            return 0;
+        }
+        
+        // A NACK doesn't say why, and the likeliest reason (besides a bad path) is that somebody's using path
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 ) {
+            WARN( "Unknown error in communication!" );
+            freeMsgList(msgList);
+            return -EIO;
+        }
+        freeMsgList(msgList);
+        return -EBUSY;
+    }
+    return -EIO;
+}
+
+#if defined( __OSX__ )
+int ShinyFuse::fuse_getxattr( const char * path, const char * name, char * value, size_t size, uint32_t position ) {
+#else
+int ShinyFuse::fuse_getxattr( const char * path, const char * name, char * value, size_t size ) {
+#endif
+    LOG( "getxattr [%s] [%s]", path, name );
+    if( strcmp( name, SHINYFS_XATTR_VERSIONS ) != 0 )
+        return -ENOXATTR;
+    
+    std::string versions;
+    int retval = getVersions( path, versions );
+    if( retval != 0 )
+        return retval;
+    
+    // A size of 0 is just asking how big it is
+    if( size == 0 )
+        return versions.size();
+    if( size < versions.size() )
+        return -ERANGE;
+    memcpy( value, versions.data(), versions.size() );
+    return versions.size();
+}
+
+int ShinyFuse::fuse_listxattr( const char * path, char * list, size_t size ) {
+    LOG( "listxattr [%s]", path );
+    
+    // Only files have versions
+    std::string versions;
+    if( getVersions( path, versions ) != 0 )
+        return 0;
+    
+    size_t len = strlen( SHINYFS_XATTR_VERSIONS ) + 1;
+    if( size == 0 )
+        return len;
+    if( size < len )
+        return -ERANGE;
+    memcpy( list, SHINYFS_XATTR_VERSIONS, len );
+    return len;
+}
+
+int ShinyFuse::getVersions( const char * path, std::string & versions ) {
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::VERSIONS, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        
+        // Send
+        sendMessages( sock, 2, &typeMsg, &pathMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        delete( sock );
+        
+        // ACK, then a msg per version
+        if( msgList.size() >= 1 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            versions.clear();
+            for( uint64_t i=1; i<msgList.size(); ++i ) {
+                char * time = parseStringMsg(msgList[i]);
+                versions.append( time );
+                versions.append( "\n" );
+                delete( time );
+            }
+            freeMsgList(msgList);
+            return 0;
+        }
+        
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 )
+            WARN( "Unknown error in communication!" );
+        freeMsgList(msgList);
+        return -ENOXATTR;
+    }
+    return -EIO;
+}
+
+int ShinyFuse::checkoutNode( const char * path, const char * newPath, uint64_t when ) {
+    LOG( "checkout [%s -> %s] [%llu]", path, newPath, when );
+    zmq::socket_t * sock = sfm->getMediator();
+    if( sock ) {
+        zmq::message_t typeMsg; buildTypeMsg( ShinyFilesystemMediator::CHECKOUT, &typeMsg );
+        zmq::message_t pathMsg; buildStringMsg( path, &pathMsg );
+        zmq::message_t newPathMsg; buildStringMsg( newPath, &newPathMsg );
+        zmq::message_t whenMsg; buildDataMsg( &when, sizeof(uint64_t), &whenMsg );
+        
+        // Send
+        sendMessages( sock, 4, &typeMsg, &pathMsg, &newPathMsg, &whenMsg );
+        
+        // wait for response
+        std::vector<zmq::message_t *> msgList;
+        recvMessages( sock, msgList );
+        delete( sock );
+        
+        if( msgList.size() == 1 && parseTypeMsg(msgList[0]) == ShinyFilesystemMediator::ACK ) {
+            freeMsgList(msgList);
+            return 0;
+        }
+        
+        // A NACK doesn't say why, but the likeliest reason is that there's no version as old as when
+        if( (msgList.size() == 1 && parseTypeMsg(msgList[0]) != ShinyFilesystemMediator::NACK) || msgList.size() != 1 ) {
+            WARN( "Unknown error in communication!" );
+            freeMsgList(msgList);
+            return -EIO;
+        }
+        freeMsgList(msgList);
+        return -ENOENT;
+    }
+    return -EIO;
+}
+
 int ShinyFuse::fuse_access( const char *path, int mode ) {
     LOG( "access [%s] [%d]", path, mode );
 /*    
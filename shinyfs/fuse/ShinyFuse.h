@@ -3,8 +3,10 @@
 #define shinyfs_node_ShinyFuse_h
 
 #include <pthread.h>
+#include <sys/uio.h>
 #include "../util/cppzmq/zmq.hpp"
 #include <vector>
+#include <string>
 
 //Include FUSE here
 #define _FILE_OFFSET_BITS 64
@@ -18,7 +20,11 @@ class ShinyFuse {
 /////// CREATION ///////
 public:
     //Initializes the FUSE interface, sets up the callbacks, etc....
-    static bool init( const char * mountPoint );
+    //filecache picks the storage engine and where it lives, see ShinyDBBackend.h
+    //chunkMode and chunkCodec pick how a new filecache lays out file data (e.g. MODE_DEDUP to share identical chunks)
+    //and what it gets compressed with, see ShinyChunkStore.h
+    //chunkCacheSize is how much memory recently read chunks get to take up, see ShinyChunkCache.h (0 turns it off)
+    static bool init( const char * mountPoint, const char * filecache = "leveldb:filecache", ShinyChunkStore::Mode chunkMode = ShinyChunkStore::MODE_DIRECT, const char * chunkCodec = "lz", uint64_t chunkCacheSize = ShinyChunkCache::DEFAULT_SIZE );
 private:
     
     
@@ -40,6 +46,33 @@ private:
     static int fuse_write( const char * path, const char * buffer, size_t len, off_t offset, struct fuse_file_info * fi );
     static int fuse_release( const char * path, struct fuse_file_info * fi );
     
+    //Same as read/write, but with FUSE's buffer vectors (from 2.9 on).  Written buffers that are already in memory go
+    //straight to ShinyMetaFileHandle::writev() without being copied into one piece first; ones spliced in through a
+    //pipe get read out into scratch space.  Either way, read() and write() end up in readFile()/writeFile()
+#if FUSE_VERSION >= 29
+    static int fuse_read_buf( const char * path, struct fuse_bufvec ** bufp, size_t len, off_t offset, struct fuse_file_info * fi );
+    static int fuse_write_buf( const char * path, struct fuse_bufvec * buf, off_t offset, struct fuse_file_info * fi );
+#endif
+    static int readFile( const char * path, const struct iovec * iov, int iovcnt, off_t offset );
+    static int writeFile( const char * path, const struct iovec * iov, int iovcnt, off_t offset );
+    
+    //The most buffers fuse_write_buf() will pass along as iovecs before it just copies them all into one
+    static const int MAX_WRITE_IOVS = 16;
+    
+    //Small writes get buffered up until they fill a chunk (see ShinyChunkWriteback), so fsync() and closing a file
+    //that was open for writing have to write out whatever's left
+    static int fuse_fsync( const char * path, int datasync, struct fuse_file_info * fi );
+    static int flushFile( const char * path );
+    
+    //Works out the Merkle root of the file at path into root (SHINYFS_MERKLE_ROOT_LEN bytes), for SHINYFS_IOC_MERKLE
+    static int merkleRoot( const char * path, char * root );
+    
+    //SEEK_DATA/SEEK_HOLE, so cp --sparse and friends can skip right over holes.  FUSE only passes lseek() along to
+    //us from 3.8 on; before that the kernel treats the whole file as data, which is slow but correct
+#if FUSE_VERSION >= 38
+    static off_t fuse_lseek( const char * path, off_t offset, int whence, struct fuse_file_info * fi );
+#endif
+    
     static int fuse_truncate( const char * path, off_t len );
     
     static int fuse_mknod( const char * path, mode_t permissions, dev_t device );
@@ -51,6 +84,31 @@ private:
     
     static int fuse_rename( const char * path, const char * newPath );
     
+    //Copies that share chunks with what they were copied from (see ShinyIoctl.h).  SHINYFS_IOC_CLONE clones files or
+    //whole trees; copy_file_range() (from 3.4 on) only clones when it's asked to copy all of one file over the top of
+    //another, and otherwise just copies the bytes
+#if FUSE_VERSION >= 28
+    static int fuse_ioctl( const char * path, int cmd, void * arg, struct fuse_file_info * fi, unsigned int flags, void * data );
+#endif
+#if FUSE_VERSION >= 34
+    static ssize_t fuse_copy_file_range( const char * path, struct fuse_file_info * fi, off_t offset, const char * newPath, struct fuse_file_info * newFi, off_t newOffset, size_t len, int flags );
+#endif
+    static int cloneNode( const char * path, const char * newPath );
+    
+    //Old versions of files (see ShinyFileHistory).  When each of a file's saved versions was saved shows up in its
+    //SHINYFS_XATTR_VERSIONS xattr, and SHINYFS_IOC_CHECKOUT gets one back (see ShinyIoctl.h)
+#if defined( __OSX__ )
+    static int fuse_getxattr( const char * path, const char * name, char * value, size_t size, uint32_t position );
+#else
+    static int fuse_getxattr( const char * path, const char * name, char * value, size_t size );
+#endif
+    static int fuse_listxattr( const char * path, char * list, size_t size );
+    static int getVersions( const char * path, std::string & versions );
+    static int checkoutNode( const char * path, const char * newPath, uint64_t when );
+    
+    //How much copy_file_range() copies at a time when it can't clone
+    static const uint64_t COPY_BLOCKSIZE = 1024*1024;
+    
     static int fuse_access( const char * path, int mode );
     
     static int fuse_chmod( const char * path, mode_t mode );
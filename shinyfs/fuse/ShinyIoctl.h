@@ -0,0 +1,59 @@
+#pragma once
+#ifndef shinyfs_node_ShinyIoctl_h
+#define shinyfs_node_ShinyIoctl_h
+
+#include <sys/ioctl.h>
+
+/*
+ The ioctl()s shinyfs answers to, for anybody who wants to call them on a file (or dir) inside a mounted shinyfs.
+
+ The kernel deals with FICLONE itself and never passes it down to FUSE, so this is our own version of it.  Open the
+ file or dir you want to copy and hand SHINYFS_IOC_CLONE the path the copy should end up at, relative to the root of
+ the mount (e.g. "/backups/today").  Nothing gets copied but metadata: the copy shares every chunk with the original
+ until one of them writes over it.  A file that's already at dest gets replaced if you're cloning a file; anything
+ else already there is an error.  Whatever you're cloning can't be in the middle of a read or write while it happens
+ (you'll get EBUSY).
+
+ SHINYFS_IOC_MERKLE fills in the root of a file's Merkle tree (see filesystem/ShinyChunkMerkle.h for exactly what goes
+ into it), which is the same for any two files holding the same data in the same size of chunks, so it's a cheap way
+ to tell whether a file changed, or whether two files match, without reading them yourself.  The first one for a file
+ reads the whole thing, but after that it's kept up to date as the file's written.  Comes back with EIO if any chunk
+ of the file doesn't match its checksum.
+
+ Every time a file that was written to gets closed, what's in it gets saved as a new version (see
+ filesystem/ShinyFileHistory.h), and the SHINYFS_XATTR_VERSIONS xattr of a file lists when each of them was saved, in
+ seconds since the epoch, a line apiece, oldest first.  SHINYFS_IOC_CHECKOUT gets the file back how it was as of when
+ (so the newest version saved in or before that second) into dest, which works just like SHINYFS_IOC_CLONE's: a file
+ that's already there gets replaced, and it can be the file itself, to put it back how it was.  Comes back with ENOENT
+ if it can't be done, which mostly means there's no version that old, but can also mean either file was in the middle
+ of a read or write.
+ */
+
+// As long a dest as we'll take, NUL and all
+#define SHINYFS_CLONE_PATH_MAX  4096
+
+struct shinyfs_clone {
+    char dest[SHINYFS_CLONE_PATH_MAX];
+};
+
+#define SHINYFS_IOC_CLONE       _IOW( 'S', 1, struct shinyfs_clone )
+
+// A SHA-256
+#define SHINYFS_MERKLE_ROOT_LEN 32
+
+struct shinyfs_merkle {
+    unsigned char root[SHINYFS_MERKLE_ROOT_LEN];
+};
+
+#define SHINYFS_IOC_MERKLE      _IOR( 'S', 2, struct shinyfs_merkle )
+
+#define SHINYFS_XATTR_VERSIONS  "user.shinyfs.versions"
+
+struct shinyfs_checkout {
+    unsigned long long when;
+    char dest[SHINYFS_CLONE_PATH_MAX];
+};
+
+#define SHINYFS_IOC_CHECKOUT    _IOW( 'S', 3, struct shinyfs_checkout )
+
+#endif
@@ -0,0 +1,201 @@
+//
+//  ShinyCRC32C.cpp
+//  shinyfs
+//
+
+#include "ShinyCRC32C.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define SHINY_CRC32C_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define SHINY_CRC32C_ARM
+#endif
+
+// The Castagnoli polynomial, bit-reversed, since CRC-32C goes through each byte lowest bit first
+#define POLY            0x82f63b78
+
+// The hardware version runs three streams of LONG bytes side by side (or SHORT, for whatever's left), each one
+// through its own CRC, and then shifts them over on top of each other.  The instruction takes 3 cycles to come back
+// but can start a new one every cycle, so one stream on its own would leave it sitting around two thirds of the time
+#define LONG            8192
+#define SHORT           256
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+// The software version's tables: table[0] is the CRC of every byte, and table[k] is that same byte followed by k zeros
+static uint32_t table[8][256];
+
+// x^(2^k) mod POLY, for every k we could need to shift by, and the shifts the hardware version uses all the time
+static uint32_t x2nTable[64];
+static uint32_t xLong, xShort;
+
+static bool hardware = false;
+
+// Everything below works on the raw CRC register, before the ~ on the way in and out that CRC-32C does
+
+// a*b mod POLY, a bit at a time
+static uint32_t multModP( uint32_t a, uint32_t b ) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    while( m ) {
+        if( a & m ) {
+            p ^= b;
+            if( (a & (m - 1)) == 0 )
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n*2^k) mod POLY, which is what shifting a CRC over by n*2^k bits amounts to.  Shifting by bytes is k = 3
+static uint32_t x2nModP( uint64_t n, unsigned k ) {
+    uint32_t p = (uint32_t)1 << 31;
+    for( ; n && k < 64; n >>= 1, ++k ) {
+        if( n & 1 )
+            p = multModP( x2nTable[k], p );
+    }
+    return p;
+}
+
+static uint32_t rawSoftware( uint32_t crc, const unsigned char * data, uint64_t len ) {
+    while( len && ((uintptr_t)data & 7) ) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    // Put together byte by byte so it comes out the same whatever order the CPU keeps its words in
+    for( ; len >= 8; data += 8, len -= 8 ) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+        uint32_t hi = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    while( len-- )
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(SHINY_CRC32C_X86) || defined(SHINY_CRC32C_ARM)
+#ifdef SHINY_CRC32C_X86
+#define CRC_BYTE( crc, byte )   _mm_crc32_u8( (uint32_t)(crc), (byte) )
+#define CRC_WORD( crc, word )   _mm_crc32_u64( (crc), (word) )
+#define HARDWARE                __attribute__((target("sse4.2")))
+#else
+#define CRC_BYTE( crc, byte )   __crc32cb( (uint32_t)(crc), (byte) )
+#define CRC_WORD( crc, word )   __crc32cd( (uint32_t)(crc), (word) )
+#define HARDWARE
+#endif
+
+static inline uint64_t load64( const unsigned char * data ) {
+    uint64_t word;
+    memcpy( &word, data, sizeof(word) );
+    return word;
+}
+
+// Runs three blockLen streams at once for as long as there's enough data left, then shifts them together.  shift is
+// x^(8*blockLen) mod POLY
+HARDWARE static uint32_t rawStreams( uint32_t crc, const unsigned char ** data, uint64_t * len, uint64_t blockLen, uint32_t shift ) {
+    while( *len >= 3*blockLen ) {
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+        const unsigned char * p = *data;
+        const unsigned char * end = p + blockLen;
+        do {
+            crc0 = CRC_WORD( crc0, load64( p ) );
+            crc1 = CRC_WORD( crc1, load64( p + blockLen ) );
+            crc2 = CRC_WORD( crc2, load64( p + 2*blockLen ) );
+            p += 8;
+        } while( p < end );
+        crc = multModP( shift, multModP( shift, (uint32_t)crc0 ) ^ (uint32_t)crc1 ) ^ (uint32_t)crc2;
+        *data += 3*blockLen;
+        *len -= 3*blockLen;
+    }
+    return crc;
+}
+
+HARDWARE static uint32_t rawHardware( uint32_t crc, const unsigned char * data, uint64_t len ) {
+    while( len && ((uintptr_t)data & 7) ) {
+        crc = CRC_BYTE( crc, *data++ );
+        len--;
+    }
+    crc = rawStreams( crc, &data, &len, LONG, xLong );
+    crc = rawStreams( crc, &data, &len, SHORT, xShort );
+    uint64_t crc64 = crc;
+    for( ; len >= 8; data += 8, len -= 8 )
+        crc64 = CRC_WORD( crc64, load64( data ) );
+    crc = (uint32_t)crc64;
+    while( len-- )
+        crc = CRC_BYTE( crc, *data++ );
+    return crc;
+}
+#endif
+
+void ShinyCRC32C::init() {
+    for( uint32_t i=0; i<256; ++i ) {
+        uint32_t crc = i;
+        for( int bit=0; bit<8; ++bit )
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for( uint32_t i=0; i<256; ++i ) {
+        for( int k=1; k<8; ++k )
+            table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+    }
+
+    // x^1, then squared over and over
+    uint32_t p = (uint32_t)1 << 30;
+    x2nTable[0] = p;
+    for( int k=1; k<64; ++k )
+        x2nTable[k] = p = multModP( p, p );
+    xLong = x2nModP( LONG, 3 );
+    xShort = x2nModP( SHORT, 3 );
+
+#if defined(SHINY_CRC32C_X86)
+    __builtin_cpu_init();
+    hardware = __builtin_cpu_supports( "sse4.2" );
+#elif defined(SHINY_CRC32C_ARM)
+    hardware = true;
+#endif
+}
+
+uint32_t ShinyCRC32C::hash( const char * data, uint64_t len ) {
+    return extend( 0, data, len );
+}
+
+uint32_t ShinyCRC32C::extend( uint32_t crc, const char * data, uint64_t len ) {
+    pthread_once( &initOnce, &ShinyCRC32C::init );
+    const unsigned char * bytes = (const unsigned char *)data;
+#if defined(SHINY_CRC32C_X86) || defined(SHINY_CRC32C_ARM)
+    if( hardware )
+        return ~rawHardware( ~crc, bytes, len );
+#endif
+    return ~rawSoftware( ~crc, bytes, len );
+}
+
+uint32_t ShinyCRC32C::extendZeros( uint32_t crc, uint64_t len ) {
+    pthread_once( &initOnce, &ShinyCRC32C::init );
+
+    // Zeros going into a register that's already zero leave it that way, so all they do is shift what's there over
+    if( !len )
+        return crc;
+    return ~multModP( x2nModP( len, 3 ), ~crc );
+}
+
+bool ShinyCRC32C::isHardware() {
+    pthread_once( &initOnce, &ShinyCRC32C::init );
+    return hardware;
+}
+
+void ShinyCRC32C::encode( uint32_t crc, char * output ) {
+    for( int i=0; i<4; ++i )
+        output[i] = (char)((crc >> (i*8)) & 0xff);
+}
+
+uint32_t ShinyCRC32C::decode( const char * input ) {
+    const unsigned char * bytes = (const unsigned char *)input;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
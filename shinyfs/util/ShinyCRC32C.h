@@ -0,0 +1,38 @@
+#pragma once
+#ifndef shinyfs_ShinyCRC32C_h
+#define shinyfs_ShinyCRC32C_h
+
+#include <stdint.h>
+
+// CRC-32C (Castagnoli, the one iSCSI, ext4 and friends use), for checking that what comes back out of the DB is what
+// went in.  Runs on the CPU's own CRC32 instruction wherever there is one (SSE4.2 on x86, checked for when we start
+// up, and ARMv8's CRC extension if we were compiled for it), three streams at once so the instruction's latency is
+// hidden, and falls back on plain old table lookups, 8 bytes at a time, everywhere else
+class ShinyCRC32C {
+public:
+    // How many bytes a CRC takes up once it's been encode()d
+    static const uint64_t LEN = sizeof(uint32_t);
+
+    // The CRC of len bytes of data
+    static uint32_t hash( const char * data, uint64_t len );
+
+    // Picks up where crc (the CRC of whatever came before) left off, returning the CRC of it all with data tacked on
+    // the end.  hash() is just extend() starting from 0, which is the CRC of nothing at all
+    static uint32_t extend( uint32_t crc, const char * data, uint64_t len );
+
+    // Same as extend()ing crc by len zeros, but without going through them one by one.  Costs a few dozen shifts per
+    // bit in len, however many zeros that is
+    static uint32_t extendZeros( uint32_t crc, uint64_t len );
+
+    // Whether hash() and extend() have a CRC32 instruction to run on, or are stuck with the tables
+    static bool isHardware();
+
+    // Writes crc out as LEN bytes, little-endian, and reads it back in
+    static void encode( uint32_t crc, char * output );
+    static uint32_t decode( const char * input );
+private:
+    // Works out the tables and checks the CPU out, once
+    static void init();
+};
+
+#endif // shinyfs_ShinyCRC32C_h
@@ -0,0 +1,187 @@
+//
+//  ShinyDelta.cpp
+//  shinyfs
+//
+
+#include "ShinyDelta.h"
+#include <string.h>
+
+// The rolling hash is a plain old polynomial one, mod 2^32: every byte that comes in multiplies everything before it
+// by MULT, and the one that falls out the back takes MULT^BLOCK times itself along with it
+#define MULT            0x01000193
+
+// Spreads the hash's bits out before we take the top ones for a slot
+#define SPREAD          0x9e3779b1
+
+static uint32_t multPow() {
+    uint32_t p = 1;
+    for( uint64_t i=0; i<ShinyDelta::BLOCK; ++i )
+        p *= MULT;
+    return p;
+}
+
+static const uint32_t outMult = multPow();
+
+uint32_t ShinyDelta::hashBlock( const char * data ) {
+    uint32_t hash = 0;
+    for( uint64_t i=0; i<BLOCK; ++i )
+        hash = hash*MULT + (uint8_t)data[i];
+    return hash;
+}
+
+uint32_t ShinyDelta::roll( uint32_t hash, uint8_t out, uint8_t in ) {
+    return hash*MULT + in - out*outMult;
+}
+
+uint64_t ShinyDelta::slot( uint32_t hash, int shift ) {
+    return (uint32_t)(hash*SPREAD) >> shift;
+}
+
+void ShinyDelta::buildIndex( const char * source, uint64_t sourceLen, Index & index ) {
+    // Twice as many slots as blocks (rounded up to a power of two), so not too many of them land on top of each other
+    uint64_t numBlocks = sourceLen/BLOCK;
+    int bits = 1;
+    while( bits < 32 && ((uint64_t)1 << bits) < 2*numBlocks )
+        bits++;
+    index.blocks.assign( (uint64_t)1 << bits, 0 );
+    index.shift = 32 - bits;
+
+    // Slots hold the block number plus one, so 0 means empty
+    for( uint64_t block=0; block<numBlocks; ++block )
+        index.blocks[slot( hashBlock( source + block*BLOCK ), index.shift )] = (uint32_t)(block + 1);
+}
+
+void ShinyDelta::encode( const char * source, uint64_t sourceLen, const char * target, uint64_t targetLen, std::string & delta ) {
+    delta.clear();
+    putVarint( delta, targetLen );
+
+    // Everything in target from literal on hasn't gone into an opcode yet
+    uint64_t literal = 0;
+    uint64_t lastCopyEnd = 0;
+    if( sourceLen >= BLOCK && targetLen >= BLOCK ) {
+        Index index;
+        buildIndex( source, sourceLen, index );
+
+        uint64_t pos = 0;
+        uint32_t hash = hashBlock( target );
+        while( true ) {
+            uint32_t found = index.blocks[slot( hash, index.shift )];
+            uint64_t src = (uint64_t)(found - 1)*BLOCK;
+            if( found && memcmp( source + src, target + pos, BLOCK ) == 0 ) {
+                // Stretch the match as far forward as it goes, a word at a time while we can...
+                uint64_t end = pos + BLOCK, srcEnd = src + BLOCK;
+                while( end + 8 <= targetLen && srcEnd + 8 <= sourceLen && memcmp( source + srcEnd, target + end, 8 ) == 0 ) {
+                    end += 8;
+                    srcEnd += 8;
+                }
+                while( end < targetLen && srcEnd < sourceLen && source[srcEnd] == target[end] ) {
+                    end++;
+                    srcEnd++;
+                }
+
+                // ...and back over whatever we slid past without noticing, but not into the last copy
+                uint64_t start = pos;
+                while( start > literal && src > 0 && source[src - 1] == target[start - 1] ) {
+                    start--;
+                    src--;
+                }
+
+                putInsert( delta, target + literal, start - literal );
+                putCopy( delta, src, end - start, &lastCopyEnd );
+                literal = pos = end;
+                if( pos + BLOCK > targetLen )
+                    break;
+                hash = hashBlock( target + pos );
+                continue;
+            }
+
+            if( pos + BLOCK >= targetLen )
+                break;
+            hash = roll( hash, (uint8_t)target[pos], (uint8_t)target[pos + BLOCK] );
+            pos++;
+        }
+    }
+    putInsert( delta, target + literal, targetLen - literal );
+}
+
+bool ShinyDelta::decode( const char * source, uint64_t sourceLen, const char * delta, uint64_t deltaLen, std::string & target ) {
+    target.clear();
+    const char * input = delta;
+    const char * end = delta + deltaLen;
+    uint64_t targetLen;
+    if( !getVarint( &input, end, &targetLen ) )
+        return false;
+
+    // A garbled length shouldn't get to make us allocate the world, so don't trust it any further than the delta
+    // could possibly stretch
+    target.reserve( targetLen < sourceLen + deltaLen ? targetLen : sourceLen + deltaLen );
+
+    uint64_t lastCopyEnd = 0;
+    while( input < end ) {
+        uint64_t op;
+        if( !getVarint( &input, end, &op ) )
+            return false;
+        uint64_t len = op >> 1;
+        if( len > targetLen - target.size() )
+            return false;
+
+        if( (op & 1) == COPY ) {
+            uint64_t zigzag;
+            if( !getVarint( &input, end, &zigzag ) )
+                return false;
+            uint64_t offset = lastCopyEnd + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+            if( offset > sourceLen || len > sourceLen - offset )
+                return false;
+            target.append( source + offset, len );
+            lastCopyEnd = offset + len;
+        } else {
+            if( len > (uint64_t)(end - input) )
+                return false;
+            target.append( input, len );
+            input += len;
+        }
+    }
+    return target.size() == targetLen;
+}
+
+bool ShinyDelta::getTargetLen( const char * delta, uint64_t deltaLen, uint64_t * targetLen ) {
+    return getVarint( &delta, delta + deltaLen, targetLen );
+}
+
+void ShinyDelta::putInsert( std::string & delta, const char * data, uint64_t len ) {
+    if( len == 0 )
+        return;
+    putVarint( delta, (len << 1) | INSERT );
+    delta.append( data, len );
+}
+
+void ShinyDelta::putCopy( std::string & delta, uint64_t offset, uint64_t len, uint64_t * lastCopyEnd ) {
+    int64_t hop = (int64_t)(offset - *lastCopyEnd);
+    putVarint( delta, (len << 1) | COPY );
+    putVarint( delta, ((uint64_t)hop << 1) ^ (uint64_t)(hop >> 63) );
+    *lastCopyEnd = offset + len;
+}
+
+void ShinyDelta::putVarint( std::string & delta, uint64_t value ) {
+    char buff[10];
+    int len = 0;
+    while( value >= 0x80 ) {
+        buff[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buff[len++] = (char)value;
+    delta.append( buff, len );
+}
+
+bool ShinyDelta::getVarint( const char ** input, const char * end, uint64_t * value ) {
+    uint64_t result = 0;
+    for( int shift = 0; shift < 64 && *input < end; shift += 7 ) {
+        uint8_t byte = (uint8_t)*(*input)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if( !(byte & 0x80) ) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef shinyfs_ShinyDelta_h
+#define shinyfs_ShinyDelta_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ Binary deltas: encode() works out how to build target out of pieces of source (plus whatever bytes source doesn't
+ have), and decode() follows those directions to get target back, given the same source.  Deltas between two
+ versions of a file that only had a few edits made to it come out a tiny fraction of the size of either one.
+
+ Finding the pieces goes like rsync/xdelta: source is cut up into BLOCK byte blocks, each one goes into a hash table
+ by its rolling hash, and then a window of BLOCK bytes slides along target one byte at a time, rolling its hash as it
+ goes (one multiply and add a byte), and looking it up.  Whenever a block of source matches, the match gets stretched
+ out as far as it goes in both directions.  So it's one pass over each, no matter where in target things moved to
+ or how much got inserted, rather than trying every offset of source for every byte of target.  Matches that start
+ in the middle of a block of source (and are shorter than two blocks) can get missed, which just costs a few bytes.
+
+ A delta is the length of target, then a string of opcodes, all as varints (7 bits a byte, lowest first, with the
+ top bit set on every byte but the last).  Each opcode is (len << 1) | COPY or (len << 1) | INSERT: an INSERT is
+ followed by the len bytes to insert, and a COPY by where in source to copy len bytes from, as the difference from
+ wherever the last COPY left off (zig-zagged, so little hops either way stay little), since edits mostly leave
+ things in order.
+ */
+
+class ShinyDelta {
+public:
+    // How big the blocks source gets indexed by are.  Smaller finds more matches but makes a bigger index
+    static const uint64_t BLOCK = 16;
+
+    // The opcodes
+    static const uint64_t INSERT = 0;
+    static const uint64_t COPY = 1;
+
+    // Writes the delta that turns source into target out to delta (replacing whatever was in it)
+    static void encode( const char * source, uint64_t sourceLen, const char * target, uint64_t targetLen, std::string & delta );
+
+    // Rebuilds target (replacing whatever was in it) from source and a delta made from that same source.  Returns
+    // false if delta is garbled, or wants bytes source doesn't have
+    static bool decode( const char * source, uint64_t sourceLen, const char * delta, uint64_t deltaLen, std::string & target );
+
+    // How long the target of delta is, without decoding the whole thing.  Returns false if delta is garbled
+    static bool getTargetLen( const char * delta, uint64_t deltaLen, uint64_t * targetLen );
+private:
+    // Index of every block of source, by hash.  Only the last block with a given hash is kept, the rest are just
+    // missed matches
+    struct Index {
+        std::vector<uint32_t> blocks;
+        int shift;
+    };
+    static void buildIndex( const char * source, uint64_t sourceLen, Index & index );
+
+    // The hash of BLOCK bytes of data, and how to roll it along a byte
+    static uint32_t hashBlock( const char * data );
+    static uint32_t roll( uint32_t hash, uint8_t out, uint8_t in );
+    static uint64_t slot( uint32_t hash, int shift );
+
+    // Tacks an opcode onto delta.  Inserts come with data, copies with where they're from
+    static void putInsert( std::string & delta, const char * data, uint64_t len );
+    static void putCopy( std::string & delta, uint64_t offset, uint64_t len, uint64_t * lastCopyEnd );
+
+    static void putVarint( std::string & delta, uint64_t value );
+    static bool getVarint( const char ** input, const char * end, uint64_t * value );
+};
+
+#endif // shinyfs_ShinyDelta_h
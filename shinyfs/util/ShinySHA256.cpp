@@ -0,0 +1,121 @@
+//
+//  ShinySHA256.cpp
+//  shinyfs
+//
+
+#include "ShinySHA256.h"
+#include <string.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR( x, n )    (((x) >> (n)) | ((x) << (32 - (n))))
+
+ShinySHA256::ShinySHA256() {
+    this->reset();
+}
+
+void ShinySHA256::reset() {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy( this->state, initial, sizeof(initial) );
+    this->totalLen = 0;
+    this->bufferLen = 0;
+}
+
+void ShinySHA256::transform( const uint8_t * block ) {
+    uint32_t w[64];
+    for( int i=0; i<16; ++i )
+        w[i] = (block[i*4] << 24) | (block[i*4 + 1] << 16) | (block[i*4 + 2] << 8) | block[i*4 + 3];
+    for( int i=16; i<64; ++i ) {
+        uint32_t s0 = ROTR( w[i-15], 7 ) ^ ROTR( w[i-15], 18 ) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROTR( w[i-2], 17 ) ^ ROTR( w[i-2], 19 ) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = this->state[0], b = this->state[1], c = this->state[2], d = this->state[3];
+    uint32_t e = this->state[4], f = this->state[5], g = this->state[6], h = this->state[7];
+    for( int i=0; i<64; ++i ) {
+        uint32_t t1 = h + (ROTR( e, 6 ) ^ ROTR( e, 11 ) ^ ROTR( e, 25 )) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (ROTR( a, 2 ) ^ ROTR( a, 13 ) ^ ROTR( a, 22 )) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    this->state[0] += a;
+    this->state[1] += b;
+    this->state[2] += c;
+    this->state[3] += d;
+    this->state[4] += e;
+    this->state[5] += f;
+    this->state[6] += g;
+    this->state[7] += h;
+}
+
+void ShinySHA256::update( const char * data, uint64_t len ) {
+    const uint8_t * input = (const uint8_t *)data;
+    this->totalLen += len;
+
+    // Top off whatever's left over from last time first
+    if( this->bufferLen ) {
+        uint64_t fill = 64 - this->bufferLen;
+        if( fill > len )
+            fill = len;
+        memcpy( this->buffer + this->bufferLen, input, fill );
+        this->bufferLen += fill;
+        input += fill;
+        len -= fill;
+        if( this->bufferLen < 64 )
+            return;
+        this->transform( this->buffer );
+        this->bufferLen = 0;
+    }
+
+    // Then go straight through data a block at a time, without copying
+    for( ; len >= 64; input += 64, len -= 64 )
+        this->transform( input );
+
+    memcpy( this->buffer, input, len );
+    this->bufferLen = len;
+}
+
+void ShinySHA256::finish( char * digest ) {
+    uint64_t bitLen = this->totalLen*8;
+
+    // Tack on the 1 bit, then pad with zeros until there's just room for the length at the end of a block
+    uint8_t pad[72];
+    memset( pad, 0, sizeof(pad) );
+    pad[0] = 0x80;
+    uint64_t padLen = (this->bufferLen < 56) ? 56 - this->bufferLen : 120 - this->bufferLen;
+    for( int i=0; i<8; ++i )
+        pad[padLen + i] = (uint8_t)(bitLen >> (56 - i*8));
+    this->update( (const char *)pad, padLen + 8 );
+
+    for( int i=0; i<8; ++i ) {
+        digest[i*4] = (char)(this->state[i] >> 24);
+        digest[i*4 + 1] = (char)(this->state[i] >> 16);
+        digest[i*4 + 2] = (char)(this->state[i] >> 8);
+        digest[i*4 + 3] = (char)this->state[i];
+    }
+}
+
+void ShinySHA256::hash( const char * data, uint64_t len, char * digest ) {
+    ShinySHA256 sha;
+    sha.update( data, len );
+    sha.finish( digest );
+}
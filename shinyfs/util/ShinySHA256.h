@@ -0,0 +1,38 @@
+#pragma once
+#ifndef shinyfs_ShinySHA256_h
+#define shinyfs_ShinySHA256_h
+
+#include <stdint.h>
+
+// Plain old SHA-256 (FIPS 180-4), so we don't have to drag in a whole crypto library just to name chunks by their
+// contents.  Either feed it data a piece at a time with update() and then finish(), or just call hash()
+class ShinySHA256 {
+public:
+    static const uint64_t DIGEST_LEN = 32;
+
+    ShinySHA256();
+
+    // Starts over, as if nothing had been fed in yet
+    void reset();
+
+    // Feeds another len bytes of data in
+    void update( const char * data, uint64_t len );
+
+    // Writes the DIGEST_LEN byte digest of everything fed in so far out to digest.  reset() before reusing!
+    void finish( char * digest );
+
+    // All of the above, in one go
+    static void hash( const char * data, uint64_t len, char * digest );
+private:
+    // Chews through one 64-byte block
+    void transform( const uint8_t * block );
+
+    uint32_t state[8];
+    uint64_t totalLen;
+
+    // Leftovers that didn't make up a whole block yet
+    uint8_t buffer[64];
+    uint64_t bufferLen;
+};
+
+#endif // shinyfs_ShinySHA256_h